@@ -128,6 +128,26 @@ draw_create_with_llvm_context(struct pipe_context *pipe,
 {
    return draw_create_context(pipe, context, TRUE);
 }
+
+
+/**
+ * Let the driver look up and store the code generated for shader variants,
+ * e.g. in its on-disk shader cache.
+ */
+void
+draw_set_disk_cache_callbacks(struct draw_context *draw,
+                              void *data_cookie,
+                              void (*find_shader)(void *cookie,
+                                                  struct lp_cached_code *cache,
+                                                  const unsigned char ir_sha1_cache_key[20]),
+                              void (*insert_shader)(void *cookie,
+                                                    struct lp_cached_code *cache,
+                                                    const unsigned char ir_sha1_cache_key[20]))
+{
+   draw->disk_cache_find_shader = find_shader;
+   draw->disk_cache_insert_shader = insert_shader;
+   draw->disk_cache_cookie = data_cookie;
+}
 #endif
 
 /**
@@ -565,6 +585,20 @@ draw_set_force_passthrough( struct draw_context *draw, boolean enable )
 }
 
 
+/**
+ * How many threads besides the calling one the driver can spare for
+ * vertex shading.  None unless set; only used with LLVM.
+ */
+void
+draw_set_vs_threads(struct draw_context *draw, unsigned num_threads)
+{
+#ifdef DRAW_LLVM_AVAILABLE
+   if (draw->llvm)
+      draw_llvm_set_vs_threads(draw->llvm, num_threads);
+#endif
+}
+
+
 
 /**
  * Allocate an extra vertex/geometry shader vertex attribute, if it doesn't
@@ -1173,6 +1207,19 @@ void draw_collect_primitives_generated(struct draw_context *draw,
    draw->collect_primgen = enable;
 }
 
+/**
+ * Returns the running totals of the vertices shaded and the primitives
+ * drawn.  Unlike the pipeline statistics these are always counted, per
+ * vertex cache flush rather than per vertex.
+ */
+void
+draw_get_vertex_stats(const struct draw_context *draw,
+                      struct draw_vertex_stats *stats)
+{
+   stats->vertices_shaded = draw->pt.vertex_stats.vertices_shaded;
+   stats->primitives = draw->pt.vertex_stats.primitives;
+}
+
 /**
  * Computes clipper invocation statistics.
  *
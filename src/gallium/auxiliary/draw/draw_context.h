@@ -68,8 +68,20 @@ bool draw_has_llvm(void);
 struct draw_context *draw_create( struct pipe_context *pipe );
 
 #ifdef LLVM_AVAILABLE
+struct lp_cached_code;
+
 struct draw_context *draw_create_with_llvm_context(struct pipe_context *pipe,
                                                    void *context);
+
+void
+draw_set_disk_cache_callbacks(struct draw_context *draw,
+                              void *data_cookie,
+                              void (*find_shader)(void *cookie,
+                                                  struct lp_cached_code *cache,
+                                                  const unsigned char ir_sha1_cache_key[20]),
+                              void (*insert_shader)(void *cookie,
+                                                    struct lp_cached_code *cache,
+                                                    const unsigned char ir_sha1_cache_key[20]));
 #endif
 
 struct draw_context *draw_create_no_llvm(struct pipe_context *pipe);
@@ -307,6 +319,8 @@ void draw_set_driver_clipping( struct draw_context *draw,
 void draw_set_force_passthrough( struct draw_context *draw, 
                                  boolean enable );
 
+void draw_set_vs_threads(struct draw_context *draw, unsigned num_threads);
+
 
 /*******************************************************************************
  * Draw statistics
@@ -317,6 +331,19 @@ void draw_collect_pipeline_statistics(struct draw_context *draw,
 void draw_collect_primitives_generated(struct draw_context *draw,
                                        bool eanble);
 
+/**
+ * Running totals of the vertices fetched and shaded, and of the primitives
+ * drawn from them.  vertices_shaded / primitives is the average cache miss
+ * ratio (ACMR) of the vertex cache, 0.5 to 3 for triangles.
+ */
+struct draw_vertex_stats {
+   uint64_t vertices_shaded;
+   uint64_t primitives;
+};
+
+void draw_get_vertex_stats(const struct draw_context *draw,
+                           struct draw_vertex_stats *stats);
+
 /*******************************************************************************
  * Draw pipeline 
  */
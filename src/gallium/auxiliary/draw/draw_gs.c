@@ -31,6 +31,7 @@
 #include "draw_context.h"
 #ifdef LLVM_AVAILABLE
 #include "draw_llvm.h"
+#include "gallivm/lp_bld_init.h"
 #endif
 
 #include "tgsi/tgsi_parse.h"
@@ -883,6 +884,10 @@ draw_create_geometry_shader(struct draw_context *draw,
 
       gs->jit_context = &draw->llvm->gs_jit_context;
 
+      if (draw->disk_cache_cookie) {
+         llvm_gs->has_ir_sha1 = gallivm_hash_shader_ir(&gs->state, &gs->info,
+                                                       llvm_gs->ir_sha1);
+      }
 
       llvm_gs->variant_key_size =
          draw_gs_llvm_variant_key_size(
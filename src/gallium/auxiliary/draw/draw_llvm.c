@@ -53,11 +53,16 @@
 
 #include "tgsi/tgsi_exec.h"
 #include "tgsi/tgsi_dump.h"
+#include "tgsi/tgsi_parse.h"
 
+#include "util/u_atomic.h"
+#include "util/u_debug.h"
 #include "util/u_math.h"
+#include "util/u_memory.h"
 #include "util/u_pointer.h"
 #include "util/u_string.h"
 #include "util/simple_list.h"
+#include "util/mesa-sha1.h"
 
 
 #define DEBUG_STORE 0
@@ -560,6 +565,26 @@ get_vertex_header_ptr_type(struct draw_llvm_variant *variant)
 }
 
 
+DEBUG_GET_ONCE_NUM_OPTION(draw_vs_threads, "DRAW_VS_THREADS", -1)
+
+
+/**
+ * Number of threads large vertex shader runs are split over, besides the
+ * calling one: as many as the driver asked for, unless DRAW_VS_THREADS is
+ * set.  Zero keeps them on the calling thread.
+ */
+static unsigned
+vs_thread_count(unsigned requested)
+{
+   long threads = debug_get_option_draw_vs_threads();
+
+   if (threads < 0)
+      threads = requested;
+
+   return CLAMP(threads, 0, DRAW_LLVM_MAX_VS_THREADS);
+}
+
+
 /**
  * Create per-context LLVM info.
  */
@@ -591,6 +616,8 @@ draw_llvm_create(struct draw_context *draw, LLVMContextRef context)
    llvm->nr_gs_variants = 0;
    make_empty_list(&llvm->gs_variants_list);
 
+   llvm->num_vs_threads = vs_thread_count(0);
+
    return llvm;
 
 fail:
@@ -605,6 +632,17 @@ fail:
 void
 draw_llvm_destroy(struct draw_llvm *llvm)
 {
+   if (llvm->has_compile_queue) {
+      struct draw_llvm_variant_list_item *li;
+
+      /* Destroying the queue would leak the recompiles still queued. */
+      foreach(li, &llvm->vs_variants_list)
+         util_queue_drop_job(&llvm->compile_queue, &li->base->optimized);
+      util_queue_destroy(&llvm->compile_queue);
+   }
+   if (llvm->has_vs_queue)
+      util_queue_destroy(&llvm->vs_queue);
+
    if (llvm->context_owned)
       LLVMContextDispose(llvm->context);
    llvm->context = NULL;
@@ -614,6 +652,197 @@ draw_llvm_destroy(struct draw_llvm *llvm)
 }
 
 
+/**
+ * Set the number of threads besides the calling one that large vertex
+ * shader runs may be split over.
+ */
+void
+draw_llvm_set_vs_threads(struct draw_llvm *llvm, unsigned num_threads)
+{
+   llvm->num_vs_threads = vs_thread_count(num_threads);
+
+   if (llvm->has_vs_queue)
+      util_queue_adjust_num_threads(&llvm->vs_queue,
+                                    MAX2(llvm->num_vs_threads, 1));
+}
+
+
+/**
+ * A range of the vertices of a vertex shader run.
+ */
+struct draw_llvm_vs_chunk {
+   draw_jit_vert_func jit_func;
+   struct draw_jit_context *context;
+   struct vertex_header *io;
+   const struct draw_vertex_buffer *vbuffers;
+   unsigned count;
+   unsigned start_or_maxelt;
+   unsigned stride;
+   struct pipe_vertex_buffer *vertex_buffers;
+   unsigned instance_id;
+   unsigned vertex_id_offset;
+   unsigned start_instance;
+   const unsigned *fetch_elts;
+   unsigned draw_id;
+
+   boolean clipped;
+   struct util_queue_fence fence;
+};
+
+
+static void
+run_vs_chunk(void *data, int thread_index)
+{
+   struct draw_llvm_vs_chunk *chunk = data;
+
+   chunk->clipped = chunk->jit_func(chunk->context,
+                                    chunk->io,
+                                    chunk->vbuffers,
+                                    chunk->count,
+                                    chunk->start_or_maxelt,
+                                    chunk->stride,
+                                    chunk->vertex_buffers,
+                                    chunk->instance_id,
+                                    chunk->vertex_id_offset,
+                                    chunk->start_instance,
+                                    chunk->fetch_elts,
+                                    chunk->draw_id);
+}
+
+
+/**
+ * Run a vertex shader variant, with the arguments of draw_jit_vert_func.
+ *
+ * Every vertex is fetched, shaded, clipped and transformed independently,
+ * so large runs are split into chunks of consecutive vertices, which are
+ * shaded on the vertex shader threads and on the calling one.  Each chunk
+ * writes its vertices in place, so they come out in order for primitive
+ * assembly.  Returns whether any vertex needs clipping.
+ */
+boolean
+draw_llvm_run_vs(struct draw_llvm *llvm,
+                 draw_jit_vert_func jit_func,
+                 struct vertex_header *io,
+                 const struct draw_vertex_buffer vbuffers[PIPE_MAX_ATTRIBS],
+                 unsigned count,
+                 unsigned start_or_maxelt,
+                 unsigned stride,
+                 struct pipe_vertex_buffer *vertex_buffers,
+                 unsigned instance_id,
+                 unsigned vertex_id_offset,
+                 unsigned start_instance,
+                 const unsigned *fetch_elts,
+                 unsigned draw_id)
+{
+   struct draw_llvm_vs_chunk chunks[DRAW_LLVM_MAX_VS_THREADS + 1];
+   unsigned num_chunks, chunk_size, i;
+   boolean clipped = FALSE;
+
+   num_chunks = MIN2(llvm->num_vs_threads + 1, count / DRAW_LLVM_VS_CHUNK);
+
+   if (num_chunks > 1 && !llvm->has_vs_queue) {
+      llvm->has_vs_queue =
+         util_queue_init(&llvm->vs_queue, "drawvsrun",
+                         DRAW_LLVM_MAX_VS_THREADS, llvm->num_vs_threads, 0);
+      if (!llvm->has_vs_queue)
+         llvm->num_vs_threads = 0;
+   }
+
+   if (num_chunks < 2 || !llvm->has_vs_queue) {
+      return jit_func(&llvm->jit_context, io, vbuffers, count,
+                      start_or_maxelt, stride, vertex_buffers, instance_id,
+                      vertex_id_offset, start_instance, fetch_elts, draw_id);
+   }
+
+   chunk_size = align(DIV_ROUND_UP(count, num_chunks), DRAW_LLVM_VS_CHUNK / 4);
+   num_chunks = DIV_ROUND_UP(count, chunk_size);
+
+   for (i = 0; i < num_chunks; i++) {
+      struct draw_llvm_vs_chunk *chunk = &chunks[i];
+      unsigned first = i * chunk_size;
+
+      chunk->jit_func = jit_func;
+      chunk->context = &llvm->jit_context;
+      chunk->io = (struct vertex_header *)((char *)io + first * stride);
+      chunk->vbuffers = vbuffers;
+      chunk->count = MIN2(chunk_size, count - first);
+      chunk->vertex_buffers = vertex_buffers;
+      chunk->stride = stride;
+      chunk->instance_id = instance_id;
+      chunk->vertex_id_offset = vertex_id_offset;
+      chunk->start_instance = start_instance;
+      chunk->draw_id = draw_id;
+      chunk->clipped = FALSE;
+
+      /* Indexed runs fetch through the elts, linear ones from the start. */
+      if (fetch_elts) {
+         chunk->start_or_maxelt = start_or_maxelt;
+         chunk->fetch_elts = fetch_elts + first;
+      }
+      else {
+         chunk->start_or_maxelt = start_or_maxelt + first;
+         chunk->fetch_elts = NULL;
+      }
+
+      if (i > 0) {
+         util_queue_fence_init(&chunk->fence);
+         util_queue_add_job(&llvm->vs_queue, chunk, &chunk->fence,
+                            run_vs_chunk, NULL, 0);
+      }
+   }
+
+   run_vs_chunk(&chunks[0], 0);
+   clipped = chunks[0].clipped;
+
+   for (i = 1; i < num_chunks; i++) {
+      util_queue_fence_wait(&chunks[i].fence);
+      util_queue_fence_destroy(&chunks[i].fence);
+      clipped |= chunks[i].clipped;
+   }
+
+   return clipped;
+}
+
+
+/**
+ * Hash the shader IR, the variant key and \p val_32bit, which together
+ * determine the code generated for a variant.
+ */
+static void
+draw_get_ir_cache_key(const unsigned char ir_sha1[20],
+                      const void *key, size_t key_size,
+                      uint32_t val_32bit,
+                      unsigned char ir_sha1_cache_key[20])
+{
+   struct mesa_sha1 ctx;
+
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, key, key_size);
+   _mesa_sha1_update(&ctx, &val_32bit, sizeof val_32bit);
+   _mesa_sha1_update(&ctx, ir_sha1, 20);
+   _mesa_sha1_final(&ctx, ir_sha1_cache_key);
+}
+
+
+/**
+ * Generate the IR of a variant into variant->gallivm.
+ */
+static void
+generate_variant(struct draw_llvm *llvm, struct draw_llvm_variant *variant)
+{
+   LLVMTypeRef vertex_header;
+
+   create_jit_types(variant);
+
+   vertex_header = create_jit_vertex_header(variant->gallivm,
+                                            variant->num_inputs);
+
+   variant->vertex_header_ptr_type = LLVMPointerType(vertex_header, 0);
+
+   draw_llvm_generate(llvm, variant);
+}
+
+
 /**
  * Create LLVM-generated code for a vertex shader.
  */
@@ -625,8 +854,10 @@ draw_llvm_create_variant(struct draw_llvm *llvm,
    struct draw_llvm_variant *variant;
    struct llvm_vertex_shader *shader =
       llvm_vertex_shader(llvm->draw->vs.vertex_shader);
-   LLVMTypeRef vertex_header;
    char module_name[64];
+   unsigned char ir_sha1_cache_key[20];
+   struct lp_cached_code cached = { 0 };
+   bool needs_caching = false;
 
    variant = MALLOC(sizeof *variant +
                     shader->variant_key_size -
@@ -634,17 +865,48 @@ draw_llvm_create_variant(struct draw_llvm *llvm,
    if (!variant)
       return NULL;
 
+   memset(variant, 0, sizeof *variant);
    variant->llvm = llvm;
    variant->shader = shader;
+   variant->num_inputs = num_inputs;
+   memcpy(&variant->key, key, shader->variant_key_size);
+   util_queue_fence_init(&variant->optimized);
 
    snprintf(module_name, sizeof(module_name), "draw_llvm_vs_variant%u",
             variant->shader->variants_cached);
 
-   variant->gallivm = gallivm_create(module_name, llvm->context);
+   if (llvm->draw->disk_cache_cookie && shader->has_ir_sha1) {
+      draw_get_ir_cache_key(shader->ir_sha1,
+                            key, shader->variant_key_size,
+                            num_inputs,
+                            ir_sha1_cache_key);
 
-   create_jit_types(variant);
+      llvm->draw->disk_cache_find_shader(llvm->draw->disk_cache_cookie,
+                                         &cached,
+                                         ir_sha1_cache_key);
+      needs_caching = !cached.data_size;
+   }
 
-   memcpy(&variant->key, key, shader->variant_key_size);
+   /*
+    * Unless it can be loaded, generate the code quickly for now, and with
+    * optimizations on a background thread once the variant proves hot.
+    */
+   if ((gallivm_perf & GALLIVM_PERF_TIERED) && !cached.data_size &&
+       !llvm->has_compile_queue) {
+      llvm->has_compile_queue =
+         util_queue_init(&llvm->compile_queue, "drawvs", 16, 1,
+                         UTIL_QUEUE_INIT_RESIZE_IF_FULL);
+   }
+   variant->unoptimized = (gallivm_perf & GALLIVM_PERF_TIERED) &&
+                          !cached.data_size && llvm->has_compile_queue;
+
+   if (variant->unoptimized) {
+      variant->gallivm = gallivm_create_unoptimized(module_name, llvm->context);
+      needs_caching = false;
+   }
+   else {
+      variant->gallivm = gallivm_create(module_name, llvm->context, &cached);
+   }
 
    if (gallivm_debug & (GALLIVM_DEBUG_TGSI | GALLIVM_DEBUG_IR)) {
       if (llvm->draw->vs.vertex_shader->state.type == PIPE_SHADER_IR_TGSI)
@@ -654,18 +916,19 @@ draw_llvm_create_variant(struct draw_llvm *llvm,
       draw_llvm_dump_variant_key(&variant->key);
    }
 
-   vertex_header = create_jit_vertex_header(variant->gallivm, num_inputs);
-
-   variant->vertex_header_ptr_type = LLVMPointerType(vertex_header, 0);
-
-   draw_llvm_generate(llvm, variant);
+   generate_variant(llvm, variant);
 
    gallivm_compile_module(variant->gallivm);
 
    variant->jit_func = (draw_jit_vert_func)
          gallivm_jit_function(variant->gallivm, variant->function);
 
+   if (needs_caching)
+      llvm->draw->disk_cache_insert_shader(llvm->draw->disk_cache_cookie,
+                                           &cached,
+                                           ir_sha1_cache_key);
    gallivm_free_ir(variant->gallivm);
+   free(cached.data);
 
    variant->list_item_global.base = variant;
    variant->list_item_local.base = variant;
@@ -676,6 +939,109 @@ draw_llvm_create_variant(struct draw_llvm *llvm,
 }
 
 
+/**
+ * The optimized recompile of a variant, see draw_llvm_optimize_variant().
+ */
+struct draw_llvm_optimize_job
+{
+   struct draw_llvm_variant *variant;
+   LLVMContextRef context;
+   struct lp_cached_code cached;
+   unsigned char ir_sha1_cache_key[20];
+   bool needs_caching;
+};
+
+
+static void
+optimize_variant_execute(void *data, int thread_index)
+{
+   struct draw_llvm_optimize_job *job = data;
+   struct draw_llvm_variant *variant = job->variant;
+   struct draw_context *draw = variant->llvm->draw;
+   draw_jit_vert_func jit_func;
+
+   gallivm_compile_module(variant->gallivm);
+
+   jit_func = (draw_jit_vert_func)
+         gallivm_jit_function(variant->gallivm, variant->function);
+   p_atomic_set(&variant->jit_func, jit_func);
+
+   if (job->needs_caching)
+      draw->disk_cache_insert_shader(draw->disk_cache_cookie,
+                                     &job->cached,
+                                     job->ir_sha1_cache_key);
+}
+
+
+static void
+optimize_variant_cleanup(void *data, int thread_index)
+{
+   struct draw_llvm_optimize_job *job = data;
+
+   /* Also when the job was dropped before it ran. */
+   gallivm_free_ir(job->variant->gallivm);
+   LLVMContextDispose(job->context);
+   free(job->cached.data);
+   FREE(job);
+}
+
+
+/**
+ * Generate the IR of a variant compiled without optimizations again, and
+ * compile it with optimizations on the compile queue.
+ *
+ * The IR depends on draw state, so it is generated here, while that is the
+ * state the variant was created for.  It goes into a new LLVM context, as
+ * the compile runs on another thread.
+ */
+void
+draw_llvm_optimize_variant(struct draw_llvm_variant *variant)
+{
+   struct draw_llvm *llvm = variant->llvm;
+   struct llvm_vertex_shader *shader = variant->shader;
+   struct draw_llvm_optimize_job *job;
+   struct gallivm_state *gallivm;
+
+   assert(variant->unoptimized && !variant->gallivm_unoptimized);
+   assert(llvm->draw->vs.vertex_shader == &shader->base);
+
+   job = CALLOC_STRUCT(draw_llvm_optimize_job);
+   if (!job)
+      return;
+
+   job->variant = variant;
+   job->context = LLVMContextCreate();
+   if (!job->context) {
+      FREE(job);
+      return;
+   }
+
+   if (llvm->draw->disk_cache_cookie && shader->has_ir_sha1) {
+      draw_get_ir_cache_key(shader->ir_sha1,
+                            &variant->key, shader->variant_key_size,
+                            variant->num_inputs,
+                            job->ir_sha1_cache_key);
+      job->needs_caching = true;
+   }
+
+   gallivm = gallivm_create("draw_llvm_vs_variant_optimized", job->context,
+                            &job->cached);
+   if (!gallivm) {
+      LLVMContextDispose(job->context);
+      FREE(job);
+      return;
+   }
+
+   variant->gallivm_unoptimized = variant->gallivm;
+   variant->gallivm = gallivm;
+
+   generate_variant(llvm, variant);
+
+   util_queue_add_job(&llvm->compile_queue, job, &variant->optimized,
+                      optimize_variant_execute, optimize_variant_cleanup, 0);
+}
+
+
 static void
 generate_vs(struct draw_llvm_variant *variant,
             LLVMBuilderRef builder,
@@ -1647,7 +2013,7 @@ draw_llvm_generate(struct draw_llvm *llvm, struct draw_llvm_variant *variant)
    struct lp_build_context bld, blduivec;
    struct lp_build_loop_state lp_loop;
    struct lp_build_if_state if_ctx;
-   const int vector_length = lp_native_vector_width / 32;
+   const int vector_length = draw_llvm_vector_length();
    LLVMValueRef outputs[PIPE_MAX_SHADER_OUTPUTS][TGSI_NUM_CHANNELS];
    struct lp_build_sampler_soa *sampler = 0;
    struct lp_build_image_soa *image = NULL;
@@ -1674,8 +2040,10 @@ draw_llvm_generate(struct draw_llvm *llvm, struct draw_llvm_variant *variant)
 
    memset(&system_values, 0, sizeof(system_values));
    memset(&outputs, 0, sizeof(outputs));
-   snprintf(func_name, sizeof(func_name), "draw_llvm_vs_variant%u",
-            variant->shader->variants_cached);
+   /* The name must not depend on the creation order, as cached objects are
+    * looked up by it.
+    */
+   snprintf(func_name, sizeof(func_name), "draw_llvm_vs_variant");
 
    i = 0;
    arg_types[i++] = get_context_ptr_type(variant);       /* context */
@@ -2324,7 +2692,14 @@ draw_llvm_destroy_variant(struct draw_llvm_variant *variant)
                     variant->shader->variants_cached, llvm->nr_variants);
    }
 
+   /* The optimized recompile may still be queued or running. */
+   if (llvm->has_compile_queue)
+      util_queue_drop_job(&llvm->compile_queue, &variant->optimized);
+   util_queue_fence_destroy(&variant->optimized);
+
    gallivm_destroy(variant->gallivm);
+   if (variant->gallivm_unoptimized)
+      gallivm_destroy(variant->gallivm_unoptimized);
 
    remove_from_list(&variant->list_item_local);
    variant->shader->variants_cached--;
@@ -2422,8 +2797,10 @@ draw_gs_llvm_generate(struct draw_llvm *llvm,
    memset(&system_values, 0, sizeof(system_values));
    memset(&outputs, 0, sizeof(outputs));
 
-   snprintf(func_name, sizeof(func_name), "draw_llvm_gs_variant%u",
-            variant->shader->variants_cached);
+   /* The name must not depend on the creation order, as cached objects are
+    * looked up by it.
+    */
+   snprintf(func_name, sizeof(func_name), "draw_llvm_gs_variant");
 
    assert(variant->vertex_header_ptr_type);
 
@@ -2566,6 +2943,9 @@ draw_gs_llvm_create_variant(struct draw_llvm *llvm,
       llvm_geometry_shader(llvm->draw->gs.geometry_shader);
    LLVMTypeRef vertex_header;
    char module_name[64];
+   unsigned char ir_sha1_cache_key[20];
+   struct lp_cached_code cached = { 0 };
+   bool needs_caching = false;
 
    variant = MALLOC(sizeof *variant +
                     shader->variant_key_size -
@@ -2575,15 +2955,26 @@ draw_gs_llvm_create_variant(struct draw_llvm *llvm,
 
    variant->llvm = llvm;
    variant->shader = shader;
+   memcpy(&variant->key, key, shader->variant_key_size);
 
    snprintf(module_name, sizeof(module_name), "draw_llvm_gs_variant%u",
             variant->shader->variants_cached);
 
-   variant->gallivm = gallivm_create(module_name, llvm->context);
+   if (llvm->draw->disk_cache_cookie && shader->has_ir_sha1) {
+      draw_get_ir_cache_key(shader->ir_sha1,
+                            key, shader->variant_key_size,
+                            num_outputs,
+                            ir_sha1_cache_key);
 
-   create_gs_jit_types(variant);
+      llvm->draw->disk_cache_find_shader(llvm->draw->disk_cache_cookie,
+                                         &cached,
+                                         ir_sha1_cache_key);
+      needs_caching = !cached.data_size;
+   }
 
-   memcpy(&variant->key, key, shader->variant_key_size);
+   variant->gallivm = gallivm_create(module_name, llvm->context, &cached);
+
+   create_gs_jit_types(variant);
 
    vertex_header = create_jit_vertex_header(variant->gallivm, num_outputs);
 
@@ -2596,7 +2987,12 @@ draw_gs_llvm_create_variant(struct draw_llvm *llvm,
    variant->jit_func = (draw_gs_jit_func)
          gallivm_jit_function(variant->gallivm, variant->function);
 
+   if (needs_caching)
+      llvm->draw->disk_cache_insert_shader(llvm->draw->disk_cache_cookie,
+                                           &cached,
+                                           ir_sha1_cache_key);
    gallivm_free_ir(variant->gallivm);
+   free(cached.data);
 
    variant->list_item_global.base = variant;
    variant->list_item_local.base = variant;
@@ -38,6 +38,26 @@
 
 #include "pipe/p_context.h"
 #include "util/simple_list.h"
+#include "util/u_queue.h"
+
+
+/**
+ * Number of runs after which a vertex shader variant compiled without
+ * optimizations is recompiled with them, with GALLIVM_PERF=tiered.
+ */
+#define DRAW_LLVM_HOT_RUNS 16
+
+/**
+ * Most threads a vertex shader run is split over, besides the calling one.
+ */
+#define DRAW_LLVM_MAX_VS_THREADS 7
+
+/**
+ * Fewest vertices per chunk of a vertex shader run split over threads.
+ * Chunks are a multiple of any vector length, as the shader writes whole
+ * vectors of vertices.
+ */
+#define DRAW_LLVM_VS_CHUNK 256
 
 
 struct draw_llvm;
@@ -394,6 +414,17 @@ struct draw_gs_llvm_variant_key
     PIPE_MAX_SHADER_SAMPLER_VIEWS * sizeof(struct draw_sampler_static_state))
 
 
+/**
+ * Number of vertices the vertex shader processes at once.  Vertex shading
+ * stays at 256 bits even when the fragment side runs wider.
+ */
+static inline unsigned
+draw_llvm_vector_length(void)
+{
+   return MIN2(lp_native_vector_width, 256) / 32;
+}
+
+
 static inline size_t
 draw_llvm_variant_key_size(unsigned nr_vertex_elements,
                            unsigned nr_samplers, unsigned nr_images)
@@ -463,6 +494,19 @@ struct draw_llvm_variant
    LLVMValueRef function;
    draw_jit_vert_func jit_func;
 
+   /*
+    * With GALLIVM_PERF=tiered the code is first generated without
+    * optimizations.  After DRAW_LLVM_HOT_RUNS runs the IR is generated
+    * again and compiled with optimizations on the draw_llvm compile queue,
+    * and jit_func switched over once that is done.  The unoptimized code
+    * is kept until the variant is destroyed.
+    */
+   boolean unoptimized;
+   unsigned runs;
+   unsigned num_inputs;
+   struct util_queue_fence optimized;
+   struct gallivm_state *gallivm_unoptimized;
+
    struct llvm_vertex_shader *shader;
 
    struct draw_llvm *llvm;
@@ -502,6 +546,10 @@ struct draw_gs_llvm_variant
 struct llvm_vertex_shader {
    struct draw_vertex_shader base;
 
+   /* Hash of the IR for the disk cache, see gallivm_hash_shader_ir() */
+   unsigned char ir_sha1[20];
+   boolean has_ir_sha1;
+
    unsigned variant_key_size;
    struct draw_llvm_variant_list_item variants;
    unsigned variants_created;
@@ -511,6 +559,10 @@ struct llvm_vertex_shader {
 struct llvm_geometry_shader {
    struct draw_geometry_shader base;
 
+   /* Hash of the IR for the disk cache, see gallivm_hash_shader_ir() */
+   unsigned char ir_sha1[20];
+   boolean has_ir_sha1;
+
    unsigned variant_key_size;
    struct draw_gs_llvm_variant_list_item variants;
    unsigned variants_created;
@@ -532,6 +584,15 @@ struct draw_llvm {
 
    struct draw_gs_llvm_variant_list_item gs_variants_list;
    int nr_gs_variants;
+
+   /** For optimizing tiered vertex shader variants, created when needed */
+   struct util_queue compile_queue;
+   boolean has_compile_queue;
+
+   /** For splitting large vertex shader runs, created when needed */
+   struct util_queue vs_queue;
+   boolean has_vs_queue;
+   unsigned num_vs_threads;
 };
 
 
@@ -556,6 +617,41 @@ draw_llvm_create(struct draw_context *draw, LLVMContextRef llvm_context);
 void
 draw_llvm_destroy(struct draw_llvm *llvm);
 
+void
+draw_llvm_set_vs_threads(struct draw_llvm *llvm, unsigned num_threads);
+
+void
+draw_llvm_optimize_variant(struct draw_llvm_variant *variant);
+
+boolean
+draw_llvm_run_vs(struct draw_llvm *llvm,
+                 draw_jit_vert_func jit_func,
+                 struct vertex_header *io,
+                 const struct draw_vertex_buffer vbuffers[PIPE_MAX_ATTRIBS],
+                 unsigned count,
+                 unsigned start_or_maxelt,
+                 unsigned stride,
+                 struct pipe_vertex_buffer *vertex_buffers,
+                 unsigned instance_id,
+                 unsigned vertex_id_offset,
+                 unsigned start_instance,
+                 const unsigned *fetch_elts,
+                 unsigned draw_id);
+
+
+/**
+ * Count a run of a variant, and have it optimized once it proves hot.
+ */
+static inline void
+draw_llvm_count_variant_run(struct draw_llvm_variant *variant)
+{
+   if (unlikely(variant->unoptimized) &&
+       variant->runs < DRAW_LLVM_HOT_RUNS &&
+       ++variant->runs == DRAW_LLVM_HOT_RUNS)
+      draw_llvm_optimize_variant(variant);
+}
+
+
 struct draw_llvm_variant *
 draw_llvm_create_variant(struct draw_llvm *llvm,
                          unsigned num_vertex_header_attribs,
@@ -109,6 +109,55 @@ void draw_pipeline_destroy( struct draw_context *draw )
 
 
 
+/**
+ * Run the batched triangles down the pipeline in order, except those the
+ * clip and cull stages would drop anyway.
+ */
+static void flush_tris( struct draw_context *draw )
+{
+   const unsigned count = draw->pipeline.num_batched_tris;
+   const struct draw_stage *first = draw->pipeline.first;
+   unsigned culled = 0, i;
+
+   if (!count)
+      return;
+
+   draw->pipeline.num_batched_tris = 0;
+
+   /* The pipeline is only known once the first primitive validated it. */
+   if (first != draw->pipeline.validate) {
+      const boolean clip = first == draw->pipeline.clip;
+      const struct draw_stage *cull_stage = clip ? first->next : first;
+      const boolean cull =
+         cull_stage == draw->pipeline.cull &&
+         draw->rasterizer->cull_face != PIPE_FACE_NONE &&
+         !draw_current_shader_num_written_culldistances(draw);
+
+      if (clip || cull) {
+         culled = draw_cull_tri_batch(
+            (struct vertex_header *const (*)[3])draw->pipeline.tri_batch,
+            count, draw_current_shader_position_output(draw), clip, cull,
+            draw->rasterizer->cull_face, draw->rasterizer->front_ccw);
+      }
+   }
+
+   for (i = 0; i < count; i++) {
+      struct prim_header prim;
+
+      if (culled & (1u << i))
+         continue;
+
+      prim.v[0] = draw->pipeline.tri_batch[i][0];
+      prim.v[1] = draw->pipeline.tri_batch[i][1];
+      prim.v[2] = draw->pipeline.tri_batch[i][2];
+      prim.flags = draw->pipeline.tri_batch_flags[i];
+      prim.pad = 0;
+
+      draw->pipeline.first->tri( draw->pipeline.first, &prim );
+   }
+}
+
+
 /**
  * Build primitive to render a point with vertex at v0.
  */
@@ -116,6 +165,8 @@ static void do_point( struct draw_context *draw,
 		      const char *v0 )
 {
    struct prim_header prim;
+
+   flush_tris(draw);
    
    prim.flags = 0;
    prim.pad = 0;
@@ -135,6 +186,8 @@ static void do_line( struct draw_context *draw,
 		     const char *v1 )
 {
    struct prim_header prim;
+
+   flush_tris(draw);
    
    prim.flags = flags;
    prim.pad = 0;
@@ -146,7 +199,8 @@ static void do_line( struct draw_context *draw,
 
 
 /**
- * Build primitive to render a triangle with vertices at v0, v1, v2.
+ * Batch a triangle with vertices at v0, v1, v2, to be culled together with
+ * the following ones.
  * \param flags  bitmask of DRAW_PIPE_EDGE_x, DRAW_PIPE_RESET_STIPPLE
  */
 static void do_triangle( struct draw_context *draw,
@@ -155,15 +209,15 @@ static void do_triangle( struct draw_context *draw,
 			 char *v1,
 			 char *v2 )
 {
-   struct prim_header prim;
-   
-   prim.v[0] = (struct vertex_header *)v0;
-   prim.v[1] = (struct vertex_header *)v1;
-   prim.v[2] = (struct vertex_header *)v2;
-   prim.flags = flags;
-   prim.pad = 0;
+   const unsigned n = draw->pipeline.num_batched_tris;
+
+   draw->pipeline.tri_batch[n][0] = (struct vertex_header *)v0;
+   draw->pipeline.tri_batch[n][1] = (struct vertex_header *)v1;
+   draw->pipeline.tri_batch[n][2] = (struct vertex_header *)v2;
+   draw->pipeline.tri_batch_flags[n] = flags;
 
-   draw->pipeline.first->tri( draw->pipeline.first, &prim );
+   if (++draw->pipeline.num_batched_tris == DRAW_PIPE_TRI_BATCH)
+      flush_tris(draw);
 }
 
 
@@ -266,6 +320,7 @@ void draw_pipeline_run( struct draw_context *draw,
                     prim_info->elts + start,
                     count,
                     vert_info->count - 1);
+      flush_tris(draw);
    }
 
    draw->pipeline.verts = NULL;
@@ -336,6 +391,7 @@ void draw_pipeline_run_linear( struct draw_context *draw,
                       (struct vertex_header*)verts,
                       vert_info->stride,
                       count);
+      flush_tris(draw);
    }
 
    draw->pipeline.verts = NULL;
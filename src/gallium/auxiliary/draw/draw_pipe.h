@@ -97,6 +97,11 @@ extern boolean draw_alloc_temp_verts( struct draw_stage *stage, unsigned nr );
 
 extern void draw_reset_vertex_ids( struct draw_context *draw );
 
+unsigned
+draw_cull_tri_batch(struct vertex_header *const (*tris)[3], unsigned count,
+                    unsigned pos, boolean clip, boolean cull,
+                    unsigned cull_face, unsigned front_ccw);
+
 void draw_pipe_passthrough_tri(struct draw_stage *stage, struct prim_header *header);
 void draw_pipe_passthrough_line(struct draw_stage *stage, struct prim_header *header);
 void draw_pipe_passthrough_point(struct draw_stage *stage, struct prim_header *header);
@@ -128,4 +133,31 @@ dup_vert( struct draw_stage *stage,
    return tmp;
 }
 
+/**
+ * The determinant of a triangle from its window coordinates, negative for
+ * counter-clockwise winding.  Shared by the cull stage and the scalar
+ * batched culling, so that both round alike.
+ */
+static inline float
+draw_tri_det( const float *v0,
+              const float *v1,
+              const float *v2 )
+{
+   /* edge vectors: e = v0 - v2, f = v1 - v2 */
+   const float ex = v0[0] - v2[0];
+   const float ey = v0[1] - v2[1];
+   const float fx = v1[0] - v2[0];
+   const float fy = v1[1] - v2[1];
+
+   /* Round the products, so that the compiler can't fuse one into an FMA
+    * with the subtract, which would round differently from the batched
+    * culling, and differently again depending on the product it picks.
+    */
+   volatile float exfy = ex * fy;
+   volatile float eyfx = ey * fx;
+
+   /* det = cross(e,f).z */
+   return exfy - eyfx;
+}
+
 #endif
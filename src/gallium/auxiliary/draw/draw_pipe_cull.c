@@ -35,6 +35,7 @@
 
 #include "util/u_math.h"
 #include "util/u_memory.h"
+#include "util/u_sse.h"
 #include "pipe/p_defines.h"
 #include "draw_pipe.h"
 
@@ -158,15 +159,7 @@ static void cull_tri( struct draw_stage *stage,
       const float *v1 = header->v[1]->data[pos];
       const float *v2 = header->v[2]->data[pos];
 
-      /* edge vectors: e = v0 - v2, f = v1 - v2 */
-      const float ex = v0[0] - v2[0];
-      const float ey = v0[1] - v2[1];
-      const float fx = v1[0] - v2[0];
-      const float fy = v1[1] - v2[1];
-
-
-      /* det = cross(e,f).z */
-      header->det = ex * fy - ey * fx;
+      header->det = draw_tri_det(v0, v1, v2);
 
       if (header->det != 0) {
          /* if det < 0 then Z points toward the camera and the triangle is
@@ -195,6 +188,106 @@ static void cull_tri( struct draw_stage *stage,
    }
 }
 
+/**
+ * Find the triangles of a batch that the clip and cull stages would drop
+ * without clipping them, so that they can skip the pipeline.
+ *
+ * With clip, those are the triangles with all vertices outside one clip
+ * plane, as in clip_tri().  With cull, also the triangles which need no
+ * clipping and face cull_face, zero area counting as back facing, as in
+ * cull_tri() without cull distances.  The window coordinates are loaded
+ * as structure of arrays, and the determinants computed four triangles at
+ * a time with SSE, with the same operations as draw_tri_det().
+ *
+ * Returns a mask with bit i set if triangle i is dropped.
+ */
+unsigned
+draw_cull_tri_batch(struct vertex_header *const (*tris)[3], unsigned count,
+                    unsigned pos, boolean clip, boolean cull,
+                    unsigned cull_face, unsigned front_ccw)
+{
+   PIPE_ALIGN_VAR(16) float x[3][DRAW_PIPE_TRI_BATCH];
+   PIPE_ALIGN_VAR(16) float y[3][DRAW_PIPE_TRI_BATCH];
+   const unsigned all = (1u << count) - 1;
+   unsigned rejected = 0, unclipped = all;
+   unsigned front = 0, back, culled = 0;
+   unsigned i, j;
+
+   assert(count <= DRAW_PIPE_TRI_BATCH);
+
+   if (clip) {
+      unclipped = 0;
+      for (i = 0; i < count; i++) {
+         const unsigned m0 = tris[i][0]->clipmask;
+         const unsigned m1 = tris[i][1]->clipmask;
+         const unsigned m2 = tris[i][2]->clipmask;
+
+         if (m0 & m1 & m2)
+            rejected |= 1u << i;
+         else if (!(m0 | m1 | m2))
+            unclipped |= 1u << i;
+      }
+   }
+
+   if (!cull || !unclipped)
+      return rejected;
+
+   for (i = 0; i < count; i++) {
+      for (j = 0; j < 3; j++) {
+         x[j][i] = tris[i][j]->data[pos][0];
+         y[j][i] = tris[i][j]->data[pos][1];
+      }
+   }
+
+#if defined(PIPE_ARCH_SSE)
+   /* zero area in the unused lanes, which are masked out below */
+   for (i = count; i < align(count, 4); i++) {
+      for (j = 0; j < 3; j++)
+         x[j][i] = y[j][i] = 0.0f;
+   }
+
+   for (i = 0; i < count; i += 4) {
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 x2 = _mm_load_ps(&x[2][i]);
+      const __m128 y2 = _mm_load_ps(&y[2][i]);
+      const __m128 ex = _mm_sub_ps(_mm_load_ps(&x[0][i]), x2);
+      const __m128 ey = _mm_sub_ps(_mm_load_ps(&y[0][i]), y2);
+      const __m128 fx = _mm_sub_ps(_mm_load_ps(&x[1][i]), x2);
+      const __m128 fy = _mm_sub_ps(_mm_load_ps(&y[1][i]), y2);
+      /* rounded products, never fused, as in draw_tri_det() */
+      volatile __m128 exfy = _mm_mul_ps(ex, fy);
+      volatile __m128 eyfx = _mm_mul_ps(ey, fx);
+      const __m128 det = _mm_sub_ps(exfy, eyfx);
+      /* NaN is nonzero but not negative, like the scalar compares */
+      const unsigned nonzero = _mm_movemask_ps(_mm_cmpneq_ps(det, zero));
+      const unsigned ccw = _mm_movemask_ps(_mm_cmplt_ps(det, zero));
+
+      front |= (nonzero & (front_ccw ? ccw : ~ccw)) << i;
+   }
+#else
+   for (i = 0; i < count; i++) {
+      const float v0[2] = { x[0][i], y[0][i] };
+      const float v1[2] = { x[1][i], y[1][i] };
+      const float v2[2] = { x[2][i], y[2][i] };
+      const float det = draw_tri_det(v0, v1, v2);
+
+      if (det != 0 && (unsigned)(det < 0) == front_ccw)
+         front |= 1u << i;
+   }
+#endif
+
+   front &= all;
+   back = ~front & all;
+
+   if (cull_face & PIPE_FACE_FRONT)
+      culled |= front;
+   if (cull_face & PIPE_FACE_BACK)
+      culled |= back;
+
+   return rejected | (culled & unclipped);
+}
+
+
 static void cull_first_point( struct draw_stage *stage,
                               struct prim_header *header )
 {
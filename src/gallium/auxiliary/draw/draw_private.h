@@ -48,6 +48,7 @@
 
 #ifdef LLVM_AVAILABLE
 struct gallivm_state;
+struct lp_cached_code;
 #endif
 
 
@@ -102,6 +103,9 @@ struct vertex_header {
 #define UNDEFINED_VERTEX_ID 0xffff
 
 
+/* number of triangles culled together ahead of the pipeline */
+#define DRAW_PIPE_TRI_BATCH 16
+
 /* maximum number of shader variants we can cache */
 #define DRAW_MAX_SHADER_VARIANTS 512
 
@@ -144,6 +148,11 @@ struct draw_context
       char *verts;
       unsigned vertex_stride;
       unsigned vertex_count;
+
+      /* Triangles waiting to be culled together, see draw_pipe.c */
+      struct vertex_header *tri_batch[DRAW_PIPE_TRI_BATCH][3];
+      ushort tri_batch_flags[DRAW_PIPE_TRI_BATCH];
+      unsigned num_batched_tris;
    } pipeline;
 
 
@@ -219,6 +228,12 @@ struct draw_context
 
       boolean test_fse;         /* enable FSE even though its not correct (eg for softpipe) */
       boolean no_fse;           /* disable FSE even when it is correct */
+
+      /** Running totals, see draw_get_vertex_stats() */
+      struct {
+         uint64_t vertices_shaded;
+         uint64_t primitives;
+      } vertex_stats;
    } pt;
 
    struct {
@@ -333,6 +348,17 @@ struct draw_context
 
    struct draw_llvm *llvm;
 
+#ifdef LLVM_AVAILABLE
+   /** Optional cache of the code generated for shader variants */
+   void *disk_cache_cookie;
+   void (*disk_cache_find_shader)(void *cookie,
+                                  struct lp_cached_code *cache,
+                                  const unsigned char ir_sha1_cache_key[20]);
+   void (*disk_cache_insert_shader)(void *cookie,
+                                    struct lp_cached_code *cache,
+                                    const unsigned char ir_sha1_cache_key[20]);
+#endif
+
    /** Texture sampler and sampler view state.
     * Note that we have arrays indexed by shader type.  At this time
     * we only handle vertex and geometry shaders in the draw module, but
@@ -25,6 +25,7 @@
  *
  **************************************************************************/
 
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "util/u_prim.h"
@@ -389,6 +390,7 @@ llvm_pipeline_generic(struct draw_pt_middle_end *middle,
    boolean clipped = 0;
    unsigned start_or_maxelt, vid_base;
    const unsigned *elts;
+   draw_jit_vert_func jit_func;
 
    assert(fetch_info->count > 0);
    llvm_vert_info.count = fetch_info->count;
@@ -396,7 +398,7 @@ llvm_pipeline_generic(struct draw_pt_middle_end *middle,
    llvm_vert_info.stride = fpme->vertex_size;
    llvm_vert_info.verts = (struct vertex_header *)
       MALLOC(fpme->vertex_size *
-             align(fetch_info->count, lp_native_vector_width / 32));
+             align(fetch_info->count, draw_llvm_vector_length()));
    if (!llvm_vert_info.verts) {
       assert(0);
       return;
@@ -419,17 +421,21 @@ llvm_pipeline_generic(struct draw_pt_middle_end *middle,
       vid_base = draw->pt.user.eltBias;
       elts = fetch_info->elts;
    }
-   clipped = fpme->current_variant->jit_func(&fpme->llvm->jit_context,
-                                             llvm_vert_info.verts,
-                                             draw->pt.user.vbuffer,
-                                             fetch_info->count,
-                                             start_or_maxelt,
-                                             fpme->vertex_size,
-                                             draw->pt.vertex_buffer,
-                                             draw->instance_id,
-                                             vid_base,
-                                             draw->start_instance,
-                                             elts, draw->pt.user.drawid);
+   draw_llvm_count_variant_run(fpme->current_variant);
+
+   /* The compile queue may switch the variant to optimized code. */
+   jit_func = p_atomic_read(&fpme->current_variant->jit_func);
+   clipped = draw_llvm_run_vs(fpme->llvm, jit_func,
+                              llvm_vert_info.verts,
+                              draw->pt.user.vbuffer,
+                              fetch_info->count,
+                              start_or_maxelt,
+                              fpme->vertex_size,
+                              draw->pt.vertex_buffer,
+                              draw->instance_id,
+                              vid_base,
+                              draw->start_instance,
+                              elts, draw->pt.user.drawid);
 
    /* Finished with fetch and vs:
     */
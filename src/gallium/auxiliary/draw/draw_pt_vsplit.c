@@ -23,15 +23,20 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include "util/u_debug.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
+#include "util/u_prim.h"
 
 #include "draw/draw_context.h"
 #include "draw/draw_private.h"
 #include "draw/draw_pt.h"
 
 #define SEGMENT_SIZE 1024
-#define MAP_SIZE     256
+
+/* The vertex cache is set-associative, with up to SEGMENT_SIZE entries */
+#define CACHE_WAYS     4
+#define MAX_CACHE_SETS (SEGMENT_SIZE / CACHE_WAYS)
 
 /* The largest possible index within an index buffer */
 #define MAX_ELT_IDX 0xffffffff
@@ -53,9 +58,12 @@ struct vsplit_frontend {
    ushort identity_draw_elts[SEGMENT_SIZE];
 
    struct {
-      /* map a fetch element to a draw element */
-      unsigned fetches[MAP_SIZE];
-      ushort draws[MAP_SIZE];
+      /* map a fetch element to a draw element, in the set fetch % num_sets */
+      unsigned fetches[MAX_CACHE_SETS][CACHE_WAYS];
+      ushort draws[MAX_CACHE_SETS][CACHE_WAYS];
+      /* the way of each set to replace next */
+      ubyte victims[MAX_CACHE_SETS];
+      unsigned num_sets;
       boolean has_max_fetch;
 
       ushort num_fetch_elts;
@@ -64,10 +72,30 @@ struct vsplit_frontend {
 };
 
 
+/**
+ * Count the vertices fetched and shaded for a segment, and the primitives
+ * drawn from them, see draw_get_vertex_stats().
+ */
+static inline void
+vsplit_count(struct vsplit_frontend *vsplit,
+             unsigned fetch_count, unsigned draw_count)
+{
+   struct draw_context *draw = vsplit->draw;
+
+   draw->pt.vertex_stats.vertices_shaded += fetch_count;
+   draw->pt.vertex_stats.primitives +=
+      u_decomposed_prims_for_vertices(vsplit->prim, draw_count);
+}
+
 static void
 vsplit_clear_cache(struct vsplit_frontend *vsplit)
 {
-   memset(vsplit->cache.fetches, 0xff, sizeof(vsplit->cache.fetches));
+   const unsigned num_sets = vsplit->cache.num_sets;
+
+   memset(vsplit->cache.fetches, 0xff,
+          num_sets * sizeof(vsplit->cache.fetches[0]));
+   memset(vsplit->cache.victims, 0,
+          num_sets * sizeof(vsplit->cache.victims[0]));
    vsplit->cache.has_max_fetch = FALSE;
    vsplit->cache.num_fetch_elts = 0;
    vsplit->cache.num_draw_elts = 0;
@@ -76,6 +104,8 @@ vsplit_clear_cache(struct vsplit_frontend *vsplit)
 static void
 vsplit_flush_cache(struct vsplit_frontend *vsplit, unsigned flags)
 {
+   vsplit_count(vsplit, vsplit->cache.num_fetch_elts,
+                vsplit->cache.num_draw_elts);
    vsplit->middle->run(vsplit->middle,
          vsplit->fetch_elts, vsplit->cache.num_fetch_elts,
          vsplit->draw_elts, vsplit->cache.num_draw_elts, flags);
@@ -87,23 +117,50 @@ vsplit_flush_cache(struct vsplit_frontend *vsplit, unsigned flags)
 static inline void
 vsplit_add_cache(struct vsplit_frontend *vsplit, unsigned fetch)
 {
-   unsigned hash;
+   const unsigned set = fetch & (vsplit->cache.num_sets - 1);
+   const unsigned *fetches = vsplit->cache.fetches[set];
+   unsigned way;
 
-   hash = fetch % MAP_SIZE;
+   for (way = 0; way < CACHE_WAYS; way++) {
+      if (fetches[way] == fetch)
+         break;
+   }
 
    /* If the value isn't in the cache or it's an overflow due to the
     * element bias */
-   if (vsplit->cache.fetches[hash] != fetch) {
-      /* update cache */
-      vsplit->cache.fetches[hash] = fetch;
-      vsplit->cache.draws[hash] = vsplit->cache.num_fetch_elts;
+   if (way == CACHE_WAYS) {
+      /* update cache, replacing the oldest way of the set */
+      way = vsplit->cache.victims[set];
+      vsplit->cache.victims[set] = (way + 1) % CACHE_WAYS;
+      vsplit->cache.fetches[set][way] = fetch;
+      vsplit->cache.draws[set][way] = vsplit->cache.num_fetch_elts;
 
       /* add fetch */
       assert(vsplit->cache.num_fetch_elts < vsplit->segment_size);
       vsplit->fetch_elts[vsplit->cache.num_fetch_elts++] = fetch;
    }
 
-   vsplit->draw_elts[vsplit->cache.num_draw_elts++] = vsplit->cache.draws[hash];
+   vsplit->draw_elts[vsplit->cache.num_draw_elts++] =
+      vsplit->cache.draws[set][way];
+}
+
+/**
+ * Make DRAW_MAX_FETCH_IDX miss the first time it is added, as the cache is
+ * initialized to -1.  Only the ways still holding that initial value are
+ * touched, so the vertices cached in the other ways of the set stay valid.
+ */
+static inline void
+vsplit_add_max_fetch(struct vsplit_frontend *vsplit)
+{
+   const unsigned set = DRAW_MAX_FETCH_IDX & (vsplit->cache.num_sets - 1);
+   unsigned way;
+
+   /* force update - any value will do except DRAW_MAX_FETCH_IDX */
+   for (way = 0; way < CACHE_WAYS; way++) {
+      if (vsplit->cache.fetches[set][way] == DRAW_MAX_FETCH_IDX)
+         vsplit->cache.fetches[set][way] = 0;
+   }
+   vsplit->cache.has_max_fetch = TRUE;
 }
 
 /**
@@ -126,11 +183,8 @@ vsplit_add_cache_ubyte(struct vsplit_frontend *vsplit, const ubyte *elts,
    elt_idx = vsplit_get_base_idx(start, fetch);
    elt_idx = (unsigned)((int)(DRAW_GET_IDX(elts, elt_idx)) + elt_bias);
    /* unlike the uint case this can only happen with elt_bias */
-   if (elt_bias && elt_idx == DRAW_MAX_FETCH_IDX && !vsplit->cache.has_max_fetch) {
-      unsigned hash = elt_idx % MAP_SIZE;
-      vsplit->cache.fetches[hash] = 0;
-      vsplit->cache.has_max_fetch = TRUE;
-   }
+   if (elt_bias && elt_idx == DRAW_MAX_FETCH_IDX && !vsplit->cache.has_max_fetch)
+      vsplit_add_max_fetch(vsplit);
    vsplit_add_cache(vsplit, elt_idx);
 }
 
@@ -143,11 +197,8 @@ vsplit_add_cache_ushort(struct vsplit_frontend *vsplit, const ushort *elts,
    elt_idx = vsplit_get_base_idx(start, fetch);
    elt_idx = (unsigned)((int)(DRAW_GET_IDX(elts, elt_idx)) + elt_bias);
    /* unlike the uint case this can only happen with elt_bias */
-   if (elt_bias && elt_idx == DRAW_MAX_FETCH_IDX && !vsplit->cache.has_max_fetch) {
-      unsigned hash = elt_idx % MAP_SIZE;
-      vsplit->cache.fetches[hash] = 0;
-      vsplit->cache.has_max_fetch = TRUE;
-   }
+   if (elt_bias && elt_idx == DRAW_MAX_FETCH_IDX && !vsplit->cache.has_max_fetch)
+      vsplit_add_max_fetch(vsplit);
    vsplit_add_cache(vsplit, elt_idx);
 }
 
@@ -168,12 +219,8 @@ vsplit_add_cache_uint(struct vsplit_frontend *vsplit, const uint *elts,
    elt_idx = vsplit_get_base_idx(start, fetch);
    elt_idx = (unsigned)((int)(DRAW_GET_IDX(elts, elt_idx)) + elt_bias);
    /* Take care for DRAW_MAX_FETCH_IDX (since cache is initialized to -1). */
-   if (elt_idx == DRAW_MAX_FETCH_IDX && !vsplit->cache.has_max_fetch) {
-      unsigned hash = elt_idx % MAP_SIZE;
-      /* force update - any value will do except DRAW_MAX_FETCH_IDX */
-      vsplit->cache.fetches[hash] = 0;
-      vsplit->cache.has_max_fetch = TRUE;
-   }
+   if (elt_idx == DRAW_MAX_FETCH_IDX && !vsplit->cache.has_max_fetch)
+      vsplit_add_max_fetch(vsplit);
    vsplit_add_cache(vsplit, elt_idx);
 }
 
@@ -249,9 +296,13 @@ static void vsplit_destroy(struct draw_pt_front_end *frontend)
 }
 
 
+DEBUG_GET_ONCE_NUM_OPTION(draw_vcache_size, "DRAW_VCACHE_SIZE", SEGMENT_SIZE)
+
+
 struct draw_pt_front_end *draw_pt_vsplit(struct draw_context *draw)
 {
    struct vsplit_frontend *vsplit = CALLOC_STRUCT(vsplit_frontend);
+   unsigned cache_size;
    ushort i;
 
    if (!vsplit)
@@ -266,5 +317,11 @@ struct draw_pt_front_end *draw_pt_vsplit(struct draw_context *draw)
    for (i = 0; i < SEGMENT_SIZE; i++)
       vsplit->identity_draw_elts[i] = i;
 
+   /* At least two sets, so that only DRAW_MAX_FETCH_IDX maps to its set */
+   cache_size = CLAMP(debug_get_option_draw_vcache_size(),
+                      2 * CACHE_WAYS, SEGMENT_SIZE);
+   vsplit->cache.num_sets = util_next_power_of_two(cache_size) / CACHE_WAYS;
+   vsplit->cache.num_sets = MIN2(vsplit->cache.num_sets, MAX_CACHE_SETS);
+
    return &vsplit->base;
 }
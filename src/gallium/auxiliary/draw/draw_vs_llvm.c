@@ -35,6 +35,8 @@
 #include "draw_vs.h"
 #include "draw_llvm.h"
 
+#include "gallivm/lp_bld_init.h"
+
 #include "tgsi/tgsi_parse.h"
 #include "tgsi/tgsi_scan.h"
 #include "nir/nir_to_tgsi_info.h"
@@ -110,6 +112,15 @@ draw_create_vs_llvm(struct draw_context *draw,
       tgsi_scan_shader(state->tokens, &vs->base.info);
    }
 
+   vs->base.state.type = state->type;
+
+   /* Before any variant is compiled, as that modifies the NIR. */
+   if (draw->disk_cache_cookie) {
+      vs->has_ir_sha1 = gallivm_hash_shader_ir(&vs->base.state,
+                                               &vs->base.info,
+                                               vs->ir_sha1);
+   }
+
    vs->variant_key_size = 
       draw_llvm_variant_key_size(
          vs->base.info.file_max[TGSI_FILE_INPUT]+1,
@@ -117,7 +128,6 @@ draw_create_vs_llvm(struct draw_context *draw,
               vs->base.info.file_max[TGSI_FILE_SAMPLER_VIEW]+1),
          vs->base.info.file_max[TGSI_FILE_IMAGE]+1);
 
-   vs->base.state.type = state->type;
    vs->base.state.stream_output = state->stream_output;
    vs->base.draw = draw;
    vs->base.prepare = vs_llvm_prepare;
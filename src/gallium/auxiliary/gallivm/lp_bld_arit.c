@@ -114,10 +114,11 @@ lp_build_min_simple(struct lp_build_context *bld,
             intrinsic = "llvm.x86.sse.min.ps";
             intr_size = 128;
          }
-         else {
+         else if (type.length <= 8 || !util_cpu_caps.has_avx512f) {
             intrinsic = "llvm.x86.avx.min.ps.256";
             intr_size = 256;
          }
+         /* else leave it to llvm, there's no plain avx512 intrinsic */
       }
       if (type.width == 64 && util_cpu_caps.has_sse2) {
          if (type.length == 1) {
@@ -128,7 +129,7 @@ lp_build_min_simple(struct lp_build_context *bld,
             intrinsic = "llvm.x86.sse2.min.pd";
             intr_size = 128;
          }
-         else {
+         else if (type.length <= 4 || !util_cpu_caps.has_avx512f) {
             intrinsic = "llvm.x86.avx.min.pd.256";
             intr_size = 256;
          }
@@ -284,10 +285,11 @@ lp_build_max_simple(struct lp_build_context *bld,
             intrinsic = "llvm.x86.sse.max.ps";
             intr_size = 128;
          }
-         else {
+         else if (type.length <= 8 || !util_cpu_caps.has_avx512f) {
             intrinsic = "llvm.x86.avx.max.ps.256";
             intr_size = 256;
          }
+         /* else leave it to llvm, there's no plain avx512 intrinsic */
       }
       if (type.width == 64 && util_cpu_caps.has_sse2) {
          if (type.length == 1) {
@@ -298,7 +300,7 @@ lp_build_max_simple(struct lp_build_context *bld,
             intrinsic = "llvm.x86.sse2.max.pd";
             intr_size = 128;
          }
-         else {
+         else if (type.length <= 4 || !util_cpu_caps.has_avx512f) {
             intrinsic = "llvm.x86.avx.max.pd.256";
             intr_size = 256;
          }
@@ -459,8 +459,10 @@ lp_build_const_string(struct gallivm_state *gallivm,
 /**
  * Build a callable function pointer.
  *
- * We use function pointer constants instead of LLVMAddGlobalMapping()
- * to work around a bug in LLVM 2.6, and for efficiency/simplicity.
+ * The function is declared by name and bound to \p ptr with a global
+ * mapping instead of being embedded as an absolute address, so that the
+ * generated code can be cached and reloaded in another process.  \p name
+ * must therefore uniquely identify \p ptr within the module.
  */
 LLVMValueRef
 lp_build_const_func_pointer(struct gallivm_state *gallivm,
@@ -471,15 +473,34 @@ lp_build_const_func_pointer(struct gallivm_state *gallivm,
                             const char *name)
 {
    LLVMTypeRef function_type;
-   LLVMValueRef function;
 
    function_type = LLVMFunctionType(ret_type, arg_types, num_args, 0);
 
-   function = lp_build_const_int_pointer(gallivm, ptr);
+   return lp_build_const_func_pointer_from_type(gallivm, ptr,
+                                                function_type, name);
+}
+
+
+/**
+ * Like lp_build_const_func_pointer(), but for an existing function type,
+ * e.g. one taking variable arguments.
+ */
+LLVMValueRef
+lp_build_const_func_pointer_from_type(struct gallivm_state *gallivm,
+                                      const void *ptr,
+                                      LLVMTypeRef function_type,
+                                      const char *name)
+{
+   LLVMValueRef function;
+
+   function = LLVMGetNamedFunction(gallivm->module, name);
+   if (!function) {
+      function = LLVMAddFunction(gallivm->module, name, function_type);
+      LLVMSetLinkage(function, LLVMExternalLinkage);
+      gallivm_add_global_mapping(gallivm, function, (void *)ptr);
+   }
 
-   function = LLVMBuildBitCast(gallivm->builder, function,
-                               LLVMPointerType(function_type, 0),
-                               name);
+   assert(LLVMGetElementType(LLVMTypeOf(function)) == function_type);
 
    return function;
 }
@@ -167,8 +167,8 @@ LLVMValueRef lp_build_coro_begin_alloc_mem(struct gallivm_state *gallivm, LLVMVa
 
    LLVMTypeRef malloc_type = LLVMFunctionType(mem_ptr_type, &int32_type, 1, 0);
 
-   LLVMValueRef func_malloc = lp_build_const_int_pointer(gallivm, func_to_pointer((func_pointer)coro_malloc));
-   func_malloc = LLVMBuildBitCast(gallivm->builder, func_malloc, LLVMPointerType(malloc_type, 0), "coro_malloc");
+   LLVMValueRef func_malloc = lp_build_const_func_pointer_from_type(gallivm, func_to_pointer((func_pointer)coro_malloc),
+                                                                    malloc_type, "coro_malloc");
    alloc_mem = LLVMBuildCall(gallivm->builder, func_malloc, &coro_size, 1, "");
 
    LLVMBuildStore(gallivm->builder, alloc_mem, alloc_mem_store);
@@ -183,8 +183,8 @@ void lp_build_coro_free_mem(struct gallivm_state *gallivm, LLVMValueRef coro_id,
    LLVMValueRef alloc_mem = lp_build_coro_free(gallivm, coro_id, coro_hdl);
    LLVMTypeRef ptr_type = LLVMPointerType(LLVMInt8TypeInContext(gallivm->context), 0);
    LLVMTypeRef free_type = LLVMFunctionType(LLVMVoidTypeInContext(gallivm->context), &ptr_type, 1, 0);
-   LLVMValueRef func_free = lp_build_const_int_pointer(gallivm, func_to_pointer((func_pointer)coro_free));
-   func_free = LLVMBuildBitCast(gallivm->builder, func_free, LLVMPointerType(free_type, 0), "coro_free");
+   LLVMValueRef func_free = lp_build_const_func_pointer_from_type(gallivm, func_to_pointer((func_pointer)coro_free),
+                                                                  free_type, "coro_free");
    alloc_mem = LLVMBuildCall(gallivm->builder, func_free, &alloc_mem, 1, "");
 }
 
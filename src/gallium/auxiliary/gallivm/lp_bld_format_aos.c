@@ -793,24 +793,22 @@ lp_build_fetch_rgba_aos(struct gallivm_state *gallivm,
           */
          LLVMTypeRef ret_type;
          LLVMTypeRef arg_types[4];
-         LLVMTypeRef function_type;
+         char name[64];
 
          ret_type = LLVMVoidTypeInContext(gallivm->context);
          arg_types[0] = pi8t;
          arg_types[1] = pi8t;
          arg_types[2] = i32t;
          arg_types[3] = i32t;
-         function_type = LLVMFunctionType(ret_type, arg_types,
-                                          ARRAY_SIZE(arg_types), 0);
 
-         /* make const pointer for the C fetch_rgba_8unorm function */
-         function = lp_build_const_int_pointer(gallivm,
-            func_to_pointer((func_pointer) format_desc->fetch_rgba_8unorm));
+         snprintf(name, sizeof name, "util_format_%s_fetch_rgba_8unorm",
+                  format_desc->short_name);
 
-         /* cast the callee pointer to the function's type */
-         function = LLVMBuildBitCast(builder, function,
-                                     LLVMPointerType(function_type, 0),
-                                     "cast callee");
+         function = lp_build_const_func_pointer(gallivm,
+                                                func_to_pointer((func_pointer) format_desc->fetch_rgba_8unorm),
+                                                ret_type,
+                                                arg_types, ARRAY_SIZE(arg_types),
+                                                name);
       }
 
       tmp_ptr = lp_build_alloca(gallivm, i32t, "");
@@ -898,6 +896,7 @@ lp_build_fetch_rgba_aos(struct gallivm_state *gallivm,
           */
          LLVMTypeRef ret_type;
          LLVMTypeRef arg_types[4];
+         char name[64];
 
          ret_type = LLVMVoidTypeInContext(gallivm->context);
          arg_types[0] = pf32t;
@@ -905,11 +904,14 @@ lp_build_fetch_rgba_aos(struct gallivm_state *gallivm,
          arg_types[2] = i32t;
          arg_types[3] = i32t;
 
+         snprintf(name, sizeof name, "util_format_%s_fetch_rgba_float",
+                  format_desc->short_name);
+
          function = lp_build_const_func_pointer(gallivm,
                                                 func_to_pointer((func_pointer) format_desc->fetch_rgba_float),
                                                 ret_type,
                                                 arg_types, ARRAY_SIZE(arg_types),
-                                                format_desc->short_name);
+                                                name);
       }
 
       tmp_ptr = lp_build_alloca(gallivm, f32x4t, "");
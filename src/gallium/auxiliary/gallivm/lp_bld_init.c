@@ -28,6 +28,9 @@
 
 #include "pipe/p_config.h"
 #include "pipe/p_compiler.h"
+#include "pipe/p_state.h"
+#include "tgsi/tgsi_parse.h"
+#include "tgsi/tgsi_scan.h"
 #include "util/u_cpu_detect.h"
 #include "util/u_debug.h"
 #include "util/u_memory.h"
@@ -37,6 +40,8 @@
 #include "lp_bld_debug.h"
 #include "lp_bld_misc.h"
 #include "lp_bld_init.h"
+#include "lp_bld_type.h"
+#include "nir.h"
 
 #include <llvm/Config/llvm-config.h>
 #include <llvm-c/Analysis.h>
@@ -60,6 +65,8 @@ static const struct debug_named_value lp_bld_perf_flags[] = {
    { "no_quad_lod", GALLIVM_PERF_NO_QUAD_LOD, "disable quad_lod optimization" },
    { "no_aos_sampling", GALLIVM_PERF_NO_AOS_SAMPLING, "disable aos sampling optimization" },
    { "nopt",   GALLIVM_PERF_NO_OPT, "disable optimization passes to speed up shader compilation" },
+   { "shared_jit", GALLIVM_PERF_SHARED_JIT, "compile modules in a few shared execution engines" },
+   { "tiered", GALLIVM_PERF_TIERED, "compile shaders without optimizations first, and optimize them once used often" },
    { "no_filter_hacks", GALLIVM_PERF_NO_BRILINEAR | GALLIVM_PERF_NO_RHO_APPROX |
      GALLIVM_PERF_NO_QUAD_LOD, "disable filter optimization hacks" },
    DEBUG_NAMED_VALUE_END
@@ -145,7 +152,7 @@ create_pass_manager(struct gallivm_state *gallivm)
    LLVMAddCoroElidePass(gallivm->cgpassmgr);
 #endif
 
-   if ((gallivm_perf & GALLIVM_PERF_NO_OPT) == 0) {
+   if ((gallivm_perf & GALLIVM_PERF_NO_OPT) == 0 && !gallivm->no_opt) {
       /*
        * TODO: Evaluate passes some more - keeping in mind
        * both quality of generated code and compile times.
@@ -203,13 +210,23 @@ gallivm_free_ir(struct gallivm_state *gallivm)
    }
 #endif
 
-   if (gallivm->engine) {
+   if (gallivm->shared_jit) {
+      lp_shared_jit_remove_module(gallivm->shared_jit, gallivm->module);
+      LLVMDisposeModule(gallivm->module);
+   } else if (gallivm->engine) {
       /* This will already destroy any associated module */
       LLVMDisposeExecutionEngine(gallivm->engine);
    } else if (gallivm->module) {
       LLVMDisposeModule(gallivm->module);
    }
 
+   /* The engine doesn't own its object cache. */
+   if (gallivm->object_cache) {
+      lp_free_object_cache(gallivm->object_cache);
+   }
+
+   FREE(gallivm->mappings);
+
    FREE(gallivm->module_name);
 
    if (gallivm->target) {
@@ -222,6 +239,12 @@ gallivm_free_ir(struct gallivm_state *gallivm)
    /* The LLVMContext should be owned by the parent of gallivm. */
 
    gallivm->engine = NULL;
+   gallivm->shared_jit = NULL;
+   gallivm->object_cache = NULL;
+   gallivm->cache = NULL;
+   gallivm->mappings = NULL;
+   gallivm->num_mappings = 0;
+   gallivm->max_mappings = 0;
    gallivm->target = NULL;
    gallivm->module = NULL;
    gallivm->module_name = NULL;
@@ -255,15 +278,33 @@ init_gallivm_engine(struct gallivm_state *gallivm)
       char *error = NULL;
       int ret;
 
-      if (gallivm_perf & GALLIVM_PERF_NO_OPT) {
+      if ((gallivm_perf & GALLIVM_PERF_NO_OPT) || gallivm->no_opt) {
          optlevel = None;
       }
       else {
          optlevel = Default;
       }
 
+      /*
+       * Objects compiled in a shared engine have engine specific symbol
+       * names, so they are neither loaded from nor stored in the cache.
+       */
+      if ((gallivm_perf & GALLIVM_PERF_SHARED_JIT) &&
+          !(gallivm->cache && gallivm->cache->data_size)) {
+         gallivm->shared_jit = lp_shared_jit_compile(gallivm->module,
+                                                     gallivm->memorymgr,
+                                                     gallivm->mappings,
+                                                     gallivm->num_mappings,
+                                                     (unsigned) optlevel,
+                                                     &gallivm->code);
+         if (gallivm->shared_jit)
+            return TRUE;
+      }
+
       ret = lp_build_create_jit_compiler_for_module(&gallivm->engine,
                                                     &gallivm->code,
+                                                    gallivm->cache,
+                                                    &gallivm->object_cache,
                                                     gallivm->module,
                                                     gallivm->memorymgr,
                                                     (unsigned) optlevel,
@@ -275,6 +316,12 @@ init_gallivm_engine(struct gallivm_state *gallivm)
       }
    }
 
+   for (unsigned i = 0; i < gallivm->num_mappings; i++) {
+      LLVMAddGlobalMapping(gallivm->engine,
+                           gallivm->mappings[i].global,
+                           gallivm->mappings[i].address);
+   }
+
    if (0) {
        /*
         * Dump the data layout strings.
@@ -309,7 +356,7 @@ fail:
  */
 static boolean
 init_gallivm_state(struct gallivm_state *gallivm, const char *name,
-                   LLVMContextRef context)
+                   LLVMContextRef context, struct lp_cached_code *cache)
 {
    assert(!gallivm->context);
    assert(!gallivm->module);
@@ -318,6 +365,7 @@ init_gallivm_state(struct gallivm_state *gallivm, const char *name,
       return FALSE;
 
    gallivm->context = context;
+   gallivm->cache = cache;
 
    if (!gallivm->context)
       goto fail;
@@ -454,6 +502,28 @@ lp_build_init(void)
    lp_native_vector_width = debug_get_num_option("LP_NATIVE_VECTOR_WIDTH",
                                                  lp_native_vector_width);
 
+   /* 512-bit vectors are opt-in: they only pay off on cores with two full
+    * width FMA units, and the frequency drop can cost more elsewhere.
+    */
+   if (lp_native_vector_width > 256 && !util_cpu_caps.has_avx512f)
+      lp_native_vector_width = 256;
+   lp_native_vector_width = MIN2(lp_native_vector_width, LP_MAX_VECTOR_WIDTH);
+
+   if (lp_native_vector_width <= 256) {
+      /* Likewise hide AVX-512 unless asked for 512-bit vectors, as LLVM
+       * would otherwise use it for narrower vectors too.
+       */
+      util_cpu_caps.has_avx512f = 0;
+      util_cpu_caps.has_avx512dq = 0;
+      util_cpu_caps.has_avx512ifma = 0;
+      util_cpu_caps.has_avx512pf = 0;
+      util_cpu_caps.has_avx512er = 0;
+      util_cpu_caps.has_avx512cd = 0;
+      util_cpu_caps.has_avx512bw = 0;
+      util_cpu_caps.has_avx512vl = 0;
+      util_cpu_caps.has_avx512vbmi = 0;
+   }
+
    if (lp_native_vector_width <= 128) {
       /* Hide AVX support, as often LLVM AVX intrinsics are only guarded by
        * "util_cpu_caps.has_avx" predicate, and lack the
@@ -499,15 +569,44 @@ lp_build_init(void)
 
 /**
  * Create a new gallivm_state object.
+ *
+ * \param cache  optional object code to load instead of compiling the
+ *               module, or to receive the compiled object; must remain valid
+ *               until gallivm_free_ir() is called
+ */
+struct gallivm_state *
+gallivm_create(const char *name, LLVMContextRef context,
+               struct lp_cached_code *cache)
+{
+   struct gallivm_state *gallivm;
+
+   gallivm = CALLOC_STRUCT(gallivm_state);
+   if (gallivm) {
+      if (!init_gallivm_state(gallivm, name, context, cache)) {
+         FREE(gallivm);
+         gallivm = NULL;
+      }
+   }
+
+   return gallivm;
+}
+
+
+/**
+ * Create a new gallivm_state object for code which is needed quickly
+ * rather than fast, as if GALLIVM_PERF=nopt was set for it: only the
+ * passes the backends need are run, and code is generated at -O0, which
+ * uses the fast instruction selector.
  */
 struct gallivm_state *
-gallivm_create(const char *name, LLVMContextRef context)
+gallivm_create_unoptimized(const char *name, LLVMContextRef context)
 {
    struct gallivm_state *gallivm;
 
    gallivm = CALLOC_STRUCT(gallivm_state);
    if (gallivm) {
-      if (!init_gallivm_state(gallivm, name, context)) {
+      gallivm->no_opt = TRUE;
+      if (!init_gallivm_state(gallivm, name, context, NULL)) {
          FREE(gallivm);
          gallivm = NULL;
       }
@@ -554,6 +653,17 @@ gallivm_verify_function(struct gallivm_state *gallivm,
 }
 
 
+static void *
+get_pointer_to_function(struct gallivm_state *gallivm, LLVMValueRef func)
+{
+   if (gallivm->shared_jit)
+      return lp_shared_jit_get_pointer(gallivm->shared_jit, func);
+
+   assert(gallivm->engine);
+   return LLVMGetPointerToGlobal(gallivm->engine, func);
+}
+
+
 /**
  * Compile a module.
  * This does IR optimization on all functions in the module.
@@ -587,6 +697,10 @@ gallivm_compile_module(struct gallivm_state *gallivm)
                    "[-mattr=<-mattr option(s)>]");
    }
 
+   /* A cached object replaces optimization and code generation. */
+   if (gallivm->cache && gallivm->cache->data_size)
+      goto skip_passes;
+
    if (gallivm_debug & GALLIVM_DEBUG_PERF)
       time_begin = os_time_get();
 
@@ -621,6 +735,7 @@ gallivm_compile_module(struct gallivm_state *gallivm)
                    gallivm->module_name, time_msec);
    }
 
+skip_passes:
    /* Setting the module's DataLayout to an empty string will cause the
     * ExecutionEngine to copy to the DataLayout string from its target machine
     * to the module.  As of LLVM 3.8 the module and the execution engine are
@@ -643,7 +758,7 @@ gallivm_compile_module(struct gallivm_state *gallivm)
    if (!init_gallivm_engine(gallivm)) {
       assert(0);
    }
-   assert(gallivm->engine);
+   assert(gallivm->engine || gallivm->shared_jit);
 
    ++gallivm->compiled;
 
@@ -657,7 +772,7 @@ gallivm_compile_module(struct gallivm_state *gallivm)
           * LLVMGetPointerToGlobal() will abort otherwise.
           */
          if (!LLVMIsDeclaration(llvm_func)) {
-            void *func_code = LLVMGetPointerToGlobal(gallivm->engine, llvm_func);
+            void *func_code = get_pointer_to_function(gallivm, llvm_func);
             lp_disassemble(llvm_func, func_code);
          }
          llvm_func = LLVMGetNextFunction(llvm_func);
@@ -670,7 +785,7 @@ gallivm_compile_module(struct gallivm_state *gallivm)
 
       while (llvm_func) {
          if (!LLVMIsDeclaration(llvm_func)) {
-            void *func_code = LLVMGetPointerToGlobal(gallivm->engine, llvm_func);
+            void *func_code = get_pointer_to_function(gallivm, llvm_func);
             lp_profile(llvm_func, func_code);
          }
          llvm_func = LLVMGetNextFunction(llvm_func);
@@ -690,12 +805,11 @@ gallivm_jit_function(struct gallivm_state *gallivm,
    int64_t time_begin = 0;
 
    assert(gallivm->compiled);
-   assert(gallivm->engine);
 
    if (gallivm_debug & GALLIVM_DEBUG_PERF)
       time_begin = os_time_get();
 
-   code = LLVMGetPointerToGlobal(gallivm->engine, func);
+   code = get_pointer_to_function(gallivm, func);
    assert(code);
    jit_func = pointer_to_func(code);
 
@@ -708,3 +822,88 @@ gallivm_jit_function(struct gallivm_state *gallivm,
 
    return jit_func;
 }
+
+
+/**
+ * Resolve the given declaration to a host address when the module is
+ * compiled or loaded.
+ */
+void
+gallivm_add_global_mapping(struct gallivm_state *gallivm,
+                           LLVMValueRef global, void *address)
+{
+   assert(!gallivm->engine && !gallivm->shared_jit);
+
+   if (gallivm->num_mappings == gallivm->max_mappings) {
+      unsigned max_mappings = MAX2(gallivm->max_mappings * 2, 8);
+      gallivm->mappings = REALLOC(gallivm->mappings,
+                                  gallivm->max_mappings * sizeof *gallivm->mappings,
+                                  max_mappings * sizeof *gallivm->mappings);
+      gallivm->max_mappings = max_mappings;
+   }
+
+   gallivm->mappings[gallivm->num_mappings].global = global;
+   gallivm->mappings[gallivm->num_mappings].address = address;
+   gallivm->num_mappings++;
+}
+
+
+/**
+ * Hash the IR of a shader for the disk cache, in a form that comes out the
+ * same in every process: TGSI tokens as they are, NIR as printed.  The
+ * serialized NIR would include struct padding, and the shader name and
+ * label only identify the shader within a process, so they are left out.
+ * The scanned properties add what the printed NIR doesn't show, such as
+ * the geometry shader primitives; the rest of the info is derived from
+ * the IR, and hashing the whole struct would include its padding.
+ *
+ * Returns false if the NIR couldn't be printed.
+ */
+boolean
+gallivm_hash_shader_ir(const struct pipe_shader_state *state,
+                       const struct tgsi_shader_info *info,
+                       unsigned char sha1[20])
+{
+   struct mesa_sha1 ctx;
+
+   _mesa_sha1_init(&ctx);
+
+   if (state->type == PIPE_SHADER_IR_TGSI) {
+      _mesa_sha1_update(&ctx, state->tokens,
+                        tgsi_num_tokens(state->tokens) *
+                        sizeof(struct tgsi_token));
+   } else {
+      FILE *fp = tmpfile();
+      char line[1024];
+      unsigned num_lines = 0;
+      boolean line_start = TRUE, skip = FALSE;
+
+      if (!fp)
+         return FALSE;
+
+      nir_print_shader(state->ir.nir, fp);
+      rewind(fp);
+
+      while (fgets(line, sizeof line, fp)) {
+         size_t len = strlen(line);
+
+         /* The name and label follow the stage on the first lines. */
+         if (line_start) {
+            skip = num_lines < 3 &&
+                   (!strncmp(line, "name: ", 6) || !strncmp(line, "label: ", 7));
+         }
+         if (!skip)
+            _mesa_sha1_update(&ctx, line, len);
+
+         line_start = len && line[len - 1] == '\n';
+         if (line_start)
+            num_lines++;
+      }
+
+      fclose(fp);
+   }
+
+   _mesa_sha1_update(&ctx, info->properties, sizeof info->properties);
+   _mesa_sha1_final(&ctx, sha1);
+   return TRUE;
+}
@@ -32,6 +32,7 @@
 
 #include "pipe/p_compiler.h"
 #include "util/u_pointer.h" // for func_pointer
+#include "util/mesa-sha1.h"
 #include "lp_bld.h"
 #include <llvm-c/ExecutionEngine.h>
 
@@ -39,11 +40,39 @@
 extern "C" {
 #endif
 
+
+/**
+ * Object code of a compiled module, for persisting across processes.
+ *
+ * If data_size is non-zero when the module is compiled, the object is loaded
+ * from data instead of running the optimization passes and code generation.
+ * Otherwise the generated object is copied into data, which is then owned by
+ * the caller.
+ */
+struct lp_cached_code
+{
+   void *data;
+   size_t data_size;
+};
+
+
+/**
+ * A C function called from generated code, resolved by name when the object
+ * is loaded so that the object does not embed any addresses.
+ */
+struct lp_global_mapping
+{
+   LLVMValueRef global;
+   void *address;
+};
+
+
 struct gallivm_state
 {
    char *module_name;
    LLVMModuleRef module;
    LLVMExecutionEngineRef engine;
+   struct lp_shared_jit *shared_jit;   /**< instead of engine, if not NULL */
    LLVMTargetDataRef target;
    LLVMPassManagerRef passmgr;
    LLVMPassManagerRef cgpassmgr;
@@ -52,6 +81,14 @@ struct gallivm_state
    LLVMMCJITMemoryManagerRef memorymgr;
    struct lp_generated_code *code;
    unsigned compiled;
+   boolean no_opt;
+
+   struct lp_cached_code *cache;
+   void *object_cache;
+
+   struct lp_global_mapping *mappings;
+   unsigned num_mappings;
+   unsigned max_mappings;
 };
 
 
@@ -60,7 +97,11 @@ lp_build_init(void);
 
 
 struct gallivm_state *
-gallivm_create(const char *name, LLVMContextRef context);
+gallivm_create(const char *name, LLVMContextRef context,
+               struct lp_cached_code *cache);
+
+struct gallivm_state *
+gallivm_create_unoptimized(const char *name, LLVMContextRef context);
 
 void
 gallivm_destroy(struct gallivm_state *gallivm);
@@ -79,6 +120,21 @@ func_pointer
 gallivm_jit_function(struct gallivm_state *gallivm,
                      LLVMValueRef func);
 
+void
+gallivm_add_global_mapping(struct gallivm_state *gallivm,
+                           LLVMValueRef global, void *address);
+
+void
+gallivm_hash_host_identity(struct mesa_sha1 *ctx);
+
+struct pipe_shader_state;
+struct tgsi_shader_info;
+
+boolean
+gallivm_hash_shader_ir(const struct pipe_shader_state *state,
+                       const struct tgsi_shader_info *info,
+                       unsigned char sha1[20]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,6 +42,9 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <llvm/Config/llvm-config.h>
 
 #if LLVM_VERSION_MAJOR < 7
@@ -58,6 +61,7 @@
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ADT/Triple.h>
 #include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Host.h>
@@ -85,9 +89,12 @@
 #include "pipe/p_config.h"
 #include "util/u_debug.h"
 #include "util/u_cpu_detect.h"
+#include "util/mesa-sha1.h"
 
 #include "lp_bld_misc.h"
 #include "lp_bld_debug.h"
+#include "lp_bld_init.h"
+#include "lp_bld_type.h"
 
 namespace {
 
@@ -289,59 +296,79 @@ class ShaderMemoryManager : public DelegatingJITMemoryManager {
 
 
 /**
- * Same as LLVMCreateJITCompilerForModule, but:
- * - allows using MCJIT and enabling AVX feature where available.
- * - set target options
- *
- * See also:
- * - llvm/lib/ExecutionEngine/ExecutionEngineBindings.cpp
- * - llvm/tools/lli/lli.cpp
- * - http://markmail.org/message/ttkuhvgj4cxxy2on#query:+page:1+mid:aju2dggerju3ivd3+state:results
+ * Hands MCJIT the object in an lp_cached_code instead of compiling the
+ * module, or copies the object it compiled into it.
  */
-extern "C"
-LLVMBool
-lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
-                                        lp_generated_code **OutCode,
-                                        LLVMModuleRef M,
-                                        LLVMMCJITMemoryManagerRef CMM,
-                                        unsigned OptLevel,
-                                        char **OutError)
-{
-   using namespace llvm;
+class LPObjectCache : public llvm::ObjectCache {
+public:
+   LPObjectCache(lp_cached_code *cache) : cache(cache) {}
 
-   std::string Error;
-   EngineBuilder builder(std::unique_ptr<Module>(unwrap(M)));
+   void notifyObjectCompiled(const llvm::Module *M,
+                             llvm::MemoryBufferRef Obj) override
+   {
+      assert(!cache->data_size);
+      cache->data_size = Obj.getBufferSize();
+      cache->data = malloc(cache->data_size);
+      if (!cache->data) {
+         cache->data_size = 0;
+         return;
+      }
+      memcpy(cache->data, Obj.getBufferStart(), cache->data_size);
+   }
 
-   /**
-    * LLVM 3.1+ haven't more "extern unsigned llvm::StackAlignmentOverride" and
-    * friends for configuring code generation options, like stack alignment.
-    */
-   TargetOptions options;
-#if defined(PIPE_ARCH_X86)
-   options.StackAlignmentOverride = 4;
-#endif
+   std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override
+   {
+      if (!cache->data_size)
+         return nullptr;
+      /* MCJIT copies the sections out, so the data needn't outlive this. */
+      return llvm::MemoryBuffer::getMemBuffer(
+         llvm::StringRef((const char *)cache->data, cache->data_size),
+         M->getModuleIdentifier(), false);
+   }
 
-   builder.setEngineKind(EngineKind::JIT)
-          .setErrorStr(&Error)
-          .setTargetOptions(options)
-          .setOptLevel((CodeGenOpt::Level)OptLevel);
+private:
+   lp_cached_code *cache;
+};
 
-#ifdef _WIN32
-    /*
-     * MCJIT works on Windows, but currently only through ELF object format.
-     *
-     * XXX: We could use `LLVM_HOST_TRIPLE "-elf"` but LLVM_HOST_TRIPLE has
-     * different strings for MinGW/MSVC, so better play it safe and be
-     * explicit.
-     */
-#  ifdef _WIN64
-    LLVMSetTarget(M, "x86_64-pc-win32-elf");
-#  else
-    LLVMSetTarget(M, "i686-pc-win32-elf");
-#  endif
-#endif
 
-   llvm::SmallVector<std::string, 16> MAttrs;
+/*
+ * Send the allocations of the module being loaded into a shared engine to
+ * the memory manager of the gallivm state it belongs to, so that its code is
+ * freed along with the other modules of that state.
+ */
+class RedirectingMemoryManager : public DelegatingJITMemoryManager {
+
+   BaseMemoryManager *TheMM;
+
+   BaseMemoryManager *mgr() const {
+      return TheMM;
+   }
+
+   public:
+
+      RedirectingMemoryManager(BaseMemoryManager *MM) {
+         TheMM = MM;
+      }
+
+      void setCurrent(BaseMemoryManager *MM) {
+         TheMM = MM;
+      }
+};
+
+
+static std::vector<std::string> host_mattrs;
+static std::string host_mcpu;
+static once_flag host_target_once_flag = ONCE_FLAG_INIT;
+
+
+/**
+ * Work out the -mattr and -mcpu options for the host, once rather than for
+ * every engine.
+ */
+static void
+init_host_target()
+{
+   using namespace llvm;
 
 #if LLVM_VERSION_MAJOR >= 4 && (defined(PIPE_ARCH_X86) || defined(PIPE_ARCH_X86_64) || defined(PIPE_ARCH_ARM))
    /* llvm-3.3+ implements sys::getHostCPUFeatures for Arm
@@ -355,7 +382,7 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
    for (StringMapIterator<bool> f = features.begin();
         f != features.end();
         ++f) {
-      MAttrs.push_back(((*f).second ? "+" : "-") + (*f).first().str());
+      host_mattrs.push_back(((*f).second ? "+" : "-") + (*f).first().str());
    }
 #elif defined(PIPE_ARCH_X86) || defined(PIPE_ARCH_X86_64)
    /*
@@ -367,41 +394,43 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
     * http://llvm.org/PR19429
     * http://llvm.org/PR16721
     */
-   MAttrs.push_back(util_cpu_caps.has_sse    ? "+sse"    : "-sse"   );
-   MAttrs.push_back(util_cpu_caps.has_sse2   ? "+sse2"   : "-sse2"  );
-   MAttrs.push_back(util_cpu_caps.has_sse3   ? "+sse3"   : "-sse3"  );
-   MAttrs.push_back(util_cpu_caps.has_ssse3  ? "+ssse3"  : "-ssse3" );
-   MAttrs.push_back(util_cpu_caps.has_sse4_1 ? "+sse4.1" : "-sse4.1");
-   MAttrs.push_back(util_cpu_caps.has_sse4_2 ? "+sse4.2" : "-sse4.2");
+   host_mattrs.push_back(util_cpu_caps.has_sse    ? "+sse"    : "-sse"   );
+   host_mattrs.push_back(util_cpu_caps.has_sse2   ? "+sse2"   : "-sse2"  );
+   host_mattrs.push_back(util_cpu_caps.has_sse3   ? "+sse3"   : "-sse3"  );
+   host_mattrs.push_back(util_cpu_caps.has_ssse3  ? "+ssse3"  : "-ssse3" );
+   host_mattrs.push_back(util_cpu_caps.has_sse4_1 ? "+sse4.1" : "-sse4.1");
+   host_mattrs.push_back(util_cpu_caps.has_sse4_2 ? "+sse4.2" : "-sse4.2");
    /*
     * AVX feature is not automatically detected from CPUID by the X86 target
     * yet, because the old (yet default) JIT engine is not capable of
     * emitting the opcodes. On newer llvm versions it is and at least some
     * versions (tested with 3.3) will emit avx opcodes without this anyway.
     */
-   MAttrs.push_back(util_cpu_caps.has_avx  ? "+avx"  : "-avx");
-   MAttrs.push_back(util_cpu_caps.has_f16c ? "+f16c" : "-f16c");
-   MAttrs.push_back(util_cpu_caps.has_fma  ? "+fma"  : "-fma");
-   MAttrs.push_back(util_cpu_caps.has_avx2 ? "+avx2" : "-avx2");
-   /* disable avx512 and all subvariants */
-   MAttrs.push_back("-avx512cd");
-   MAttrs.push_back("-avx512er");
-   MAttrs.push_back("-avx512f");
-   MAttrs.push_back("-avx512pf");
-   MAttrs.push_back("-avx512bw");
-   MAttrs.push_back("-avx512dq");
-   MAttrs.push_back("-avx512vl");
+   host_mattrs.push_back(util_cpu_caps.has_avx  ? "+avx"  : "-avx");
+   host_mattrs.push_back(util_cpu_caps.has_f16c ? "+f16c" : "-f16c");
+   host_mattrs.push_back(util_cpu_caps.has_fma  ? "+fma"  : "-fma");
+   host_mattrs.push_back(util_cpu_caps.has_avx2 ? "+avx2" : "-avx2");
+   /* avx512 is only left enabled with 512-bit native vectors, see
+    * lp_build_init(); the xeon phi subvariants are never used
+    */
+   host_mattrs.push_back(util_cpu_caps.has_avx512cd ? "+avx512cd" : "-avx512cd");
+   host_mattrs.push_back("-avx512er");
+   host_mattrs.push_back(util_cpu_caps.has_avx512f ? "+avx512f" : "-avx512f");
+   host_mattrs.push_back("-avx512pf");
+   host_mattrs.push_back(util_cpu_caps.has_avx512bw ? "+avx512bw" : "-avx512bw");
+   host_mattrs.push_back(util_cpu_caps.has_avx512dq ? "+avx512dq" : "-avx512dq");
+   host_mattrs.push_back(util_cpu_caps.has_avx512vl ? "+avx512vl" : "-avx512vl");
 #endif
 #if defined(PIPE_ARCH_ARM)
    if (!util_cpu_caps.has_neon) {
-      MAttrs.push_back("-neon");
-      MAttrs.push_back("-crypto");
-      MAttrs.push_back("-vfp2");
+      host_mattrs.push_back("-neon");
+      host_mattrs.push_back("-crypto");
+      host_mattrs.push_back("-vfp2");
    }
 #endif
 
 #if defined(PIPE_ARCH_PPC)
-   MAttrs.push_back(util_cpu_caps.has_altivec ? "+altivec" : "-altivec");
+   host_mattrs.push_back(util_cpu_caps.has_altivec ? "+altivec" : "-altivec");
 #if (LLVM_VERSION_MAJOR < 4)
    /*
     * Make sure VSX instructions are disabled
@@ -412,7 +441,7 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
     * https://llvm.org/bugs/show_bug.cgi?id=34647 (llc performance on certain unusual shader IR; intro'd in 4.0, pending as of 5.0)
     */
    if (util_cpu_caps.has_altivec) {
-      MAttrs.push_back("-vsx");
+      host_mattrs.push_back("-vsx");
    }
 #else
    /*
@@ -426,24 +455,13 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
     * VSX instructions are explicitly enabled/disabled via GALLIVM_VSX=1 or 0.
     */
    if (util_cpu_caps.has_altivec) {
-      MAttrs.push_back(util_cpu_caps.has_vsx ? "+vsx" : "-vsx");
+      host_mattrs.push_back(util_cpu_caps.has_vsx ? "+vsx" : "-vsx");
    }
 #endif
 #endif
 
-   builder.setMAttrs(MAttrs);
 
-   if (gallivm_debug & (GALLIVM_DEBUG_IR | GALLIVM_DEBUG_ASM | GALLIVM_DEBUG_DUMP_BC)) {
-      int n = MAttrs.size();
-      if (n > 0) {
-         debug_printf("llc -mattr option(s): ");
-         for (int i = 0; i < n; i++)
-            debug_printf("%s%s", MAttrs[i].c_str(), (i < n - 1) ? "," : "");
-         debug_printf("\n");
-      }
-   }
-
-   StringRef MCPU = llvm::sys::getHostCPUName();
+   host_mcpu = llvm::sys::getHostCPUName().str();
    /*
     * The cpu bits are no longer set automatically, so need to set mcpu manually.
     * Note that the MAttrs set above will be sort of ignored (since we should
@@ -457,6 +475,60 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
     * can't handle. Not entirely sure if we really need to do anything yet.
     */
 
+#if defined(PIPE_ARCH_PPC_64) && UTIL_ARCH_LITTLE_ENDIAN
+   /*
+    * Versions of LLVM prior to 4.0 lacked a table entry for "POWER8NVL",
+    * resulting in (big-endian) "generic" being returned on
+    * little-endian Power8NVL systems.  The result was that code that
+    * attempted to load the least significant 32 bits of a 64-bit quantity
+    * from memory loaded the wrong half.  This resulted in failures in some
+    * Piglit tests, e.g.
+    * .../arb_gpu_shader_fp64/execution/conversion/frag-conversion-explicit-double-uint
+    */
+   if (host_mcpu == "generic")
+      host_mcpu = "pwr8";
+#endif
+}
+
+
+/**
+ * Set up an engine builder for the host, see
+ * lp_build_create_jit_compiler_for_module().
+ */
+static void
+configure_engine_builder(llvm::EngineBuilder &builder, std::string *Error,
+                         unsigned OptLevel)
+{
+   using namespace llvm;
+
+   call_once(&host_target_once_flag, init_host_target);
+
+   /**
+    * LLVM 3.1+ haven't more "extern unsigned llvm::StackAlignmentOverride" and
+    * friends for configuring code generation options, like stack alignment.
+    */
+   TargetOptions options;
+#if defined(PIPE_ARCH_X86)
+   options.StackAlignmentOverride = 4;
+#endif
+
+   builder.setEngineKind(EngineKind::JIT)
+          .setErrorStr(Error)
+          .setTargetOptions(options)
+          .setOptLevel((CodeGenOpt::Level)OptLevel);
+
+   builder.setMAttrs(host_mattrs);
+
+   if (gallivm_debug & (GALLIVM_DEBUG_IR | GALLIVM_DEBUG_ASM | GALLIVM_DEBUG_DUMP_BC)) {
+      int n = host_mattrs.size();
+      if (n > 0) {
+         debug_printf("llc -mattr option(s): ");
+         for (int i = 0; i < n; i++)
+            debug_printf("%s%s", host_mattrs[i].c_str(), (i < n - 1) ? "," : "");
+         debug_printf("\n");
+      }
+   }
+
 #ifdef PIPE_ARCH_PPC_64
    /*
     * Large programs, e.g. gnome-shell and firefox, may tax the addressability
@@ -468,25 +540,64 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
     * - change an add-immediate (addis) instruction to a load (ld).
     */
    builder.setCodeModel(CodeModel::Large);
-
-#if UTIL_ARCH_LITTLE_ENDIAN
-   /*
-    * Versions of LLVM prior to 4.0 lacked a table entry for "POWER8NVL",
-    * resulting in (big-endian) "generic" being returned on
-    * little-endian Power8NVL systems.  The result was that code that
-    * attempted to load the least significant 32 bits of a 64-bit quantity
-    * from memory loaded the wrong half.  This resulted in failures in some
-    * Piglit tests, e.g.
-    * .../arb_gpu_shader_fp64/execution/conversion/frag-conversion-explicit-double-uint
-    */
-   if (MCPU == "generic")
-      MCPU = "pwr8";
-#endif
 #endif
-   builder.setMCPU(MCPU);
+
+   builder.setMCPU(host_mcpu);
    if (gallivm_debug & (GALLIVM_DEBUG_IR | GALLIVM_DEBUG_ASM | GALLIVM_DEBUG_DUMP_BC)) {
-      debug_printf("llc -mcpu option: %s\n", MCPU.str().c_str());
+      debug_printf("llc -mcpu option: %s\n", host_mcpu.c_str());
    }
+}
+
+
+static void
+set_module_target(LLVMModuleRef M)
+{
+#ifdef _WIN32
+    /*
+     * MCJIT works on Windows, but currently only through ELF object format.
+     *
+     * XXX: We could use `LLVM_HOST_TRIPLE "-elf"` but LLVM_HOST_TRIPLE has
+     * different strings for MinGW/MSVC, so better play it safe and be
+     * explicit.
+     */
+#  ifdef _WIN64
+    LLVMSetTarget(M, "x86_64-pc-win32-elf");
+#  else
+    LLVMSetTarget(M, "i686-pc-win32-elf");
+#  endif
+#endif
+}
+
+
+/**
+ * Same as LLVMCreateJITCompilerForModule, but:
+ * - allows using MCJIT and enabling AVX feature where available.
+ * - set target options
+ * - loads the object from, or stores it to, the optional Cache
+ *
+ * See also:
+ * - llvm/lib/ExecutionEngine/ExecutionEngineBindings.cpp
+ * - llvm/tools/lli/lli.cpp
+ * - http://markmail.org/message/ttkuhvgj4cxxy2on#query:+page:1+mid:aju2dggerju3ivd3+state:results
+ */
+extern "C"
+LLVMBool
+lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
+                                        lp_generated_code **OutCode,
+                                        lp_cached_code *Cache,
+                                        void **OutObjectCache,
+                                        LLVMModuleRef M,
+                                        LLVMMCJITMemoryManagerRef CMM,
+                                        unsigned OptLevel,
+                                        char **OutError)
+{
+   using namespace llvm;
+
+   std::string Error;
+   EngineBuilder builder(std::unique_ptr<Module>(unwrap(M)));
+
+   configure_engine_builder(builder, &Error, OptLevel);
+   set_module_target(M);
 
    ShaderMemoryManager *MM = NULL;
    BaseMemoryManager* JMM = reinterpret_cast<BaseMemoryManager*>(CMM);
@@ -504,6 +615,11 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
    JIT->RegisterJITEventListener(JEL);
 #endif
    if (JIT) {
+      if (Cache) {
+         LPObjectCache *ObjectCache = new LPObjectCache(Cache);
+         JIT->setObjectCache(ObjectCache);
+         *OutObjectCache = ObjectCache;
+      }
       *OutJIT = wrap(JIT);
       return 0;
    }
@@ -515,6 +631,253 @@ lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
 }
 
 
+/**
+ * An MCJIT engine which several modules are added to, instead of creating
+ * an engine, and with it a target machine and pass pipeline, per module.
+ *
+ * MCJIT keeps the symbol table and object of every module it loaded even
+ * after the module is removed, so an engine is retired after a number of
+ * modules and destroyed once its last module is removed.
+ */
+struct lp_shared_jit
+{
+   mtx_t mutex;                           /**< serializes use of the engine */
+   llvm::ExecutionEngine *engine;
+   RedirectingMemoryManager *redirect;    /**< owned by engine */
+   BaseMemoryManager *own_mm;
+   LLVMContextRef context;                /**< of the engine's empty module */
+   unsigned opt_level;
+
+   unsigned num_modules;                  /**< ever added, names the symbols */
+
+   /* Under shared_jits_mutex. */
+   unsigned refs;                         /**< modules not yet removed */
+   bool retired;
+};
+
+#define LP_MAX_SHARED_JITS 8
+#define LP_SHARED_JIT_MAX_MODULES 256
+
+/* Protects the list below, and the refs of the engines. */
+static mtx_t shared_jits_mutex = _MTX_INITIALIZER_NP;
+static struct lp_shared_jit *shared_jits[LP_MAX_SHARED_JITS];
+static unsigned shared_jits_next;
+
+
+static struct lp_shared_jit *
+shared_jit_create(unsigned OptLevel)
+{
+   using namespace llvm;
+
+   struct lp_shared_jit *jit = new lp_shared_jit();
+   std::string Error;
+
+   jit->opt_level = OptLevel;
+   jit->context = LLVMContextCreate();
+   LLVMModuleRef M = LLVMModuleCreateWithNameInContext("shared_jit",
+                                                       jit->context);
+   set_module_target(M);
+
+   jit->own_mm = new SectionMemoryManager();
+   jit->redirect = new RedirectingMemoryManager(jit->own_mm);
+
+   {
+      EngineBuilder builder(std::unique_ptr<Module>(unwrap(M)));
+      configure_engine_builder(builder, &Error, OptLevel);
+      builder.setMCJITMemoryManager(std::unique_ptr<RTDyldMemoryManager>(jit->redirect));
+      jit->engine = builder.create();
+      /* On failure the builder frees the module and redirect. */
+   }
+
+   if (!jit->engine) {
+      _debug_printf("%s\n", Error.c_str());
+      delete jit->own_mm;
+      LLVMContextDispose(jit->context);
+      delete jit;
+      return NULL;
+   }
+#if LLVM_USE_INTEL_JITEVENTS
+   jit->engine->RegisterJITEventListener(
+      JITEventListener::createIntelJITEventListener());
+#endif
+   jit->engine->finalizeObject();
+
+   (void) mtx_init(&jit->mutex, mtx_plain);
+   return jit;
+}
+
+
+static void
+shared_jit_destroy(struct lp_shared_jit *jit)
+{
+   jit->redirect->setCurrent(jit->own_mm);
+   delete jit->engine;
+   delete jit->own_mm;
+   LLVMContextDispose(jit->context);
+   mtx_destroy(&jit->mutex);
+   delete jit;
+}
+
+
+/**
+ * Pick an engine for the next module and return it locked.  An idle engine
+ * is preferred, so that modules compiled on different threads don't wait on
+ * each other.
+ */
+static struct lp_shared_jit *
+shared_jit_acquire(unsigned OptLevel)
+{
+   struct lp_shared_jit *jit = NULL;
+   bool locked = false;
+   unsigned i;
+
+   mtx_lock(&shared_jits_mutex);
+
+   for (i = 0; i < LP_MAX_SHARED_JITS && !jit; i++) {
+      struct lp_shared_jit *cur = shared_jits[i];
+      if (!cur || cur->opt_level != OptLevel)
+         continue;
+      if (mtx_trylock(&cur->mutex) != thrd_success)
+         continue;
+      if (cur->num_modules >= LP_SHARED_JIT_MAX_MODULES) {
+         mtx_unlock(&cur->mutex);
+         cur->retired = true;
+         shared_jits[i] = NULL;
+         if (!cur->refs)
+            shared_jit_destroy(cur);
+         continue;
+      }
+      jit = cur;
+      locked = true;
+   }
+
+   for (i = 0; i < LP_MAX_SHARED_JITS && !jit; i++) {
+      if (!shared_jits[i]) {
+         jit = shared_jits[i] = shared_jit_create(OptLevel);
+         if (!jit)
+            break;
+         mtx_lock(&jit->mutex);
+         locked = true;
+      }
+   }
+
+   /* All engines are busy, queue on one of them. */
+   for (i = 0; i < LP_MAX_SHARED_JITS && !jit; i++) {
+      struct lp_shared_jit *cur =
+         shared_jits[shared_jits_next++ % LP_MAX_SHARED_JITS];
+      if (cur && cur->opt_level == OptLevel)
+         jit = cur;
+   }
+
+   if (jit)
+      jit->refs++;
+
+   mtx_unlock(&shared_jits_mutex);
+
+   /* Our reference keeps the engine from being destroyed meanwhile. */
+   if (jit && !locked)
+      mtx_lock(&jit->mutex);
+
+   return jit;
+}
+
+
+static void
+shared_jit_release(struct lp_shared_jit *jit)
+{
+   mtx_lock(&shared_jits_mutex);
+   assert(jit->refs);
+   if (!--jit->refs && jit->retired)
+      shared_jit_destroy(jit);
+   mtx_unlock(&shared_jits_mutex);
+}
+
+
+/**
+ * Compile a module in one of the shared engines, with the code going into
+ * the given memory manager.
+ *
+ * Defined symbols are renamed so they are unique within the engine; the
+ * function values keep referring to them.  The module stays owned by the
+ * engine until lp_shared_jit_remove_module().
+ *
+ * Returns NULL when no shared engine could be had, and the caller should
+ * compile the module with an engine of its own.
+ */
+extern "C"
+struct lp_shared_jit *
+lp_shared_jit_compile(LLVMModuleRef M,
+                      LLVMMCJITMemoryManagerRef CMM,
+                      const struct lp_global_mapping *mappings,
+                      unsigned num_mappings,
+                      unsigned OptLevel,
+                      struct lp_generated_code **OutCode)
+{
+   using namespace llvm;
+
+   struct lp_shared_jit *jit = shared_jit_acquire(OptLevel);
+   if (!jit)
+      return NULL;
+
+   Module *mod = unwrap(M);
+   std::string suffix = "." + std::to_string(jit->num_modules++);
+   for (GlobalValue &GV : mod->global_values()) {
+      if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+         GV.setName(GV.getName() + suffix);
+   }
+
+   set_module_target(M);
+   jit->engine->addModule(std::unique_ptr<Module>(mod));
+
+   for (unsigned i = 0; i < num_mappings; i++) {
+      jit->engine->addGlobalMapping(unwrap<GlobalValue>(mappings[i].global),
+                                    mappings[i].address);
+   }
+
+   ShaderMemoryManager MM(reinterpret_cast<BaseMemoryManager*>(CMM));
+   *OutCode = MM.getGeneratedCode();
+
+   jit->redirect->setCurrent(&MM);
+   jit->engine->finalizeObject();
+   jit->redirect->setCurrent(jit->own_mm);
+
+   mtx_unlock(&jit->mutex);
+
+   return jit;
+}
+
+
+extern "C"
+void *
+lp_shared_jit_get_pointer(struct lp_shared_jit *jit, LLVMValueRef F)
+{
+   void *code;
+
+   mtx_lock(&jit->mutex);
+   code = jit->engine->getPointerToGlobal(llvm::unwrap<llvm::GlobalValue>(F));
+   mtx_unlock(&jit->mutex);
+
+   return code;
+}
+
+
+/**
+ * Take the module back from the engine, leaving it to the caller to dispose
+ * of it.  The generated code stays valid until it is freed along with its
+ * memory manager.
+ */
+extern "C"
+void
+lp_shared_jit_remove_module(struct lp_shared_jit *jit, LLVMModuleRef M)
+{
+   mtx_lock(&jit->mutex);
+   jit->engine->removeModule(llvm::unwrap(M));
+   mtx_unlock(&jit->mutex);
+
+   shared_jit_release(jit);
+}
+
+
 extern "C"
 void
 lp_free_generated_code(struct lp_generated_code *code)
@@ -522,6 +885,46 @@ lp_free_generated_code(struct lp_generated_code *code)
    ShaderMemoryManager::freeGeneratedCode(code);
 }
 
+extern "C"
+void
+lp_free_object_cache(void *object_cache)
+{
+   delete reinterpret_cast<LPObjectCache *>(object_cache);
+}
+
+/**
+ * Hash what the generated code depends on about the host: the cpu and
+ * features llvm targets, and the caps gallivm builds code for.
+ */
+extern "C"
+void
+gallivm_hash_host_identity(struct mesa_sha1 *ctx)
+{
+   std::string cpu = llvm::sys::getHostCPUName().str();
+   _mesa_sha1_update(ctx, cpu.data(), cpu.size() + 1);
+
+   llvm::StringMap<bool> features;
+   if (llvm::sys::getHostCPUFeatures(features)) {
+      std::vector<std::string> attrs;
+      for (llvm::StringMapIterator<bool> f = features.begin();
+           f != features.end(); ++f)
+         attrs.push_back(((*f).second ? "+" : "-") + (*f).first().str());
+      std::sort(attrs.begin(), attrs.end());
+      for (const std::string &attr : attrs)
+         _mesa_sha1_update(ctx, attr.c_str(), attr.size() + 1);
+   }
+
+   /* The thread and cache topology don't affect code generation. */
+   struct util_cpu_caps caps;
+   memcpy(&caps, &util_cpu_caps, sizeof caps);
+   caps.nr_cpus = 0;
+   caps.cores_per_L3 = 0;
+   _mesa_sha1_update(ctx, &caps, sizeof caps);
+
+   _mesa_sha1_update(ctx, &lp_native_vector_width, sizeof lp_native_vector_width);
+   _mesa_sha1_update(ctx, &gallivm_perf, sizeof gallivm_perf);
+}
+
 extern "C"
 LLVMMCJITMemoryManagerRef
 lp_get_default_memory_manager()
@@ -535,7 +938,12 @@ extern "C"
 void
 lp_free_memory_manager(LLVMMCJITMemoryManagerRef memorymgr)
 {
-   delete reinterpret_cast<BaseMemoryManager*>(memorymgr);
+   BaseMemoryManager *mm = reinterpret_cast<BaseMemoryManager*>(memorymgr);
+#if LLVM_VERSION_MAJOR >= 5
+   /* Shared engines outlive the code they registered frames for. */
+   mm->deregisterEHFrames();
+#endif
+   delete mm;
 }
 
 extern "C" LLVMValueRef
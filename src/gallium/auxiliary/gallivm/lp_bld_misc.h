@@ -42,6 +42,8 @@ extern "C" {
 
 
 struct lp_generated_code;
+struct lp_cached_code;
+struct lp_global_mapping;
 
 extern LLVMTargetLibraryInfoRef
 gallivm_create_target_library_info(const char *triple);
@@ -56,11 +58,32 @@ lp_set_target_options(void);
 extern int
 lp_build_create_jit_compiler_for_module(LLVMExecutionEngineRef *OutJIT,
                                         struct lp_generated_code **OutCode,
+                                        struct lp_cached_code *Cache,
+                                        void **OutObjectCache,
                                         LLVMModuleRef M,
                                         LLVMMCJITMemoryManagerRef MM,
                                         unsigned OptLevel,
                                         char **OutError);
 
+extern void
+lp_free_object_cache(void *object_cache);
+
+struct lp_shared_jit;
+
+extern struct lp_shared_jit *
+lp_shared_jit_compile(LLVMModuleRef M,
+                      LLVMMCJITMemoryManagerRef MM,
+                      const struct lp_global_mapping *mappings,
+                      unsigned num_mappings,
+                      unsigned OptLevel,
+                      struct lp_generated_code **OutCode);
+
+extern void *
+lp_shared_jit_get_pointer(struct lp_shared_jit *jit, LLVMValueRef F);
+
+extern void
+lp_shared_jit_remove_module(struct lp_shared_jit *jit, LLVMModuleRef M);
+
 extern void
 lp_free_generated_code(struct lp_generated_code *code);
 
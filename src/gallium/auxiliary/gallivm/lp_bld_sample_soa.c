@@ -3188,10 +3188,12 @@ lp_build_sample_soa_code(struct gallivm_state *gallivm,
 
       /*
        * we only try 8-wide sampling with soa or if we have AVX2
-       * as it appears to be a loss with just AVX)
+       * as it appears to be a loss with just AVX), and 16-wide aos
+       * sampling needs AVX-512BW for its 8/16-bit math
        */
       if (num_quads == 1 || !use_aos ||
-          (util_cpu_caps.has_avx2 &&
+          ((num_quads == 2 ? util_cpu_caps.has_avx2 :
+                             util_cpu_caps.has_avx512bw) &&
            (bld.num_lods == 1 ||
             derived_sampler_state.min_img_filter == derived_sampler_state.mag_img_filter))) {
          if (use_aos) {
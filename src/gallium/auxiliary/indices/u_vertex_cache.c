@@ -0,0 +1,267 @@
+/*
+ * Copyright 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "util/u_memory.h"
+
+#include "u_vertex_cache.h"
+
+
+struct tipsify {
+   /* triangles using each vertex, adjacency[offsets[v]..offsets[v + 1]] */
+   unsigned *offsets;
+   unsigned *adjacency;
+   /* triangles not emitted yet using each vertex */
+   unsigned *live;
+   /* time each vertex last entered the cache */
+   unsigned *timestamps;
+   boolean *emitted;
+
+   /* vertices emitted, most recent on top */
+   unsigned *dead_end;
+   unsigned num_dead_end;
+
+   /* vertices of the triangles emitted around the fanning vertex */
+   unsigned *candidates;
+   unsigned num_candidates;
+
+   unsigned num_vertices;
+   unsigned cache_size;
+   unsigned time;
+   unsigned cursor;
+};
+
+
+static void
+tipsify_destroy(struct tipsify *t)
+{
+   FREE(t->offsets);
+   FREE(t->adjacency);
+   FREE(t->live);
+   FREE(t->timestamps);
+   FREE(t->emitted);
+   FREE(t->dead_end);
+   FREE(t->candidates);
+}
+
+
+static boolean
+tipsify_init(struct tipsify *t, const unsigned *indices, unsigned num_indices,
+             unsigned num_vertices, unsigned cache_size)
+{
+   const unsigned num_tris = num_indices / 3;
+   unsigned i, v;
+
+   memset(t, 0, sizeof *t);
+   t->num_vertices = num_vertices;
+   t->cache_size = cache_size;
+   t->time = cache_size + 1;
+
+   t->offsets = CALLOC(num_vertices + 1, sizeof(unsigned));
+   t->adjacency = MALLOC(num_indices * sizeof(unsigned));
+   t->live = CALLOC(num_vertices, sizeof(unsigned));
+   t->timestamps = CALLOC(num_vertices, sizeof(unsigned));
+   t->emitted = CALLOC(num_tris, sizeof(boolean));
+   t->dead_end = MALLOC(num_indices * sizeof(unsigned));
+   t->candidates = MALLOC(num_indices * sizeof(unsigned));
+   if (!t->offsets || !t->adjacency || !t->live || !t->timestamps ||
+       !t->emitted || !t->dead_end || !t->candidates)
+      return FALSE;
+
+   for (i = 0; i < num_indices; i++)
+      t->live[indices[i]]++;
+
+   for (v = 0; v < num_vertices; v++)
+      t->offsets[v + 1] = t->offsets[v] + t->live[v];
+
+   /* fill in the adjacency, using the offsets as cursors and then shifting
+    * them back */
+   for (i = 0; i < num_indices; i++)
+      t->adjacency[t->offsets[indices[i]]++] = i / 3;
+   for (v = num_vertices; v > 0; v--)
+      t->offsets[v] = t->offsets[v - 1];
+   t->offsets[0] = 0;
+
+   return TRUE;
+}
+
+
+/**
+ * The next vertex to fan around when the candidates are dead ends: the
+ * most recently emitted vertex still in use, else the next one in input
+ * order.  Returns -1 once all triangles are emitted.
+ */
+static int
+tipsify_skip_dead_end(struct tipsify *t)
+{
+   while (t->num_dead_end) {
+      unsigned v = t->dead_end[--t->num_dead_end];
+      if (t->live[v])
+         return v;
+   }
+
+   while (t->cursor < t->num_vertices) {
+      unsigned v = t->cursor++;
+      if (t->live[v])
+         return v;
+   }
+
+   return -1;
+}
+
+
+/**
+ * Pick the candidate that stays in the cache while its remaining triangles
+ * are emitted, and of those the one that entered the cache first.
+ */
+static int
+tipsify_next_vertex(struct tipsify *t)
+{
+   int best = -1, best_priority = -1;
+   unsigned i;
+
+   for (i = 0; i < t->num_candidates; i++) {
+      unsigned v = t->candidates[i];
+
+      if (t->live[v]) {
+         unsigned age = t->time - t->timestamps[v];
+         int priority = 0;
+
+         if (age + 2 * t->live[v] <= t->cache_size)
+            priority = age;
+         if (priority > best_priority) {
+            best_priority = priority;
+            best = v;
+         }
+      }
+   }
+
+   if (best == -1)
+      best = tipsify_skip_dead_end(t);
+
+   return best;
+}
+
+
+/**
+ * Reorder the triangles of a triangle list for a vertex cache of about
+ * cache_size entries, writing num_indices indices to out, which must not
+ * overlap the input.  A trailing partial triangle is dropped.  Each triangle
+ * keeps its vertex order, and so its winding.  Returns FALSE if an index
+ * is not below num_vertices or on allocation failure, leaving out alone.
+ */
+boolean
+u_vertex_cache_optimize(const unsigned *indices, unsigned num_indices,
+                        unsigned num_vertices, unsigned cache_size,
+                        unsigned *out)
+{
+   struct tipsify t;
+   unsigned num_out = 0, i;
+   int fan;
+
+   num_indices -= num_indices % 3;
+   if (!num_indices)
+      return TRUE;
+
+   for (i = 0; i < num_indices; i++) {
+      if (indices[i] >= num_vertices)
+         return FALSE;
+   }
+
+   if (!tipsify_init(&t, indices, num_indices, num_vertices,
+                     MAX2(cache_size, 3))) {
+      tipsify_destroy(&t);
+      return FALSE;
+   }
+
+   fan = tipsify_skip_dead_end(&t);
+   while (fan >= 0) {
+      unsigned a;
+
+      t.num_candidates = 0;
+
+      /* emit all triangles around the fanning vertex */
+      for (a = t.offsets[fan]; a < t.offsets[fan + 1]; a++) {
+         unsigned tri = t.adjacency[a];
+
+         if (t.emitted[tri])
+            continue;
+         t.emitted[tri] = TRUE;
+
+         for (i = 0; i < 3; i++) {
+            unsigned v = indices[tri * 3 + i];
+
+            out[num_out++] = v;
+            t.dead_end[t.num_dead_end++] = v;
+            t.candidates[t.num_candidates++] = v;
+            t.live[v]--;
+
+            /* a miss, if it left the cache since last used */
+            if (t.time - t.timestamps[v] > t.cache_size)
+               t.timestamps[v] = t.time++;
+         }
+      }
+
+      fan = tipsify_next_vertex(&t);
+   }
+
+   assert(num_out == num_indices);
+   tipsify_destroy(&t);
+   return TRUE;
+}
+
+
+/**
+ * The average cache miss ratio, vertices shaded per triangle, of a
+ * triangle list through a FIFO vertex cache of cache_size entries.
+ */
+float
+u_vertex_cache_acmr(const unsigned *indices, unsigned num_indices,
+                    unsigned num_vertices, unsigned cache_size)
+{
+   const unsigned num_tris = num_indices / 3;
+   unsigned *timestamps;
+   unsigned time, misses = 0, i;
+
+   if (!num_tris)
+      return 0.0f;
+
+   timestamps = CALLOC(num_vertices, sizeof(unsigned));
+   if (!timestamps)
+      return 0.0f;
+
+   /* time counts misses, so entries leave the cache in FIFO order */
+   time = cache_size + 1;
+   for (i = 0; i < num_tris * 3; i++) {
+      unsigned v = indices[i];
+
+      if (v >= num_vertices || time - timestamps[v] > cache_size) {
+         if (v < num_vertices)
+            timestamps[v] = time;
+         time++;
+         misses++;
+      }
+   }
+
+   FREE(timestamps);
+   return (float)misses / (float)num_tris;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * Reordering of indexed triangles for a post-transform vertex cache.
+ *
+ * Meshes whose triangles reference vertices in a poor order shade the same
+ * vertices many times, as they have left the vertex cache by the time they
+ * are used again.  u_vertex_cache_optimize() reorders the triangles of a
+ * triangle list offline with Tipsify (Sander, Nehab and Barczak, "Fast
+ * Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007),
+ * which runs in linear time and does not depend on the exact cache size.
+ */
+
+#ifndef U_VERTEX_CACHE_H
+#define U_VERTEX_CACHE_H
+
+#include "pipe/p_compiler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+boolean
+u_vertex_cache_optimize(const unsigned *indices, unsigned num_indices,
+                        unsigned num_vertices, unsigned cache_size,
+                        unsigned *out);
+
+float
+u_vertex_cache_acmr(const unsigned *indices, unsigned num_indices,
+                    unsigned num_vertices, unsigned cache_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* U_VERTEX_CACHE_H */
@@ -545,6 +545,34 @@ lp_build_depth_stencil_load_swizzled(struct gallivm_state *gallivm,
    struct lp_type zs_type = lp_depth_type(format_desc, z_src_type.length);
    struct lp_type zs_load_type = zs_type;
 
+   if (z_src_type.length == 16) {
+      /*
+       * The whole 4x4 block at once: quads 0,1 then 2,3, which is the same
+       * as two 8-wide loop iterations.
+       */
+      struct lp_type half_type = z_src_type;
+      LLVMValueRef z_half[2], s_half[2];
+      unsigned i;
+
+      half_type.length = 8;
+
+      for (i = 0; i < 2; i++) {
+         if (i > 0 && is_1d) {
+            z_half[i] = LLVMGetUndef(LLVMTypeOf(z_half[0]));
+            s_half[i] = LLVMGetUndef(LLVMTypeOf(s_half[0]));
+            break;
+         }
+         lp_build_depth_stencil_load_swizzled(gallivm, half_type, format_desc,
+                                              is_1d, depth_ptr, depth_stride,
+                                              &z_half[i], &s_half[i],
+                                              lp_build_const_int32(gallivm, i));
+      }
+
+      *z_fb = lp_build_concat(gallivm, z_half, half_type, 2);
+      *s_fb = lp_build_concat(gallivm, s_half, half_type, 2);
+      return;
+   }
+
    zs_load_type.length = zs_load_type.length / 2;
    load_ptr_type = LLVMPointerType(lp_build_vec_type(gallivm, zs_load_type), 0);
 
@@ -691,6 +719,46 @@ lp_build_depth_stencil_write_swizzled(struct gallivm_state *gallivm,
 
    lp_build_context_init(&z_bld, gallivm, z_type);
 
+   if (z_src_type.length == 16) {
+      /*
+       * Apply the mask to the whole 4x4 block, then store it as two 8-wide
+       * halves (rows 0-1 and 2-3), matching the load above.
+       */
+      struct lp_type half_type = z_src_type;
+      unsigned i;
+
+      half_type.length = 8;
+
+      if (format_desc->block.bits > 32) {
+         s_value = LLVMBuildBitCast(builder, s_value, z_bld.vec_type, "");
+      }
+
+      if (mask) {
+         mask_value = lp_build_mask_value(mask);
+         z_value = lp_build_select(&z_bld, mask_value, z_value, z_fb);
+         if (format_desc->block.bits > 32) {
+            s_fb = LLVMBuildBitCast(builder, s_fb, z_bld.vec_type, "");
+            s_value = lp_build_select(&z_bld, mask_value, s_value, s_fb);
+         }
+      }
+
+      for (i = 0; i < (is_1d ? 1 : 2); i++) {
+         LLVMValueRef z_half = lp_build_extract_range(gallivm, z_value, i * 8, 8);
+         LLVMValueRef s_half = s_value;
+
+         if (format_desc->block.bits > 32) {
+            s_half = lp_build_extract_range(gallivm, s_value, i * 8, 8);
+         }
+
+         lp_build_depth_stencil_write_swizzled(gallivm, half_type, format_desc,
+                                               is_1d, NULL, NULL, NULL,
+                                               lp_build_const_int32(gallivm, i),
+                                               depth_ptr, depth_stride,
+                                               z_half, s_half);
+      }
+      return;
+   }
+
    /*
     * This is far from ideal, at least for late depth write we should do this
     * outside the fs loop to avoid all the swizzle stuff.
@@ -42,10 +42,12 @@
 #include "lp_context.h"
 #include "lp_flush.h"
 #include "lp_perf.h"
+#include "lp_profile.h"
 #include "lp_state.h"
 #include "lp_surface.h"
 #include "lp_query.h"
 #include "lp_setup.h"
+#include "lp_screen.h"
 
 /* This is only safe if there's just one concurrent context */
 #ifdef EMBEDDED_DEVICE
@@ -104,6 +106,11 @@ static void llvmpipe_destroy( struct pipe_context *pipe )
 
    lp_delete_setup_variants(llvmpipe);
 
+   if (llvmpipe->trace) {
+      lp_profile_flush(llvmpipe_screen(pipe->screen)->profile, llvmpipe->trace);
+      FREE(llvmpipe->trace);
+   }
+
 #ifndef USE_GLOBAL_LLVM_CONTEXT
    LLVMContextDispose(llvmpipe->context);
 #endif
@@ -134,6 +141,24 @@ llvmpipe_render_condition(struct pipe_context *pipe,
    llvmpipe->render_cond_cond = condition;
 }
 
+static void
+lp_draw_disk_cache_find_shader(void *cookie,
+                               struct lp_cached_code *cache,
+                               const unsigned char ir_sha1_cache_key[20])
+{
+   struct llvmpipe_screen *screen = cookie;
+   lp_disk_cache_find_shader(screen, cache, ir_sha1_cache_key);
+}
+
+static void
+lp_draw_disk_cache_insert_shader(void *cookie,
+                                 struct lp_cached_code *cache,
+                                 const unsigned char ir_sha1_cache_key[20])
+{
+   struct llvmpipe_screen *screen = cookie;
+   lp_disk_cache_insert_shader(screen, cache, ir_sha1_cache_key);
+}
+
 struct pipe_context *
 llvmpipe_create_context(struct pipe_screen *screen, void *priv,
                         unsigned flags)
@@ -197,6 +222,20 @@ llvmpipe_create_context(struct pipe_screen *screen, void *priv,
    if (!llvmpipe->draw)
       goto fail;
 
+   /* Vertex shading shares the rasterizer threads' budget. */
+   if (llvmpipe_screen(screen)->num_threads > 1)
+      draw_set_vs_threads(llvmpipe->draw,
+                          llvmpipe_screen(screen)->num_threads - 1);
+
+   if (llvmpipe_screen(screen)->disk_shader_cache)
+      draw_set_disk_cache_callbacks(llvmpipe->draw,
+                                    llvmpipe_screen(screen),
+                                    lp_draw_disk_cache_find_shader,
+                                    lp_draw_disk_cache_insert_shader);
+
+   if (llvmpipe_screen(screen)->profile)
+      llvmpipe->trace = CALLOC_STRUCT(lp_profile_buffer);
+
    /* FIXME: devise alternative to draw_texture_samplers */
 
    llvmpipe->setup = lp_setup_create( &llvmpipe->pipe,
@@ -38,6 +38,7 @@
 
 #include "lp_tex_sample.h"
 #include "lp_jit.h"
+#include "lp_profile.h"
 #include "lp_setup.h"
 #include "lp_state_fs.h"
 #include "lp_state_cs.h"
@@ -65,6 +66,7 @@ struct llvmpipe_context {
    const struct pipe_depth_stencil_alpha_state *depth_stencil;
    const struct pipe_rasterizer_state *rasterizer;
    struct lp_fragment_shader *fs;
+   struct lp_fragment_shader_variant *fs_variant;  /**< bound for fs */
    struct draw_vertex_shader *vs;
    const struct lp_geometry_shader *gs;
    struct lp_compute_shader *cs;
@@ -107,6 +109,12 @@ struct llvmpipe_context {
 
    bool queries_disabled;
 
+   /** Totals for the driver queries */
+   struct lp_profile_counters profile_counters;
+
+   /** Events of this context's thread, if tracing (LP_TRACE_FILE) */
+   struct lp_profile_buffer *trace;
+
    unsigned dirty; /**< Mask of LP_NEW_x flags */
    unsigned cs_dirty; /**< Mask of LP_CSNEW_x flags */
    /** Mapped vertex buffers */
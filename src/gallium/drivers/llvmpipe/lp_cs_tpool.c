@@ -30,8 +30,51 @@
 
 #include "util/u_thread.h"
 #include "util/u_memory.h"
+#include "util/u_atomic.h"
+#include "util/u_math.h"
 #include "lp_cs_tpool.h"
 
+/**
+ * Run chunks of the task's iterations until none are left to claim.
+ * The caller must have counted itself in task->workers.
+ */
+static void
+lp_cs_tpool_run_task(struct lp_cs_tpool_task *task,
+                     struct lp_cs_local_mem *lmem)
+{
+   const unsigned chunk = task->iter_chunk;
+
+   for (;;) {
+      unsigned start = p_atomic_add_return(&task->iter_start, chunk) - chunk;
+      unsigned end;
+
+      if (start >= task->iter_total)
+         break;
+
+      end = MIN2(start + chunk, task->iter_total);
+      for (unsigned i = start; i < end; i++)
+         task->work(task->data, i, lmem);
+
+      p_atomic_add(&task->iter_finished, end - start);
+   }
+}
+
+/**
+ * Called with the mutex held once a thread is done with a task, which it
+ * must not touch afterwards.  Every iteration is claimed by then, so the
+ * task leaves the workqueue.
+ */
+static void
+lp_cs_tpool_leave_task(struct lp_cs_tpool *pool,
+                       struct lp_cs_tpool_task *task)
+{
+   if (!list_is_empty(&task->list))
+      list_delinit(&task->list);
+
+   if (--task->workers == 0)
+      cnd_broadcast(&pool->task_done);
+}
+
 static int
 lp_cs_tpool_worker(void *data)
 {
@@ -52,17 +95,13 @@ lp_cs_tpool_worker(void *data)
 
       task = list_first_entry(&pool->workqueue, struct lp_cs_tpool_task,
                               list);
-      unsigned this_iter = task->iter_start++;
-
-      if (task->iter_start == task->iter_total)
-         list_del(&task->list);
+      task->workers++;
 
       mtx_unlock(&pool->m);
-      task->work(task->data, this_iter, &lmem);
+      lp_cs_tpool_run_task(task, &lmem);
       mtx_lock(&pool->m);
-      task->iter_finished++;
-      if (task->iter_finished == task->iter_total)
-         cnd_broadcast(&task->finish);
+
+      lp_cs_tpool_leave_task(pool, task);
    }
    mtx_unlock(&pool->m);
    FREE(lmem.local_mem_ptr);
@@ -79,6 +118,7 @@ lp_cs_tpool_create(unsigned num_threads)
 
    (void) mtx_init(&pool->m, mtx_plain);
    cnd_init(&pool->new_work);
+   cnd_init(&pool->task_done);
 
    list_inithead(&pool->workqueue);
    assert (num_threads <= LP_MAX_THREADS);
@@ -103,6 +143,7 @@ lp_cs_tpool_destroy(struct lp_cs_tpool *pool)
       thrd_join(pool->threads[i], NULL);
    }
 
+   cnd_destroy(&pool->task_done);
    cnd_destroy(&pool->new_work);
    mtx_destroy(&pool->m);
    FREE(pool);
@@ -121,6 +162,7 @@ lp_cs_tpool_queue_task(struct lp_cs_tpool *pool,
       for (unsigned t = 0; t < num_iters; t++) {
          work(data, t, &lmem);
       }
+      FREE(lmem.local_mem_ptr);
       return NULL;
    }
    task = CALLOC_STRUCT(lp_cs_tpool_task);
@@ -131,7 +173,13 @@ lp_cs_tpool_queue_task(struct lp_cs_tpool *pool,
    task->work = work;
    task->data = data;
    task->iter_total = num_iters;
-   cnd_init(&task->finish);
+
+   /*
+    * Enough chunks for every thread, the waiting one included, to get
+    * several, so that uneven iterations still balance out.
+    */
+   task->iter_chunk = CLAMP(num_iters / ((pool->num_threads + 1) * 4),
+                            1, LP_CS_TPOOL_MAX_CHUNK);
 
    mtx_lock(&pool->m);
 
@@ -151,12 +199,22 @@ lp_cs_tpool_wait_for_task(struct lp_cs_tpool *pool,
    if (!pool || !task)
       return;
 
+   /* Help out rather than sleep while there are iterations left. */
+   mtx_lock(&pool->m);
+   task->workers++;
+   mtx_unlock(&pool->m);
+
+   lp_cs_tpool_run_task(task, &task->lmem);
+
    mtx_lock(&pool->m);
-   while (task->iter_finished < task->iter_total)
-      cnd_wait(&task->finish, &pool->m);
+   lp_cs_tpool_leave_task(pool, task);
+   while (task->workers)
+      cnd_wait(&pool->task_done, &pool->m);
    mtx_unlock(&pool->m);
 
-   cnd_destroy(&task->finish);
+   assert(task->iter_finished == task->iter_total);
+
+   FREE(task->lmem.local_mem_ptr);
    FREE(task);
    *task_handle = NULL;
 }
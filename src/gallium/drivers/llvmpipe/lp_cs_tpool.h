@@ -30,6 +30,10 @@
  * structs with just unique indexes in them.
  * It also supports a local memory support struct to be passed from
  * outside the thread exec function.
+ *
+ * Iterations are claimed in chunks with atomics rather than one at a time
+ * under the pool mutex, several tasks may be queued at once, and the
+ * thread waiting for a task runs iterations of it too.
  */
 #ifndef LP_CS_QUEUE
 #define LP_CS_QUEUE
@@ -41,9 +45,13 @@
 
 #include "lp_limits.h"
 
+/* Upper bound of the iterations a thread claims at once. */
+#define LP_CS_TPOOL_MAX_CHUNK 32
+
 struct lp_cs_tpool {
    mtx_t m;
    cnd_t new_work;
+   cnd_t task_done;   /**< a task lost its last worker */
 
    thrd_t threads[LP_MAX_THREADS];
    unsigned num_threads;
@@ -61,11 +69,13 @@ typedef void (*lp_cs_tpool_task_func)(void *data, int iter_idx, struct lp_cs_loc
 struct lp_cs_tpool_task {
    lp_cs_tpool_task_func work;
    void *data;
-   struct list_head list;
-   cnd_t finish;
+   struct list_head list;      /**< in the workqueue while iterations are left */
    unsigned iter_total;
-   unsigned iter_start;
-   unsigned iter_finished;
+   unsigned iter_chunk;
+   unsigned iter_start;        /**< next unclaimed iteration, atomic */
+   unsigned iter_finished;     /**< atomic */
+   unsigned workers;           /**< threads using the task, under the mutex */
+   struct lp_cs_local_mem lmem;   /**< for the waiting thread */
 };
 
 struct lp_cs_tpool *lp_cs_tpool_create(unsigned num_threads);
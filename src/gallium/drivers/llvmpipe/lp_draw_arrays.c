@@ -35,10 +35,13 @@
 #include "pipe/p_context.h"
 #include "util/u_draw.h"
 #include "util/u_prim.h"
+#include "util/os_time.h"
 
 #include "lp_context.h"
+#include "lp_flush.h"
 #include "lp_state.h"
 #include "lp_query.h"
+#include "lp_screen.h"
 
 #include "draw/draw_context.h"
 
@@ -56,6 +59,7 @@ llvmpipe_draw_vbo(struct pipe_context *pipe, const struct pipe_draw_info *info)
    struct llvmpipe_context *lp = llvmpipe_context(pipe);
    struct draw_context *draw = lp->draw;
    const void *mapped_indices = NULL;
+   int64_t t0 = os_time_get_nano(), duration;
    unsigned i;
 
    if (!llvmpipe_check_render_cond(lp))
@@ -69,6 +73,11 @@ llvmpipe_draw_vbo(struct pipe_context *pipe, const struct pipe_draw_info *info)
    if (lp->dirty)
       llvmpipe_update_derived( lp );
 
+   llvmpipe_count_fs_draw(lp);
+
+   /* The vertex stages run now, while earlier scenes may not be done. */
+   llvmpipe_wait_draw_resources(pipe, info);
+
    /*
     * Map vertex buffers
     */
@@ -153,6 +162,18 @@ llvmpipe_draw_vbo(struct pipe_context *pipe, const struct pipe_draw_info *info)
     * internally when this condition is seen?)
     */
    draw_flush(draw);
+
+   duration = os_time_get_nano() - t0;
+   lp->profile_counters.draw_time += duration;
+   if (lp->trace) {
+      struct lp_profile_event *event =
+         lp_profile_event(llvmpipe_screen(pipe->screen)->profile, lp->trace,
+                          LP_PROFILE_DRAW, LP_PROFILE_TID_CONTEXT);
+      event->start = t0;
+      event->duration = duration;
+      event->args[0] = info->count;
+      event->args[1] = info->instance_count;
+   }
 }
 
 
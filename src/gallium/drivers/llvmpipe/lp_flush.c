@@ -38,6 +38,7 @@
 #include "lp_flush.h"
 #include "lp_context.h"
 #include "lp_setup.h"
+#include "lp_fence.h"
 
 
 /**
@@ -128,6 +129,104 @@ llvmpipe_flush_resource(struct pipe_context *pipe,
          llvmpipe_flush(pipe, NULL, reason);
       }
    }
+   else if (cpu_access) {
+      /*
+       * Not used by anything left to flush, but scenes already flushed may
+       * still be rasterized: wait for the last one using the resource.
+       * GPU-side accesses need nothing, as scenes are rasterized in order.
+       */
+      struct llvmpipe_context *llvmpipe = llvmpipe_context(pipe);
+      struct lp_fence *fence =
+         lp_setup_get_resource_fence(llvmpipe->setup, resource, !read_only);
+
+      if (fence) {
+         if (do_not_block && !lp_fence_signalled(fence))
+            return FALSE;
+
+         /* Also when signalled, to sync with the rasterizer. */
+         lp_fence_wait(fence);
+      }
+   }
 
    return TRUE;
 }
+
+
+static void
+wait_resource(struct llvmpipe_context *llvmpipe,
+              struct pipe_resource *resource,
+              boolean write)
+{
+   struct lp_fence *fence;
+
+   if (!resource)
+      return;
+
+   fence = lp_setup_get_resource_fence(llvmpipe->setup, resource, write);
+   if (fence)
+      lp_fence_wait(fence);
+}
+
+
+/**
+ * Wait for the scenes already flushed to be done with the resources bound
+ * to a shader stage which runs right away on the CPU: vertex and geometry
+ * shaders in the draw module, and compute shaders.
+ */
+void
+llvmpipe_wait_shader_resources(struct pipe_context *pipe,
+                               enum pipe_shader_type shader)
+{
+   struct llvmpipe_context *llvmpipe = llvmpipe_context(pipe);
+   unsigned i;
+
+   for (i = 0; i < ARRAY_SIZE(llvmpipe->constants[shader]); i++)
+      wait_resource(llvmpipe, llvmpipe->constants[shader][i].buffer, FALSE);
+
+   for (i = 0; i < llvmpipe->num_sampler_views[shader]; i++) {
+      struct pipe_sampler_view *view = llvmpipe->sampler_views[shader][i];
+      if (view)
+         wait_resource(llvmpipe, view->texture, FALSE);
+   }
+
+   for (i = 0; i < llvmpipe->num_images[shader]; i++)
+      wait_resource(llvmpipe, llvmpipe->images[shader][i].resource, TRUE);
+
+   for (i = 0; i < ARRAY_SIZE(llvmpipe->ssbos[shader]); i++)
+      wait_resource(llvmpipe, llvmpipe->ssbos[shader][i].buffer, TRUE);
+
+   if (shader != PIPE_SHADER_COMPUTE) {
+      for (i = 0; i < llvmpipe->num_so_targets; i++) {
+         if (llvmpipe->so_targets[i])
+            wait_resource(llvmpipe, llvmpipe->so_targets[i]->target.buffer,
+                          TRUE);
+      }
+   }
+}
+
+
+/**
+ * Wait for the scenes already flushed to be done with everything the draw
+ * module reads while running a draw: the vertex and index buffers, and the
+ * resources of the vertex and geometry shaders.
+ */
+void
+llvmpipe_wait_draw_resources(struct pipe_context *pipe,
+                             const struct pipe_draw_info *info)
+{
+   struct llvmpipe_context *llvmpipe = llvmpipe_context(pipe);
+   unsigned i;
+
+   for (i = 0; i < llvmpipe->num_vertex_buffers; i++) {
+      if (!llvmpipe->vertex_buffer[i].is_user_buffer)
+         wait_resource(llvmpipe, llvmpipe->vertex_buffer[i].buffer.resource,
+                       FALSE);
+   }
+
+   if (info->index_size && !info->has_user_indices)
+      wait_resource(llvmpipe, info->index.resource, FALSE);
+
+   llvmpipe_wait_shader_resources(pipe, PIPE_SHADER_VERTEX);
+   if (llvmpipe->gs)
+      llvmpipe_wait_shader_resources(pipe, PIPE_SHADER_GEOMETRY);
+}
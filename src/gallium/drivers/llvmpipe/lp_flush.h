@@ -29,8 +29,10 @@
 #define LP_FLUSH_H
 
 #include "pipe/p_compiler.h"
+#include "pipe/p_defines.h"
 
 struct pipe_context;
+struct pipe_draw_info;
 struct pipe_fence_handle;
 struct pipe_resource;
 
@@ -52,4 +54,12 @@ llvmpipe_flush_resource(struct pipe_context *pipe,
                         boolean do_not_block,
                         const char *reason);
 
+void
+llvmpipe_wait_shader_resources(struct pipe_context *pipe,
+                               enum pipe_shader_type shader);
+
+void
+llvmpipe_wait_draw_resources(struct pipe_context *pipe,
+                             const struct pipe_draw_info *info);
+
 #endif
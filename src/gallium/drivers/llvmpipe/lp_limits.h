@@ -65,7 +65,23 @@
 #define LP_MAX_WIDTH  (1 << (LP_MAX_TEXTURE_LEVELS - 1))
 
 
-#define LP_MAX_THREADS 16
+/**
+ * Max number of rasterizer and compute threads.  Enough for the larger
+ * multi-socket hosts; the per-thread state is small.
+ */
+#define LP_MAX_THREADS 128
+
+/**
+ * Max number of threads compiling fragment shader variants in the
+ * background.  More only pay off when many shaders are created at once.
+ */
+#define LP_MAX_COMPILE_THREADS 4
+
+/**
+ * Number of draws after which a fragment shader variant compiled without
+ * optimizations is recompiled with them, with GALLIVM_PERF=tiered.
+ */
+#define LP_FS_HOT_DRAWS 16
 
 
 /**
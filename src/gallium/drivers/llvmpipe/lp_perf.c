@@ -47,6 +47,7 @@ lp_print_counters(void)
    if (LP_DEBUG & DEBUG_COUNTERS) {
       unsigned total_64, total_16, total_4;
       float p1, p2, p3, p4, p5, p6;
+      unsigned i;
 
       debug_printf("llvmpipe: nr_triangles:                 %9u\n", lp_count.nr_tris);
       debug_printf("llvmpipe: nr_culled_triangles:          %9u\n", lp_count.nr_culled_tris);
@@ -98,6 +99,13 @@ lp_print_counters(void)
       debug_printf("llvmpipe:   nr_empty_4x4:               %9u (%3.0f%% of %u)\n", lp_count.nr_empty_4, p1, total_4);
       debug_printf("llvmpipe:   nr_non_empty_4x4:           %9u (%3.0f%% of %u)\n", lp_count.nr_non_empty_4, p4, total_4);
 
+      p1 = 100.0 * (float) lp_count.nr_hiz_culled_tris / (float) lp_count.nr_hiz_tested_tris;
+      p2 = 100.0 * (float) lp_count.nr_hiz_culled_64 / (float) (total_64 + lp_count.nr_hiz_culled_64);
+
+      debug_printf("llvmpipe: nr_hiz_tested_triangles:      %9u\n", lp_count.nr_hiz_tested_tris);
+      debug_printf("llvmpipe:   nr_hiz_culled_triangles:    %9u (%3.0f%% of %u)\n", lp_count.nr_hiz_culled_tris, p1, lp_count.nr_hiz_tested_tris);
+      debug_printf("llvmpipe: nr_hiz_culled_64x64:          %9u (%3.0f%% of %u)\n", lp_count.nr_hiz_culled_64, p2, total_64 + lp_count.nr_hiz_culled_64);
+
       debug_printf("llvmpipe: nr_color_tile_clear:          %9u\n", lp_count.nr_color_tile_clear);
       debug_printf("llvmpipe: nr_color_tile_load:           %9u\n", lp_count.nr_color_tile_load);
       debug_printf("llvmpipe: nr_color_tile_store:          %9u\n", lp_count.nr_color_tile_store);
@@ -106,5 +114,23 @@ lp_print_counters(void)
       debug_printf("llvmpipe: total LLVM compile time:      %.2f sec\n", lp_count.llvm_compile_time / 1000000.0);
       debug_printf("llvmpipe: average LLVM compile time:    %.2f sec\n", lp_count.llvm_compile_time / 1000000.0 / lp_count.nr_llvm_compiles);
 
+      debug_printf("llvmpipe: nr_fs_variants_queued:        %9u\n", lp_count.nr_fs_variants_queued);
+      debug_printf("llvmpipe: nr_fs_variant_waits:          %9u (%.3f sec)\n", lp_count.nr_fs_variant_waits, lp_count.fs_variant_wait_time / 1000000.0);
+      debug_printf("llvmpipe: nr_fs_variants_evicted:       %9u (%u never used)\n", lp_count.nr_fs_variants_evicted, lp_count.nr_fs_variants_evicted_unused);
+      debug_printf("llvmpipe: nr_fs_variants_optimized:     %9u\n", lp_count.nr_fs_variants_optimized);
+
+      for (i = 0; i < LP_MAX_THREADS; i++) {
+         int64_t busy = lp_count.thread_busy_time[i];
+         int64_t idle = lp_count.thread_idle_time[i];
+
+         if (!busy && !idle)
+            continue;
+
+         debug_printf("llvmpipe: rasterizer thread %2u:         busy %.3f sec, idle %.3f sec (%3.0f%%), %u bins stolen\n",
+                      i, busy / 1000000.0, idle / 1000000.0,
+                      100.0 * (float) idle / (float) (busy + idle),
+                      lp_count.thread_bins_stolen[i]);
+      }
+
    }
 }
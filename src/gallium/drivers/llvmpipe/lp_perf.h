@@ -34,6 +34,7 @@
 #define LP_PERF_H
 
 #include "pipe/p_compiler.h"
+#include "lp_limits.h"
 
 /**
  * Various counters
@@ -56,12 +57,28 @@ struct lp_counters
    unsigned nr_fully_covered_4;
    unsigned nr_partially_covered_4;
    unsigned nr_non_empty_4;
+   unsigned nr_hiz_culled_tris;
+   unsigned nr_hiz_tested_tris;
+   unsigned nr_hiz_culled_64;
    unsigned nr_llvm_compiles;
    int64_t llvm_compile_time;  /**< total, in microseconds */
 
+   /** Fragment shader variant management */
+   unsigned nr_fs_variants_queued;     /**< compiled ahead of their first draw */
+   unsigned nr_fs_variant_waits;       /**< draws that waited for a compile */
+   int64_t fs_variant_wait_time;       /**< total, in microseconds */
+   unsigned nr_fs_variants_evicted;
+   unsigned nr_fs_variants_evicted_unused;
+   unsigned nr_fs_variants_optimized;  /**< recompiled once hot */
+
    unsigned nr_color_tile_clear;
    unsigned nr_color_tile_load;
    unsigned nr_color_tile_store;
+
+   /** Per rasterizer thread, in microseconds */
+   int64_t thread_busy_time[LP_MAX_THREADS];
+   int64_t thread_idle_time[LP_MAX_THREADS];
+   unsigned thread_bins_stolen[LP_MAX_THREADS];
 };
 
 
@@ -0,0 +1,172 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/**
+ * @file
+ * Chrome trace event writer.
+ *
+ * The events go to LP_TRACE_FILE as they are written, in the JSON object
+ * format with timestamps in usecs since the screen was created.
+ */
+
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "util/os_time.h"
+#include "util/u_debug.h"
+#include "util/u_memory.h"
+#include "util/u_process.h"
+#include "os/os_thread.h"
+
+#include "lp_profile.h"
+
+
+struct lp_profile
+{
+   FILE *fp;
+   mtx_t mutex;
+   int64_t t0;
+};
+
+
+static const struct {
+   const char *name;
+   const char *cat;
+   const char *args[LP_PROFILE_MAX_ARGS];
+} event_info[] = {
+   [LP_PROFILE_DRAW] =
+      { "draw", "setup", { "count", "instances" } },
+   [LP_PROFILE_SCENE] =
+      { "scene", "setup", { "triangles" } },
+   [LP_PROFILE_BIN] =
+      { "bin", "rast", { "x", "y", "fragments" } },
+   [LP_PROFILE_COMPILE] =
+      { "compile fs", "jit", { "shader", "variant", "optimized" } },
+   [LP_PROFILE_FS_VARIANT] =
+      { "fs variant", "jit",
+        { "shader", "variant", "triangles", "fragments", "compile_us" } },
+};
+
+
+/**
+ * Start a trace if LP_TRACE_FILE names a file, otherwise return NULL.
+ */
+struct lp_profile *
+lp_profile_create(void)
+{
+   const char *filename = debug_get_option("LP_TRACE_FILE", NULL);
+   const char *process_name = util_get_process_name();
+   struct lp_profile *profile;
+
+   if (!filename)
+      return NULL;
+
+   profile = CALLOC_STRUCT(lp_profile);
+   if (!profile)
+      return NULL;
+
+   profile->fp = fopen(filename, "w");
+   if (!profile->fp) {
+      debug_printf("llvmpipe: can't open trace file %s\n", filename);
+      FREE(profile);
+      return NULL;
+   }
+
+   (void) mtx_init(&profile->mutex, mtx_plain);
+   profile->t0 = os_time_get_nano();
+
+   fprintf(profile->fp,
+           "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+           "\"args\":{\"name\":\"%s\"}}",
+           process_name ? process_name : "llvmpipe");
+
+   lp_profile_thread_name(profile, LP_PROFILE_TID_CONTEXT, "context");
+
+   return profile;
+}
+
+
+void
+lp_profile_destroy(struct lp_profile *profile)
+{
+   fprintf(profile->fp, "\n]}\n");
+   fclose(profile->fp);
+   mtx_destroy(&profile->mutex);
+   FREE(profile);
+}
+
+
+void
+lp_profile_thread_name(struct lp_profile *profile, unsigned tid,
+                       const char *name)
+{
+   mtx_lock(&profile->mutex);
+   fprintf(profile->fp,
+           ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+           "\"args\":{\"name\":\"%s\"}}",
+           tid, name);
+   mtx_unlock(&profile->mutex);
+}
+
+
+void
+lp_profile_write(struct lp_profile *profile,
+                 const struct lp_profile_event *events, unsigned count)
+{
+   unsigned i, j;
+
+   mtx_lock(&profile->mutex);
+
+   for (i = 0; i < count; i++) {
+      const struct lp_profile_event *event = &events[i];
+
+      fprintf(profile->fp,
+              ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":%u,"
+              "\"ts\":%.3f,",
+              event_info[event->type].name, event_info[event->type].cat,
+              event->tid, (event->start - profile->t0) / 1000.0);
+
+      if (event->duration >= 0)
+         fprintf(profile->fp, "\"ph\":\"X\",\"dur\":%.3f,",
+                 event->duration / 1000.0);
+      else
+         fprintf(profile->fp, "\"ph\":\"i\",\"s\":\"t\",");
+
+      fprintf(profile->fp, "\"args\":{");
+      for (j = 0; j < LP_PROFILE_MAX_ARGS &&
+                  event_info[event->type].args[j]; j++) {
+         fprintf(profile->fp, "%s\"%s\":%" PRIu64,
+                 j ? "," : "", event_info[event->type].args[j],
+                 event->args[j]);
+      }
+      fprintf(profile->fp, "}}");
+   }
+
+   mtx_unlock(&profile->mutex);
+}
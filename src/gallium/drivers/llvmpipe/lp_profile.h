@@ -0,0 +1,161 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/**
+ * @file
+ * Profiling: counters behind llvmpipe's driver queries, which the HUD can
+ * graph, and an optional trace of draws, scenes, bins and shader compiles
+ * in the Chrome trace event format, enabled by LP_TRACE_FILE.  The trace
+ * can be opened in chrome://tracing or ui.perfetto.dev.
+ */
+
+
+#ifndef LP_PROFILE_H
+#define LP_PROFILE_H
+
+#include "pipe/p_compiler.h"
+#include "pipe/p_defines.h"
+
+
+/**
+ * Driver specific query types, see llvmpipe_get_driver_query_info().
+ */
+enum lp_query_type {
+   /* Counted by the context, see struct lp_profile_counters */
+   LP_QUERY_DRAW_TIME = PIPE_QUERY_DRIVER_SPECIFIC,
+   LP_QUERY_SCENES,
+   LP_QUERY_TRIANGLES,
+   LP_QUERY_JIT_TIME,
+   /* Counted by the draw module, see struct draw_vertex_stats */
+   LP_QUERY_VERTICES_SHADED,
+   LP_QUERY_ACMR,
+   /* Binned and counted per rasterizer thread */
+   LP_QUERY_RAST_TIME,
+   LP_QUERY_FRAGMENTS,
+   LP_QUERY_LAST
+};
+
+
+/**
+ * Running totals of a context, sampled at the begin and end of the
+ * context's driver queries.
+ */
+struct lp_profile_counters
+{
+   uint64_t draw_time;   /**< ns in draw_vbo, vertex processing and binning */
+   uint64_t scenes;      /**< scenes queued for rasterization */
+   uint64_t triangles;   /**< triangles binned */
+   uint64_t jit_time;    /**< usecs compiling the fragment shaders used */
+};
+
+
+/** Trace thread ids: the context, rasterizer and compile threads */
+#define LP_PROFILE_TID_CONTEXT  0
+#define LP_PROFILE_TID_RAST     1
+#define LP_PROFILE_TID_COMPILE  100
+
+#define LP_PROFILE_MAX_ARGS     5
+#define LP_PROFILE_BUFFER_SIZE  256
+
+
+enum lp_profile_event_type {
+   LP_PROFILE_DRAW,        /**< count, instances */
+   LP_PROFILE_SCENE,       /**< triangles */
+   LP_PROFILE_BIN,         /**< x, y, fragments */
+   LP_PROFILE_COMPILE,     /**< shader, variant, optimized */
+   LP_PROFILE_FS_VARIANT,  /**< shader, variant, triangles, fragments,
+                                compile usecs; at the variant's removal */
+};
+
+
+struct lp_profile_event
+{
+   enum lp_profile_event_type type;
+   unsigned tid;
+   int64_t start;      /**< os_time_get_nano() */
+   int64_t duration;   /**< ns, or -1 for an instant event */
+   uint64_t args[LP_PROFILE_MAX_ARGS];
+};
+
+
+/**
+ * Events recorded by a single thread, written out when it fills up, so
+ * that recording doesn't take the trace's lock.
+ */
+struct lp_profile_buffer
+{
+   unsigned count;
+   struct lp_profile_event events[LP_PROFILE_BUFFER_SIZE];
+};
+
+
+struct lp_profile;
+
+
+struct lp_profile *
+lp_profile_create(void);
+
+void
+lp_profile_destroy(struct lp_profile *profile);
+
+void
+lp_profile_thread_name(struct lp_profile *profile, unsigned tid,
+                       const char *name);
+
+void
+lp_profile_write(struct lp_profile *profile,
+                 const struct lp_profile_event *events, unsigned count);
+
+
+static inline void
+lp_profile_flush(struct lp_profile *profile, struct lp_profile_buffer *buf)
+{
+   lp_profile_write(profile, buf->events, buf->count);
+   buf->count = 0;
+}
+
+
+/**
+ * Get the next free event of a thread's buffer.
+ */
+static inline struct lp_profile_event *
+lp_profile_event(struct lp_profile *profile, struct lp_profile_buffer *buf,
+                 enum lp_profile_event_type type, unsigned tid)
+{
+   struct lp_profile_event *event;
+
+   if (buf->count == LP_PROFILE_BUFFER_SIZE)
+      lp_profile_flush(profile, buf);
+
+   event = &buf->events[buf->count++];
+   event->type = type;
+   event->tid = tid;
+   return event;
+}
+
+
+#endif /* LP_PROFILE_H */
@@ -37,6 +37,7 @@
 #include "lp_context.h"
 #include "lp_flush.h"
 #include "lp_fence.h"
+#include "lp_profile.h"
 #include "lp_query.h"
 #include "lp_screen.h"
 #include "lp_state.h"
@@ -48,6 +49,89 @@ static struct llvmpipe_query *llvmpipe_query( struct pipe_query *p )
    return (struct llvmpipe_query *)p;
 }
 
+/**
+ * The context's running total of a driver query, see lp_profile.h.
+ */
+static uint64_t
+profile_counter(const struct llvmpipe_context *llvmpipe, unsigned type)
+{
+   switch (type) {
+   case LP_QUERY_DRAW_TIME:
+      return llvmpipe->profile_counters.draw_time;
+   case LP_QUERY_SCENES:
+      return llvmpipe->profile_counters.scenes;
+   case LP_QUERY_TRIANGLES:
+      return llvmpipe->profile_counters.triangles;
+   case LP_QUERY_JIT_TIME:
+      return llvmpipe->profile_counters.jit_time;
+   default:
+      assert(0);
+      return 0;
+   }
+}
+
+/**
+ * Sample the draw module's vertex counters for a driver query.
+ */
+static void
+vertex_stats_sample(const struct llvmpipe_context *llvmpipe, uint64_t *counts)
+{
+   struct draw_vertex_stats stats;
+
+   draw_get_vertex_stats(llvmpipe->draw, &stats);
+   counts[0] = stats.vertices_shaded;
+   counts[1] = stats.primitives;
+}
+
+/**
+ * Vertices shaded per primitive drawn between the begin and end of the
+ * query, or 0 without primitives.
+ */
+static float
+acmr_query_result(const struct llvmpipe_query *pq)
+{
+   uint64_t primitives = pq->end[1] - pq->start[1];
+
+   if (!primitives)
+      return 0.0f;
+
+   return (float)(pq->end[0] - pq->start[0]) / (float)primitives;
+}
+
+/**
+ * The result of a driver query, in the units of
+ * llvmpipe_get_driver_query_info().  lp-acmr is truncated to an integer.
+ */
+static uint64_t
+profile_query_result(const struct llvmpipe_query *pq, unsigned num_threads)
+{
+   uint64_t value = 0;
+   unsigned i;
+
+   switch (pq->type) {
+   case LP_QUERY_DRAW_TIME:
+      return (pq->end[0] - pq->start[0]) / 1000;
+   case LP_QUERY_SCENES:
+   case LP_QUERY_TRIANGLES:
+   case LP_QUERY_JIT_TIME:
+   case LP_QUERY_VERTICES_SHADED:
+      return pq->end[0] - pq->start[0];
+   case LP_QUERY_ACMR:
+      return (uint64_t)acmr_query_result(pq);
+   case LP_QUERY_RAST_TIME:
+      for (i = 0; i < num_threads; i++)
+         value += pq->end[i];
+      return value / 1000;
+   case LP_QUERY_FRAGMENTS:
+      for (i = 0; i < num_threads; i++)
+         value += pq->end[i];
+      return value * LP_RASTER_BLOCK_SIZE * LP_RASTER_BLOCK_SIZE;
+   default:
+      assert(0);
+      return 0;
+   }
+}
+
 static struct pipe_query *
 llvmpipe_create_query(struct pipe_context *pipe, 
                       unsigned type,
@@ -55,7 +139,8 @@ llvmpipe_create_query(struct pipe_context *pipe,
 {
    struct llvmpipe_query *pq;
 
-   assert(type < PIPE_QUERY_TYPES);
+   assert(type < PIPE_QUERY_TYPES ||
+          (type >= PIPE_QUERY_DRIVER_SPECIFIC && type < LP_QUERY_LAST));
 
    pq = CALLOC_STRUCT( llvmpipe_query );
 
@@ -177,6 +262,18 @@ llvmpipe_get_query_result(struct pipe_context *pipe,
       *stats = pq->stats;
    }
       break;
+   case LP_QUERY_DRAW_TIME:
+   case LP_QUERY_SCENES:
+   case LP_QUERY_TRIANGLES:
+   case LP_QUERY_JIT_TIME:
+   case LP_QUERY_VERTICES_SHADED:
+   case LP_QUERY_RAST_TIME:
+   case LP_QUERY_FRAGMENTS:
+      *result = profile_query_result(pq, num_threads);
+      break;
+   case LP_QUERY_ACMR:
+      vresult->f = acmr_query_result(pq);
+      break;
    default:
       assert(0);
       break;
@@ -299,6 +396,16 @@ llvmpipe_get_query_result_resource(struct pipe_context *pipe,
             break;
          }
          break;
+      case LP_QUERY_DRAW_TIME:
+      case LP_QUERY_SCENES:
+      case LP_QUERY_TRIANGLES:
+      case LP_QUERY_JIT_TIME:
+      case LP_QUERY_VERTICES_SHADED:
+      case LP_QUERY_ACMR:
+      case LP_QUERY_RAST_TIME:
+      case LP_QUERY_FRAGMENTS:
+         value = profile_query_result(pq, num_threads);
+         break;
       default:
          fprintf(stderr, "Unknown query type %d\n", pq->type);
          break;
@@ -387,6 +494,16 @@ llvmpipe_begin_query(struct pipe_context *pipe, struct pipe_query *q)
       llvmpipe->active_occlusion_queries++;
       llvmpipe->dirty |= LP_NEW_OCCLUSION_QUERY;
       break;
+   case LP_QUERY_DRAW_TIME:
+   case LP_QUERY_SCENES:
+   case LP_QUERY_TRIANGLES:
+   case LP_QUERY_JIT_TIME:
+      pq->start[0] = profile_counter(llvmpipe, pq->type);
+      break;
+   case LP_QUERY_VERTICES_SHADED:
+   case LP_QUERY_ACMR:
+      vertex_stats_sample(llvmpipe, pq->start);
+      break;
    default:
       break;
    }
@@ -455,6 +572,16 @@ llvmpipe_end_query(struct pipe_context *pipe, struct pipe_query *q)
       llvmpipe->active_occlusion_queries--;
       llvmpipe->dirty |= LP_NEW_OCCLUSION_QUERY;
       break;
+   case LP_QUERY_DRAW_TIME:
+   case LP_QUERY_SCENES:
+   case LP_QUERY_TRIANGLES:
+   case LP_QUERY_JIT_TIME:
+      pq->end[0] = profile_counter(llvmpipe, pq->type);
+      break;
+   case LP_QUERY_VERTICES_SHADED:
+   case LP_QUERY_ACMR:
+      vertex_stats_sample(llvmpipe, pq->end);
+      break;
    default:
       break;
    }
@@ -26,6 +26,7 @@
  **************************************************************************/
 
 #include <limits.h>
+#include "util/u_atomic.h"
 #include "util/u_memory.h"
 #include "util/u_math.h"
 #include "util/u_rect.h"
@@ -33,6 +34,7 @@
 #include "util/u_pack_color.h"
 #include "util/u_string.h"
 #include "util/u_thread.h"
+#include "util/u_cpu_detect.h"
 
 #include "util/os_time.h"
 
@@ -70,16 +72,37 @@ lp_rast_begin( struct lp_rasterizer *rast,
    LP_DBG(DEBUG_RAST, "%s\n", __FUNCTION__);
 
    lp_scene_begin_rasterization( scene );
-   lp_scene_bin_iter_begin( scene );
+   lp_scene_bin_iter_begin( scene, MAX2(rast->num_threads, 1) );
 }
 
 
+/**
+ * End rasterizing a scene.
+ * Called once per scene by one thread, once all the threads are done with
+ * it.  Signalling the fence hands the scene back to the setup module, so
+ * this must be the last access to it, and the fence is held on to until
+ * the signalling is done.
+ */
 static void
 lp_rast_end( struct lp_rasterizer *rast )
 {
-   lp_scene_end_rasterization( rast->curr_scene );
+   struct lp_scene *scene = rast->curr_scene;
+
+   lp_scene_end_rasterization( scene );
 
    rast->curr_scene = NULL;
+
+   if (scene->fence) {
+      struct lp_fence *fence = NULL;
+
+      /* The setup thread may see the fence signalled as soon as the count
+       * is bumped, reset the scene and drop the scene's reference, before
+       * lp_fence_signal() is done with the mutex and condition variable.
+       */
+      lp_fence_reference(&fence, scene->fence);
+      lp_fence_signal(fence);
+      lp_fence_reference(&fence, NULL);
+   }
 }
 
 
@@ -109,6 +132,9 @@ lp_rast_tile_begin(struct lp_rasterizer_task *task,
    task->thread_data.vis_counter = 0;
    task->thread_data.ps_invocations = 0;
 
+   if (scene->time_bins)
+      task->tile_start = os_time_get_nano();
+
    for (i = 0; i < task->scene->fb.nr_cbufs; i++) {
       if (task->scene->fb.cbufs[i]) {
          task->color_tiles[i] = scene->cbufs[i].map +
@@ -316,6 +342,11 @@ lp_rast_shade_tile(struct lp_rasterizer_task *task,
    }
    variant = state->variant;
 
+   if (task->trace) {
+      p_atomic_add(&variant->nr_fragments,
+                   align(task->width, 4) * align(task->height, 4));
+   }
+
    /* render the whole 64x64 tile in 4x4 chunks */
    for (y = 0; y < task->height; y += 4){
       for (x = 0; x < task->width; x += 4) {
@@ -449,6 +480,9 @@ lp_rast_shade_quads_mask(struct lp_rasterizer_task *task,
       /* Propagate non-interpolated raster state. */
       task->thread_data.raster_state.viewport_index = inputs->viewport_index;
 
+      if (task->trace)
+         p_atomic_add(&variant->nr_fragments, util_bitcount(mask));
+
       /* run shader on 4x4 block */
       BEGIN_JIT_CALL(state, task);
       variant->jit_function[RAST_EDGE_TEST](&state->jit_context,
@@ -487,8 +521,12 @@ lp_rast_begin_query(struct lp_rasterizer_task *task,
       pq->start[task->thread_index] = task->thread_data.vis_counter;
       break;
    case PIPE_QUERY_PIPELINE_STATISTICS:
+   case LP_QUERY_FRAGMENTS:
       pq->start[task->thread_index] = task->thread_data.ps_invocations;
       break;
+   case LP_QUERY_RAST_TIME:
+      pq->start[task->thread_index] = os_time_get_nano() - task->tile_start;
+      break;
    default:
       assert(0);
       break;
@@ -519,10 +557,16 @@ lp_rast_end_query(struct lp_rasterizer_task *task,
       pq->end[task->thread_index] = os_time_get_nano();
       break;
    case PIPE_QUERY_PIPELINE_STATISTICS:
+   case LP_QUERY_FRAGMENTS:
       pq->end[task->thread_index] +=
          task->thread_data.ps_invocations - pq->start[task->thread_index];
       pq->start[task->thread_index] = 0;
       break;
+   case LP_QUERY_RAST_TIME:
+      pq->end[task->thread_index] +=
+         os_time_get_nano() - task->tile_start - pq->start[task->thread_index];
+      pq->start[task->thread_index] = 0;
+      break;
    default:
       assert(0);
       break;
@@ -628,6 +672,18 @@ rasterize_bin(struct lp_rasterizer_task *task,
 
    lp_rast_tile_end(task);
 
+   if (task->trace) {
+      struct lp_profile_event *event =
+         lp_profile_event(task->rast->profile, task->trace, LP_PROFILE_BIN,
+                          LP_PROFILE_TID_RAST + task->thread_index);
+      event->start = task->tile_start;
+      event->duration = os_time_get_nano() - task->tile_start;
+      event->args[0] = x;
+      event->args[1] = y;
+      event->args[2] = task->thread_data.ps_invocations *
+                       LP_RASTER_BLOCK_SIZE * LP_RASTER_BLOCK_SIZE;
+   }
+
 #ifdef DEBUG
    /* Debug/Perf flags:
     */
@@ -680,13 +736,25 @@ rasterize_scene(struct lp_rasterizer_task *task,
       /* loop over scene bins, rasterize each */
       {
          struct cmd_bin *bin;
+         boolean stolen;
+         int64_t start = 0;
          int i, j;
 
+         if (LP_DEBUG & DEBUG_COUNTERS)
+            start = os_time_get();
+
          assert(scene);
-         while ((bin = lp_scene_bin_iter_next(scene, &i, &j))) {
+         while ((bin = lp_scene_bin_iter_next(scene, task->thread_index,
+                                              &i, &j, &stolen))) {
+            if (stolen)
+               LP_COUNT(thread_bins_stolen[task->thread_index]);
             if (!is_empty_bin( bin ))
                rasterize_bin(task, bin, i, j);
          }
+
+         if (LP_DEBUG & DEBUG_COUNTERS)
+            LP_COUNT_ADD(thread_busy_time[task->thread_index],
+                         os_time_get() - start);
       }
    }
 
@@ -705,10 +773,6 @@ rasterize_scene(struct lp_rasterizer_task *task,
    }
 #endif
 
-   if (scene->fence) {
-      lp_fence_signal(scene->fence);
-   }
-
    task->scene = NULL;
 }
 
@@ -757,19 +821,42 @@ lp_rast_queue_scene( struct lp_rasterizer *rast,
 }
 
 
-void
-lp_rast_finish( struct lp_rasterizer *rast )
+/**
+ * Pin a rasterizer thread to one group of CPUs sharing an L3 cache, and
+ * reallocate its per-thread data from there, so that the memory it touches
+ * most stays local to its socket.
+ *
+ * The threads are spread evenly over the L3 caches, with consecutive
+ * thread indices sharing the same one.
+ */
+static void
+pin_rast_thread(struct lp_rasterizer_task *task)
 {
-   if (rast->num_threads == 0) {
-      /* nothing to do */
-   }
-   else {
-      int i;
+   struct lp_rasterizer *rast = task->rast;
+   unsigned cores_per_L3 = util_cpu_caps.cores_per_L3;
+   unsigned num_L3_caches;
+   struct lp_build_format_cache *cache;
 
-      /* wait for work to complete */
-      for (i = 0; i < rast->num_threads; i++) {
-         pipe_semaphore_wait(&rast->tasks[i].work_done);
-      }
+   if (!cores_per_L3)
+      return;
+
+   num_L3_caches = DIV_ROUND_UP(util_cpu_caps.nr_cpus, cores_per_L3);
+   if (num_L3_caches <= 1)
+      return;
+
+   util_pin_thread_to_L3(thrd_current(),
+                         task->thread_index * num_L3_caches / rast->num_threads,
+                         cores_per_L3);
+
+   /* Nothing has touched the cache yet: the rasterizer doesn't hand out
+    * work before the threads wait for it.  Replace it with one first
+    * touched from the new CPUs.
+    */
+   cache = align_malloc(sizeof(struct lp_build_format_cache), 16);
+   if (cache) {
+      memset(cache, 0, sizeof *cache);
+      align_free(task->thread_data.cache);
+      task->thread_data.cache = cache;
    }
 }
 
@@ -779,7 +866,7 @@ lp_rast_finish( struct lp_rasterizer *rast )
  * It's a simple loop:
  *   1. wait for work
  *   2. do work
- *   3. signal that we're done
+ *   3. signal the scene's fence once all threads are done
  */
 static int
 thread_function(void *init_data)
@@ -799,6 +886,9 @@ thread_function(void *init_data)
    fpstate = util_fpstate_get();
    util_fpstate_set_denorms_to_zero(fpstate);
 
+   if (rast->pin_threads)
+      pin_rast_thread(task);
+
    while (1) {
       /* wait for work */
       if (debug)
@@ -830,19 +920,26 @@ thread_function(void *init_data)
                       rast->curr_scene);
       
       /* wait for all threads to finish with this scene */
-      util_barrier_wait( &rast->barrier );
+      if (LP_DEBUG & DEBUG_COUNTERS) {
+         int64_t start = os_time_get();
+         util_barrier_wait( &rast->barrier );
+         LP_COUNT_ADD(thread_idle_time[task->thread_index],
+                      os_time_get() - start);
+      }
+      else {
+         util_barrier_wait( &rast->barrier );
+      }
 
-      /* XXX: shouldn't be necessary:
+      /* thread[0]:
+       *  - unmap the framebuffer surfaces
+       *  - signal the scene's fence
        */
       if (task->thread_index == 0) {
          lp_rast_end( rast );
       }
 
-      /* signal done with work */
       if (debug)
          debug_printf("thread %d done working\n", task->thread_index);
-
-      pipe_semaphore_signal(&task->work_done);
    }
 
 #ifdef _WIN32
@@ -882,7 +979,7 @@ create_rast_threads(struct lp_rasterizer *rast)
  * \param num_threads  number of rasterizer threads to create
  */
 struct lp_rasterizer *
-lp_rast_create( unsigned num_threads )
+lp_rast_create( unsigned num_threads, struct lp_profile *profile )
 {
    struct lp_rasterizer *rast;
    unsigned i;
@@ -911,9 +1008,20 @@ lp_rast_create( unsigned num_threads )
    rast->num_threads = num_threads;
 
    rast->no_rast = debug_get_bool_option("LP_NO_RAST", FALSE);
+   rast->pin_threads = debug_get_bool_option("LP_PIN_THREADS", FALSE);
 
    create_rast_threads(rast);
 
+   rast->profile = profile;
+   if (profile) {
+      for (i = 0; i < MAX2(1, rast->num_threads); i++) {
+         char name[16];
+         rast->tasks[i].trace = CALLOC_STRUCT(lp_profile_buffer);
+         snprintf(name, sizeof name, "llvmpipe-%u", i);
+         lp_profile_thread_name(profile, LP_PROFILE_TID_RAST + i, name);
+      }
+   }
+
    /* for synchronizing rasterization threads */
    if (rast->num_threads > 0) {
       util_barrier_init( &rast->barrier, rast->num_threads );
@@ -971,6 +1079,10 @@ void lp_rast_destroy( struct lp_rasterizer *rast )
    }
    for (i = 0; i < MAX2(1, rast->num_threads); i++) {
       align_free(rast->tasks[i].thread_data.cache);
+      if (rast->tasks[i].trace) {
+         lp_profile_flush(rast->profile, rast->tasks[i].trace);
+         FREE(rast->tasks[i].trace);
+      }
    }
 
    /* for synchronizing rasterization threads */
@@ -45,6 +45,7 @@
 struct lp_rasterizer;
 struct lp_scene;
 struct lp_fence;
+struct lp_profile;
 struct cmd_bin;
 
 #define FIXED_TYPE_WIDTH 64
@@ -157,7 +158,7 @@ struct lp_rast_clear_rb {
 
 
 struct lp_rasterizer *
-lp_rast_create( unsigned num_threads );
+lp_rast_create( unsigned num_threads, struct lp_profile *profile );
 
 void
 lp_rast_destroy( struct lp_rasterizer * );
@@ -166,9 +167,6 @@ void
 lp_rast_queue_scene( struct lp_rasterizer *rast,
                      struct lp_scene *scene );
 
-void
-lp_rast_finish( struct lp_rasterizer *rast );
-
 
 union lp_rast_cmd_arg {
    const struct lp_rast_shader_inputs *shade_tile;
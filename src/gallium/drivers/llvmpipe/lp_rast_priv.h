@@ -29,6 +29,7 @@
 #define LP_RAST_PRIV_H
 
 #include "util/format/u_format.h"
+#include "util/u_atomic.h"
 #include "util/u_thread.h"
 #include "gallivm/lp_bld_debug.h"
 #include "lp_memory.h"
@@ -37,6 +38,7 @@
 #include "lp_state.h"
 #include "lp_texture.h"
 #include "lp_limits.h"
+#include "lp_profile.h"
 
 
 #define TILE_VECTOR_HEIGHT 4
@@ -100,8 +102,14 @@ struct lp_rasterizer_task
    /** Non-interpolated passthru state and occlude counter for visible pixels */
    struct lp_jit_thread_data thread_data;
 
+   /** When the current tile began, if the scene times its bins */
+   int64_t tile_start;
+
+   /** This thread's trace events, if tracing */
+   struct lp_profile_buffer *trace;
+
    pipe_semaphore work_ready;
-   pipe_semaphore work_done;
+   pipe_semaphore work_done;  /**< thread exit, on Windows */
 };
 
 
@@ -127,6 +135,12 @@ struct lp_rasterizer
    unsigned num_threads;
    thrd_t threads[LP_MAX_THREADS];
 
+   /** Pin the threads to the CPUs sharing an L3 cache (LP_PIN_THREADS) */
+   boolean pin_threads;
+
+   /** The screen's trace, or NULL */
+   struct lp_profile *profile;
+
    /** For synchronizing the rasterization threads */
    util_barrier barrier;
 };
@@ -260,6 +274,9 @@ lp_rast_shade_quads_all( struct lp_rasterizer_task *task,
       /* Propagate non-interpolated raster state. */
       task->thread_data.raster_state.viewport_index = inputs->viewport_index;
 
+      if (task->trace)
+         p_atomic_add(&variant->nr_fragments, 16);
+
       /* run shader on 4x4 block */
       BEGIN_JIT_CALL(state, task);
       variant->jit_function[RAST_WHOLE]( &state->jit_context,
@@ -26,6 +26,7 @@
  **************************************************************************/
 
 #include "util/u_framebuffer.h"
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "util/u_inlines.h"
@@ -41,6 +42,7 @@
 /** List of resource references */
 struct resource_ref {
    struct pipe_resource *resource[RESOURCE_REF_SZ];
+   uint32_t writeable;        /**< bitmask of the resources written to */
    int count;
    struct resource_ref *next;
 };
@@ -62,8 +64,6 @@ lp_scene_create( struct pipe_context *pipe )
    scene->data.head =
       CALLOC_STRUCT(data_block);
 
-   (void) mtx_init(&scene->mutex, mtx_plain);
-
 #ifdef DEBUG
    /* Do some scene limit sanity checks here */
    {
@@ -90,7 +90,6 @@ void
 lp_scene_destroy(struct lp_scene *scene)
 {
    lp_fence_reference(&scene->fence, NULL);
-   mtx_destroy(&scene->mutex);
    assert(scene->data.head->next == NULL);
    FREE(scene->data.head);
    FREE(scene);
@@ -106,8 +105,11 @@ lp_scene_is_empty(struct lp_scene *scene )
 {
    unsigned x, y;
 
-   for (y = 0; y < TILES_Y; y++) {
-      for (x = 0; x < TILES_X; x++) {
+   if (!scene->tile)
+      return TRUE;
+
+   for (y = 0; y < scene->tiles_y; y++) {
+      for (x = 0; x < scene->tiles_x; x++) {
          const struct cmd_bin *bin = lp_scene_get_bin(scene, x, y);
          if (bin->head) {
             return FALSE;
@@ -138,6 +140,7 @@ lp_scene_bin_reset(struct lp_scene *scene, unsigned x, unsigned y)
    struct cmd_bin *bin = lp_scene_get_bin(scene, x, y);
 
    bin->last_state = NULL;
+   bin->cost = 0;
    bin->head = bin->tail;
    if (bin->tail) {
       bin->tail->next = NULL;
@@ -204,12 +207,12 @@ lp_scene_begin_rasterization(struct lp_scene *scene)
 
 
 /**
- * Free all the temporary data in a scene.
+ * Unmap the framebuffer once the rasterizer is done with the scene.
  */
 void
 lp_scene_end_rasterization(struct lp_scene *scene )
 {
-   int i, j;
+   int i;
 
    /* Unmap color buffers */
    for (i = 0; i < scene->fb.nr_cbufs; i++) {
@@ -232,22 +235,24 @@ lp_scene_end_rasterization(struct lp_scene *scene )
                               zsbuf->u.tex.first_layer);
       scene->zsbuf.map = NULL;
    }
+}
 
-   /* Reset all command lists:
-    */
-   for (i = 0; i < scene->tiles_x; i++) {
-      for (j = 0; j < scene->tiles_y; j++) {
-         struct cmd_bin *bin = lp_scene_get_bin(scene, i, j);
-         bin->head = NULL;
-         bin->tail = NULL;
-         bin->last_state = NULL;
-      }
-   }
 
-   /* If there are any bins which weren't cleared by the loop above,
-    * they will be caught (on debug builds at least) by this assert:
+/**
+ * Free all the temporary data in a scene, so that it can be binned into
+ * again.  Called by the setup module once the scene's fence has signalled.
+ */
+void
+lp_scene_reset(struct lp_scene *scene)
+{
+   assert(!scene->fence || lp_fence_signalled(scene->fence));
+
+   /* Drop the bins, they go with the scene data:
     */
-   assert(lp_scene_is_empty(scene));
+   scene->tile = NULL;
+   scene->bin_order = NULL;
+   FREE(scene->large_bins);
+   scene->large_bins = NULL;
 
    /* Decrement texture ref counts
     */
@@ -374,7 +379,8 @@ lp_scene_data_size( const struct lp_scene *scene )
 boolean
 lp_scene_add_resource_reference(struct lp_scene *scene,
                                 struct pipe_resource *resource,
-                                boolean initializing_scene)
+                                boolean initializing_scene,
+                                boolean writeable)
 {
    struct resource_ref *ref, **last = &scene->resources;
    int i;
@@ -386,9 +392,13 @@ lp_scene_add_resource_reference(struct lp_scene *scene,
 
       /* Search for this resource:
        */
-      for (i = 0; i < ref->count; i++)
-         if (ref->resource[i] == resource)
+      for (i = 0; i < ref->count; i++) {
+         if (ref->resource[i] == resource) {
+            if (writeable)
+               ref->writeable |= 1u << i;
             return TRUE;
+         }
+      }
 
       if (ref->count < RESOURCE_REF_SZ) {
          /* If the block is half-empty, then append the reference here.
@@ -411,6 +421,8 @@ lp_scene_add_resource_reference(struct lp_scene *scene,
 
    /* Append the reference to the reference block.
     */
+   if (writeable)
+      ref->writeable |= 1u << ref->count;
    pipe_resource_reference(&ref->resource[ref->count++], resource);
    scene->resource_reference_size += llvmpipe_resource_size(resource);
 
@@ -429,86 +441,247 @@ lp_scene_add_resource_reference(struct lp_scene *scene,
 
 /**
  * Does this scene have a reference to the given resource?
+ * \return LP_REFERENCED_FOR_READ/WRITE bits
  */
-boolean
+unsigned
 lp_scene_is_resource_referenced(const struct lp_scene *scene,
                                 const struct pipe_resource *resource)
 {
    const struct resource_ref *ref;
    int i;
 
+   for (i = 0; i < scene->fb.nr_cbufs; i++) {
+      if (scene->fb.cbufs[i] && scene->fb.cbufs[i]->texture == resource)
+         return LP_REFERENCED_FOR_READ | LP_REFERENCED_FOR_WRITE;
+   }
+   if (scene->fb.zsbuf && scene->fb.zsbuf->texture == resource)
+      return LP_REFERENCED_FOR_READ | LP_REFERENCED_FOR_WRITE;
+
    for (ref = scene->resources; ref; ref = ref->next) {
-      for (i = 0; i < ref->count; i++)
-         if (ref->resource[i] == resource)
-            return TRUE;
+      for (i = 0; i < ref->count; i++) {
+         if (ref->resource[i] == resource) {
+            if (ref->writeable & (1u << i))
+               return LP_REFERENCED_FOR_READ | LP_REFERENCED_FOR_WRITE;
+            return LP_REFERENCED_FOR_READ;
+         }
+      }
    }
 
-   return FALSE;
+   return LP_UNREFERENCED;
 }
 
 
 
 
-/** advance curr_x,y to the next bin */
-static boolean
-next_bin(struct lp_scene *scene)
+static inline uint64_t
+bin_range(unsigned head, unsigned tail)
 {
-   scene->curr_x++;
-   if (scene->curr_x >= scene->tiles_x) {
-      scene->curr_x = 0;
-      scene->curr_y++;
+   return (uint64_t)tail << 32 | head;
+}
+
+
+/** Extract the even bits of a 2D Morton code */
+static inline unsigned
+morton_compact(unsigned code)
+{
+   code &= 0x55555555;
+   code = (code | (code >> 1)) & 0x33333333;
+   code = (code | (code >> 2)) & 0x0f0f0f0f;
+   code = (code | (code >> 4)) & 0x00ff00ff;
+   code = (code | (code >> 8)) & 0x0000ffff;
+   return code;
+}
+
+
+/**
+ * Split the non-empty bins among the rasterizer threads.
+ *
+ * The bins are ordered along a Z-order curve, so that consecutive bins are
+ * spatially close, and cut into one contiguous range per thread holding
+ * about the same estimated cost.  Threads that run out of work steal from
+ * the far end of the others' ranges, see lp_scene_bin_iter_next().
+ */
+void
+lp_scene_bin_iter_begin( struct lp_scene *scene, unsigned num_threads )
+{
+   unsigned dim = util_next_power_of_two(MAX2(scene->tiles_x, scene->tiles_y));
+   unsigned num_bins = 0;
+   uint64_t total_cost = 0, cost = 0;
+   unsigned code, i, t;
+
+   for (code = 0; code < dim * dim; code++) {
+      unsigned x = morton_compact(code);
+      unsigned y = morton_compact(code >> 1);
+      const struct cmd_bin *bin;
+
+      if (x >= scene->tiles_x || y >= scene->tiles_y)
+         continue;
+
+      bin = lp_scene_get_bin(scene, x, y);
+      if (!bin->head)
+         continue;
+
+      scene->bin_order[num_bins].x = x;
+      scene->bin_order[num_bins].y = y;
+      num_bins++;
+      total_cost += bin->cost;
    }
-   if (scene->curr_y >= scene->tiles_y) {
-      /* no more bins */
-      return FALSE;
+
+   num_threads = CLAMP(num_threads, 1, LP_MAX_THREADS);
+   scene->num_bin_deques = num_threads;
+
+   for (i = 0, t = 0; t < num_threads; t++) {
+      uint64_t target = total_cost * (t + 1) / num_threads;
+      unsigned head = i;
+
+      if (t == num_threads - 1) {
+         i = num_bins;
+      } else {
+         while (i < num_bins && cost < target) {
+            const struct lp_bin_ref *ref = &scene->bin_order[i++];
+            cost += lp_scene_get_bin(scene, ref->x, ref->y)->cost;
+         }
+      }
+
+      scene->bin_deques[t].range = bin_range(head, i);
    }
-   return TRUE;
 }
 
 
-void
-lp_scene_bin_iter_begin( struct lp_scene *scene )
+/**
+ * Take a bin from the head of the deque, or half of the remaining bins from
+ * its tail when stealing.
+ *
+ * \return the number of bins taken, starting at \p index
+ */
+static unsigned
+bin_deque_take(struct lp_bin_deque *deque, boolean steal, unsigned *index)
 {
-   scene->curr_x = scene->curr_y = -1;
+   uint64_t range = p_atomic_read(&deque->range);
+
+   for (;;) {
+      unsigned head = (unsigned)range;
+      unsigned tail = (unsigned)(range >> 32);
+      unsigned count;
+      uint64_t prev;
+
+      if (head >= tail)
+         return 0;
+
+      count = steal ? (tail - head + 1) / 2 : 1;
+
+      if (steal)
+         prev = p_atomic_cmpxchg(&deque->range, range,
+                                 bin_range(head, tail - count));
+      else
+         prev = p_atomic_cmpxchg(&deque->range, range,
+                                 bin_range(head + count, tail));
+
+      if (prev == range) {
+         *index = steal ? tail - count : head;
+         return count;
+      }
+
+      range = prev;
+   }
 }
 
 
 /**
- * Return pointer to next bin to be rendered.
- * The lp_scene::curr_x and ::curr_y fields will be advanced.
- * Multiple rendering threads will call this function to get a chunk
- * of work (a bin) to work on.
+ * Return the next bin for the given thread to render, or NULL when all the
+ * bins of the scene have been handed out.
+ *
+ * Each thread works through its own range first.  Once that is exhausted
+ * it steals the far half of the fullest remaining range, which keeps both
+ * threads working on spatially coherent runs.
  */
 struct cmd_bin *
-lp_scene_bin_iter_next( struct lp_scene *scene , int *x, int *y)
+lp_scene_bin_iter_next( struct lp_scene *scene, unsigned thread_index,
+                        int *x, int *y, boolean *stolen )
 {
-   struct cmd_bin *bin = NULL;
+   struct lp_bin_deque *own = &scene->bin_deques[thread_index];
+   const struct lp_bin_ref *ref;
+   unsigned index;
+
+   assert(thread_index < scene->num_bin_deques);
+
+   *stolen = FALSE;
+
+   if (!bin_deque_take(own, FALSE, &index)) {
+      for (;;) {
+         struct lp_bin_deque *victim = NULL;
+         unsigned max_left = 0, count, i;
+
+         for (i = 1; i < scene->num_bin_deques; i++) {
+            struct lp_bin_deque *deque =
+               &scene->bin_deques[(thread_index + i) % scene->num_bin_deques];
+            uint64_t range = p_atomic_read(&deque->range);
+            unsigned head = (unsigned)range;
+            unsigned tail = (unsigned)(range >> 32);
+
+            if (tail > head && tail - head > max_left) {
+               max_left = tail - head;
+               victim = deque;
+            }
+         }
+
+         if (!victim)
+            return NULL;
+
+         count = bin_deque_take(victim, TRUE, &index);
+         if (count) {
+            /* Nobody else writes an empty deque, so this can't fail. */
+            uint64_t old = p_atomic_read(&own->range);
+            p_atomic_cmpxchg(&own->range, old,
+                             bin_range(index + 1, index + count));
+            *stolen = TRUE;
+            break;
+         }
+      }
+   }
+
+   ref = &scene->bin_order[index];
+   *x = ref->x;
+   *y = ref->y;
+   return lp_scene_get_bin(scene, ref->x, ref->y);
+}
 
-   mtx_lock(&scene->mutex);
 
-   if (scene->curr_x < 0) {
-      /* first bin */
-      scene->curr_x = 0;
-      scene->curr_y = 0;
+/**
+ * Allocate the bins for the framebuffer size.  Take them from the scene
+ * data if they fit in a data block, which is kept from one scene to the
+ * next, so that common framebuffer sizes cost no allocation at all.
+ */
+static boolean
+alloc_bins(struct lp_scene *scene)
+{
+   unsigned num_bins = scene->tiles_x * scene->tiles_y;
+   size_t bins_size = align(num_bins * sizeof(struct cmd_bin), 16);
+   size_t size = bins_size + num_bins * sizeof(struct lp_bin_ref);
+   uint8_t *bins;
+
+   if (size + 16 <= DATA_BLOCK_SIZE) {
+      bins = lp_scene_alloc_aligned(scene, size, 16);
    }
-   else if (!next_bin(scene)) {
-      /* no more bins left */
-      goto end;
+   else {
+      scene->large_bins = MALLOC(size);
+      bins = scene->large_bins;
+      scene->scene_size += size;
    }
 
-   bin = lp_scene_get_bin(scene, scene->curr_x, scene->curr_y);
-   *x = scene->curr_x;
-   *y = scene->curr_y;
+   if (!bins)
+      return FALSE;
+
+   scene->tile = (struct cmd_bin *)bins;
+   scene->bin_order = (struct lp_bin_ref *)(bins + bins_size);
+   memset(scene->tile, 0, num_bins * sizeof(struct cmd_bin));
 
-end:
-   /*printf("return bin %p at %d, %d\n", (void *) bin, *bin_x, *bin_y);*/
-   mtx_unlock(&scene->mutex);
-   return bin;
+   return TRUE;
 }
 
 
-void lp_scene_begin_binning(struct lp_scene *scene,
-                            struct pipe_framebuffer_state *fb)
+boolean lp_scene_begin_binning(struct lp_scene *scene,
+                               struct pipe_framebuffer_state *fb)
 {
    int i;
    unsigned max_layer = ~0;
@@ -522,6 +695,11 @@ void lp_scene_begin_binning(struct lp_scene *scene,
    assert(scene->tiles_x <= TILES_X);
    assert(scene->tiles_y <= TILES_Y);
 
+   if (!alloc_bins(scene))
+      return FALSE;
+
+   scene->hiz_valid = FALSE;
+
    /*
     * Determine how many layers the fb has (used for clamping layer value).
     * OpenGL (but not d3d10) permits different amount of layers per rt, however
@@ -545,6 +723,24 @@ void lp_scene_begin_binning(struct lp_scene *scene,
       max_layer = MIN2(max_layer, zsbuf->u.tex.last_layer - zsbuf->u.tex.first_layer);
    }
    scene->fb_max_layer = max_layer;
+
+   return TRUE;
+}
+
+
+/**
+ * Note a depth clear of the whole framebuffer, which is the only way the
+ * per-tile depth bounds become known.
+ */
+void
+lp_scene_hiz_clear(struct lp_scene *scene, float depth)
+{
+   unsigned i;
+
+   for (i = 0; i < scene->tiles_x * scene->tiles_y; i++)
+      scene->tile[i].zmax = depth;
+
+   scene->hiz_valid = TRUE;
 }
 
 
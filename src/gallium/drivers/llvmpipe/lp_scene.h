@@ -36,14 +36,15 @@
 #define LP_SCENE_H
 
 #include "os/os_thread.h"
+#include "lp_limits.h"
 #include "lp_rast.h"
 #include "lp_debug.h"
 
 struct lp_scene_queue;
 struct lp_rast_state;
 
-/* We're limited to 2K by 2K for 32bit fixed point rasterization.
- * Will need a 64-bit version for larger framebuffers.
+/* Max number of tiles in each dimension.  The bins are allocated for the
+ * framebuffer size, this is only used for sanity checks.
  */
 #define TILES_X (LP_MAX_WIDTH / TILE_SIZE)
 #define TILES_Y (LP_MAX_HEIGHT / TILE_SIZE)
@@ -97,6 +98,26 @@ struct cmd_bin {
    const struct lp_rast_state *last_state;       /* most recent state set in bin */
    struct cmd_block *head;
    struct cmd_block *tail;
+   unsigned cost;             /* commands binned, as an estimate of the work */
+   float zmax;                /* upper bound of the tile depth, see hiz_valid */
+};
+
+
+/** Tile coordinates of a bin */
+struct lp_bin_ref {
+   uint16_t x, y;
+};
+
+
+/**
+ * A rasterizer thread's share of the bins: the range [head, tail) of
+ * lp_scene::bin_order, packed as tail << 32 | head so that the owner taking
+ * bins from the head and other threads stealing from the tail only need a
+ * compare-and-swap.  Padded to keep the deques on separate cache lines.
+ */
+struct lp_bin_deque {
+   uint64_t range;
+   uint8_t pad[56];
 };
    
 
@@ -135,6 +156,13 @@ struct lp_scene {
    /* If queries were either active or there were begin/end query commands */
    boolean had_queries;
 
+   /* Whether the rasterizer times the bins, for the trace or a query */
+   boolean time_bins;
+
+   /* When binning began and the context's triangle count then, for the trace */
+   int64_t bin_start;
+   uint64_t bin_triangles;
+
    /* Framebuffer mappings - valid only between begin_rasterization()
     * and end_rasterization().
     */
@@ -148,6 +176,12 @@ struct lp_scene {
    /* The amount of layers in the fb (minimum of all attachments) */
    unsigned fb_max_layer;
 
+   /* Whether cmd_bin::zmax bounds the depth of each tile at the current
+    * point of binning.  Set by depth clears, cleared by draws which may
+    * increase the depth.
+    */
+   boolean hiz_valid;
+
    /** the framebuffer to render the scene into */
    struct pipe_framebuffer_state fb;
 
@@ -172,10 +206,18 @@ struct lp_scene {
     */
    unsigned tiles_x, tiles_y;
 
-   int curr_x, curr_y;  /**< for iterating over bins */
-   mtx_t mutex;
+   /** The bins, tiles_x * tiles_y of them in row order, allocated when
+    * binning begins: from the scene data when they fit in a data block,
+    * else in large_bins.
+    */
+   struct cmd_bin *tile;
+   void *large_bins;
+
+   /** Non-empty bins in rasterization order, split among the threads */
+   struct lp_bin_ref *bin_order;
+   struct lp_bin_deque bin_deques[LP_MAX_THREADS];
+   unsigned num_bin_deques;
 
-   struct cmd_bin tile[TILES_X][TILES_Y];
    struct data_block_list data;
 };
 
@@ -186,6 +228,8 @@ struct lp_scene *lp_scene_create(struct pipe_context *pipe);
 void lp_scene_destroy(struct lp_scene *scene);
 
 boolean lp_scene_is_empty(struct lp_scene *scene );
+
+void lp_scene_hiz_clear(struct lp_scene *scene, float depth);
 boolean lp_scene_is_oom(struct lp_scene *scene );
 
 
@@ -196,10 +240,11 @@ struct cmd_block *lp_scene_new_cmd_block( struct lp_scene *scene,
 
 boolean lp_scene_add_resource_reference(struct lp_scene *scene,
                                         struct pipe_resource *resource,
-                                        boolean initializing_scene);
+                                        boolean initializing_scene,
+                                        boolean writeable);
 
-boolean lp_scene_is_resource_referenced(const struct lp_scene *scene,
-                                        const struct pipe_resource *resource );
+unsigned lp_scene_is_resource_referenced(const struct lp_scene *scene,
+                                         const struct pipe_resource *resource );
 
 
 /**
@@ -284,7 +329,8 @@ lp_scene_putback_data( struct lp_scene *scene, unsigned size)
 static inline struct cmd_bin *
 lp_scene_get_bin(struct lp_scene *scene, unsigned x, unsigned y)
 {
-   return &scene->tile[x][y];
+   assert(x < scene->tiles_x && y < scene->tiles_y);
+   return &scene->tile[y * scene->tiles_x + x];
 }
 
 
@@ -322,6 +368,8 @@ lp_scene_bin_command( struct lp_scene *scene,
       tail->arg[i] = arg;
       tail->count++;
    }
+
+   bin->cost++;
    
    return TRUE;
 }
@@ -378,16 +426,17 @@ lp_scene_get_num_bins( const struct lp_scene *scene )
 
 
 void
-lp_scene_bin_iter_begin( struct lp_scene *scene );
+lp_scene_bin_iter_begin( struct lp_scene *scene, unsigned num_threads );
 
 struct cmd_bin *
-lp_scene_bin_iter_next( struct lp_scene *scene, int *x, int *y );
+lp_scene_bin_iter_next( struct lp_scene *scene, unsigned thread_index,
+                        int *x, int *y, boolean *stolen );
 
 
 
 /* Begin/end binning of a scene
  */
-void
+boolean
 lp_scene_begin_binning(struct lp_scene *scene,
                        struct pipe_framebuffer_state *fb);
 
@@ -403,6 +452,9 @@ lp_scene_begin_rasterization(struct lp_scene *scene);
 void
 lp_scene_end_rasterization(struct lp_scene *scene);
 
+void
+lp_scene_reset(struct lp_scene *scene);
+
 
 
 
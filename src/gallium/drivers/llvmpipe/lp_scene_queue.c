@@ -39,7 +39,8 @@
 
 
 
-#define SCENE_QUEUE_SIZE 4
+/* Enough for a few contexts with their scene pipelines full. */
+#define SCENE_QUEUE_SIZE 256
 
 
 
@@ -28,6 +28,7 @@
 
 #include "util/u_memory.h"
 #include "util/u_math.h"
+#include "util/u_atomic.h"
 #include "util/u_cpu_detect.h"
 #include "util/format/u_format.h"
 #include "util/u_screen.h"
@@ -38,7 +39,10 @@
 #include "draw/draw_context.h"
 #include "gallivm/lp_bld_type.h"
 #include "gallivm/lp_bld_nir.h"
+#include "gallivm/lp_bld_init.h"
 
+#include "util/disk_cache.h"
+#include "util/mesa-sha1.h"
 #include "util/os_misc.h"
 #include "util/os_time.h"
 #include "lp_texture.h"
@@ -51,6 +55,7 @@
 #include "lp_limits.h"
 #include "lp_rast.h"
 #include "lp_cs_tpool.h"
+#include "lp_profile.h"
 
 #include "state_tracker/sw_winsys.h"
 
@@ -75,6 +80,7 @@ static const struct debug_named_value lp_debug_flags[] = {
    { "cs", DEBUG_CS, NULL },
    { "tgsi_ir", DEBUG_TGSI_IR, NULL },
    { "cl", DEBUG_CL, NULL },
+   { "cache_stats", DEBUG_CACHE_STATS, NULL },
    DEBUG_NAMED_VALUE_END
 };
 #endif
@@ -89,6 +95,7 @@ static const struct debug_named_value lp_perf_flags[] = {
    { "no_blend",       PERF_NO_BLEND, NULL },
    { "no_depth",       PERF_NO_DEPTH, NULL },
    { "no_alphatest",   PERF_NO_ALPHATEST, NULL },
+   { "no_hiz",         PERF_NO_HIZ, NULL },
    DEBUG_NAMED_VALUE_END
 };
 
@@ -766,6 +773,18 @@ llvmpipe_flush_frontbuffer(struct pipe_screen *_screen,
    struct llvmpipe_screen *screen = llvmpipe_screen(_screen);
    struct sw_winsys *winsys = screen->winsys;
    struct llvmpipe_resource *texture = llvmpipe_resource(resource);
+   struct lp_fence *fence = NULL;
+
+   /* Flushes don't wait for the rasterizer, so let it finish the scenes
+    * queued so far, which may render to this display target.
+    */
+   mtx_lock(&screen->rast_mutex);
+   lp_fence_reference(&fence, screen->last_fence);
+   mtx_unlock(&screen->rast_mutex);
+   if (fence) {
+      lp_fence_wait(fence);
+      lp_fence_reference(&fence, NULL);
+   }
 
    assert(texture->dt);
    if (texture->dt)
@@ -778,21 +797,35 @@ llvmpipe_destroy_screen( struct pipe_screen *_screen )
    struct llvmpipe_screen *screen = llvmpipe_screen(_screen);
    struct sw_winsys *winsys = screen->winsys;
 
+   if (screen->num_compile_threads)
+      util_queue_destroy(&screen->fs_compile_queue);
+
    if (screen->cs_tpool)
       lp_cs_tpool_destroy(screen->cs_tpool);
 
    if (screen->rast)
       lp_rast_destroy(screen->rast);
 
+   if (screen->profile)
+      lp_profile_destroy(screen->profile);
+
+   lp_fence_reference(&screen->last_fence, NULL);
+
    lp_jit_screen_cleanup(screen);
 
+   if (LP_DEBUG & DEBUG_CACHE_STATS) {
+      debug_printf("disk shader cache: hits = %u, misses = %u\n",
+                   screen->num_disk_shader_cache_hits,
+                   screen->num_disk_shader_cache_misses);
+   }
+   disk_cache_destroy(screen->disk_shader_cache);
+
    if(winsys->destroy)
       winsys->destroy(winsys);
 
    glsl_type_singleton_decref();
 
    mtx_destroy(&screen->rast_mutex);
-   mtx_destroy(&screen->cs_mutex);
    FREE(screen);
 }
 
@@ -843,6 +876,125 @@ llvmpipe_get_timestamp(struct pipe_screen *_screen)
    return os_time_get_nano();
 }
 
+static int
+llvmpipe_get_driver_query_info(struct pipe_screen *_screen,
+                               unsigned index,
+                               struct pipe_driver_query_info *info)
+{
+#define QUERY(NAME, ENUM, UNITS) \
+   {NAME, ENUM, {0}, UNITS, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE, 0, 0x0}
+
+   static const struct pipe_driver_query_info queries[] = {
+      QUERY("lp-draw-time", LP_QUERY_DRAW_TIME,
+            PIPE_DRIVER_QUERY_TYPE_MICROSECONDS),
+      QUERY("lp-scenes", LP_QUERY_SCENES,
+            PIPE_DRIVER_QUERY_TYPE_UINT64),
+      QUERY("lp-triangles-binned", LP_QUERY_TRIANGLES,
+            PIPE_DRIVER_QUERY_TYPE_UINT64),
+      QUERY("lp-jit-time", LP_QUERY_JIT_TIME,
+            PIPE_DRIVER_QUERY_TYPE_MICROSECONDS),
+      QUERY("lp-vertices-shaded", LP_QUERY_VERTICES_SHADED,
+            PIPE_DRIVER_QUERY_TYPE_UINT64),
+      QUERY("lp-acmr", LP_QUERY_ACMR,
+            PIPE_DRIVER_QUERY_TYPE_FLOAT),
+      QUERY("lp-rast-time", LP_QUERY_RAST_TIME,
+            PIPE_DRIVER_QUERY_TYPE_MICROSECONDS),
+      QUERY("lp-fragments-shaded", LP_QUERY_FRAGMENTS,
+            PIPE_DRIVER_QUERY_TYPE_UINT64),
+   };
+#undef QUERY
+
+   if (!info)
+      return ARRAY_SIZE(queries);
+
+   if (index >= ARRAY_SIZE(queries))
+      return 0;
+
+   *info = queries[index];
+   return 1;
+}
+
+static void
+lp_disk_cache_create(struct llvmpipe_screen *screen)
+{
+#ifdef HAVE_DLADDR
+   struct mesa_sha1 ctx;
+   unsigned char sha1[20];
+   char cache_id[20 * 2 + 1];
+
+   _mesa_sha1_init(&ctx);
+
+   if (!disk_cache_get_function_identifier(lp_disk_cache_create, &ctx) ||
+       !disk_cache_get_function_identifier(LLVMLinkInMCJIT, &ctx))
+      return;
+
+   /* Cached objects are only valid for the cpu they were compiled for. */
+   gallivm_hash_host_identity(&ctx);
+
+   _mesa_sha1_final(&ctx, sha1);
+   disk_cache_format_hex_id(cache_id, sha1, 20 * 2);
+
+   screen->disk_shader_cache = disk_cache_create("llvmpipe", cache_id, 0);
+#endif
+}
+
+static struct disk_cache *
+llvmpipe_get_disk_shader_cache(struct pipe_screen *_screen)
+{
+   struct llvmpipe_screen *screen = llvmpipe_screen(_screen);
+
+   return screen->disk_shader_cache;
+}
+
+/**
+ * Look up the object code of a shader variant, leaving \p cache empty on a
+ * miss.  The caller owns cache->data.
+ */
+void
+lp_disk_cache_find_shader(struct llvmpipe_screen *screen,
+                          struct lp_cached_code *cache,
+                          const unsigned char ir_sha1_cache_key[20])
+{
+   unsigned char sha1[CACHE_KEY_SIZE];
+
+   if (!screen->disk_shader_cache)
+      return;
+
+   disk_cache_compute_key(screen->disk_shader_cache, ir_sha1_cache_key,
+                          20, sha1);
+
+   size_t binary_size;
+   uint8_t *buffer = disk_cache_get(screen->disk_shader_cache, sha1,
+                                    &binary_size);
+   if (!buffer) {
+      p_atomic_inc(&screen->num_disk_shader_cache_misses);
+      return;
+   }
+
+   cache->data_size = binary_size;
+   cache->data = buffer;
+   p_atomic_inc(&screen->num_disk_shader_cache_hits);
+}
+
+/**
+ * Store the object code a shader variant was compiled to after a miss.
+ */
+void
+lp_disk_cache_insert_shader(struct llvmpipe_screen *screen,
+                            struct lp_cached_code *cache,
+                            const unsigned char ir_sha1_cache_key[20])
+{
+   unsigned char sha1[CACHE_KEY_SIZE];
+
+   if (!screen->disk_shader_cache || !cache->data_size)
+      return;
+
+   disk_cache_compute_key(screen->disk_shader_cache, ir_sha1_cache_key,
+                          20, sha1);
+   disk_cache_put(screen->disk_shader_cache, sha1, cache->data,
+                  cache->data_size, NULL);
+}
+
 /**
  * Create a new pipe_screen object
  * Note: we're not presently subclassing pipe_screen (no llvmpipe_screen).
@@ -891,6 +1043,8 @@ llvmpipe_create_screen(struct sw_winsys *winsys)
    screen->base.fence_finish = llvmpipe_fence_finish;
 
    screen->base.get_timestamp = llvmpipe_get_timestamp;
+   screen->base.get_driver_query_info = llvmpipe_get_driver_query_info;
+   screen->base.get_disk_shader_cache = llvmpipe_get_disk_shader_cache;
 
    screen->base.finalize_nir = llvmpipe_finalize_nir;
    llvmpipe_init_screen_resource_funcs(&screen->base);
@@ -903,8 +1057,12 @@ llvmpipe_create_screen(struct sw_winsys *winsys)
    screen->num_threads = debug_get_num_option("LP_NUM_THREADS", screen->num_threads);
    screen->num_threads = MIN2(screen->num_threads, LP_MAX_THREADS);
 
-   screen->rast = lp_rast_create(screen->num_threads);
+   screen->profile = lp_profile_create();
+
+   screen->rast = lp_rast_create(screen->num_threads, screen->profile);
    if (!screen->rast) {
+      if (screen->profile)
+         lp_profile_destroy(screen->profile);
       lp_jit_screen_cleanup(screen);
       FREE(screen);
       return NULL;
@@ -914,11 +1072,40 @@ llvmpipe_create_screen(struct sw_winsys *winsys)
    screen->cs_tpool = lp_cs_tpool_create(screen->num_threads);
    if (!screen->cs_tpool) {
       lp_rast_destroy(screen->rast);
+      if (screen->profile)
+         lp_profile_destroy(screen->profile);
       lp_jit_screen_cleanup(screen);
       FREE(screen);
       return NULL;
    }
-   (void) mtx_init(&screen->cs_mutex, mtx_plain);
+
+   screen->num_compile_threads = MIN2(util_cpu_caps.nr_cpus, LP_MAX_COMPILE_THREADS);
+#ifdef EMBEDDED_DEVICE
+   screen->num_compile_threads = 0;
+#endif
+   screen->num_compile_threads = debug_get_num_option("LP_NUM_COMPILE_THREADS",
+                                                      screen->num_compile_threads);
+   screen->num_compile_threads = MIN2(screen->num_compile_threads,
+                                      LP_MAX_COMPILE_THREADS);
+   if (screen->num_compile_threads &&
+       !util_queue_init(&screen->fs_compile_queue, "lpfs", 64,
+                        screen->num_compile_threads,
+                        UTIL_QUEUE_INIT_RESIZE_IF_FULL)) {
+      screen->num_compile_threads = 0;
+   }
+
+   if (screen->profile) {
+      unsigned i;
+
+      for (i = 0; i < screen->num_compile_threads; i++) {
+         char name[16];
+         snprintf(name, sizeof name, "lpfs:%u", i);
+         lp_profile_thread_name(screen->profile, LP_PROFILE_TID_COMPILE + i,
+                                name);
+      }
+   }
+
+   lp_disk_cache_create(screen);
 
    return &screen->base;
 }
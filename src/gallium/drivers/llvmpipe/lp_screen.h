@@ -37,11 +37,16 @@
 #include "pipe/p_screen.h"
 #include "pipe/p_defines.h"
 #include "os/os_thread.h"
+#include "util/u_queue.h"
 #include "gallivm/lp_bld.h"
 
 
 struct sw_winsys;
 struct lp_cs_tpool;
+struct lp_cached_code;
+struct lp_fence;
+struct lp_profile;
+struct disk_cache;
 
 struct llvmpipe_screen
 {
@@ -57,11 +62,23 @@ struct llvmpipe_screen
 
    struct lp_rasterizer *rast;
    mtx_t rast_mutex;
+   struct lp_fence *last_fence;  /**< of the last scene queued, any context */
 
-   struct lp_cs_tpool *cs_tpool;
-   mtx_t cs_mutex;
+   struct lp_cs_tpool *cs_tpool;   /**< shared by the contexts' dispatches */
+
+   /* Fragment shader variants compile here, unless num_compile_threads is 0. */
+   struct util_queue fs_compile_queue;
+   unsigned num_compile_threads;
+
+   /* Trace of the screen's contexts, see LP_TRACE_FILE, or NULL. */
+   struct lp_profile *profile;
 
    bool use_tgsi;
+
+   /* On-disk cache of compiled shader variants, or NULL. */
+   struct disk_cache *disk_shader_cache;
+   unsigned num_disk_shader_cache_hits;
+   unsigned num_disk_shader_cache_misses;
 };
 
 
@@ -74,5 +91,15 @@ llvmpipe_screen( struct pipe_screen *pipe )
 }
 
 
+void
+lp_disk_cache_find_shader(struct llvmpipe_screen *screen,
+                          struct lp_cached_code *cache,
+                          const unsigned char ir_sha1_cache_key[20]);
+
+void
+lp_disk_cache_insert_shader(struct llvmpipe_screen *screen,
+                            struct lp_cached_code *cache,
+                            const unsigned char ir_sha1_cache_key[20]);
+
 
 #endif /* LP_SCREEN_H */
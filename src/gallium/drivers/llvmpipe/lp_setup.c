@@ -48,6 +48,7 @@
 #include "lp_texture.h"
 #include "lp_debug.h"
 #include "lp_fence.h"
+#include "lp_profile.h"
 #include "lp_query.h"
 #include "lp_rast.h"
 #include "lp_setup_context.h"
@@ -64,26 +65,59 @@ static boolean set_scene_state( struct lp_setup_context *, enum setup_state,
 static boolean try_update_scene_state( struct lp_setup_context *setup );
 
 
-static void
+/**
+ * Get the next scene to bin into.
+ *
+ * Scenes are used round-robin, so that the next one is always the oldest:
+ * if the rasterizer isn't done with it yet, wait for its fence.  Scenes
+ * are only reset here, by the setup thread, which lets the rasterizer
+ * carry on without waiting for us.  Checking the fences without their
+ * mutex is fine, as lp_rast_end() keeps a reference to a fence while
+ * signalling it.
+ *
+ * Returns FALSE if the bins for the framebuffer couldn't be allocated.
+ */
+static boolean
 lp_setup_get_empty_scene(struct lp_setup_context *setup)
 {
+   struct lp_scene *scene;
+   unsigned i;
+
    assert(setup->scene == NULL);
 
+   /* Release the resources held by scenes already rasterized. */
+   for (i = 0; i < setup->num_scenes; i++) {
+      scene = setup->scenes[i];
+      if (scene && scene->fence && lp_fence_signalled(scene->fence))
+         lp_scene_reset(scene);
+   }
+
    setup->scene_idx++;
-   setup->scene_idx %= ARRAY_SIZE(setup->scenes);
+   setup->scene_idx %= setup->num_scenes;
+
+   if (!setup->scenes[setup->scene_idx]) {
+      setup->scenes[setup->scene_idx] = lp_scene_create(setup->pipe);
+      if (!setup->scenes[setup->scene_idx]) {
+         /* Make do with the scenes we have. */
+         setup->num_scenes = setup->scene_idx;
+         setup->scene_idx = 0;
+      }
+   }
 
-   setup->scene = setup->scenes[setup->scene_idx];
+   scene = setup->scenes[setup->scene_idx];
 
-   if (setup->scene->fence) {
+   if (scene->fence) {
       if (LP_DEBUG & DEBUG_SETUP)
          debug_printf("%s: wait for scene %d\n",
-                      __FUNCTION__, setup->scene->fence->id);
+                      __FUNCTION__, scene->fence->id);
 
-      lp_fence_wait(setup->scene->fence);
+      lp_fence_wait(scene->fence);
+      lp_scene_reset(scene);
    }
 
-   lp_scene_begin_binning(setup->scene, &setup->fb);
+   setup->scene = scene;
 
+   return lp_scene_begin_binning(setup->scene, &setup->fb);
 }
 
 
@@ -153,6 +187,17 @@ lp_setup_rasterize_scene( struct lp_setup_context *setup )
 {
    struct lp_scene *scene = setup->scene;
    struct llvmpipe_screen *screen = llvmpipe_screen(scene->pipe->screen);
+   struct llvmpipe_context *lp = llvmpipe_context(setup->pipe);
+
+   lp->profile_counters.scenes++;
+   if (lp->trace) {
+      struct lp_profile_event *event =
+         lp_profile_event(screen->profile, lp->trace,
+                          LP_PROFILE_SCENE, LP_PROFILE_TID_CONTEXT);
+      event->start = scene->bin_start;
+      event->duration = os_time_get_nano() - scene->bin_start;
+      event->args[0] = lp->profile_counters.triangles - scene->bin_triangles;
+   }
 
    scene->num_active_queries = setup->active_binned_queries;
    memcpy(scene->active_queries, setup->active_queries,
@@ -165,43 +210,53 @@ lp_setup_rasterize_scene( struct lp_setup_context *setup )
    if (setup->last_fence)
       setup->last_fence->issued = TRUE;
 
-   mtx_lock(&screen->rast_mutex);
-
-   /* FIXME: We enqueue the scene then wait on the rasterizer to finish.
-    * This means we never actually run any vertex stuff in parallel to
-    * rasterization (not in the same context at least) which is what the
-    * multiple scenes per setup is about - when we get a new empty scene
-    * any old one is already empty again because we waited here for
-    * raster tasks to be finished. Ideally, we shouldn't need to wait here
-    * and rely on fences elsewhere when waiting is necessary.
-    * Certainly, lp_scene_end_rasterization() would need to be deferred too
-    * and there's probably other bits why this doesn't actually work.
+   /* Don't wait for the rasterizer: the scene's fence tells when it is
+    * done with the scene, see lp_setup_get_empty_scene(), and when the
+    * resources it uses are safe to access, see lp_setup_get_resource_fence().
     */
+   mtx_lock(&screen->rast_mutex);
    lp_rast_queue_scene(screen->rast, scene);
-   lp_rast_finish(screen->rast);
+   lp_fence_reference(&screen->last_fence, scene->fence);
    mtx_unlock(&screen->rast_mutex);
 
-   lp_scene_end_rasterization(setup->scene);
    lp_setup_reset( setup );
 
    LP_DBG(DEBUG_SETUP, "%s done \n", __FUNCTION__);
 }
 
 
+/**
+ * Note a depth clear in the scene.  The per-tile depth bounds stay void
+ * while a variant which can raise the depth is bound, as they are only
+ * voided again by try_update_scene_state() when the state changes.
+ */
+static void
+setup_hiz_clear(struct lp_setup_context *setup, float depth)
+{
+   lp_scene_hiz_clear(setup->scene, depth);
+
+   if (setup->fs.current.variant &&
+       setup->fs.current.variant->hiz_clobber)
+      setup->scene->hiz_valid = FALSE;
+}
+
 
 static boolean
 begin_binning( struct lp_setup_context *setup )
 {
    struct lp_scene *scene = setup->scene;
+   struct llvmpipe_context *lp = llvmpipe_context(setup->pipe);
    boolean need_zsload = FALSE;
    boolean ok;
+   unsigned i;
 
    assert(scene);
    assert(scene->fence == NULL);
 
-   /* Always create a fence:
+   /* Always create a fence.  It is signalled once, by lp_rast_end(), when
+    * all the threads are done with the scene.
     */
-   scene->fence = lp_fence_create(MAX2(1, setup->num_threads));
+   scene->fence = lp_fence_create(1);
    if (!scene->fence)
       return FALSE;
 
@@ -254,6 +309,10 @@ begin_binning( struct lp_setup_context *setup )
          if (!ok)
             return FALSE;
       }
+
+      if ((setup->clear.flags & PIPE_CLEAR_DEPTH) &&
+          util_format_has_depth(util_format_description(setup->fb.zsbuf->format)))
+         setup_hiz_clear(setup, setup->clear.depth);
    }
 
    setup->clear.flags = 0;
@@ -262,6 +321,14 @@ begin_binning( struct lp_setup_context *setup )
 
    scene->had_queries = !!setup->active_binned_queries;
 
+   scene->time_bins = lp->trace != NULL;
+   for (i = 0; i < setup->active_binned_queries; i++) {
+      if (setup->active_queries[i]->type == LP_QUERY_RAST_TIME)
+         scene->time_bins = TRUE;
+   }
+   scene->bin_start = os_time_get_nano();
+   scene->bin_triangles = lp->profile_counters.triangles;
+
    LP_DBG(DEBUG_SETUP, "%s done\n", __FUNCTION__);
    return TRUE;
 }
@@ -311,8 +378,10 @@ set_scene_state( struct lp_setup_context *setup,
 
    /* wait for a free/empty scene
     */
-   if (old_state == SETUP_FLUSHED) 
-      lp_setup_get_empty_scene(setup);
+   if (old_state == SETUP_FLUSHED) {
+      if (!lp_setup_get_empty_scene(setup))
+         goto fail;
+   }
 
    switch (new_state) {
    case SETUP_CLEARED:
@@ -342,7 +411,8 @@ set_scene_state( struct lp_setup_context *setup,
 
 fail:
    if (setup->scene) {
-      lp_scene_end_rasterization(setup->scene);
+      lp_fence_reference(&setup->scene->fence, NULL);
+      lp_scene_reset(setup->scene);
       setup->scene = NULL;
    }
 
@@ -516,6 +586,10 @@ lp_setup_try_clear_zs(struct lp_setup_context *setup,
                                    LP_RAST_OP_CLEAR_ZSTENCIL,
                                    lp_rast_arg_clearzs(zsvalue, zsmask)))
          return FALSE;
+
+      if ((flags & PIPE_CLEAR_DEPTH) &&
+          util_format_has_depth(util_format_description(format)))
+         setup_hiz_clear(setup, depth);
    }
    else {
       /* Put ourselves into the 'pre-clear' state, specifically to try
@@ -530,6 +604,8 @@ lp_setup_try_clear_zs(struct lp_setup_context *setup,
       setup->clear.zsmask |= zsmask;
       setup->clear.zsvalue =
          (setup->clear.zsvalue & ~zsmask) | (zsvalue & zsmask);
+      if (flags & PIPE_CLEAR_DEPTH)
+         setup->clear.depth = depth;
    }
 
    return TRUE;
@@ -1057,9 +1133,9 @@ lp_setup_set_fragment_sampler_state(struct lp_setup_context *setup,
 
 
 /**
- * Is the given texture referenced by any scene?
- * Note: we have to check all scenes including any scenes currently
- * being rendered and the current scene being built.
+ * Is the given texture referenced by the current state or the scene being
+ * built, that is, by anything a flush would still have to submit?
+ * Scenes already flushed are covered by lp_setup_get_resource_fence().
  */
 unsigned
 lp_setup_is_resource_referenced( const struct lp_setup_context *setup,
@@ -1077,10 +1153,11 @@ lp_setup_is_resource_referenced( const struct lp_setup_context *setup,
    }
 
    /* check textures referenced by the scene */
-   for (i = 0; i < ARRAY_SIZE(setup->scenes); i++) {
-      if (lp_scene_is_resource_referenced(setup->scenes[i], texture)) {
-         return LP_REFERENCED_FOR_READ;
-      }
+   if (setup->scene) {
+      unsigned referenced = lp_scene_is_resource_referenced(setup->scene,
+                                                            texture);
+      if (referenced)
+         return referenced;
    }
 
    for (i = 0; i < ARRAY_SIZE(setup->ssbos); i++) {
@@ -1097,6 +1174,43 @@ lp_setup_is_resource_referenced( const struct lp_setup_context *setup,
 }
 
 
+/**
+ * Return the fence of the most recent flushed scene which the rasterizer
+ * may still be using the given resource for, or NULL.  Only scenes writing
+ * to the resource count, unless \p write is set.
+ *
+ * Scenes are rasterized in order, so waiting on this fence is enough
+ * before the CPU accesses the resource.  The fence is returned even if it
+ * looks signalled already, as it may still be being signalled, and only
+ * waiting on it syncs with the rasterizer through the fence mutex.
+ */
+struct lp_fence *
+lp_setup_get_resource_fence( const struct lp_setup_context *setup,
+                             const struct pipe_resource *texture,
+                             boolean write )
+{
+   unsigned i;
+
+   /* newest first */
+   for (i = 0; i < setup->num_scenes; i++) {
+      unsigned idx = (setup->scene_idx + setup->num_scenes - i) %
+                     setup->num_scenes;
+      struct lp_scene *scene = setup->scenes[idx];
+      unsigned referenced;
+
+      if (!scene || scene == setup->scene || !scene->fence)
+         continue;
+
+      referenced = lp_scene_is_resource_referenced(scene, texture);
+      if ((referenced & LP_REFERENCED_FOR_WRITE) ||
+          ((referenced & LP_REFERENCED_FOR_READ) && write))
+         return scene->fence;
+   }
+
+   return NULL;
+}
+
+
 /**
  * Called by vbuf code when we're about to draw something.
  *
@@ -1257,6 +1371,12 @@ try_update_scene_state( struct lp_setup_context *setup )
          setup->dirty |= LP_SETUP_NEW_FS;
       }
    }
+
+   if (setup->dirty & LP_SETUP_NEW_IMAGES) {
+      /* The jit images were updated when bound, just store them. */
+      setup->dirty |= LP_SETUP_NEW_FS;
+   }
+
    if (setup->dirty & LP_SETUP_NEW_FS) {
       if (!setup->fs.stored ||
           memcmp(setup->fs.stored,
@@ -1287,7 +1407,32 @@ try_update_scene_state( struct lp_setup_context *setup )
             if (setup->fs.current_tex[i]) {
                if (!lp_scene_add_resource_reference(scene,
                                                     setup->fs.current_tex[i],
-                                                    new_scene)) {
+                                                    new_scene, FALSE)) {
+                  assert(!new_scene);
+                  return FALSE;
+               }
+            }
+         }
+
+         /* The fragment shader may write to its buffers and images, and
+          * they must stay alive until the scene is rasterized.
+          */
+         for (i = 0; i < ARRAY_SIZE(setup->ssbos); i++) {
+            if (setup->ssbos[i].current.buffer) {
+               if (!lp_scene_add_resource_reference(scene,
+                                                    setup->ssbos[i].current.buffer,
+                                                    new_scene, TRUE)) {
+                  assert(!new_scene);
+                  return FALSE;
+               }
+            }
+         }
+
+         for (i = 0; i < ARRAY_SIZE(setup->images); i++) {
+            if (setup->images[i].current.resource) {
+               if (!lp_scene_add_resource_reference(scene,
+                                                    setup->images[i].current.resource,
+                                                    new_scene, TRUE)) {
                   assert(!new_scene);
                   return FALSE;
                }
@@ -1309,6 +1454,13 @@ try_update_scene_state( struct lp_setup_context *setup )
 
    setup->dirty = 0;
 
+   /* Drawing with a depth test that can raise the depth voids the per-tile
+    * bounds until the next depth clear.
+    */
+   if (setup->fs.current.variant &&
+       setup->fs.current.variant->hiz_clobber)
+      scene->hiz_valid = FALSE;
+
    assert(setup->fs.stored);
    return TRUE;
 }
@@ -1412,13 +1564,17 @@ lp_setup_destroy( struct lp_setup_context *setup )
       pipe_resource_reference(&setup->ssbos[i].current.buffer, NULL);
    }
 
-   /* free the scenes in the 'empty' queue */
+   /* free the scenes, once the rasterizer is done with them */
    for (i = 0; i < ARRAY_SIZE(setup->scenes); i++) {
       struct lp_scene *scene = setup->scenes[i];
 
+      if (!scene)
+         continue;
+
       if (scene->fence)
          lp_fence_wait(scene->fence);
 
+      lp_scene_reset(scene);
       lp_scene_destroy(scene);
    }
 
@@ -1439,7 +1595,6 @@ lp_setup_create( struct pipe_context *pipe,
 {
    struct llvmpipe_screen *screen = llvmpipe_screen(pipe->screen);
    struct lp_setup_context *setup;
-   unsigned i;
 
    setup = CALLOC_STRUCT(lp_setup_context);
    if (!setup) {
@@ -1462,12 +1617,17 @@ lp_setup_create( struct pipe_context *pipe,
    draw_set_rasterize_stage(draw, setup->vbuf);
    draw_set_render(draw, &setup->base);
 
-   /* create some empty scenes */
-   for (i = 0; i < MAX_SCENES; i++) {
-      setup->scenes[i] = lp_scene_create( pipe );
-      if (!setup->scenes[i]) {
-         goto no_scenes;
-      }
+   /* create the first scene, the others are created as the pipeline
+    * fills up
+    */
+   setup->num_scenes = debug_get_num_option("LP_NUM_SCENES",
+                                            DEFAULT_NUM_SCENES);
+   setup->num_scenes = CLAMP(setup->num_scenes, 1, MAX_SCENES);
+   setup->scene_idx = setup->num_scenes - 1;
+
+   setup->scenes[0] = lp_scene_create( pipe );
+   if (!setup->scenes[0]) {
+      goto no_scenes;
    }
 
    setup->triangle = first_triangle;
@@ -1483,12 +1643,6 @@ lp_setup_create( struct pipe_context *pipe,
    return setup;
 
 no_scenes:
-   for (i = 0; i < MAX_SCENES; i++) {
-      if (setup->scenes[i]) {
-         lp_scene_destroy(setup->scenes[i]);
-      }
-   }
-
    setup->vbuf->destroy(setup->vbuf);
 no_vbuf:
    FREE(setup);
@@ -1510,7 +1664,9 @@ lp_setup_begin_query(struct lp_setup_context *setup,
    if (!(pq->type == PIPE_QUERY_OCCLUSION_COUNTER ||
          pq->type == PIPE_QUERY_OCCLUSION_PREDICATE ||
          pq->type == PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE ||
-         pq->type == PIPE_QUERY_PIPELINE_STATISTICS))
+         pq->type == PIPE_QUERY_PIPELINE_STATISTICS ||
+         pq->type == LP_QUERY_RAST_TIME ||
+         pq->type == LP_QUERY_FRAGMENTS))
       return;
 
    /* init the query to its beginning state */
@@ -1539,6 +1695,8 @@ lp_setup_begin_query(struct lp_setup_context *setup,
          }
       }
       setup->scene->had_queries |= TRUE;
+      if (pq->type == LP_QUERY_RAST_TIME)
+         setup->scene->time_bins = TRUE;
    }
 }
 
@@ -1562,6 +1720,8 @@ lp_setup_end_query(struct lp_setup_context *setup, struct llvmpipe_query *pq)
           pq->type == PIPE_QUERY_OCCLUSION_PREDICATE ||
           pq->type == PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE ||
           pq->type == PIPE_QUERY_PIPELINE_STATISTICS ||
+          pq->type == LP_QUERY_RAST_TIME ||
+          pq->type == LP_QUERY_FRAGMENTS ||
           pq->type == PIPE_QUERY_TIMESTAMP) {
          if (pq->type == PIPE_QUERY_TIMESTAMP &&
                !(setup->scene->tiles_x | setup->scene->tiles_y)) {
@@ -1598,7 +1758,9 @@ fail:
    if (pq->type == PIPE_QUERY_OCCLUSION_COUNTER ||
       pq->type == PIPE_QUERY_OCCLUSION_PREDICATE ||
       pq->type == PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE ||
-      pq->type == PIPE_QUERY_PIPELINE_STATISTICS) {
+      pq->type == PIPE_QUERY_PIPELINE_STATISTICS ||
+      pq->type == LP_QUERY_RAST_TIME ||
+      pq->type == LP_QUERY_FRAGMENTS) {
       unsigned i;
 
       /* remove from active binned query list */
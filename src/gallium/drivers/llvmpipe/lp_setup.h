@@ -44,6 +44,7 @@ struct lp_fragment_shader_variant;
 struct lp_jit_context;
 struct llvmpipe_query;
 struct pipe_fence_handle;
+struct lp_fence;
 struct lp_setup_variant;
 struct lp_setup_context;
 
@@ -149,6 +150,11 @@ unsigned
 lp_setup_is_resource_referenced( const struct lp_setup_context *setup,
                                 const struct pipe_resource *texture );
 
+struct lp_fence *
+lp_setup_get_resource_fence( const struct lp_setup_context *setup,
+                             const struct pipe_resource *texture,
+                             boolean write );
+
 void
 lp_setup_set_flatshade_first( struct lp_setup_context *setup, 
                               boolean flatshade_first );
@@ -55,9 +55,11 @@
 struct lp_setup_variant;
 
 
-/** Max number of scenes */
-/* XXX: make multiple scenes per context work, see lp_setup_rasterize_scene */
-#define MAX_SCENES 1
+/** Max number of scenes in flight per context, see LP_NUM_SCENES */
+#define MAX_SCENES 64
+
+/** Default number of scenes in flight per context */
+#define DEFAULT_NUM_SCENES 4
 
 
 
@@ -88,8 +90,9 @@ struct lp_setup_context
     */
    struct draw_stage *vbuf;
    unsigned num_threads;
+   unsigned num_scenes;                  /**< depth of the scene pipeline */
    unsigned scene_idx;
-   struct lp_scene *scenes[MAX_SCENES];  /**< all the scenes */
+   struct lp_scene *scenes[MAX_SCENES];  /**< all the scenes, created lazily */
    struct lp_scene *scene;               /**< current scene being built */
 
    struct lp_fence *last_fence;
@@ -122,6 +125,7 @@ struct lp_setup_context
       union util_color color_val[PIPE_MAX_COLOR_BUFS];
       uint64_t zsmask;
       uint64_t zsvalue;               /**< lp_rast_clear_zstencil() cmd */
+      float depth;                    /**< for the hierarchical Z bounds */
    } clear;
 
    enum setup_state {
@@ -29,6 +29,7 @@
  * Binning code for triangles
  */
 
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "util/u_rect.h"
@@ -206,6 +207,122 @@ lp_rast_32_tri_tab[MAX_PLANES+1] = {
 
 
 
+/**
+ * Slack for the hierarchical Z tests, covering the rounding of depth values
+ * to the depth buffer format (Z16 at worst) and the shader interpolating
+ * depth in a different order than here.
+ */
+#define LP_HIZ_EPSILON (1.0f / 32768.0f)
+
+
+/**
+ * Range of the triangle's depth over a rect of pixels, widened by a pixel
+ * to include any sample position, and clamped to the viewport depth range
+ * the fragment depth ends up in.
+ */
+static void
+lp_setup_tri_depth_range(const struct lp_setup_context *setup,
+                         const struct lp_rast_triangle *tri,
+                         const struct u_rect *rect,
+                         float *zmin, float *zmax)
+{
+   const float (*a0)[4] = (const float (*)[4])GET_A0(&tri->inputs);
+   const float (*dadx)[4] = (const float (*)[4])GET_DADX(&tri->inputs);
+   const float (*dady)[4] = (const float (*)[4])GET_DADY(&tri->inputs);
+   const struct lp_jit_viewport *vp =
+      &setup->viewports[tri->inputs.viewport_index];
+   float zx0 = dadx[0][2] * (float)(rect->x0 - 1);
+   float zx1 = dadx[0][2] * (float)(rect->x1 + 2);
+   float zy0 = dady[0][2] * (float)(rect->y0 - 1);
+   float zy1 = dady[0][2] * (float)(rect->y1 + 2);
+
+   /* The position is in input slot zero */
+   *zmin = a0[0][2] + MIN2(zx0, zx1) + MIN2(zy0, zy1);
+   *zmax = a0[0][2] + MAX2(zx0, zx1) + MAX2(zy0, zy1);
+   *zmin = CLAMP(*zmin, vp->min_depth, vp->max_depth);
+   *zmax = CLAMP(*zmax, vp->min_depth, vp->max_depth);
+}
+
+
+/**
+ * Whether the triangle fails the depth test everywhere within \p rect of
+ * tile (tx, ty), going by the tile's depth bound.
+ */
+static inline boolean
+lp_setup_tile_occluded(struct lp_setup_context *setup,
+                       const struct lp_rast_triangle *tri,
+                       const struct u_rect *rect,
+                       int tx, int ty)
+{
+   struct u_rect tile_rect;
+   float zmin, zmax;
+
+   tile_rect.x0 = tx * TILE_SIZE;
+   tile_rect.y0 = ty * TILE_SIZE;
+   tile_rect.x1 = tile_rect.x0 + TILE_SIZE - 1;
+   tile_rect.y1 = tile_rect.y0 + TILE_SIZE - 1;
+   u_rect_find_intersection(rect, &tile_rect);
+
+   lp_setup_tri_depth_range(setup, tri, &tile_rect, &zmin, &zmax);
+
+   return zmin > lp_scene_get_bin(setup->scene, tx, ty)->zmax + LP_HIZ_EPSILON;
+}
+
+
+/**
+ * Whether the triangle fails the depth test in every tile it touches, in
+ * which case there is no need to bin it at all.
+ */
+static boolean
+lp_setup_tri_occluded(struct lp_setup_context *setup,
+                      const struct lp_rast_triangle *tri,
+                      const struct u_rect *bbox)
+{
+   struct lp_scene *scene = setup->scene;
+   struct u_rect rect = *bbox;
+   float zmin, zmax;
+   int x, y;
+
+   u_rect_find_intersection(&setup->draw_regions[tri->inputs.viewport_index],
+                            &rect);
+
+   lp_setup_tri_depth_range(setup, tri, &rect, &zmin, &zmax);
+
+   for (y = rect.y0 / TILE_SIZE; y <= rect.y1 / TILE_SIZE; y++) {
+      for (x = rect.x0 / TILE_SIZE; x <= rect.x1 / TILE_SIZE; x++) {
+         if (zmin <= lp_scene_get_bin(scene, x, y)->zmax + LP_HIZ_EPSILON)
+            return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+
+/**
+ * The triangle covers tile (tx, ty) and writes the depth of all of it, so
+ * the tile depth can't be above the triangle's after this.
+ */
+static inline void
+lp_setup_tile_bound_depth(struct lp_setup_context *setup,
+                          const struct lp_rast_triangle *tri,
+                          int tx, int ty)
+{
+   struct cmd_bin *bin = lp_scene_get_bin(setup->scene, tx, ty);
+   struct u_rect tile_rect;
+   float zmin, zmax;
+
+   tile_rect.x0 = tx * TILE_SIZE;
+   tile_rect.y0 = ty * TILE_SIZE;
+   tile_rect.x1 = tile_rect.x0 + TILE_SIZE - 1;
+   tile_rect.y1 = tile_rect.y0 + TILE_SIZE - 1;
+
+   lp_setup_tri_depth_range(setup, tri, &tile_rect, &zmin, &zmax);
+
+   bin->zmax = MIN2(bin->zmax, zmax);
+}
+
+
 /**
  * The primitive covers the whole tile- shade whole tile.
  *
@@ -269,6 +386,7 @@ do_triangle_ccw(struct lp_setup_context *setup,
                 const float (*v2)[4],
                 boolean frontfacing )
 {
+   struct llvmpipe_context *lp_context = (struct llvmpipe_context *)setup->pipe;
    struct lp_scene *scene = setup->scene;
    const struct lp_setup_variant_key *key = &setup->setup.variant->key;
    struct lp_rast_triangle *tri;
@@ -373,6 +491,10 @@ do_triangle_ccw(struct lp_setup_context *setup,
 
    LP_COUNT(nr_tris);
 
+   lp_context->profile_counters.triangles++;
+   if (lp_context->trace)
+      p_atomic_inc(&setup->fs.current.variant->nr_tris);
+
    /* Setup parameter interpolants:
     */
    setup->setup.variant->jit_function(v0, v1, v2,
@@ -387,6 +509,18 @@ do_triangle_ccw(struct lp_setup_context *setup,
    tri->inputs.layer = layer;
    tri->inputs.viewport_index = viewport_index;
 
+   /* Hierarchical Z: drop triangles hidden behind the depth of every tile
+    * they touch.
+    */
+   if (scene->hiz_valid && setup->fs.current.variant->hiz_test) {
+      LP_COUNT(nr_hiz_tested_tris);
+      if (lp_setup_tri_occluded(setup, tri, &bbox)) {
+         LP_COUNT(nr_hiz_culled_tris);
+         lp_scene_putback_data(scene, tri_bytes);
+         return TRUE;
+      }
+   }
+
    if (0)
       lp_dump_setup_coef(&setup->setup.variant->key,
                          (const float (*)[4])GET_A0(&tri->inputs),
@@ -879,6 +1013,16 @@ lp_setup_bin_triangle(struct lp_setup_context *setup,
       int iy0 = trimmed_box.y0 / TILE_SIZE;
       int ix1 = trimmed_box.x1 / TILE_SIZE;
       int iy1 = trimmed_box.y1 / TILE_SIZE;
+
+      /* Hierarchical Z: skip the tiles where the triangle is hidden, and
+       * lower the depth bound of those it covers.  Bounds are per tile, not
+       * per layer, so only layered rendering can't lower them.
+       */
+      const struct lp_fragment_shader_variant *variant =
+         setup->fs.current.variant;
+      boolean hiz_test = scene->hiz_valid && variant->hiz_test;
+      boolean hiz_bound = hiz_test && variant->hiz_bound &&
+                          scene->fb_max_layer == 0;
       
       for (i = 0; i < nr_planes; i++) {
          c[i] = (plane[i].c + 
@@ -927,6 +1071,12 @@ lp_setup_bin_triangle(struct lp_setup_context *setup,
                   break;  /* exiting triangle, all done with this row */
                LP_COUNT(nr_empty_64);
             }
+            else if (hiz_test &&
+                     lp_setup_tile_occluded(setup, tri, &trimmed_box, x, y)) {
+               /* hidden, nothing to rasterize */
+               in = TRUE;
+               LP_COUNT(nr_hiz_culled_64);
+            }
             else if (partial) {
                /* Not trivially accepted by at least one plane -
                 * rasterize/shade partial tile
@@ -950,6 +1100,8 @@ lp_setup_bin_triangle(struct lp_setup_context *setup,
                in = TRUE;
                if (!lp_setup_whole_tile(setup, &tri->inputs, x, y))
                   goto fail;
+               if (hiz_bound)
+                  lp_setup_tile_bound_depth(setup, tri, x, y);
             }
 
             /* Iterate cx values across the region: */
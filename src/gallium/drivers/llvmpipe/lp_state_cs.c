@@ -27,6 +27,7 @@
 #include "util/os_time.h"
 #include "util/u_dump.h"
 #include "util/u_string.h"
+#include "util/mesa-sha1.h"
 #include "tgsi/tgsi_dump.h"
 #include "tgsi/tgsi_parse.h"
 #include "gallivm/lp_bld_const.h"
@@ -34,11 +35,13 @@
 #include "gallivm/lp_bld_intr.h"
 #include "gallivm/lp_bld_flow.h"
 #include "gallivm/lp_bld_gather.h"
+#include "gallivm/lp_bld_init.h"
 #include "gallivm/lp_bld_coro.h"
 #include "gallivm/lp_bld_nir.h"
 #include "lp_state_cs.h"
 #include "lp_context.h"
 #include "lp_debug.h"
+#include "lp_flush.h"
 #include "lp_state.h"
 #include "lp_perf.h"
 #include "lp_screen.h"
@@ -92,11 +95,12 @@ generate_compute(struct llvmpipe_context *lp,
    cs_type.norm = FALSE;         /* values are not limited to [0,1] or [-1,1] */
    cs_type.width = 32;           /* 32-bit float */
    cs_type.length = MIN2(lp_native_vector_width / 32, 16); /* n*4 elements per vector */
-   snprintf(func_name, sizeof(func_name), "cs%u_variant%u",
-            shader->no, variant->no);
+   /* The names must not depend on the creation order, as cached objects are
+    * looked up by them.
+    */
+   snprintf(func_name, sizeof(func_name), "cs_variant");
 
-   snprintf(func_name_coro, sizeof(func_name), "cs_co_%u_variant%u",
-            shader->no, variant->no);
+   snprintf(func_name_coro, sizeof(func_name), "cs_co_variant");
 
    arg_types[0] = variant->jit_cs_context_ptr_type;       /* context */
    arg_types[1] = int32_type;                          /* block_x_size */
@@ -448,6 +452,12 @@ llvmpipe_create_compute_state(struct pipe_context *pipe,
       nir_tgsi_scan_shader(shader->base.ir.nir, &shader->info.base, false);
    }
 
+   if (llvmpipe_screen(pipe->screen)->disk_shader_cache) {
+      shader->has_ir_sha1 = gallivm_hash_shader_ir(&shader->base,
+                                                   &shader->info.base,
+                                                   shader->ir_sha1);
+   }
+
    shader->req_local_mem = templ->req_local_mem;
    make_empty_list(&shader->variants);
 
@@ -497,7 +507,7 @@ llvmpipe_remove_cs_shader_variant(struct llvmpipe_context *lp,
    /* remove from context's list */
    remove_from_list(&variant->list_item_global);
    lp->nr_fs_variants--;
-   lp->nr_fs_instrs -= variant->nr_instrs;
+   lp->nr_cs_instrs -= variant->nr_instrs;
 
    FREE(variant);
 }
@@ -657,13 +667,30 @@ lp_debug_cs_variant(const struct lp_compute_shader_variant *variant)
    debug_printf("\n");
 }
 
+static void
+lp_cs_get_ir_cache_key(struct lp_compute_shader_variant *variant,
+                       unsigned char ir_sha1_cache_key[20])
+{
+   struct lp_compute_shader *shader = variant->shader;
+   struct mesa_sha1 ctx;
+
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, &variant->key, shader->variant_key_size);
+   _mesa_sha1_update(&ctx, shader->ir_sha1, sizeof shader->ir_sha1);
+   _mesa_sha1_final(&ctx, ir_sha1_cache_key);
+}
+
 static struct lp_compute_shader_variant *
 generate_variant(struct llvmpipe_context *lp,
                  struct lp_compute_shader *shader,
                  const struct lp_compute_shader_variant_key *key)
 {
+   struct llvmpipe_screen *screen = llvmpipe_screen(lp->pipe.screen);
    struct lp_compute_shader_variant *variant;
    char module_name[64];
+   unsigned char ir_sha1_cache_key[20];
+   struct lp_cached_code cached = { 0 };
+   bool needs_caching = false;
 
    variant = CALLOC_STRUCT(lp_compute_shader_variant);
    if (!variant)
@@ -672,19 +699,26 @@ generate_variant(struct llvmpipe_context *lp,
    snprintf(module_name, sizeof(module_name), "cs%u_variant%u",
             shader->no, shader->variants_created);
 
-   variant->gallivm = gallivm_create(module_name, lp->context);
+   variant->shader = shader;
+   memcpy(&variant->key, key, shader->variant_key_size);
+
+   if (shader->has_ir_sha1) {
+      lp_cs_get_ir_cache_key(variant, ir_sha1_cache_key);
+      lp_disk_cache_find_shader(screen, &cached, ir_sha1_cache_key);
+      needs_caching = !cached.data_size;
+   }
+
+   variant->gallivm = gallivm_create(module_name, lp->context, &cached);
    if (!variant->gallivm) {
+      free(cached.data);
       FREE(variant);
       return NULL;
    }
 
-   variant->shader = shader;
    variant->list_item_global.base = variant;
    variant->list_item_local.base = variant;
    variant->no = shader->variants_created++;
 
-   memcpy(&variant->key, key, shader->variant_key_size);
-
    if ((LP_DEBUG & DEBUG_CS) || (gallivm_debug & GALLIVM_DEBUG_IR)) {
       lp_debug_cs_variant(variant);
    }
@@ -699,7 +733,11 @@ generate_variant(struct llvmpipe_context *lp,
 
    variant->jit_function = (lp_jit_cs_func)gallivm_jit_function(variant->gallivm, variant->function);
 
+   if (needs_caching)
+      lp_disk_cache_insert_shader(screen, &cached, ir_sha1_cache_key);
+
    gallivm_free_ir(variant->gallivm);
+   free(cached.data);
    return variant;
 }
 
@@ -1247,6 +1285,9 @@ static void llvmpipe_launch_grid(struct pipe_context *pipe,
 
    llvmpipe_cs_update_derived(llvmpipe, info->input);
 
+   /* Compute runs now, while earlier scenes may not be done. */
+   llvmpipe_wait_shader_resources(pipe, PIPE_SHADER_COMPUTE);
+
    fill_grid_size(pipe, info, job_info.grid_size);
 
    job_info.block_size[0] = info->block[0];
@@ -1259,11 +1300,9 @@ static void llvmpipe_launch_grid(struct pipe_context *pipe,
    int num_tasks = job_info.grid_size[2] * job_info.grid_size[1] * job_info.grid_size[0];
    if (num_tasks) {
       struct lp_cs_tpool_task *task;
-      mtx_lock(&screen->cs_mutex);
       task = lp_cs_tpool_queue_task(screen->cs_tpool, cs_exec_fn, &job_info, num_tasks);
 
       lp_cs_tpool_wait_for_task(screen->cs_tpool, &task);
-      mtx_unlock(&screen->cs_mutex);
    }
    llvmpipe->pipeline_statistics.cs_invocations += num_tasks * info->block[0] * info->block[1] * info->block[2];
 }
@@ -82,6 +82,10 @@ struct lp_compute_shader {
 
    struct lp_tgsi_info info;
 
+   /* Hash of the IR for the disk cache, see gallivm_hash_shader_ir() */
+   unsigned char ir_sha1[20];
+   boolean has_ir_sha1;
+
    uint32_t req_local_mem;
 
    /* For debugging/profiling purposes */
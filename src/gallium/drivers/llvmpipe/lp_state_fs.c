@@ -59,6 +59,7 @@
 
 #include <limits.h>
 #include "pipe/p_defines.h"
+#include "util/u_atomic.h"
 #include "util/u_inlines.h"
 #include "util/u_memory.h"
 #include "util/u_pointer.h"
@@ -68,6 +69,7 @@
 #include "util/simple_list.h"
 #include "util/u_dual_blend.h"
 #include "util/os_time.h"
+#include "util/mesa-sha1.h"
 #include "pipe/p_shader_tokens.h"
 #include "draw/draw_context.h"
 #include "tgsi/tgsi_dump.h"
@@ -97,12 +99,14 @@
 #include "lp_context.h"
 #include "lp_debug.h"
 #include "lp_perf.h"
+#include "lp_profile.h"
 #include "lp_setup.h"
 #include "lp_state.h"
 #include "lp_tex_sample.h"
 #include "lp_flush.h"
 #include "lp_state_fs.h"
 #include "lp_rast.h"
+#include "lp_screen.h"
 #include "nir/nir_to_tgsi_info.h"
 
 /** Fragment shader number (for debugging) */
@@ -1851,7 +1855,8 @@ generate_unswizzled_blend(struct gallivm_state *gallivm,
    undef_src_val = lp_build_undef(gallivm, fs_type);
 
    row_type.length = fs_type.length;
-   vector_width    = dst_type.floating ? lp_native_vector_width : lp_integer_vector_width;
+   vector_width    = dst_type.floating ? MIN2(lp_native_vector_width, 256) :
+                                         lp_integer_vector_width;
 
    /* Compute correct swizzle and count channels */
    memset(swizzle, LP_BLD_SWIZZLE_DONTCARE, TGSI_NUM_CHANNELS);
@@ -2429,8 +2434,7 @@ generate_unswizzled_blend(struct gallivm_state *gallivm,
  * 2x2 pixels.
  */
 static void
-generate_fragment(struct llvmpipe_context *lp,
-                  struct lp_fragment_shader *shader,
+generate_fragment(struct lp_fragment_shader *shader,
                   struct lp_fragment_shader_variant *variant,
                   unsigned partial_mask)
 {
@@ -2519,8 +2523,11 @@ generate_fragment(struct llvmpipe_context *lp,
 
    blend_vec_type = lp_build_vec_type(gallivm, blend_type);
 
-   snprintf(func_name, sizeof(func_name), "fs%u_variant%u_%s",
-            shader->no, variant->no, partial_mask ? "partial" : "whole");
+   /* The name must not depend on the creation order, as cached objects are
+    * looked up by it.
+    */
+   snprintf(func_name, sizeof(func_name), "fs_variant_%s",
+            partial_mask ? "partial" : "whole");
 
    arg_types[0] = variant->jit_context_ptr_type;       /* context */
    arg_types[1] = int32_type;                          /* x */
@@ -2612,7 +2619,7 @@ generate_fragment(struct llvmpipe_context *lp,
 
    num_fs = 16 / fs_type.length; /* number of loops per 4x4 stamp */
    /* for 1d resources only run "upper half" of stamp */
-   if (key->resource_1d)
+   if (key->resource_1d && num_fs > 1)
       num_fs /= 2;
 
    {
@@ -2699,6 +2706,40 @@ generate_fragment(struct llvmpipe_context *lp,
 
    sampler->destroy(sampler);
    image->destroy(image);
+
+   /*
+    * Blending doesn't go beyond 8 wide, so with 16 wide shading hand the
+    * stamp over as two 8 wide halves (rows 0-1 and 2-3).
+    */
+   if (fs_type.length == 16) {
+      struct lp_type half_type = fs_type;
+      LLVMTypeRef half_ptr_type;
+      LLVMValueRef mask = fs_mask[0];
+
+      half_type.length = 8;
+      half_ptr_type = LLVMPointerType(lp_build_vec_type(gallivm, half_type), 0);
+      num_fs = key->resource_1d ? 1 : 2;
+
+      for (i = 0; i < num_fs; i++) {
+         fs_mask[i] = lp_build_extract_range(gallivm, mask, i * 8, 8);
+      }
+
+      for (cbuf = 0; cbuf < MAX2(key->nr_cbufs, dual_source_blend ? 2 : 0);
+           cbuf++) {
+         for (chan = 0; chan < TGSI_NUM_CHANNELS; ++chan) {
+            LLVMValueRef ptr = LLVMBuildBitCast(builder,
+                                                fs_out_color[cbuf][chan][0],
+                                                half_ptr_type, "");
+            for (i = 0; i < num_fs; i++) {
+               LLVMValueRef indexi = lp_build_const_int32(gallivm, i);
+               fs_out_color[cbuf][chan][i] =
+                  LLVMBuildGEP(builder, ptr, &indexi, 1, "");
+            }
+         }
+      }
+      fs_type = half_type;
+   }
+
    /* Loop over color outputs / color buffers to do blending.
     */
    for(cbuf = 0; cbuf < key->nr_cbufs; cbuf++) {
@@ -2856,44 +2897,203 @@ lp_debug_fs_variant(struct lp_fragment_shader_variant *variant)
       nir_print_shader(variant->shader->base.ir.nir, stderr);
    dump_fs_variant_key(&variant->key);
    debug_printf("variant->opaque = %u\n", variant->opaque);
+   debug_printf("variant->hiz_test = %u\n", variant->hiz_test);
    debug_printf("\n");
 }
 
 
 /**
- * Generate a new fragment shader variant from the shader code and
- * other state indicated by the key.
+ * Hash the shader IR and the variant key, which together determine the
+ * code generated for the variant.
+ */
+static void
+lp_fs_get_ir_cache_key(struct lp_fragment_shader_variant *variant,
+                       unsigned char ir_sha1_cache_key[20])
+{
+   struct lp_fragment_shader *shader = variant->shader;
+   struct mesa_sha1 ctx;
+
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, &variant->key, shader->variant_key_size);
+   _mesa_sha1_update(&ctx, shader->ir_sha1, sizeof shader->ir_sha1);
+   _mesa_sha1_final(&ctx, ir_sha1_cache_key);
+}
+
+
+/**
+ * Allocate a new fragment shader variant for the state indicated by the
+ * key.  The code is generated by compile_variant().
  */
 static struct lp_fragment_shader_variant *
-generate_variant(struct llvmpipe_context *lp,
-                 struct lp_fragment_shader *shader,
-                 const struct lp_fragment_shader_variant_key *key)
+create_variant(struct lp_fragment_shader *shader,
+               const struct lp_fragment_shader_variant_key *key)
 {
    struct lp_fragment_shader_variant *variant;
-   const struct util_format_description *cbuf0_format_desc = NULL;
-   boolean fullcolormask;
-   char module_name[64];
 
    variant = MALLOC(sizeof *variant + shader->variant_key_size - sizeof variant->key);
    if (!variant)
       return NULL;
 
    memset(variant, 0, sizeof(*variant));
-   snprintf(module_name, sizeof(module_name), "fs%u_variant%u",
-            shader->no, shader->variants_created);
-
-   variant->gallivm = gallivm_create(module_name, lp->context);
-   if (!variant->gallivm) {
-      FREE(variant);
-      return NULL;
-   }
 
    variant->shader = shader;
+   memcpy(&variant->key, key, shader->variant_key_size);
+
    variant->list_item_global.base = variant;
    variant->list_item_local.base = variant;
    variant->no = shader->variants_created++;
 
-   memcpy(&variant->key, key, shader->variant_key_size);
+   util_queue_fence_init(&variant->ready);
+   util_queue_fence_init(&variant->optimized);
+
+   return variant;
+}
+
+
+/**
+ * Generate and compile the code of a variant into a new gallivm state, and
+ * point jit_function at it.  The code is loaded from or stored in the disk
+ * cache, unless generated without optimizations.
+ *
+ * \return  the compile time in microseconds, or -1 on failure
+ */
+static int64_t
+compile_variant_code(struct lp_fragment_shader_variant *variant,
+                     boolean unoptimized, int thread_index)
+{
+   struct lp_fragment_shader *shader = variant->shader;
+   struct llvmpipe_screen *screen = shader->screen;
+   char module_name[64];
+   unsigned char ir_sha1_cache_key[20];
+   struct lp_cached_code cached = { 0 };
+   bool needs_caching = false;
+   lp_jit_frag_func jit_function[2];
+   LLVMContextRef context;
+   int64_t t0, compile_time;
+
+   t0 = os_time_get_nano();
+
+   snprintf(module_name, sizeof(module_name), "fs%u_variant%u",
+            shader->no, variant->no);
+
+   mtx_lock(&shader->compile_mutex);
+
+   if (shader->has_ir_sha1) {
+      lp_fs_get_ir_cache_key(variant, ir_sha1_cache_key);
+      lp_disk_cache_find_shader(screen, &cached, ir_sha1_cache_key);
+      /* Loading optimized code beats quickly generating worse code. */
+      if (cached.data_size)
+         unoptimized = FALSE;
+      needs_caching = !cached.data_size && !unoptimized;
+   }
+
+   /*
+    * LLVM contexts can't be shared between threads, so each variant gets
+    * its own, which is no longer needed once the IR is freed.
+    */
+   context = LLVMContextCreate();
+   if (!context) {
+      mtx_unlock(&shader->compile_mutex);
+      free(cached.data);
+      return -1;
+   }
+
+   if (unoptimized)
+      variant->gallivm = gallivm_create_unoptimized(module_name, context);
+   else
+      variant->gallivm = gallivm_create(module_name, context, &cached);
+   if (!variant->gallivm) {
+      mtx_unlock(&shader->compile_mutex);
+      LLVMContextDispose(context);
+      free(cached.data);
+      return -1;
+   }
+
+   lp_jit_init_types(variant);
+
+   variant->function[RAST_EDGE_TEST] = NULL;
+   variant->function[RAST_WHOLE] = NULL;
+
+   generate_fragment(shader, variant, RAST_EDGE_TEST);
+
+   if (variant->opaque) {
+      /* Specialized shader, which doesn't need to read the color buffer. */
+      generate_fragment(shader, variant, RAST_WHOLE);
+   }
+
+   mtx_unlock(&shader->compile_mutex);
+
+   /*
+    * Compile everything
+    */
+
+   gallivm_compile_module(variant->gallivm);
+
+   /* The context is charged for the first code only. */
+   if (!variant->jit_function[RAST_EDGE_TEST]) {
+      variant->nr_instrs += lp_build_count_ir_module(variant->gallivm->module);
+      variant->unoptimized = unoptimized;
+   }
+
+   jit_function[RAST_EDGE_TEST] = (lp_jit_frag_func)
+         gallivm_jit_function(variant->gallivm,
+                              variant->function[RAST_EDGE_TEST]);
+
+   if (variant->function[RAST_WHOLE]) {
+      jit_function[RAST_WHOLE] = (lp_jit_frag_func)
+            gallivm_jit_function(variant->gallivm,
+                                 variant->function[RAST_WHOLE]);
+   } else {
+      jit_function[RAST_WHOLE] = jit_function[RAST_EDGE_TEST];
+   }
+
+   /* The rasterizer threads may be running the previous code. */
+   p_atomic_set(&variant->jit_function[RAST_WHOLE], jit_function[RAST_WHOLE]);
+   p_atomic_set(&variant->jit_function[RAST_EDGE_TEST],
+                jit_function[RAST_EDGE_TEST]);
+
+   if (needs_caching)
+      lp_disk_cache_insert_shader(screen, &cached, ir_sha1_cache_key);
+
+   gallivm_free_ir(variant->gallivm);
+   LLVMContextDispose(context);
+   free(cached.data);
+
+   compile_time = (os_time_get_nano() - t0) / 1000;
+
+   if (screen->profile) {
+      struct lp_profile_event event = { 0 };
+
+      event.type = LP_PROFILE_COMPILE;
+      event.tid = screen->num_compile_threads ?
+         LP_PROFILE_TID_COMPILE + thread_index : LP_PROFILE_TID_CONTEXT;
+      event.start = t0;
+      event.duration = compile_time * 1000;
+      event.args[0] = shader->no;
+      event.args[1] = variant->no;
+      event.args[2] = !unoptimized;
+      lp_profile_write(screen->profile, &event, 1);
+   }
+
+   return compile_time;
+}
+
+
+/**
+ * Generate the code of a fragment shader variant from the shader code and
+ * other state indicated by its key.  This only touches the variant and
+ * reads the shader, so it may run on the screen's compile queue.  On
+ * failure the variant is left without functions.
+ */
+static void
+compile_variant(void *data, int thread_index)
+{
+   struct lp_fragment_shader_variant *variant = data;
+   struct lp_fragment_shader *shader = variant->shader;
+   struct llvmpipe_screen *screen = shader->screen;
+   const struct lp_fragment_shader_variant_key *key = &variant->key;
+   const struct util_format_description *cbuf0_format_desc = NULL;
+   boolean fullcolormask;
 
    /*
     * Determine whether we are touching all channels in the color buffer.
@@ -2916,50 +3116,79 @@ generate_variant(struct llvmpipe_context *lp,
          !shader->info.base.writes_samplemask
       ? TRUE : FALSE;
 
-   if ((LP_DEBUG & DEBUG_FS) || (gallivm_debug & GALLIVM_DEBUG_IR)) {
-      lp_debug_fs_variant(variant);
-   }
-
-   lp_jit_init_types(variant);
-   
-   if (variant->jit_function[RAST_EDGE_TEST] == NULL)
-      generate_fragment(lp, shader, variant, RAST_EDGE_TEST);
-
-   if (variant->jit_function[RAST_WHOLE] == NULL) {
-      if (variant->opaque) {
-         /* Specialized shader, which doesn't need to read the color buffer. */
-         generate_fragment(lp, shader, variant, RAST_WHOLE);
-      }
-   }
-
    /*
-    * Compile everything
+    * Hierarchical Z only tracks an upper bound of the depth in each tile,
+    * so it works with LESS/LEQUAL depth tests.  Skipped fragments must not
+    * have any other effect, such as stencil or memory writes from a late
+    * depth tested shader.
     */
+   variant->hiz_test =
+         !(LP_PERF & PERF_NO_HIZ) &&
+         key->depth.enabled &&
+         (key->depth.func == PIPE_FUNC_LESS ||
+          key->depth.func == PIPE_FUNC_LEQUAL) &&
+         !key->stencil[0].enabled &&
+         !shader->info.base.writes_z &&
+         !shader->info.base.writes_stencil &&
+         (!shader->info.base.writes_memory ||
+          shader->info.base.properties[TGSI_PROPERTY_FS_EARLY_DEPTH_STENCIL])
+      ? TRUE : FALSE;
 
-   gallivm_compile_module(variant->gallivm);
+   variant->hiz_bound =
+         variant->hiz_test &&
+         key->depth.writemask &&
+         !key->alpha.enabled &&
+         !key->blend.alpha_to_coverage &&
+         !shader->info.base.uses_kill &&
+         !shader->info.base.writes_samplemask
+      ? TRUE : FALSE;
 
-   variant->nr_instrs += lp_build_count_ir_module(variant->gallivm->module);
+   variant->hiz_clobber =
+         key->depth.enabled &&
+         key->depth.writemask &&
+         key->depth.func != PIPE_FUNC_LESS &&
+         key->depth.func != PIPE_FUNC_LEQUAL &&
+         key->depth.func != PIPE_FUNC_EQUAL &&
+         key->depth.func != PIPE_FUNC_NEVER
+      ? TRUE : FALSE;
 
-   if (variant->function[RAST_EDGE_TEST]) {
-      variant->jit_function[RAST_EDGE_TEST] = (lp_jit_frag_func)
-            gallivm_jit_function(variant->gallivm,
-                                 variant->function[RAST_EDGE_TEST]);
+   if ((LP_DEBUG & DEBUG_FS) || (gallivm_debug & GALLIVM_DEBUG_IR)) {
+      lp_debug_fs_variant(variant);
    }
 
-   if (variant->function[RAST_WHOLE]) {
-         variant->jit_function[RAST_WHOLE] = (lp_jit_frag_func)
-               gallivm_jit_function(variant->gallivm,
-                                    variant->function[RAST_WHOLE]);
-   } else if (!variant->jit_function[RAST_WHOLE]) {
-      variant->jit_function[RAST_WHOLE] = variant->jit_function[RAST_EDGE_TEST];
-   }
+   variant->compile_time =
+      compile_variant_code(variant,
+                           (gallivm_perf & GALLIVM_PERF_TIERED) &&
+                           screen->num_compile_threads,
+                           thread_index);
+   if (variant->compile_time < 0)
+      variant->compile_time = 0;
+}
 
-   gallivm_free_ir(variant->gallivm);
 
-   return variant;
+/**
+ * Regenerate the code of a variant compiled without optimizations with
+ * them, on the screen's compile queue.
+ */
+static void
+optimize_variant(void *data, int thread_index)
+{
+   struct lp_fragment_shader_variant *variant = data;
+
+   variant->gallivm_unoptimized = variant->gallivm;
+   if (compile_variant_code(variant, FALSE, thread_index) < 0) {
+      /* Keep running the unoptimized code. */
+      variant->gallivm = variant->gallivm_unoptimized;
+      variant->gallivm_unoptimized = NULL;
+   }
 }
 
 
+static void
+llvmpipe_prepare_fs(struct llvmpipe_context *lp,
+                    struct lp_fragment_shader *shader);
+
+
 static void *
 llvmpipe_create_fs_state(struct pipe_context *pipe,
                          const struct pipe_shader_state *templ)
@@ -2976,7 +3205,9 @@ llvmpipe_create_fs_state(struct pipe_context *pipe,
       return NULL;
 
    shader->no = fs_no++;
+   shader->screen = llvmpipe_screen(pipe->screen);
    make_empty_list(&shader->variants);
+   (void) mtx_init(&shader->compile_mutex, mtx_plain);
 
    shader->base.type = templ->type;
    if (templ->type == PIPE_SHADER_IR_TGSI) {
@@ -2990,8 +3221,16 @@ llvmpipe_create_fs_state(struct pipe_context *pipe,
       nir_tgsi_scan_shader(templ->ir.nir, &shader->info.base, true);
    }
 
+   /* Before any variant is compiled, as that modifies the NIR. */
+   if (shader->screen->disk_shader_cache) {
+      shader->has_ir_sha1 = gallivm_hash_shader_ir(&shader->base,
+                                                   &shader->info.base,
+                                                   shader->ir_sha1);
+   }
+
    shader->draw_data = draw_create_fragment_shader(llvmpipe->draw, templ);
    if (shader->draw_data == NULL) {
+      mtx_destroy(&shader->compile_mutex);
       FREE((void *) shader->base.tokens);
       FREE(shader);
       return NULL;
@@ -3058,6 +3297,8 @@ llvmpipe_create_fs_state(struct pipe_context *pipe,
       debug_printf("\n");
    }
 
+   llvmpipe_prepare_fs(llvmpipe, shader);
+
    return shader;
 }
 
@@ -3087,6 +3328,8 @@ static void
 llvmpipe_remove_shader_variant(struct llvmpipe_context *lp,
                                struct lp_fragment_shader_variant *variant)
 {
+   struct llvmpipe_screen *screen = llvmpipe_screen(lp->pipe.screen);
+
    if ((LP_DEBUG & DEBUG_FS) || (gallivm_debug & GALLIVM_DEBUG_IR)) {
       debug_printf("llvmpipe: del fs #%u var %u v created %u v cached %u "
                    "v total cached %u inst %u total inst %u\n",
@@ -3096,7 +3339,42 @@ llvmpipe_remove_shader_variant(struct llvmpipe_context *lp,
                    lp->nr_fs_variants, variant->nr_instrs, lp->nr_fs_instrs);
    }
 
-   gallivm_destroy(variant->gallivm);
+   /* The variant may still be queued or compiling. */
+   if (screen->num_compile_threads) {
+      util_queue_drop_job(&screen->fs_compile_queue, &variant->ready);
+      util_queue_drop_job(&screen->fs_compile_queue, &variant->optimized);
+   }
+   util_queue_fence_destroy(&variant->ready);
+   util_queue_fence_destroy(&variant->optimized);
+
+   /* Eviction may happen outside of llvmpipe_update_fs(), e.g. when a new
+    * shader's variant is prepared, so make the next draw bind another one.
+    */
+   if (lp->fs_variant == variant) {
+      lp->fs_variant = NULL;
+      lp_setup_set_fs_variant(lp->setup, NULL);
+      lp->dirty |= LP_NEW_FS;
+   }
+
+   if (screen->profile && variant->uses) {
+      struct lp_profile_event event = { 0 };
+
+      event.type = LP_PROFILE_FS_VARIANT;
+      event.tid = LP_PROFILE_TID_CONTEXT;
+      event.start = os_time_get_nano();
+      event.duration = -1;
+      event.args[0] = variant->shader->no;
+      event.args[1] = variant->no;
+      event.args[2] = variant->nr_tris;
+      event.args[3] = variant->nr_fragments;
+      event.args[4] = variant->compile_time;
+      lp_profile_write(screen->profile, &event, 1);
+   }
+
+   if (variant->gallivm)
+      gallivm_destroy(variant->gallivm);
+   if (variant->gallivm_unoptimized)
+      gallivm_destroy(variant->gallivm_unoptimized);
 
    /* remove from shader's list */
    remove_from_list(&variant->list_item_local);
@@ -3105,7 +3383,8 @@ llvmpipe_remove_shader_variant(struct llvmpipe_context *lp,
    /* remove from context's list */
    remove_from_list(&variant->list_item_global);
    lp->nr_fs_variants--;
-   lp->nr_fs_instrs -= variant->nr_instrs;
+   if (variant->uses)
+      lp->nr_fs_instrs -= variant->nr_instrs;
 
    FREE(variant);
 }
@@ -3141,6 +3420,7 @@ llvmpipe_delete_fs_state(struct pipe_context *pipe, void *fs)
    if (shader->base.ir.nir)
       ralloc_free(shader->base.ir.nir);
    assert(shader->variants_cached == 0);
+   mtx_destroy(&shader->compile_mutex);
    FREE((void *) shader->base.tokens);
    FREE(shader);
 }
@@ -3298,7 +3578,10 @@ make_variant_key(struct llvmpipe_context *lp,
 
    key = (struct lp_fragment_shader_variant_key *)store;
 
-   memset(key, 0, offsetof(struct lp_fragment_shader_variant_key, samplers[1]));
+   /* Clear the whole key, so that unused sampler and image slots compare
+    * and hash equal.
+    */
+   memset(key, 0, shader->variant_key_size);
 
    if (lp->framebuffer.zsbuf) {
       enum pipe_format zsbuf_format = lp->framebuffer.zsbuf->format;
@@ -3500,6 +3783,147 @@ make_variant_key(struct llvmpipe_context *lp,
 
 
 
+/**
+ * Free variants of the context until there is room for a new one.
+ * Candidates come from the least recently bound end of the list, but
+ * those bound more than once go back to the head with their use count
+ * halved, so that variants drawn with every frame survive a burst of
+ * one-off ones.  The bound variant is spared the same way.
+ */
+static void
+evict_fs_variants(struct llvmpipe_context *lp)
+{
+   unsigned variants_to_cull;
+   unsigned spared = 0;
+   unsigned i;
+
+   /* First, check if we've exceeded the max number of shader variants.
+    * If so, free 6.25% of them.
+    */
+   variants_to_cull = lp->nr_fs_variants >= LP_MAX_SHADER_VARIANTS ? LP_MAX_SHADER_VARIANTS / 16 : 0;
+
+   if (!variants_to_cull &&
+       lp->nr_fs_instrs < LP_MAX_SHADER_INSTRUCTIONS)
+      return;
+
+   if (gallivm_debug & GALLIVM_DEBUG_PERF) {
+      debug_printf("Evicting FS: %u total variants,"
+                   "\t%u instrs,\t%u instrs/variant\n",
+                   lp->nr_fs_variants, lp->nr_fs_instrs,
+                   lp->nr_fs_instrs / lp->nr_fs_variants);
+   }
+
+   /*
+    * XXX: we need to flush the context until we have some sort of
+    * reference counting in fragment shaders as they may still be binned
+    * Flushing alone might not be sufficient we need to wait on it too.
+    */
+   llvmpipe_finish(&lp->pipe, __FUNCTION__);
+
+   /*
+    * We need to re-check lp->nr_fs_variants because an arbitrarliy large
+    * number of shader variants (potentially all of them) could be
+    * pending for destruction on flush.
+    */
+
+   i = 0;
+   while (i < variants_to_cull || lp->nr_fs_instrs >= LP_MAX_SHADER_INSTRUCTIONS) {
+      struct lp_fs_variant_list_item *item;
+      struct lp_fragment_shader_variant *variant;
+
+      if (is_empty_list(&lp->fs_variants_list)) {
+         break;
+      }
+      item = last_elem(&lp->fs_variants_list);
+      assert(item);
+      assert(item->base);
+      variant = item->base;
+
+      if ((variant->uses > 1 || variant == lp->fs_variant) &&
+          spared < lp->nr_fs_variants) {
+         /* Not below 1, as an unused variant gets accounted for again. */
+         variant->uses = MAX2(variant->uses / 2, 1);
+         move_to_head(&lp->fs_variants_list, item);
+         spared++;
+         continue;
+      }
+
+      LP_COUNT(nr_fs_variants_evicted);
+      if (!variant->uses)
+         LP_COUNT(nr_fs_variants_evicted_unused);
+
+      llvmpipe_remove_shader_variant(lp, variant);
+      i++;
+   }
+}
+
+
+/**
+ * Create a variant for the given key and start compiling it, on the
+ * screen's compile queue if it has one.
+ */
+static struct lp_fragment_shader_variant *
+add_fs_variant(struct llvmpipe_context *lp,
+               struct lp_fragment_shader *shader,
+               const struct lp_fragment_shader_variant_key *key)
+{
+   struct llvmpipe_screen *screen = llvmpipe_screen(lp->pipe.screen);
+   struct lp_fragment_shader_variant *variant;
+
+   if (LP_DEBUG & DEBUG_FS) {
+      debug_printf("%u variants,\t%u instrs,\t%u instrs/variant\n",
+                   lp->nr_fs_variants,
+                   lp->nr_fs_instrs,
+                   lp->nr_fs_variants ? lp->nr_fs_instrs / lp->nr_fs_variants : 0);
+   }
+
+   evict_fs_variants(lp);
+
+   variant = create_variant(shader, key);
+   if (!variant)
+      return NULL;
+
+   if (screen->num_compile_threads) {
+      util_queue_add_job(&screen->fs_compile_queue, variant, &variant->ready,
+                         compile_variant, NULL, 0);
+   }
+   else {
+      compile_variant(variant, 0);
+   }
+
+   /* Put the new variant into the list */
+   insert_at_head(&shader->variants, &variant->list_item_local);
+   insert_at_head(&lp->fs_variants_list, &variant->list_item_global);
+   lp->nr_fs_variants++;
+   shader->variants_cached++;
+
+   return variant;
+}
+
+
+/**
+ * Start compiling the variant the current state calls for, in the hope
+ * that it is ready by the time the shader is first drawn with.
+ */
+static void
+llvmpipe_prepare_fs(struct llvmpipe_context *lp,
+                    struct lp_fragment_shader *shader)
+{
+   struct llvmpipe_screen *screen = llvmpipe_screen(lp->pipe.screen);
+   struct lp_fragment_shader_variant_key *key;
+   char store[LP_FS_MAX_VARIANT_KEY_SIZE];
+
+   if (!screen->num_compile_threads ||
+       !lp->blend || !lp->depth_stencil || !lp->rasterizer)
+      return;
+
+   key = make_variant_key(lp, shader, store);
+
+   if (add_fs_variant(lp, shader, key))
+      LP_COUNT(nr_fs_variants_queued);
+}
+
+
 /**
  * Update fragment shader state.  This is called just prior to drawing
  * something when some fragment-related state has changed.
@@ -3533,84 +3957,68 @@ llvmpipe_update_fs(struct llvmpipe_context *lp)
    }
    else {
       /* variant not found, create it now */
-      int64_t t0, t1, dt;
-      unsigned i;
-      unsigned variants_to_cull;
+      variant = add_fs_variant(lp, shader, key);
+   }
 
-      if (LP_DEBUG & DEBUG_FS) {
-         debug_printf("%u variants,\t%u instrs,\t%u instrs/variant\n",
-                      lp->nr_fs_variants,
-                      lp->nr_fs_instrs,
-                      lp->nr_fs_variants ? lp->nr_fs_instrs / lp->nr_fs_variants : 0);
+   if (variant) {
+      /*
+       * There is no variant to fall back to, as they all bake in some of
+       * the state, so wait for the compile if it hasn't finished yet.
+       */
+      if (!util_queue_fence_is_signalled(&variant->ready)) {
+         int64_t t0 = os_time_get();
+         util_queue_fence_wait(&variant->ready);
+         LP_COUNT(nr_fs_variant_waits);
+         LP_COUNT_ADD(fs_variant_wait_time, os_time_get() - t0);
       }
 
-      /* First, check if we've exceeded the max number of shader variants.
-       * If so, free 6.25% of them (the least recently used ones).
-       */
-      variants_to_cull = lp->nr_fs_variants >= LP_MAX_SHADER_VARIANTS ? LP_MAX_SHADER_VARIANTS / 16 : 0;
-
-      if (variants_to_cull ||
-          lp->nr_fs_instrs >= LP_MAX_SHADER_INSTRUCTIONS) {
-         struct pipe_context *pipe = &lp->pipe;
-
-         if (gallivm_debug & GALLIVM_DEBUG_PERF) {
-            debug_printf("Evicting FS: %u fs variants,\t%u total variants,"
-                         "\t%u instrs,\t%u instrs/variant\n",
-                         shader->variants_cached,
-                         lp->nr_fs_variants, lp->nr_fs_instrs,
-                         lp->nr_fs_instrs / lp->nr_fs_variants);
+      if (!variant->uses) {
+         if (!variant->jit_function[RAST_EDGE_TEST]) {
+            llvmpipe_remove_shader_variant(lp, variant);
+            variant = NULL;
          }
-
-         /*
-          * XXX: we need to flush the context until we have some sort of
-          * reference counting in fragment shaders as they may still be binned
-          * Flushing alone might not be sufficient we need to wait on it too.
-          */
-         llvmpipe_finish(pipe, __FUNCTION__);
-
-         /*
-          * We need to re-check lp->nr_fs_variants because an arbitrarliy large
-          * number of shader variants (potentially all of them) could be
-          * pending for destruction on flush.
-          */
-
-         for (i = 0; i < variants_to_cull || lp->nr_fs_instrs >= LP_MAX_SHADER_INSTRUCTIONS; i++) {
-            struct lp_fs_variant_list_item *item;
-            if (is_empty_list(&lp->fs_variants_list)) {
-               break;
-            }
-            item = last_elem(&lp->fs_variants_list);
-            assert(item);
-            assert(item->base);
-            llvmpipe_remove_shader_variant(lp, item->base);
+         else {
+            LP_COUNT_ADD(llvm_compile_time, variant->compile_time);
+            LP_COUNT_ADD(nr_llvm_compiles, 2);  /* emit vs. omit in/out test */
+            lp->profile_counters.jit_time += variant->compile_time;
+            lp->nr_fs_instrs += variant->nr_instrs;
          }
       }
 
-      /*
-       * Generate the new variant.
-       */
-      t0 = os_time_get();
-      variant = generate_variant(lp, shader, key);
-      t1 = os_time_get();
-      dt = t1 - t0;
-      LP_COUNT_ADD(llvm_compile_time, dt);
-      LP_COUNT_ADD(nr_llvm_compiles, 2);  /* emit vs. omit in/out test */
-
-      /* Put the new variant into the list */
-      if (variant) {
-         insert_at_head(&shader->variants, &variant->list_item_local);
-         insert_at_head(&lp->fs_variants_list, &variant->list_item_global);
-         lp->nr_fs_variants++;
-         lp->nr_fs_instrs += variant->nr_instrs;
-         shader->variants_cached++;
-      }
+      if (variant)
+         variant->uses++;
    }
 
    /* Bind this variant */
+   lp->fs_variant = variant;
    lp_setup_set_fs_variant(lp->setup, variant);
 }
 
 
+/**
+ * Count a draw with the bound variant, and queue its recompile with
+ * optimizations once it has been drawn with LP_FS_HOT_DRAWS times.
+ */
+void
+llvmpipe_count_fs_draw(struct llvmpipe_context *lp)
+{
+   struct lp_fragment_shader_variant *variant = lp->fs_variant;
+   struct llvmpipe_screen *screen;
+
+   if (!variant || !variant->unoptimized ||
+       variant->draws >= LP_FS_HOT_DRAWS)
+      return;
+
+   if (++variant->draws < LP_FS_HOT_DRAWS)
+      return;
+
+   screen = llvmpipe_screen(lp->pipe.screen);
+   util_queue_add_job(&screen->fs_compile_queue, variant, &variant->optimized,
+                      optimize_variant, NULL, 0);
+   LP_COUNT(nr_fs_variants_optimized);
+}
+
+
 
 
 
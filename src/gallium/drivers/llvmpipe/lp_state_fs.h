@@ -32,6 +32,7 @@
 
 #include "pipe/p_compiler.h"
 #include "pipe/p_state.h"
+#include "util/u_queue.h"
 #include "tgsi/tgsi_scan.h" /* for tgsi_shader_info */
 #include "gallivm/lp_bld_sample.h" /* for struct lp_sampler_static_state */
 #include "gallivm/lp_bld_tgsi.h" /* for lp_tgsi_info */
@@ -40,6 +41,7 @@
 
 struct tgsi_token;
 struct lp_fragment_shader;
+struct llvmpipe_screen;
 
 
 /** Indexes into jit_function[] array */
@@ -125,6 +127,14 @@ struct lp_fragment_shader_variant
 
    boolean opaque;
 
+   /*
+    * How the variant relates to the per-tile depth bounds the setup code
+    * keeps for hierarchical Z culling, see lp_setup_tri.c.
+    */
+   boolean hiz_test;     /**< fragments known to fail the depth test may be skipped */
+   boolean hiz_bound;    /**< shaded fragments always write their depth */
+   boolean hiz_clobber;  /**< depth writes may increase stored values */
+
    struct gallivm_state *gallivm;
 
    LLVMTypeRef jit_context_ptr_type;
@@ -138,6 +148,36 @@ struct lp_fragment_shader_variant
    /* Total number of LLVM instructions generated */
    unsigned nr_instrs;
 
+   /*
+    * Signalled once the code above is ready.  Variants may be compiled on
+    * the screen's compile queue, so wait on this before touching them.
+    */
+   struct util_queue_fence ready;
+   int64_t compile_time;   /**< in microseconds */
+
+   /*
+    * With GALLIVM_PERF=tiered and a compile queue, the code is first
+    * generated without optimizations.  After LP_FS_HOT_DRAWS draws it is
+    * regenerated with them on the queue, and jit_function switched over
+    * once that is done.  The unoptimized code is kept until the variant is
+    * destroyed, as scenes in flight may still be running it.
+    */
+   boolean unoptimized;
+   unsigned draws;
+   struct util_queue_fence optimized;
+   struct gallivm_state *gallivm_unoptimized;
+
+   /* Triangles binned and fragments shaded with the variant, if tracing */
+   uint64_t nr_tris;
+   uint64_t nr_fragments;
+
+   /*
+    * Number of times the variant was bound, halved whenever an eviction
+    * pass spares it, so that often used variants outlive rarely used but
+    * more recent ones.
+    */
+   unsigned uses;
+
    struct lp_fs_variant_list_item list_item_global, list_item_local;
    struct lp_fragment_shader *shader;
 
@@ -160,6 +200,15 @@ struct lp_fragment_shader
 
    struct draw_fragment_shader *draw_data;
 
+   struct llvmpipe_screen *screen;
+
+   /* Hash of the IR for the disk cache, see gallivm_hash_shader_ir() */
+   unsigned char ir_sha1[20];
+   boolean has_ir_sha1;
+
+   /* Translating NIR modifies it, so variants compile one at a time. */
+   mtx_t compile_mutex;
+
    /* For debugging/profiling purposes */
    unsigned variant_key_size;
    unsigned no;
@@ -30,6 +30,7 @@
 #include "util/u_memory.h"
 #include "util/simple_list.h"
 #include "util/os_time.h"
+#include "util/mesa-sha1.h"
 #include "gallivm/lp_bld_arit.h"
 #include "gallivm/lp_bld_bitarit.h"
 #include "gallivm/lp_bld_const.h"
@@ -707,6 +708,7 @@ static struct lp_setup_variant *
 generate_setup_variant(struct lp_setup_variant_key *key,
                        struct llvmpipe_context *lp)
 {
+   struct llvmpipe_screen *screen = llvmpipe_screen(lp->pipe.screen);
    struct lp_setup_variant *variant = NULL;
    struct gallivm_state *gallivm;
    struct lp_setup_args args;
@@ -717,6 +719,9 @@ generate_setup_variant(struct lp_setup_variant_key *key,
    LLVMBasicBlockRef block;
    LLVMBuilderRef builder;
    int64_t t0 = 0, t1;
+   unsigned char ir_sha1_cache_key[20];
+   struct lp_cached_code cached = { 0 };
+   bool needs_caching = false;
 
    if (0)
       goto fail;
@@ -730,7 +735,15 @@ generate_setup_variant(struct lp_setup_variant_key *key,
    snprintf(func_name, sizeof(func_name), "setup_variant_%u",
             variant->no);
 
-   variant->gallivm = gallivm = gallivm_create(func_name, lp->context);
+   /* The setup code depends on nothing but the key. */
+   if (screen->disk_shader_cache) {
+      _mesa_sha1_compute(key, key->size, ir_sha1_cache_key);
+      lp_disk_cache_find_shader(screen, &cached, ir_sha1_cache_key);
+      needs_caching = !cached.data_size;
+   }
+
+   variant->gallivm = gallivm = gallivm_create(func_name, lp->context,
+                                               &cached);
    if (!variant->gallivm) {
       goto fail;
    }
@@ -761,7 +774,11 @@ generate_setup_variant(struct lp_setup_variant_key *key,
    func_type = LLVMFunctionType(LLVMVoidTypeInContext(gallivm->context),
                                 arg_types, ARRAY_SIZE(arg_types), 0);
 
-   variant->function = LLVMAddFunction(gallivm->module, func_name, func_type);
+   /* The module name is unique, but cached objects are looked up by the
+    * function name, which must not depend on the creation order.
+    */
+   variant->function = LLVMAddFunction(gallivm->module, "setup_variant",
+                                       func_type);
    if (!variant->function)
       goto fail;
 
@@ -805,7 +822,11 @@ generate_setup_variant(struct lp_setup_variant_key *key,
    if (!variant->jit_function)
       goto fail;
 
+   if (needs_caching)
+      lp_disk_cache_insert_shader(screen, &cached, ir_sha1_cache_key);
+
    gallivm_free_ir(variant->gallivm);
+   free(cached.data);
 
    /*
     * Update timing information:
@@ -825,6 +846,7 @@ fail:
       }
       FREE(variant);
    }
+   free(cached.data);
 
    return NULL;
 }
@@ -0,0 +1,199 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/**
+ * @file
+ * Unit tests for loading cached object code instead of compiling a module.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/u_pointer.h"
+#include "gallivm/lp_bld.h"
+#include "gallivm/lp_bld_init.h"
+#include "gallivm/lp_bld_const.h"
+
+#include "lp_test.h"
+
+
+void
+write_tsv_header(FILE *fp)
+{
+   fprintf(fp,
+           "result\t"
+           "format\n");
+
+   fflush(fp);
+}
+
+
+typedef int32_t (*test_cache_t)(int32_t x);
+
+
+/* Called from the generated code through a global mapping. */
+static int32_t
+test_cache_callee(int32_t x)
+{
+   return x * 3;
+}
+
+
+/**
+ * Build test_cache(x) = test_cache_callee(x) + bias.
+ */
+static LLVMValueRef
+add_cache_test(struct gallivm_state *gallivm, int32_t bias)
+{
+   LLVMModuleRef module = gallivm->module;
+   LLVMTypeRef i32t = LLVMInt32TypeInContext(gallivm->context);
+   LLVMValueRef func = LLVMAddFunction(module, "test_cache", LLVMFunctionType(i32t, &i32t, 1, 0));
+   LLVMBuilderRef builder = gallivm->builder;
+   LLVMBasicBlockRef block = LLVMAppendBasicBlockInContext(gallivm->context, func, "entry");
+   LLVMValueRef callee, arg, res;
+
+   LLVMSetFunctionCallConv(func, LLVMCCallConv);
+
+   LLVMPositionBuilderAtEnd(builder, block);
+
+   callee = lp_build_const_func_pointer(gallivm,
+                                        func_to_pointer((func_pointer)test_cache_callee),
+                                        i32t, &i32t, 1,
+                                        "test_cache_callee");
+
+   arg = LLVMGetParam(func, 0);
+   res = LLVMBuildCall(builder, callee, &arg, 1, "");
+   res = LLVMBuildAdd(builder, res, lp_build_const_int32(gallivm, bias), "");
+   LLVMBuildRet(builder, res);
+
+   gallivm_verify_function(gallivm, func);
+
+   return func;
+}
+
+
+/**
+ * Compile a module with the given bias, loading it from \p cache if that
+ * holds an object, and return test_cache(5).
+ */
+PIPE_ALIGN_STACK
+static int32_t
+run_cache_test(struct lp_cached_code *cache, int32_t bias)
+{
+   LLVMContextRef context;
+   struct gallivm_state *gallivm;
+   LLVMValueRef test;
+   test_cache_t test_cache_func;
+   int32_t res;
+
+   context = LLVMContextCreate();
+   gallivm = gallivm_create("test_module", context, cache);
+
+   test = add_cache_test(gallivm, bias);
+
+   gallivm_compile_module(gallivm);
+
+   test_cache_func = (test_cache_t) gallivm_jit_function(gallivm, test);
+
+   gallivm_free_ir(gallivm);
+
+   res = test_cache_func(5);
+
+   gallivm_destroy(gallivm);
+   LLVMContextDispose(context);
+
+   return res;
+}
+
+
+static boolean
+test_cache(unsigned verbose, FILE *fp)
+{
+   struct lp_cached_code cache = { 0 };
+   struct lp_cached_code copy = { 0 };
+   boolean success = TRUE;
+   int32_t res;
+
+   /* A miss compiles the module and hands back its object. */
+   res = run_cache_test(&cache, 1);
+   if (res != 16 || !cache.data_size) {
+      fprintf(stderr, "compiled: got %d, object of %u bytes\n",
+              res, (unsigned)cache.data_size);
+      success = FALSE;
+      goto out;
+   }
+
+   /* A hit must load the object rather than compile the new IR, whose
+    * different bias would show in the result.  Use a copy at another
+    * address, as if read back from disk.
+    */
+   copy.data_size = cache.data_size;
+   copy.data = malloc(copy.data_size);
+   memcpy(copy.data, cache.data, copy.data_size);
+
+   res = run_cache_test(&copy, 2);
+   if (res != 16 || copy.data_size != cache.data_size ||
+       memcmp(copy.data, cache.data, cache.data_size) != 0) {
+      fprintf(stderr, "loaded: got %d, expected 16\n", res);
+      success = FALSE;
+   }
+
+out:
+   if (verbose)
+      fprintf(stderr, "cache: %s\n", success ? "pass" : "fail");
+
+   free(copy.data);
+   free(cache.data);
+
+   return success;
+}
+
+
+boolean
+test_all(unsigned verbose, FILE *fp)
+{
+   return test_cache(verbose, fp);
+}
+
+
+boolean
+test_some(unsigned verbose, FILE *fp,
+          unsigned long n)
+{
+   return test_all(verbose, fp);
+}
+
+
+boolean
+test_single(unsigned verbose, FILE *fp)
+{
+   printf("no test_single()");
+   return TRUE;
+}
@@ -0,0 +1,232 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/**
+ * @file
+ * Unit tests and throughput measurements for the compute thread pool.
+ *
+ * Every iteration of a task must run exactly once, also with several tasks
+ * in flight.  The time per iteration is reported for tiny iterations, where
+ * claiming them dominates, and for larger ones, where the work does.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/u_atomic.h"
+#include "util/u_cpu_detect.h"
+#include "util/u_memory.h"
+#include "util/os_time.h"
+
+#include "lp_cs_tpool.h"
+#include "lp_test.h"
+
+
+struct test_cs_task {
+   unsigned *runs;         /**< per iteration */
+   unsigned work;          /**< inner loop count per iteration */
+   unsigned local_size;
+};
+
+
+static void
+test_cs_work(void *data, int iter_idx, struct lp_cs_local_mem *lmem)
+{
+   struct test_cs_task *t = data;
+   float acc = (float)iter_idx;
+   unsigned i;
+
+   /* Like cs_exec_fn, keep the shared memory per thread. */
+   if (lmem->local_size < t->local_size) {
+      lmem->local_mem_ptr = REALLOC(lmem->local_mem_ptr, lmem->local_size,
+                                    t->local_size);
+      lmem->local_size = t->local_size;
+   }
+
+   for (i = 0; i < t->work; i++)
+      acc = acc * 0.999f + 1.0f;
+   *(volatile float *)lmem->local_mem_ptr = acc;
+
+   p_atomic_inc(&t->runs[iter_idx]);
+}
+
+
+static boolean
+check_runs(const struct test_cs_task *t, unsigned num_iters)
+{
+   unsigned i;
+
+   for (i = 0; i < num_iters; i++) {
+      if (t->runs[i] != 1) {
+         fprintf(stderr, "iteration %u of %u ran %u times\n",
+                 i, num_iters, t->runs[i]);
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+void
+write_tsv_header(FILE *fp)
+{
+   fprintf(fp,
+           "result\t"
+           "threads\t"
+           "tasks\t"
+           "iterations\t"
+           "work\t"
+           "ns_per_iteration\n");
+
+   fflush(fp);
+}
+
+
+static void
+write_tsv_row(FILE *fp, boolean success, unsigned num_threads,
+              unsigned num_tasks, unsigned num_iters, unsigned work,
+              double ns)
+{
+   fprintf(fp, "%s\t%u\t%u\t%u\t%u\t%.1f\n",
+           success ? "pass" : "fail",
+           num_threads, num_tasks, num_iters, work, ns);
+
+   fflush(fp);
+}
+
+
+/**
+ * Run num_tasks tasks of num_iters iterations each, all queued before
+ * waiting on any of them.
+ */
+static boolean
+test_cs_tpool(unsigned verbose, FILE *fp, struct lp_cs_tpool *pool,
+              unsigned num_tasks, unsigned num_iters, unsigned work)
+{
+   struct test_cs_task tasks[2];
+   struct lp_cs_tpool_task *handles[2];
+   boolean success = TRUE;
+   int64_t start, end;
+   double ns;
+   unsigned i;
+
+   assert(num_tasks <= ARRAY_SIZE(tasks));
+
+   for (i = 0; i < num_tasks; i++) {
+      memset(&tasks[i], 0, sizeof tasks[i]);
+      tasks[i].runs = CALLOC(num_iters, sizeof(unsigned));
+      tasks[i].work = work;
+      tasks[i].local_size = 1024 * (i + 1);
+   }
+
+   start = os_time_get_nano();
+   for (i = 0; i < num_tasks; i++)
+      handles[i] = lp_cs_tpool_queue_task(pool, test_cs_work, &tasks[i],
+                                          num_iters);
+   for (i = 0; i < num_tasks; i++)
+      lp_cs_tpool_wait_for_task(pool, &handles[i]);
+   end = os_time_get_nano();
+
+   ns = (double)(end - start) / ((double)num_tasks * num_iters);
+
+   for (i = 0; i < num_tasks; i++) {
+      if (!check_runs(&tasks[i], num_iters))
+         success = FALSE;
+      FREE(tasks[i].runs);
+   }
+
+   if (verbose || !success) {
+      fprintf(stderr, "%u threads, %u tasks x %6u iterations, work %5u: "
+              "%8.1f ns/iteration %s\n",
+              pool->num_threads, num_tasks, num_iters, work, ns,
+              success ? "" : "FAILED");
+   }
+
+   if (fp)
+      write_tsv_row(fp, success, pool->num_threads, num_tasks, num_iters,
+                    work, ns);
+
+   return success;
+}
+
+
+boolean
+test_all(unsigned verbose, FILE *fp)
+{
+   const unsigned iters[] = { 1, 7, 1000, 100000 };
+   const unsigned works[] = { 0, 4096 };
+   unsigned thread_counts[] = { 0, 1, 4 };
+   boolean success = TRUE;
+   unsigned t, i, w, n;
+
+   util_cpu_detect();
+   thread_counts[2] = MAX2(util_cpu_caps.nr_cpus, 2);
+
+   for (t = 0; t < ARRAY_SIZE(thread_counts); t++) {
+      struct lp_cs_tpool *pool =
+         lp_cs_tpool_create(MIN2(thread_counts[t], LP_MAX_THREADS));
+
+      for (i = 0; i < ARRAY_SIZE(iters); i++) {
+         for (w = 0; w < ARRAY_SIZE(works); w++) {
+            /* Large iterations are only timed at a sensible count. */
+            if (works[w] && iters[i] > 1000)
+               continue;
+            for (n = 1; n <= 2; n++) {
+               if (!test_cs_tpool(verbose, fp, pool, n, iters[i], works[w]))
+                  success = FALSE;
+            }
+         }
+      }
+
+      lp_cs_tpool_destroy(pool);
+   }
+
+   return success;
+}
+
+
+boolean
+test_some(unsigned verbose, FILE *fp,
+          unsigned long n)
+{
+   /*
+    * Not randomly generated test cases, so test all.
+    */
+
+   return test_all(verbose, fp);
+}
+
+
+boolean
+test_single(unsigned verbose, FILE *fp)
+{
+   printf("no test_single()");
+   return TRUE;
+}
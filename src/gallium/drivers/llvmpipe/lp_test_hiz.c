@@ -0,0 +1,413 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/**
+ * @file
+ * Unit tests for the hierarchical Z culling of triangles.
+ *
+ * The depth is cleared, raised everywhere by a draw with a depth test that
+ * always passes, and then a LESS tested draw in between the cleared and
+ * the raised depth must not be culled.  The clear is done both before the
+ * scene is begun and into a scene already being binned.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pipe/p_context.h"
+#include "pipe/p_defines.h"
+#include "pipe/p_screen.h"
+#include "pipe/p_state.h"
+#include "util/u_draw.h"
+#include "util/u_inlines.h"
+#include "util/u_memory.h"
+#include "util/u_simple_shaders.h"
+#include "sw/null/null_sw_winsys.h"
+
+#include "lp_public.h"
+#include "lp_test.h"
+
+
+#define TEST_HIZ_SIZE 64
+
+#define TEST_HIZ_GREEN 0xff00ff00
+
+
+struct test_hiz
+{
+   struct pipe_screen *screen;
+   struct pipe_context *pipe;
+   struct pipe_resource *cbuf;
+   struct pipe_resource *zsbuf;
+   struct pipe_framebuffer_state fb;
+   void *rasterizer;
+   void *blend;
+   void *dsa_always;
+   void *dsa_less;
+   void *velems;
+   void *vs;
+   void *fs;
+   struct pipe_resource *vbuf;
+};
+
+
+void
+write_tsv_header(FILE *fp)
+{
+   fprintf(fp,
+           "result\t"
+           "test\n");
+
+   fflush(fp);
+}
+
+
+static struct pipe_resource *
+create_target(struct pipe_screen *screen, enum pipe_format format,
+              unsigned bind)
+{
+   struct pipe_resource templ;
+
+   memset(&templ, 0, sizeof templ);
+   templ.target = PIPE_TEXTURE_2D;
+   templ.format = format;
+   templ.width0 = TEST_HIZ_SIZE;
+   templ.height0 = TEST_HIZ_SIZE;
+   templ.depth0 = 1;
+   templ.array_size = 1;
+   templ.bind = bind;
+
+   return screen->resource_create(screen, &templ);
+}
+
+
+static struct pipe_surface *
+create_surface(struct pipe_context *pipe, struct pipe_resource *resource)
+{
+   struct pipe_surface templ;
+
+   memset(&templ, 0, sizeof templ);
+   templ.format = resource->format;
+
+   return pipe->create_surface(pipe, resource, &templ);
+}
+
+
+static void *
+create_dsa(struct pipe_context *pipe, unsigned func)
+{
+   struct pipe_depth_stencil_alpha_state dsa;
+
+   memset(&dsa, 0, sizeof dsa);
+   dsa.depth.enabled = 1;
+   dsa.depth.writemask = 1;
+   dsa.depth.func = func;
+
+   return pipe->create_depth_stencil_alpha_state(pipe, &dsa);
+}
+
+
+/**
+ * Set up two full screen quads, a red one at depth 0.9 and a green one at
+ * depth 0.7, in window coordinates.
+ */
+static boolean
+init_test(struct test_hiz *t)
+{
+   static const enum tgsi_semantic semantic_names[] = {
+      TGSI_SEMANTIC_POSITION, TGSI_SEMANTIC_COLOR,
+   };
+   static const uint semantic_indexes[] = { 0, 0 };
+   static const float verts[8][2][4] = {
+      { { -1, -1, 0.8, 1 }, { 1, 0, 0, 1 } },
+      { {  1, -1, 0.8, 1 }, { 1, 0, 0, 1 } },
+      { { -1,  1, 0.8, 1 }, { 1, 0, 0, 1 } },
+      { {  1,  1, 0.8, 1 }, { 1, 0, 0, 1 } },
+      { { -1, -1, 0.4, 1 }, { 0, 1, 0, 1 } },
+      { {  1, -1, 0.4, 1 }, { 0, 1, 0, 1 } },
+      { { -1,  1, 0.4, 1 }, { 0, 1, 0, 1 } },
+      { {  1,  1, 0.4, 1 }, { 0, 1, 0, 1 } },
+   };
+   struct pipe_rasterizer_state rasterizer;
+   struct pipe_blend_state blend;
+   struct pipe_viewport_state viewport;
+   struct pipe_vertex_element velems[2];
+   struct pipe_vertex_buffer vb;
+
+   memset(t, 0, sizeof *t);
+
+   t->screen = llvmpipe_create_screen(null_sw_create());
+   if (!t->screen)
+      return FALSE;
+   t->pipe = t->screen->context_create(t->screen, NULL, 0);
+   if (!t->pipe)
+      return FALSE;
+
+   t->cbuf = create_target(t->screen, PIPE_FORMAT_B8G8R8A8_UNORM,
+                           PIPE_BIND_RENDER_TARGET);
+   t->zsbuf = create_target(t->screen, PIPE_FORMAT_Z32_FLOAT,
+                            PIPE_BIND_DEPTH_STENCIL);
+   if (!t->cbuf || !t->zsbuf)
+      return FALSE;
+
+   t->fb.width = TEST_HIZ_SIZE;
+   t->fb.height = TEST_HIZ_SIZE;
+   t->fb.nr_cbufs = 1;
+   t->fb.cbufs[0] = create_surface(t->pipe, t->cbuf);
+   t->fb.zsbuf = create_surface(t->pipe, t->zsbuf);
+   t->pipe->set_framebuffer_state(t->pipe, &t->fb);
+
+   memset(&viewport, 0, sizeof viewport);
+   viewport.scale[0] = TEST_HIZ_SIZE / 2.0f;
+   viewport.scale[1] = TEST_HIZ_SIZE / 2.0f;
+   viewport.scale[2] = 0.5f;
+   viewport.translate[0] = TEST_HIZ_SIZE / 2.0f;
+   viewport.translate[1] = TEST_HIZ_SIZE / 2.0f;
+   viewport.translate[2] = 0.5f;
+   t->pipe->set_viewport_states(t->pipe, 0, 1, &viewport);
+
+   memset(&rasterizer, 0, sizeof rasterizer);
+   rasterizer.cull_face = PIPE_FACE_NONE;
+   rasterizer.half_pixel_center = 1;
+   rasterizer.bottom_edge_rule = 1;
+   rasterizer.depth_clip_near = 1;
+   rasterizer.depth_clip_far = 1;
+   t->rasterizer = t->pipe->create_rasterizer_state(t->pipe, &rasterizer);
+   t->pipe->bind_rasterizer_state(t->pipe, t->rasterizer);
+
+   memset(&blend, 0, sizeof blend);
+   blend.rt[0].colormask = PIPE_MASK_RGBA;
+   t->blend = t->pipe->create_blend_state(t->pipe, &blend);
+   t->pipe->bind_blend_state(t->pipe, t->blend);
+
+   /* Can raise the depth, so the per-tile bounds can't be kept up. */
+   t->dsa_always = create_dsa(t->pipe, PIPE_FUNC_ALWAYS);
+   /* Uses the per-tile bounds to cull. */
+   t->dsa_less = create_dsa(t->pipe, PIPE_FUNC_LESS);
+
+   t->vs = util_make_vertex_passthrough_shader(t->pipe,
+                                               ARRAY_SIZE(semantic_names),
+                                               semantic_names,
+                                               semantic_indexes, FALSE);
+   t->pipe->bind_vs_state(t->pipe, t->vs);
+
+   t->fs = util_make_fragment_passthrough_shader(t->pipe,
+                                                 TGSI_SEMANTIC_COLOR,
+                                                 TGSI_INTERPOLATE_PERSPECTIVE,
+                                                 TRUE);
+   t->pipe->bind_fs_state(t->pipe, t->fs);
+
+   memset(velems, 0, sizeof velems);
+   velems[0].src_offset = 0;
+   velems[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   velems[1].src_offset = sizeof verts[0][0];
+   velems[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   t->velems = t->pipe->create_vertex_elements_state(t->pipe, 2, velems);
+   t->pipe->bind_vertex_elements_state(t->pipe, t->velems);
+
+   t->vbuf = pipe_buffer_create(t->screen, PIPE_BIND_VERTEX_BUFFER,
+                                PIPE_USAGE_DEFAULT, sizeof verts);
+   pipe_buffer_write(t->pipe, t->vbuf, 0, sizeof verts, verts);
+
+   memset(&vb, 0, sizeof vb);
+   vb.stride = sizeof verts[0];
+   vb.buffer.resource = t->vbuf;
+   t->pipe->set_vertex_buffers(t->pipe, 0, 1, &vb);
+
+   return TRUE;
+}
+
+
+static void
+close_test(struct test_hiz *t)
+{
+   if (t->pipe) {
+      t->pipe->bind_vs_state(t->pipe, NULL);
+      t->pipe->bind_fs_state(t->pipe, NULL);
+      t->pipe->bind_depth_stencil_alpha_state(t->pipe, NULL);
+      if (t->vs)
+         t->pipe->delete_vs_state(t->pipe, t->vs);
+      if (t->fs)
+         t->pipe->delete_fs_state(t->pipe, t->fs);
+      if (t->velems)
+         t->pipe->delete_vertex_elements_state(t->pipe, t->velems);
+      if (t->dsa_always)
+         t->pipe->delete_depth_stencil_alpha_state(t->pipe, t->dsa_always);
+      if (t->dsa_less)
+         t->pipe->delete_depth_stencil_alpha_state(t->pipe, t->dsa_less);
+      if (t->blend)
+         t->pipe->delete_blend_state(t->pipe, t->blend);
+      if (t->rasterizer)
+         t->pipe->delete_rasterizer_state(t->pipe, t->rasterizer);
+      pipe_surface_reference(&t->fb.cbufs[0], NULL);
+      pipe_surface_reference(&t->fb.zsbuf, NULL);
+      pipe_resource_reference(&t->vbuf, NULL);
+      pipe_resource_reference(&t->cbuf, NULL);
+      pipe_resource_reference(&t->zsbuf, NULL);
+      t->pipe->destroy(t->pipe);
+   }
+   if (t->screen)
+      t->screen->destroy(t->screen);
+}
+
+
+/**
+ * Draw the red (0) or green (1) quad.
+ */
+static void
+draw_quad(struct test_hiz *t, unsigned quad)
+{
+   struct pipe_draw_info info;
+
+   util_draw_init_info(&info);
+   info.mode = PIPE_PRIM_TRIANGLE_STRIP;
+   info.start = quad * 4;
+   info.count = 4;
+   t->pipe->draw_vbo(t->pipe, &info);
+}
+
+
+static void
+clear(struct test_hiz *t)
+{
+   union pipe_color_union color;
+
+   memset(&color, 0, sizeof color);
+   t->pipe->clear(t->pipe, PIPE_CLEAR_COLOR | PIPE_CLEAR_DEPTH, &color,
+                  0.5, 0);
+}
+
+
+/**
+ * Check that the green quad was drawn everywhere.
+ */
+static boolean
+check_green(struct test_hiz *t)
+{
+   struct pipe_transfer *transfer;
+   const uint8_t *map;
+   boolean success = TRUE;
+   unsigned x, y;
+
+   map = pipe_transfer_map(t->pipe, t->cbuf, 0, 0, PIPE_TRANSFER_READ,
+                           0, 0, TEST_HIZ_SIZE, TEST_HIZ_SIZE, &transfer);
+   if (!map)
+      return FALSE;
+
+   for (y = 0; y < TEST_HIZ_SIZE && success; y++) {
+      const uint32_t *row = (const uint32_t *)(map + y * transfer->stride);
+
+      for (x = 0; x < TEST_HIZ_SIZE; x++) {
+         if (row[x] != TEST_HIZ_GREEN) {
+            fprintf(stderr, "pixel (%u, %u) is %08x, expected %08x\n",
+                    x, y, row[x], TEST_HIZ_GREEN);
+            success = FALSE;
+            break;
+         }
+      }
+   }
+
+   pipe_transfer_unmap(t->pipe, transfer);
+
+   return success;
+}
+
+
+/**
+ * Clear, raise the depth with a draw which always passes and stays bound
+ * across the clear, then draw LESS tested in between.  With active, the
+ * clear goes into a scene already being binned.
+ */
+static boolean
+test_clobber(unsigned verbose, FILE *fp, boolean active)
+{
+   struct test_hiz t;
+   boolean success = FALSE;
+
+   if (!init_test(&t))
+      goto out;
+
+   t.pipe->bind_depth_stencil_alpha_state(t.pipe, t.dsa_always);
+   if (active)
+      draw_quad(&t, 0);
+   clear(&t);
+   draw_quad(&t, 0);
+
+   t.pipe->bind_depth_stencil_alpha_state(t.pipe, t.dsa_less);
+   draw_quad(&t, 1);
+
+   success = check_green(&t);
+
+out:
+   close_test(&t);
+
+   if (verbose || !success)
+      fprintf(stderr, "clear %s scene, raise, draw less: %s\n",
+              active ? "into" : "before",
+              success ? "ok" : "FAILED");
+   if (fp) {
+      fprintf(fp, "%s\tclobber_%s\n",
+              success ? "pass" : "fail",
+              active ? "active" : "cleared");
+      fflush(fp);
+   }
+
+   return success;
+}
+
+
+boolean
+test_all(unsigned verbose, FILE *fp)
+{
+   boolean success = TRUE;
+
+   if (!test_clobber(verbose, fp, FALSE))
+      success = FALSE;
+   if (!test_clobber(verbose, fp, TRUE))
+      success = FALSE;
+
+   return success;
+}
+
+
+boolean
+test_some(unsigned verbose, FILE *fp,
+          unsigned long n)
+{
+   return test_all(verbose, fp);
+}
+
+
+boolean
+test_single(unsigned verbose, FILE *fp)
+{
+   printf("no test_single()");
+   return TRUE;
+}
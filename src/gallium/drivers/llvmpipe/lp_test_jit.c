@@ -0,0 +1,262 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/**
+ * @file
+ * Unit tests and compile time measurements for shared execution engines.
+ *
+ * Modules which all define the same symbol names are compiled with an
+ * engine each, and with GALLIVM_PERF_SHARED_JIT in a few shared engines,
+ * with and without optimizations, with the time per module reported.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "util/u_memory.h"
+#include "util/u_pointer.h"
+#include "util/os_time.h"
+#include "gallivm/lp_bld.h"
+#include "gallivm/lp_bld_arit.h"
+#include "gallivm/lp_bld_const.h"
+#include "gallivm/lp_bld_debug.h"
+#include "gallivm/lp_bld_init.h"
+#include "gallivm/lp_bld_swizzle.h"
+#include "gallivm/lp_bld_type.h"
+
+#include "lp_test.h"
+
+
+#define TEST_JIT_LENGTH 4
+
+
+typedef void (*test_jit_t)(float *out, const float *in);
+
+
+void
+write_tsv_header(FILE *fp)
+{
+   fprintf(fp,
+           "result\t"
+           "engine\t"
+           "optimized\t"
+           "modules\t"
+           "ms_per_module\n");
+
+   fflush(fp);
+}
+
+
+/* Called from the generated code through a global mapping. */
+static int32_t
+test_jit_callee(int32_t x)
+{
+   return x * 3;
+}
+
+
+/**
+ * Build test_jit(out, in): out = exp2(in) + test_jit_callee(bias).
+ */
+static LLVMValueRef
+add_jit_test(struct gallivm_state *gallivm, int32_t bias)
+{
+   LLVMModuleRef module = gallivm->module;
+   LLVMContextRef context = gallivm->context;
+   struct lp_type type = lp_type_float_vec(32, 32 * TEST_JIT_LENGTH);
+   LLVMTypeRef i32t = LLVMInt32TypeInContext(context);
+   LLVMTypeRef vf32t = lp_build_vec_type(gallivm, type);
+   LLVMTypeRef args[2] = { LLVMPointerType(vf32t, 0), LLVMPointerType(vf32t, 0) };
+   LLVMValueRef func = LLVMAddFunction(module, "test_jit",
+                                       LLVMFunctionType(LLVMVoidTypeInContext(context),
+                                                        args, ARRAY_SIZE(args), 0));
+   LLVMBuilderRef builder = gallivm->builder;
+   LLVMBasicBlockRef block = LLVMAppendBasicBlockInContext(context, func, "entry");
+   struct lp_build_context bld;
+   LLVMValueRef callee, arg, offset, res;
+
+   lp_build_context_init(&bld, gallivm, type);
+
+   LLVMSetFunctionCallConv(func, LLVMCCallConv);
+
+   LLVMPositionBuilderAtEnd(builder, block);
+
+   callee = lp_build_const_func_pointer(gallivm,
+                                        func_to_pointer((func_pointer)test_jit_callee),
+                                        i32t, &i32t, 1,
+                                        "test_jit_callee");
+
+   arg = lp_build_const_int32(gallivm, bias);
+   offset = LLVMBuildCall(builder, callee, &arg, 1, "");
+   offset = LLVMBuildSIToFP(builder, offset, LLVMFloatTypeInContext(context), "");
+   offset = lp_build_broadcast(gallivm, vf32t, offset);
+
+   res = LLVMBuildLoad(builder, LLVMGetParam(func, 1), "");
+   res = lp_build_exp2(&bld, res);
+   res = lp_build_add(&bld, res, offset);
+   LLVMBuildStore(builder, res, LLVMGetParam(func, 0));
+
+   LLVMBuildRetVoid(builder);
+
+   gallivm_verify_function(gallivm, func);
+
+   return func;
+}
+
+
+/**
+ * Compile num_modules modules, all kept until the end like shader variants,
+ * and check each one's function against the reference.
+ */
+PIPE_ALIGN_STACK
+static boolean
+test_jit(unsigned verbose, FILE *fp, boolean shared, boolean optimized,
+         unsigned num_modules)
+{
+   const unsigned saved_perf = gallivm_perf;
+   LLVMContextRef context;
+   struct gallivm_state **gallivms;
+   test_jit_t *funcs;
+   boolean success = TRUE;
+   int64_t start, end;
+   double ms;
+   unsigned i, j;
+
+   if (shared)
+      gallivm_perf |= GALLIVM_PERF_SHARED_JIT;
+   else
+      gallivm_perf &= ~GALLIVM_PERF_SHARED_JIT;
+
+   gallivms = CALLOC(num_modules, sizeof *gallivms);
+   funcs = CALLOC(num_modules, sizeof *funcs);
+   context = LLVMContextCreate();
+
+   start = os_time_get_nano();
+   for (i = 0; i < num_modules; i++) {
+      LLVMValueRef test;
+
+      if (optimized)
+         gallivms[i] = gallivm_create("test_module", context, NULL);
+      else
+         gallivms[i] = gallivm_create_unoptimized("test_module", context);
+      test = add_jit_test(gallivms[i], i);
+      gallivm_compile_module(gallivms[i]);
+      funcs[i] = (test_jit_t) gallivm_jit_function(gallivms[i], test);
+      gallivm_free_ir(gallivms[i]);
+   }
+   end = os_time_get_nano();
+
+   ms = (double)(end - start) / (1000000.0 * num_modules);
+
+   for (i = 0; i < num_modules; i++) {
+      PIPE_ALIGN_VAR(16) float in[TEST_JIT_LENGTH];
+      PIPE_ALIGN_VAR(16) float out[TEST_JIT_LENGTH];
+
+      for (j = 0; j < TEST_JIT_LENGTH; j++)
+         in[j] = (float)j - 1.0f;
+
+      funcs[i](out, in);
+
+      for (j = 0; j < TEST_JIT_LENGTH; j++) {
+         float ref = exp2f(in[j]) + (float)test_jit_callee(i);
+         if (fabsf(out[j] - ref) > 1e-5f * fabsf(ref)) {
+            fprintf(stderr, "module %u: exp2(%g) + %d = %g, expected %g\n",
+                    i, in[j], test_jit_callee(i), out[j], ref);
+            success = FALSE;
+            break;
+         }
+      }
+   }
+
+   for (i = 0; i < num_modules; i++)
+      gallivm_destroy(gallivms[i]);
+   LLVMContextDispose(context);
+   FREE(funcs);
+   FREE(gallivms);
+
+   gallivm_perf = saved_perf;
+
+   if (verbose || !success) {
+      fprintf(stderr, "%-7s engines, %-11s %4u modules: %7.3f ms/module %s\n",
+              shared ? "shared" : "private",
+              optimized ? "optimized," : "unoptimized,", num_modules, ms,
+              success ? "" : "FAILED");
+   }
+
+   if (fp) {
+      fprintf(fp, "%s\t%s\t%u\t%u\t%.3f\n",
+              success ? "pass" : "fail",
+              shared ? "shared" : "private", optimized, num_modules, ms);
+      fflush(fp);
+   }
+
+   return success;
+}
+
+
+boolean
+test_all(unsigned verbose, FILE *fp)
+{
+   boolean success = TRUE;
+
+   /* Sets gallivm_perf from the environment, before we override it. */
+   lp_build_init();
+
+   if (!test_jit(verbose, fp, FALSE, TRUE, 64))
+      success = FALSE;
+   if (!test_jit(verbose, fp, TRUE, TRUE, 64))
+      success = FALSE;
+   if (!test_jit(verbose, fp, FALSE, FALSE, 64))
+      success = FALSE;
+   if (!test_jit(verbose, fp, TRUE, FALSE, 64))
+      success = FALSE;
+   /* Enough modules to retire an engine. */
+   if (!test_jit(verbose, fp, TRUE, TRUE, 300))
+      success = FALSE;
+
+   return success;
+}
+
+
+boolean
+test_some(unsigned verbose, FILE *fp,
+          unsigned long n)
+{
+   return test_all(verbose, fp);
+}
+
+
+boolean
+test_single(unsigned verbose, FILE *fp)
+{
+   printf("no test_single()");
+   return TRUE;
+}
@@ -0,0 +1,469 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/**
+ * @file
+ * Unit tests for the tiered compilation of vertex shader variants.
+ *
+ * A vertex shader is drawn with until its variant is recompiled with
+ * optimizations, and the stream output of the optimized code compared with
+ * that of the unoptimized code.  Variants are also destroyed, with the
+ * shader and with the context, while their recompiles are still queued.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pipe/p_context.h"
+#include "pipe/p_defines.h"
+#include "pipe/p_screen.h"
+#include "pipe/p_state.h"
+#include "util/u_draw.h"
+#include "util/u_inlines.h"
+#include "util/u_memory.h"
+#include "util/u_simple_shaders.h"
+#include "util/simple_list.h"
+#include "tgsi/tgsi_text.h"
+#include "gallivm/lp_bld_debug.h"
+#include "gallivm/lp_bld_init.h"
+#include "draw/draw_private.h"
+#include "draw/draw_llvm.h"
+#include "sw/null/null_sw_winsys.h"
+
+#include "lp_context.h"
+#include "lp_public.h"
+#include "lp_test.h"
+
+
+#define TEST_TIERED_VERTS 64
+
+/* Shaders made hot back to back, so that their recompiles queue up. */
+#define TEST_TIERED_QUEUED 4
+
+
+struct test_tiered
+{
+   struct pipe_screen *screen;
+   struct pipe_context *pipe;
+   void *rasterizer;
+   void *blend;
+   void *dsa;
+   void *velems;
+   void *fs;
+   struct pipe_resource *vbuf;
+   struct pipe_resource *sobuf;
+   struct pipe_stream_output_target *so_target;
+};
+
+
+void
+write_tsv_header(FILE *fp)
+{
+   fprintf(fp,
+           "result\t"
+           "test\n");
+
+   fflush(fp);
+}
+
+
+/**
+ * A vertex shader with separate multiplies and adds, so that the optimized
+ * code must give bit identical results, writing OUT[1] to stream output.
+ */
+static void *
+create_vs(struct pipe_context *pipe, float scale)
+{
+   struct tgsi_token tokens[1000];
+   struct pipe_shader_state state;
+   char text[1024];
+
+   snprintf(text, sizeof(text),
+            "VERT\n"
+            "DCL IN[0]\n"
+            "DCL OUT[0], POSITION\n"
+            "DCL OUT[1], GENERIC[0]\n"
+            "DCL TEMP[0..1]\n"
+            "IMM[0] FLT32 { %f, 2.0, -1.0, 0.25 }\n"
+            "MUL TEMP[0], IN[0], IMM[0].xyzw\n"
+            "ADD TEMP[0], TEMP[0], IMM[0].wzyx\n"
+            "MUL TEMP[1], TEMP[0], TEMP[0]\n"
+            "ADD OUT[1], TEMP[1], -IN[0].yxwz\n"
+            "MOV OUT[0], IN[0]\n"
+            "END\n", scale);
+
+   if (!tgsi_text_translate(text, tokens, ARRAY_SIZE(tokens)))
+      return NULL;
+
+   memset(&state, 0, sizeof state);
+   pipe_shader_state_from_tgsi(&state, tokens);
+   state.stream_output.num_outputs = 1;
+   state.stream_output.stride[0] = 4;
+   state.stream_output.output[0].register_index = 1;
+   state.stream_output.output[0].num_components = 4;
+
+   return pipe->create_vs_state(pipe, &state);
+}
+
+
+static boolean
+init_test(struct test_tiered *t)
+{
+   struct pipe_rasterizer_state rasterizer;
+   struct pipe_blend_state blend;
+   struct pipe_depth_stencil_alpha_state dsa;
+   struct pipe_framebuffer_state fb;
+   struct pipe_vertex_element velem;
+   struct pipe_vertex_buffer vb;
+   float verts[TEST_TIERED_VERTS][4];
+   unsigned i, j;
+
+   memset(t, 0, sizeof *t);
+
+   t->screen = llvmpipe_create_screen(null_sw_create());
+   if (!t->screen)
+      return FALSE;
+   t->pipe = t->screen->context_create(t->screen, NULL, 0);
+   if (!t->pipe)
+      return FALSE;
+
+   /* Only the vertex shader and stream output are of interest. */
+   memset(&rasterizer, 0, sizeof rasterizer);
+   rasterizer.rasterizer_discard = 1;
+   rasterizer.depth_clip_near = 1;
+   rasterizer.depth_clip_far = 1;
+   t->rasterizer = t->pipe->create_rasterizer_state(t->pipe, &rasterizer);
+   t->pipe->bind_rasterizer_state(t->pipe, t->rasterizer);
+
+   memset(&blend, 0, sizeof blend);
+   t->blend = t->pipe->create_blend_state(t->pipe, &blend);
+   t->pipe->bind_blend_state(t->pipe, t->blend);
+
+   memset(&dsa, 0, sizeof dsa);
+   t->dsa = t->pipe->create_depth_stencil_alpha_state(t->pipe, &dsa);
+   t->pipe->bind_depth_stencil_alpha_state(t->pipe, t->dsa);
+
+   memset(&fb, 0, sizeof fb);
+   fb.width = 16;
+   fb.height = 16;
+   t->pipe->set_framebuffer_state(t->pipe, &fb);
+
+   t->fs = util_make_fragment_passthrough_shader(t->pipe,
+                                                 TGSI_SEMANTIC_GENERIC,
+                                                 TGSI_INTERPOLATE_PERSPECTIVE,
+                                                 TRUE);
+   t->pipe->bind_fs_state(t->pipe, t->fs);
+
+   memset(&velem, 0, sizeof velem);
+   velem.src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   t->velems = t->pipe->create_vertex_elements_state(t->pipe, 1, &velem);
+   t->pipe->bind_vertex_elements_state(t->pipe, t->velems);
+
+   for (i = 0; i < TEST_TIERED_VERTS; i++)
+      for (j = 0; j < 4; j++)
+         verts[i][j] = random_float();
+
+   t->vbuf = pipe_buffer_create(t->screen, PIPE_BIND_VERTEX_BUFFER,
+                                PIPE_USAGE_DEFAULT, sizeof verts);
+   pipe_buffer_write(t->pipe, t->vbuf, 0, sizeof verts, verts);
+
+   memset(&vb, 0, sizeof vb);
+   vb.stride = sizeof verts[0];
+   vb.buffer.resource = t->vbuf;
+   t->pipe->set_vertex_buffers(t->pipe, 0, 1, &vb);
+
+   t->sobuf = pipe_buffer_create(t->screen, PIPE_BIND_STREAM_OUTPUT,
+                                 PIPE_USAGE_STAGING, sizeof verts);
+   t->so_target = t->pipe->create_stream_output_target(t->pipe, t->sobuf,
+                                                       0, sizeof verts);
+
+   return TRUE;
+}
+
+
+static void
+close_test(struct test_tiered *t)
+{
+   if (t->pipe) {
+      t->pipe->set_stream_output_targets(t->pipe, 0, NULL, NULL);
+      pipe_so_target_reference(&t->so_target, NULL);
+      pipe_resource_reference(&t->sobuf, NULL);
+      pipe_resource_reference(&t->vbuf, NULL);
+      t->pipe->bind_fs_state(t->pipe, NULL);
+      if (t->fs)
+         t->pipe->delete_fs_state(t->pipe, t->fs);
+      if (t->velems)
+         t->pipe->delete_vertex_elements_state(t->pipe, t->velems);
+      if (t->dsa)
+         t->pipe->delete_depth_stencil_alpha_state(t->pipe, t->dsa);
+      if (t->blend)
+         t->pipe->delete_blend_state(t->pipe, t->blend);
+      if (t->rasterizer)
+         t->pipe->delete_rasterizer_state(t->pipe, t->rasterizer);
+      t->pipe->destroy(t->pipe);
+   }
+   if (t->screen)
+      t->screen->destroy(t->screen);
+}
+
+
+/**
+ * Draw the vertices with the bound vertex shader, and read back what it
+ * wrote to stream output, if out is non-NULL.
+ */
+static void
+draw(struct test_tiered *t, float out[TEST_TIERED_VERTS][4])
+{
+   struct pipe_draw_info info;
+   unsigned offset = 0;
+
+   t->pipe->set_stream_output_targets(t->pipe, 1, &t->so_target, &offset);
+
+   util_draw_init_info(&info);
+   info.mode = PIPE_PRIM_POINTS;
+   info.count = TEST_TIERED_VERTS;
+   t->pipe->draw_vbo(t->pipe, &info);
+
+   if (out)
+      pipe_buffer_read(t->pipe, t->sobuf, 0,
+                       TEST_TIERED_VERTS * sizeof out[0], out);
+}
+
+
+/**
+ * The variant of the bound vertex shader, there being just the one.
+ */
+static struct draw_llvm_variant *
+bound_variant(struct test_tiered *t)
+{
+   struct draw_context *draw = llvmpipe_context(t->pipe)->draw;
+   struct llvm_vertex_shader *shader =
+      llvm_vertex_shader(draw->vs.vertex_shader);
+
+   if (is_empty_list(&shader->variants))
+      return NULL;
+   return first_elem(&shader->variants)->base;
+}
+
+
+/**
+ * Draw with the bound vertex shader until its variant is hot.
+ */
+static struct draw_llvm_variant *
+make_hot(struct test_tiered *t)
+{
+   struct draw_llvm_variant *variant;
+   unsigned i;
+
+   draw(t, NULL);
+   variant = bound_variant(t);
+   if (!variant || !variant->unoptimized)
+      return NULL;
+
+   for (i = 0; i < 2 * DRAW_LLVM_HOT_RUNS &&
+               variant->runs < DRAW_LLVM_HOT_RUNS; i++)
+      draw(t, NULL);
+
+   return variant->runs == DRAW_LLVM_HOT_RUNS ? variant : NULL;
+}
+
+
+/**
+ * Check that a hot variant is recompiled, and that the optimized code
+ * gives the same results as the unoptimized code did.
+ */
+static boolean
+test_recompile(unsigned verbose, FILE *fp)
+{
+   struct test_tiered t;
+   float ref[TEST_TIERED_VERTS][4];
+   float res[TEST_TIERED_VERTS][4];
+   struct draw_llvm_variant *variant;
+   draw_jit_vert_func unoptimized_func;
+   boolean success = FALSE;
+   void *vs = NULL;
+
+   if (!init_test(&t))
+      goto out;
+
+   vs = create_vs(t.pipe, 0.5f);
+   if (!vs)
+      goto out;
+   t.pipe->bind_vs_state(t.pipe, vs);
+
+   draw(&t, ref);
+   variant = bound_variant(&t);
+   if (!variant || !variant->unoptimized) {
+      fprintf(stderr, "variant not compiled without optimizations\n");
+      goto out;
+   }
+   unoptimized_func = variant->jit_func;
+
+   if (make_hot(&t) != variant) {
+      fprintf(stderr, "variant not made hot\n");
+      goto out;
+   }
+
+   util_queue_fence_wait(&variant->optimized);
+   if (variant->jit_func == unoptimized_func ||
+       !variant->gallivm_unoptimized) {
+      fprintf(stderr, "variant not recompiled\n");
+      goto out;
+   }
+
+   draw(&t, res);
+   if (memcmp(res, ref, sizeof ref) != 0) {
+      unsigned i;
+
+      for (i = 0; i < TEST_TIERED_VERTS; i++) {
+         if (memcmp(res[i], ref[i], sizeof ref[i]) != 0) {
+            fprintf(stderr, "vertex %u: %g %g %g %g, expected %g %g %g %g\n",
+                    i, res[i][0], res[i][1], res[i][2], res[i][3],
+                    ref[i][0], ref[i][1], ref[i][2], ref[i][3]);
+            break;
+         }
+      }
+      goto out;
+   }
+
+   success = TRUE;
+
+out:
+   if (vs) {
+      t.pipe->bind_vs_state(t.pipe, NULL);
+      t.pipe->delete_vs_state(t.pipe, vs);
+   }
+   close_test(&t);
+
+   if (verbose || !success)
+      fprintf(stderr, "recompile: %s\n", success ? "ok" : "FAILED");
+   if (fp) {
+      fprintf(fp, "%s\trecompile\n", success ? "pass" : "fail");
+      fflush(fp);
+   }
+
+   return success;
+}
+
+
+/**
+ * Destroy variants while their recompiles are still queued, with the
+ * shaders, or with the context if destroy_context.  There is one compile
+ * thread, so most of the recompiles are still queued.
+ */
+static boolean
+test_destroy_queued(unsigned verbose, FILE *fp, boolean destroy_context)
+{
+   struct test_tiered t;
+   void *vs[TEST_TIERED_QUEUED];
+   boolean success = FALSE;
+   unsigned i;
+
+   memset(vs, 0, sizeof vs);
+
+   if (!init_test(&t))
+      goto out;
+
+   for (i = 0; i < TEST_TIERED_QUEUED; i++) {
+      vs[i] = create_vs(t.pipe, 1.0f + i);
+      if (!vs[i])
+         goto out;
+      t.pipe->bind_vs_state(t.pipe, vs[i]);
+      if (!make_hot(&t)) {
+         fprintf(stderr, "variant not made hot\n");
+         goto out;
+      }
+   }
+
+   success = TRUE;
+
+out:
+   if (t.pipe && (!destroy_context || !success)) {
+      t.pipe->bind_vs_state(t.pipe, NULL);
+      for (i = 0; i < TEST_TIERED_QUEUED; i++) {
+         if (vs[i])
+            t.pipe->delete_vs_state(t.pipe, vs[i]);
+      }
+   }
+   /* Otherwise the shaders are leaked, their variants go with the context. */
+   close_test(&t);
+
+   if (verbose || !success)
+      fprintf(stderr, "destroy queued with %s: %s\n",
+              destroy_context ? "context" : "shader",
+              success ? "ok" : "FAILED");
+   if (fp) {
+      fprintf(fp, "%s\tdestroy_queued_with_%s\n",
+              success ? "pass" : "fail",
+              destroy_context ? "context" : "shader");
+      fflush(fp);
+   }
+
+   return success;
+}
+
+
+boolean
+test_all(unsigned verbose, FILE *fp)
+{
+   const unsigned saved_perf = gallivm_perf;
+   boolean success = TRUE;
+
+   /* Sets gallivm_perf from the environment, before we override it. */
+   lp_build_init();
+   gallivm_perf |= GALLIVM_PERF_TIERED;
+
+   if (!test_recompile(verbose, fp))
+      success = FALSE;
+   if (!test_destroy_queued(verbose, fp, FALSE))
+      success = FALSE;
+   if (!test_destroy_queued(verbose, fp, TRUE))
+      success = FALSE;
+
+   gallivm_perf = saved_perf;
+
+   return success;
+}
+
+
+boolean
+test_some(unsigned verbose, FILE *fp,
+          unsigned long n)
+{
+   return test_all(verbose, fp);
+}
+
+
+boolean
+test_single(unsigned verbose, FILE *fp)
+{
+   printf("no test_single()");
+   return TRUE;
+}
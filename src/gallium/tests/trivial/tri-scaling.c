@@ -0,0 +1,359 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Software rasterizer scaling benchmark.
+ *
+ * Renders the same fixed set of blended triangles with the software
+ * rasterizer for an increasing number of threads, and reports frames/sec
+ * for each thread count.
+ *
+ * Usage: tri-scaling [max threads] [frames]
+ *
+ * The thread count is passed to the driver through LP_NUM_THREADS, so the
+ * other llvmpipe variables (LP_PIN_THREADS, ...) apply as usual.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define NUM_TRIS 4096
+#define NUM_VERTS (NUM_TRIS * 3)
+
+/* pipe_*_state structs */
+#include "pipe/p_state.h"
+/* pipe_context */
+#include "pipe/p_context.h"
+/* pipe_screen */
+#include "pipe/p_screen.h"
+/* PIPE_* */
+#include "pipe/p_defines.h"
+/* TGSI_SEMANTIC_{POSITION|GENERIC} */
+#include "pipe/p_shader_tokens.h"
+/* pipe_buffer_* helpers */
+#include "util/u_inlines.h"
+
+/* constant state object helper */
+#include "cso_cache/cso_context.h"
+
+/* util_draw_vertex_buffer helper */
+#include "util/u_draw_quad.h"
+/* FREE & CALLOC_STRUCT */
+#include "util/u_memory.h"
+/* util_make_[fragment|vertex]_passthrough_shader */
+#include "util/u_simple_shaders.h"
+/* util_cpu_caps */
+#include "util/u_cpu_detect.h"
+/* os_time_get_nano */
+#include "util/os_time.h"
+/* to get a software pipe driver */
+#include "pipe-loader/pipe_loader.h"
+
+struct program
+{
+	struct pipe_loader_device *dev;
+	struct pipe_screen *screen;
+	struct pipe_context *pipe;
+	struct cso_context *cso;
+
+	struct pipe_blend_state blend;
+	struct pipe_depth_stencil_alpha_state depthstencil;
+	struct pipe_rasterizer_state rasterizer;
+	struct pipe_viewport_state viewport;
+	struct pipe_framebuffer_state framebuffer;
+	struct pipe_vertex_element velem[2];
+
+	void *vs;
+	void *fs;
+
+	union pipe_color_union clear_color;
+
+	struct pipe_resource *vbuf;
+	struct pipe_resource *target;
+};
+
+/* The trace: position and color of each vertex. */
+static float vertices[NUM_VERTS][2][4];
+
+static float rand_float(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (float)((*seed >> 8) & 0xffff) / 65535.0f;
+}
+
+/*
+ * Fill in the trace, with a fixed seed so that every run renders the same
+ * thing: a mix of many small and a few large triangles, the large ones
+ * making the load uneven across the screen.
+ */
+static void init_trace(void)
+{
+	unsigned seed = 1;
+	unsigned i, j;
+
+	for (i = 0; i < NUM_TRIS; i++) {
+		float size = (i % 64) ? 0.05f : 0.6f;
+		float cx = rand_float(&seed) * 2.0f - 1.0f;
+		float cy = rand_float(&seed) * 2.0f - 1.0f;
+
+		for (j = 0; j < 3; j++) {
+			float *pos = vertices[i * 3 + j][0];
+			float *color = vertices[i * 3 + j][1];
+
+			pos[0] = cx + (rand_float(&seed) - 0.5f) * size;
+			pos[1] = cy + (rand_float(&seed) - 0.5f) * size;
+			pos[2] = 0.0f;
+			pos[3] = 1.0f;
+
+			color[0] = rand_float(&seed);
+			color[1] = rand_float(&seed);
+			color[2] = rand_float(&seed);
+			color[3] = 0.5f;
+		}
+	}
+}
+
+static void init_prog(struct program *p)
+{
+	struct pipe_surface surf_tmpl;
+	int ret;
+
+	/* find the software device */
+	ret = pipe_loader_sw_probe_null(&p->dev);
+	assert(ret);
+
+	/* init a pipe screen */
+	p->screen = pipe_loader_create_screen(p->dev);
+	assert(p->screen);
+
+	/* create the pipe driver context and cso context */
+	p->pipe = p->screen->context_create(p->screen, NULL, 0);
+	p->cso = cso_create_context(p->pipe, 0);
+
+	/* set clear color */
+	p->clear_color.f[0] = 0.3;
+	p->clear_color.f[1] = 0.1;
+	p->clear_color.f[2] = 0.3;
+	p->clear_color.f[3] = 1.0;
+
+	/* vertex buffer */
+	p->vbuf = pipe_buffer_create(p->screen, PIPE_BIND_VERTEX_BUFFER,
+				     PIPE_USAGE_DEFAULT, sizeof(vertices));
+	pipe_buffer_write(p->pipe, p->vbuf, 0, sizeof(vertices), vertices);
+
+	/* render target texture */
+	{
+		struct pipe_resource tmplt;
+		memset(&tmplt, 0, sizeof(tmplt));
+		tmplt.target = PIPE_TEXTURE_2D;
+		tmplt.format = PIPE_FORMAT_B8G8R8A8_UNORM; /* All drivers support this */
+		tmplt.width0 = WIDTH;
+		tmplt.height0 = HEIGHT;
+		tmplt.depth0 = 1;
+		tmplt.array_size = 1;
+		tmplt.last_level = 0;
+		tmplt.bind = PIPE_BIND_RENDER_TARGET;
+
+		p->target = p->screen->resource_create(p->screen, &tmplt);
+	}
+
+	/* alpha blending, so that every fragment reads the tile */
+	memset(&p->blend, 0, sizeof(p->blend));
+	p->blend.rt[0].blend_enable = 1;
+	p->blend.rt[0].rgb_func = PIPE_BLEND_ADD;
+	p->blend.rt[0].rgb_src_factor = PIPE_BLENDFACTOR_SRC_ALPHA;
+	p->blend.rt[0].rgb_dst_factor = PIPE_BLENDFACTOR_INV_SRC_ALPHA;
+	p->blend.rt[0].alpha_func = PIPE_BLEND_ADD;
+	p->blend.rt[0].alpha_src_factor = PIPE_BLENDFACTOR_ONE;
+	p->blend.rt[0].alpha_dst_factor = PIPE_BLENDFACTOR_ZERO;
+	p->blend.rt[0].colormask = PIPE_MASK_RGBA;
+
+	/* no-op depth/stencil/alpha */
+	memset(&p->depthstencil, 0, sizeof(p->depthstencil));
+
+	/* rasterizer */
+	memset(&p->rasterizer, 0, sizeof(p->rasterizer));
+	p->rasterizer.cull_face = PIPE_FACE_NONE;
+	p->rasterizer.half_pixel_center = 1;
+	p->rasterizer.bottom_edge_rule = 1;
+	p->rasterizer.depth_clip_near = 1;
+	p->rasterizer.depth_clip_far = 1;
+
+	surf_tmpl.format = PIPE_FORMAT_B8G8R8A8_UNORM;
+	surf_tmpl.u.tex.level = 0;
+	surf_tmpl.u.tex.first_layer = 0;
+	surf_tmpl.u.tex.last_layer = 0;
+	/* drawing destination */
+	memset(&p->framebuffer, 0, sizeof(p->framebuffer));
+	p->framebuffer.width = WIDTH;
+	p->framebuffer.height = HEIGHT;
+	p->framebuffer.nr_cbufs = 1;
+	p->framebuffer.cbufs[0] = p->pipe->create_surface(p->pipe, p->target, &surf_tmpl);
+
+	/* viewport */
+	p->viewport.scale[0] = (float)WIDTH / 2.0f;
+	p->viewport.scale[1] = (float)HEIGHT / 2.0f;
+	p->viewport.scale[2] = 0.5f;
+	p->viewport.translate[0] = (float)WIDTH / 2.0f;
+	p->viewport.translate[1] = (float)HEIGHT / 2.0f;
+	p->viewport.translate[2] = 0.5f;
+
+	/* vertex elements state */
+	memset(p->velem, 0, sizeof(p->velem));
+	p->velem[0].src_offset = 0 * 4 * sizeof(float); /* offset 0, first element */
+	p->velem[0].instance_divisor = 0;
+	p->velem[0].vertex_buffer_index = 0;
+	p->velem[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+
+	p->velem[1].src_offset = 1 * 4 * sizeof(float); /* offset 16, second element */
+	p->velem[1].instance_divisor = 0;
+	p->velem[1].vertex_buffer_index = 0;
+	p->velem[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+
+	/* vertex shader */
+	{
+		const enum tgsi_semantic semantic_names[] =
+			{ TGSI_SEMANTIC_POSITION, TGSI_SEMANTIC_COLOR };
+		const uint semantic_indexes[] = { 0, 0 };
+		p->vs = util_make_vertex_passthrough_shader(p->pipe, 2, semantic_names, semantic_indexes, FALSE);
+	}
+
+	/* fragment shader */
+	p->fs = util_make_fragment_passthrough_shader(p->pipe,
+		    TGSI_SEMANTIC_COLOR, TGSI_INTERPOLATE_PERSPECTIVE, TRUE);
+}
+
+static void close_prog(struct program *p)
+{
+	cso_destroy_context(p->cso);
+
+	p->pipe->delete_vs_state(p->pipe, p->vs);
+	p->pipe->delete_fs_state(p->pipe, p->fs);
+
+	pipe_surface_reference(&p->framebuffer.cbufs[0], NULL);
+	pipe_resource_reference(&p->target, NULL);
+	pipe_resource_reference(&p->vbuf, NULL);
+
+	p->pipe->destroy(p->pipe);
+	p->screen->destroy(p->screen);
+	pipe_loader_release(&p->dev, 1);
+
+	FREE(p);
+}
+
+static void draw(struct program *p)
+{
+	struct pipe_fence_handle *fence = NULL;
+
+	/* set the render target */
+	cso_set_framebuffer(p->cso, &p->framebuffer);
+
+	/* clear the render target */
+	p->pipe->clear(p->pipe, PIPE_CLEAR_COLOR, &p->clear_color, 0, 0);
+
+	/* set misc state we care about */
+	cso_set_blend(p->cso, &p->blend);
+	cso_set_depth_stencil_alpha(p->cso, &p->depthstencil);
+	cso_set_rasterizer(p->cso, &p->rasterizer);
+	cso_set_viewport(p->cso, &p->viewport);
+
+	/* shaders */
+	cso_set_fragment_shader_handle(p->cso, p->fs);
+	cso_set_vertex_shader_handle(p->cso, p->vs);
+
+	/* vertex element data */
+	cso_set_vertex_elements(p->cso, 2, p->velem);
+
+	util_draw_vertex_buffer(p->pipe, p->cso,
+	                        p->vbuf, 0, 0,
+	                        PIPE_PRIM_TRIANGLES,
+	                        NUM_VERTS, /* verts */
+	                        2);        /* attribs/vert */
+
+	/* wait for the frame to be rendered */
+	p->pipe->flush(p->pipe, &fence, 0);
+	p->screen->fence_finish(p->screen, NULL, fence, PIPE_TIMEOUT_INFINITE);
+	p->screen->fence_reference(p->screen, &fence, NULL);
+}
+
+/* Return the frames/sec rendered with the given number of threads. */
+static double run(unsigned num_threads, unsigned num_frames)
+{
+	struct program *p = CALLOC_STRUCT(program);
+	char value[16];
+	int64_t start, end;
+	unsigned i;
+
+	snprintf(value, sizeof(value), "%u", num_threads);
+	setenv("LP_NUM_THREADS", value, 1);
+
+	init_prog(p);
+
+	/* warm up: compile the shaders and fault in the buffers */
+	draw(p);
+
+	start = os_time_get_nano();
+	for (i = 0; i < num_frames; i++)
+		draw(p);
+	end = os_time_get_nano();
+
+	close_prog(p);
+
+	return num_frames * 1e9 / (double)(end - start);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned max_threads, num_frames, num_threads;
+	double base_fps = 0.0;
+
+	util_cpu_detect();
+
+	max_threads = argc > 1 ? atoi(argv[1]) : util_cpu_caps.nr_cpus;
+	num_frames = argc > 2 ? atoi(argv[2]) : 50;
+	max_threads = MAX2(max_threads, 1);
+
+	init_trace();
+
+	printf("threads\tfps\tspeedup\n");
+
+	/* powers of two, then the maximum */
+	for (num_threads = 1; ; num_threads = MIN2(num_threads * 2, max_threads)) {
+		double fps = run(num_threads, num_frames);
+
+		if (num_threads == 1)
+			base_fps = fps;
+
+		printf("%u\t%.2f\t%.2f\n", num_threads, fps, fps / base_fps);
+		fflush(stdout);
+
+		if (num_threads == max_threads)
+			break;
+	}
+
+	return 0;
+}
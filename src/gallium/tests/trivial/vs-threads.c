@@ -0,0 +1,418 @@
+/**************************************************************************
+ *
+ * Copyright 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Vertex processing throughput benchmark.
+ *
+ * Draws many tiny triangles with an ALU heavy vertex shader, so that
+ * vertex fetch, shading, clipping and viewport transform dominate, and
+ * reports million vertices/sec with the draw module splitting the shading
+ * over 0, 1, 3 and 7 extra threads.
+ *
+ * Usage: vs-threads [frames]
+ *
+ * The thread count is read once per process, so each count runs in its own
+ * process with DRAW_VS_THREADS set.  Counts above the number of CPUs are
+ * skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define WIDTH 1024
+#define HEIGHT 1024
+#define NUM_TRIS (64 * 1024)
+#define NUM_VERTS (NUM_TRIS * 3)
+#define NUM_ALU_ITERS 16
+
+/* pipe_*_state structs */
+#include "pipe/p_state.h"
+/* pipe_context */
+#include "pipe/p_context.h"
+/* pipe_screen */
+#include "pipe/p_screen.h"
+/* PIPE_* */
+#include "pipe/p_defines.h"
+/* TGSI_SEMANTIC_{POSITION|GENERIC} */
+#include "pipe/p_shader_tokens.h"
+/* pipe_buffer_* helpers */
+#include "util/u_inlines.h"
+
+/* constant state object helper */
+#include "cso_cache/cso_context.h"
+
+/* util_draw_vertex_buffer helper */
+#include "util/u_draw_quad.h"
+/* FREE & CALLOC_STRUCT */
+#include "util/u_memory.h"
+/* util_make_fragment_passthrough_shader */
+#include "util/u_simple_shaders.h"
+/* os_time_get_nano */
+#include "util/os_time.h"
+/* tgsi_text_translate */
+#include "tgsi/tgsi_text.h"
+/* to get a software pipe driver */
+#include "pipe-loader/pipe_loader.h"
+
+struct program
+{
+	struct pipe_loader_device *dev;
+	struct pipe_screen *screen;
+	struct pipe_context *pipe;
+	struct cso_context *cso;
+
+	struct pipe_blend_state blend;
+	struct pipe_depth_stencil_alpha_state depthstencil;
+	struct pipe_rasterizer_state rasterizer;
+	struct pipe_viewport_state viewport;
+	struct pipe_framebuffer_state framebuffer;
+	struct pipe_vertex_element velem[2];
+
+	void *vs;
+	void *fs;
+
+	union pipe_color_union clear_color;
+
+	struct pipe_resource *vbuf;
+	struct pipe_resource *target;
+};
+
+/* Tiny triangles: position and color of each vertex. */
+static float vertices[NUM_VERTS][2][4];
+
+static void init_tris(void)
+{
+	static const float corners[3][2] = {
+		{ 0.0f, 0.0f }, { 1.0f, 0.0f }, { 0.0f, 1.0f },
+	};
+	unsigned i, j;
+
+	srand(0);
+
+	for (i = 0; i < NUM_TRIS; i++) {
+		float x = (float)rand() / RAND_MAX * 2.0f - 1.0f;
+		float y = (float)rand() / RAND_MAX * 2.0f - 1.0f;
+
+		for (j = 0; j < 3; j++) {
+			float *pos = vertices[i * 3 + j][0];
+			float *color = vertices[i * 3 + j][1];
+
+			/* about a pixel across */
+			pos[0] = x + corners[j][0] * 2.0f / WIDTH;
+			pos[1] = y + corners[j][1] * 2.0f / HEIGHT;
+			pos[2] = 0.0f;
+			pos[3] = 1.0f;
+
+			color[0] = (x + 1.0f) * 0.5f;
+			color[1] = (y + 1.0f) * 0.5f;
+			color[2] = (float)j / 3;
+			color[3] = 1.0f;
+		}
+	}
+}
+
+/* A vertex shader that is dominated by arithmetic on the color. */
+static void *create_alu_vs(struct pipe_context *pipe)
+{
+	static const char header[] =
+		"VERT\n"
+		"DCL IN[0]\n"
+		"DCL IN[1]\n"
+		"DCL OUT[0], POSITION\n"
+		"DCL OUT[1], COLOR\n"
+		"DCL TEMP[0..1]\n"
+		"IMM[0] FLT32 { 1.0100, 0.9900, 0.2500, 0.0000 }\n"
+		"MOV TEMP[0], IN[1]\n";
+	static const char iter[] =
+		"MUL TEMP[1], TEMP[0], TEMP[0]\n"
+		"MAD TEMP[0], TEMP[1], IMM[0].zzzz, TEMP[0]\n"
+		"MAD TEMP[0], TEMP[0], IMM[0].xxxx, -IMM[0].wwww\n"
+		"FRC TEMP[0], TEMP[0]\n";
+	static const char footer[] =
+		"MOV OUT[0], IN[0]\n"
+		"MOV OUT[1], TEMP[0]\n"
+		"END\n";
+	char text[sizeof(header) + NUM_ALU_ITERS * sizeof(iter) + sizeof(footer)];
+	struct tgsi_token tokens[1000];
+	struct pipe_shader_state state = {0};
+	unsigned i;
+
+	strcpy(text, header);
+	for (i = 0; i < NUM_ALU_ITERS; i++)
+		strcat(text, iter);
+	strcat(text, footer);
+
+	if (!tgsi_text_translate(text, tokens, ARRAY_SIZE(tokens))) {
+		assert(0);
+		return NULL;
+	}
+	pipe_shader_state_from_tgsi(&state, tokens);
+
+	return pipe->create_vs_state(pipe, &state);
+}
+
+static void init_prog(struct program *p)
+{
+	struct pipe_surface surf_tmpl;
+	int ret;
+
+	/* find the software device */
+	ret = pipe_loader_sw_probe_null(&p->dev);
+	assert(ret);
+
+	/* init a pipe screen */
+	p->screen = pipe_loader_create_screen(p->dev);
+	assert(p->screen);
+
+	/* create the pipe driver context and cso context */
+	p->pipe = p->screen->context_create(p->screen, NULL, 0);
+	p->cso = cso_create_context(p->pipe, 0);
+
+	/* set clear color */
+	p->clear_color.f[0] = 0.3;
+	p->clear_color.f[1] = 0.1;
+	p->clear_color.f[2] = 0.3;
+	p->clear_color.f[3] = 1.0;
+
+	/* vertex buffer */
+	p->vbuf = pipe_buffer_create(p->screen, PIPE_BIND_VERTEX_BUFFER,
+				     PIPE_USAGE_DEFAULT, sizeof(vertices));
+	pipe_buffer_write(p->pipe, p->vbuf, 0, sizeof(vertices), vertices);
+
+	/* render target texture */
+	{
+		struct pipe_resource tmplt;
+		memset(&tmplt, 0, sizeof(tmplt));
+		tmplt.target = PIPE_TEXTURE_2D;
+		tmplt.format = PIPE_FORMAT_B8G8R8A8_UNORM; /* All drivers support this */
+		tmplt.width0 = WIDTH;
+		tmplt.height0 = HEIGHT;
+		tmplt.depth0 = 1;
+		tmplt.array_size = 1;
+		tmplt.last_level = 0;
+		tmplt.bind = PIPE_BIND_RENDER_TARGET;
+
+		p->target = p->screen->resource_create(p->screen, &tmplt);
+	}
+
+	/* opaque writes */
+	memset(&p->blend, 0, sizeof(p->blend));
+	p->blend.rt[0].colormask = PIPE_MASK_RGBA;
+
+	/* no-op depth/stencil/alpha */
+	memset(&p->depthstencil, 0, sizeof(p->depthstencil));
+
+	/* rasterizer */
+	memset(&p->rasterizer, 0, sizeof(p->rasterizer));
+	p->rasterizer.cull_face = PIPE_FACE_NONE;
+	p->rasterizer.half_pixel_center = 1;
+	p->rasterizer.bottom_edge_rule = 1;
+	p->rasterizer.depth_clip_near = 1;
+	p->rasterizer.depth_clip_far = 1;
+
+	surf_tmpl.format = PIPE_FORMAT_B8G8R8A8_UNORM;
+	surf_tmpl.u.tex.level = 0;
+	surf_tmpl.u.tex.first_layer = 0;
+	surf_tmpl.u.tex.last_layer = 0;
+	/* drawing destination */
+	memset(&p->framebuffer, 0, sizeof(p->framebuffer));
+	p->framebuffer.width = WIDTH;
+	p->framebuffer.height = HEIGHT;
+	p->framebuffer.nr_cbufs = 1;
+	p->framebuffer.cbufs[0] = p->pipe->create_surface(p->pipe, p->target, &surf_tmpl);
+
+	/* viewport */
+	p->viewport.scale[0] = (float)WIDTH / 2.0f;
+	p->viewport.scale[1] = (float)HEIGHT / 2.0f;
+	p->viewport.scale[2] = 0.5f;
+	p->viewport.translate[0] = (float)WIDTH / 2.0f;
+	p->viewport.translate[1] = (float)HEIGHT / 2.0f;
+	p->viewport.translate[2] = 0.5f;
+
+	/* vertex elements state */
+	memset(p->velem, 0, sizeof(p->velem));
+	p->velem[0].src_offset = 0 * 4 * sizeof(float); /* offset 0, first element */
+	p->velem[0].instance_divisor = 0;
+	p->velem[0].vertex_buffer_index = 0;
+	p->velem[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+
+	p->velem[1].src_offset = 1 * 4 * sizeof(float); /* offset 16, second element */
+	p->velem[1].instance_divisor = 0;
+	p->velem[1].vertex_buffer_index = 0;
+	p->velem[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+
+	/* vertex shader */
+	p->vs = create_alu_vs(p->pipe);
+
+	/* fragment shader */
+	p->fs = util_make_fragment_passthrough_shader(p->pipe,
+	                                              TGSI_SEMANTIC_COLOR,
+	                                              TGSI_INTERPOLATE_PERSPECTIVE,
+	                                              TRUE);
+}
+
+static void close_prog(struct program *p)
+{
+	cso_destroy_context(p->cso);
+
+	p->pipe->delete_vs_state(p->pipe, p->vs);
+	p->pipe->delete_fs_state(p->pipe, p->fs);
+
+	pipe_surface_reference(&p->framebuffer.cbufs[0], NULL);
+	pipe_resource_reference(&p->target, NULL);
+	pipe_resource_reference(&p->vbuf, NULL);
+
+	p->pipe->destroy(p->pipe);
+	p->screen->destroy(p->screen);
+	pipe_loader_release(&p->dev, 1);
+
+	FREE(p);
+}
+
+static void draw(struct program *p)
+{
+	struct pipe_fence_handle *fence = NULL;
+
+	/* set the render target */
+	cso_set_framebuffer(p->cso, &p->framebuffer);
+
+	/* clear the render target */
+	p->pipe->clear(p->pipe, PIPE_CLEAR_COLOR, &p->clear_color, 0, 0);
+
+	/* set misc state we care about */
+	cso_set_blend(p->cso, &p->blend);
+	cso_set_depth_stencil_alpha(p->cso, &p->depthstencil);
+	cso_set_rasterizer(p->cso, &p->rasterizer);
+	cso_set_viewport(p->cso, &p->viewport);
+
+	/* shaders */
+	cso_set_fragment_shader_handle(p->cso, p->fs);
+	cso_set_vertex_shader_handle(p->cso, p->vs);
+
+	/* vertex element data */
+	cso_set_vertex_elements(p->cso, 2, p->velem);
+
+	util_draw_vertex_buffer(p->pipe, p->cso,
+	                        p->vbuf, 0, 0,
+	                        PIPE_PRIM_TRIANGLES,
+	                        NUM_VERTS, /* verts */
+	                        2);        /* attribs/vert */
+
+	/* wait for the frame to be rendered */
+	p->pipe->flush(p->pipe, &fence, 0);
+	p->screen->fence_finish(p->screen, NULL, fence, PIPE_TIMEOUT_INFINITE);
+	p->screen->fence_reference(p->screen, &fence, NULL);
+}
+
+/* Return the million vertices/sec processed in this process. */
+static double run(unsigned num_frames)
+{
+	struct program *p = CALLOC_STRUCT(program);
+	int64_t start, end;
+	unsigned i;
+
+	init_prog(p);
+
+	/* warm up: compile the shaders and fault in the buffers */
+	draw(p);
+
+	start = os_time_get_nano();
+	for (i = 0; i < num_frames; i++)
+		draw(p);
+	end = os_time_get_nano();
+
+	close_prog(p);
+
+	return (double)num_frames * NUM_VERTS * 1e3 / (double)(end - start);
+}
+
+/* Run with the given number of vertex shader threads in a child process. */
+static double run_threads(unsigned threads, unsigned num_frames)
+{
+	double mverts = 0.0;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		return 0.0;
+
+	pid = fork();
+	if (pid == 0) {
+		char value[16];
+
+		close(fds[0]);
+		snprintf(value, sizeof(value), "%u", threads);
+		setenv("DRAW_VS_THREADS", value, 1);
+
+		mverts = run(num_frames);
+		if (write(fds[1], &mverts, sizeof(mverts)) != sizeof(mverts))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (pid > 0) {
+		if (read(fds[0], &mverts, sizeof(mverts)) != sizeof(mverts))
+			mverts = 0.0;
+		waitpid(pid, NULL, 0);
+	}
+	close(fds[0]);
+
+	return mverts;
+}
+
+int main(int argc, char** argv)
+{
+	static const unsigned thread_counts[] = { 0, 1, 3, 7 };
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned num_frames, i;
+	double base_mverts = 0.0;
+
+	num_frames = argc > 1 ? atoi(argv[1]) : 20;
+
+	init_tris();
+
+	printf("threads\tMvert/s\tspeedup\n");
+
+	for (i = 0; i < ARRAY_SIZE(thread_counts); i++) {
+		double mverts;
+
+		if (i > 0 && thread_counts[i] >= num_cpus)
+			break;
+
+		mverts = run_threads(thread_counts[i], num_frames);
+		if (i == 0)
+			base_mverts = mverts;
+
+		printf("%u\t%.1f\t%.2f\n", thread_counts[i], mverts,
+		       base_mverts > 0.0 ? mverts / base_mverts : 0.0);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "util/u_cpu_detect.h"
+#include "util/u_math.h"
+#include "util/u_memory.h"
+#include "draw/draw_pipe.h"
+#include "draw/draw_vs.h"
+
+/*
+ * Checks that the batched culling ahead of the pipeline drops exactly the
+ * triangles that the scalar cull stage drops, and the ones clip_tri()
+ * trivially rejects.
+ */
+
+#define NUM_TRIS (64 * DRAW_PIPE_TRI_BATCH)
+
+struct test_vertex {
+   struct vertex_header header;
+   float data[1][4];
+};
+
+static struct test_vertex verts[NUM_TRIS][3];
+static struct vertex_header *tris[NUM_TRIS][3];
+
+static boolean passed[NUM_TRIS];
+
+static void
+capture_tri(struct draw_stage *stage, struct prim_header *header)
+{
+   passed[((char *)header->v[0] - (char *)verts) / sizeof verts[0]] = TRUE;
+}
+
+static void
+capture_flush(struct draw_stage *stage, unsigned flags)
+{
+}
+
+/* Coordinates which stress the rounding and the compares. */
+static float
+random_coord(void)
+{
+   static const float special[] = {
+      0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 1e-20f, -1e-20f, 1e-38f, 3e38f,
+      -3e38f, 1024.0f, 1024.0001f, 16777216.0f, 16777217.0f,
+   };
+   union fi fi;
+
+   switch (rand() % 8) {
+   case 0:
+      return special[rand() % ARRAY_SIZE(special)];
+   case 1:
+      fi.ui = rand() % 4 ? 0x7fc00000 : 0x7f800000; /* NaN, inf */
+      return rand() % 2 ? fi.f : -fi.f;
+   case 2:
+      return (float)(rand() % 8);  /* often collinear or degenerate */
+   default:
+      return ((float)rand() / RAND_MAX - 0.5f) * 2048.0f;
+   }
+}
+
+static void
+make_tris(void)
+{
+   unsigned i, j;
+
+   for (i = 0; i < NUM_TRIS; i++) {
+      for (j = 0; j < 3; j++) {
+         struct test_vertex *v = &verts[i][j];
+
+         memset(v, 0, sizeof *v);
+         v->header.clipmask = rand() % 4 ? 0 : rand() & 0x3f;
+         v->data[0][0] = random_coord();
+         v->data[0][1] = random_coord();
+         v->data[0][3] = 1.0f;
+         tris[i][j] = &v->header;
+      }
+
+      /* share vertices now and then, for zero area */
+      if (rand() % 8 == 0)
+         verts[i][2] = verts[i][rand() % 2];
+   }
+}
+
+int
+main(int argc, char **argv)
+{
+   static const unsigned cull_faces[] = {
+      PIPE_FACE_FRONT, PIPE_FACE_BACK, PIPE_FACE_FRONT_AND_BACK,
+   };
+   struct draw_context *draw = CALLOC_STRUCT(draw_context);
+   struct draw_vertex_shader vs;
+   struct pipe_rasterizer_state rast;
+   struct draw_stage capture;
+   struct draw_stage *cull;
+   unsigned f, ccw, clip, i, j, failures = 0;
+
+#ifdef DRAW_CULL_TEST_FMA
+   util_cpu_detect();
+   if (!util_cpu_caps.has_fma) {
+      printf("Skipped, no FMA.\n");
+      FREE(draw);
+      return 77;
+   }
+#endif
+
+   memset(&vs, 0, sizeof vs);
+   memset(&rast, 0, sizeof rast);
+   memset(&capture, 0, sizeof capture);
+   capture.tri = capture_tri;
+   capture.flush = capture_flush;
+
+   draw->vs.vertex_shader = &vs;
+   draw->vs.position_output = 0;
+   draw->rasterizer = &rast;
+
+   cull = draw_cull_stage(draw);
+   cull->next = &capture;
+
+   srand(0);
+   make_tris();
+
+   for (f = 0; f < ARRAY_SIZE(cull_faces); f++) {
+      for (ccw = 0; ccw < 2; ccw++) {
+         for (clip = 0; clip < 2; clip++) {
+            rast.cull_face = cull_faces[f];
+            rast.front_ccw = ccw;
+            cull->flush(cull, 0);
+
+            /* the scalar path: clip_tri() passes unclipped ones to cull */
+            for (i = 0; i < NUM_TRIS; i++) {
+               const unsigned m0 = tris[i][0]->clipmask;
+               const unsigned m1 = tris[i][1]->clipmask;
+               const unsigned m2 = tris[i][2]->clipmask;
+               struct prim_header header;
+
+               passed[i] = FALSE;
+               header.v[0] = tris[i][0];
+               header.v[1] = tris[i][1];
+               header.v[2] = tris[i][2];
+               header.flags = 0;
+               header.pad = 0;
+
+               if (clip && (m0 & m1 & m2))
+                  continue;
+               if (clip && (m0 | m1 | m2)) {
+                  passed[i] = TRUE;  /* clipped, never batch culled */
+                  continue;
+               }
+               cull->tri(cull, &header);
+            }
+
+            for (i = 0; i < NUM_TRIS; i += DRAW_PIPE_TRI_BATCH) {
+               /* also batches shorter than a full one */
+               unsigned count = i % 3 ? DRAW_PIPE_TRI_BATCH :
+                                        DRAW_PIPE_TRI_BATCH - 3;
+               unsigned culled = draw_cull_tri_batch(
+                  (struct vertex_header *const (*)[3])&tris[i], count,
+                  0, clip, TRUE, rast.cull_face, rast.front_ccw);
+
+               for (j = 0; j < count; j++) {
+                  if (!(culled & (1u << j)) != !!passed[i + j]) {
+                     const float *p0 = tris[i + j][0]->data[0];
+                     const float *p1 = tris[i + j][1]->data[0];
+                     const float *p2 = tris[i + j][2]->data[0];
+                     printf("triangle (%g %g) (%g %g) (%g %g) cull_face %u "
+                            "front_ccw %u clip %u: batch %s, scalar %s\n",
+                            p0[0], p0[1], p1[0], p1[1], p2[0], p2[1],
+                            rast.cull_face, ccw, clip,
+                            culled & (1u << j) ? "culled" : "passed",
+                            passed[i + j] ? "passed" : "culled");
+                     failures++;
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   cull->destroy(cull);
+   FREE(draw);
+
+   if (failures) {
+      printf("Failure! %u triangles culled differently.\n", failures);
+      return 1;
+   }
+
+   printf("Success!\n");
+   return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/u_memory.h"
+#include "indices/u_vertex_cache.h"
+
+#define GRID 64
+#define NUM_VERTS ((GRID + 1) * (GRID + 1))
+#define NUM_INDICES (GRID * GRID * 6)
+#define CACHE_SIZE 16
+
+static unsigned indices[NUM_INDICES];
+static unsigned optimized[NUM_INDICES];
+
+/* A grid of quads, two triangles each, in random order. */
+static void
+make_shuffled_grid(void)
+{
+   unsigned x, y, i, n = 0;
+
+   for (y = 0; y < GRID; y++) {
+      for (x = 0; x < GRID; x++) {
+         unsigned v = y * (GRID + 1) + x;
+
+         indices[n++] = v;
+         indices[n++] = v + 1;
+         indices[n++] = v + GRID + 1;
+         indices[n++] = v + GRID + 1;
+         indices[n++] = v + 1;
+         indices[n++] = v + GRID + 2;
+      }
+   }
+
+   srand(0);
+   for (i = NUM_INDICES / 3 - 1; i > 0; i--) {
+      unsigned j = rand() % (i + 1), k;
+
+      for (k = 0; k < 3; k++) {
+         unsigned tmp = indices[i * 3 + k];
+         indices[i * 3 + k] = indices[j * 3 + k];
+         indices[j * 3 + k] = tmp;
+      }
+   }
+}
+
+static int
+compare_tris(const void *a, const void *b)
+{
+   return memcmp(a, b, 3 * sizeof(unsigned));
+}
+
+/* Whether b holds the triangles of a, with the same vertex order. */
+static boolean
+same_triangles(const unsigned *a, const unsigned *b, unsigned num_indices)
+{
+   unsigned *sa = MALLOC(num_indices * sizeof(unsigned));
+   unsigned *sb = MALLOC(num_indices * sizeof(unsigned));
+   boolean same;
+
+   memcpy(sa, a, num_indices * sizeof(unsigned));
+   memcpy(sb, b, num_indices * sizeof(unsigned));
+   qsort(sa, num_indices / 3, 3 * sizeof(unsigned), compare_tris);
+   qsort(sb, num_indices / 3, 3 * sizeof(unsigned), compare_tris);
+   same = memcmp(sa, sb, num_indices * sizeof(unsigned)) == 0;
+
+   FREE(sa);
+   FREE(sb);
+   return same;
+}
+
+int
+main(int argc, char **argv)
+{
+   static const unsigned bad[] = { 0, 1, NUM_VERTS };
+   float before, after;
+
+   make_shuffled_grid();
+
+   if (!u_vertex_cache_optimize(indices, NUM_INDICES, NUM_VERTS, CACHE_SIZE,
+                                optimized)) {
+      printf("Failure! Could not reorder the triangles.\n");
+      return 1;
+   }
+
+   if (!same_triangles(indices, optimized, NUM_INDICES)) {
+      printf("Failure! Reordering changed the triangles.\n");
+      return 1;
+   }
+
+   before = u_vertex_cache_acmr(indices, NUM_INDICES, NUM_VERTS, CACHE_SIZE);
+   after = u_vertex_cache_acmr(optimized, NUM_INDICES, NUM_VERTS, CACHE_SIZE);
+   printf("ACMR %.3f shuffled, %.3f reordered\n", before, after);
+
+   /* a shuffled grid misses nearly always, a well ordered one about once
+    * per two triangles */
+   if (before < 2.0f || after > 1.0f) {
+      printf("Failure! Expected the reordering to reduce the ACMR.\n");
+      return 1;
+   }
+
+   if (u_vertex_cache_optimize(bad, ARRAY_SIZE(bad), NUM_VERTS, CACHE_SIZE,
+                               optimized)) {
+      printf("Failure! Accepted an index out of range.\n");
+      return 1;
+   }
+
+   printf("Success!\n");
+   return 0;
+}
@@ -0,0 +1,632 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Implements the subset of the magma client API used by the anv magma backend on top of plain
+// Linux primitives, so the host side of the driver can run without a GPU:
+//
+// - Buffers are memfds; buffer handles are dup'd fds that can be mmap'd.
+// - Semaphores are eventfds; a signaled semaphore is a readable eventfd.
+// - The notification channel is an eventfd that is readable while completed buffer ids are
+//   pending.
+// - Command buffers complete when executed, or MAGMA_SHIM_DELAY_US microseconds later from a
+//   per-connection completion thread.
+//
+// Nothing is executed; gpu mappings and wait semaphores are accepted and ignored.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "magma.h"
+#include "msd_intel_gen_query.h"
+#include "util/hash_table.h"
+#include "util/list.h"
+#include "util/macros.h"
+#include "util/u_dynarray.h"
+
+#ifndef HAVE_MEMFD_CREATE
+#include <sys/syscall.h>
+
+static inline int memfd_create(const char* name, unsigned int flags)
+{
+   return syscall(SYS_memfd_create, name, flags);
+}
+#endif
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_USEC 1000ull
+
+/* Poll items that fit on the stack; magma_wait polls one per semaphore plus the channel. */
+#define SHIM_POLL_ITEMS_INLINE 16
+
+// Kaby Lake GT2, with its subslice and EU counts.
+#define SHIM_DEFAULT_DEVICE_ID 0x5916
+#define SHIM_SUBSLICE_TOTAL 3
+#define SHIM_EU_TOTAL 24
+#define SHIM_GTT_SIZE (1ull << 48)
+
+struct shim_buffer {
+   uint64_t id;
+   uint64_t size;
+   int fd;
+};
+
+struct shim_semaphore {
+   uint64_t id;
+   int fd;
+};
+
+// A command buffer waiting for its completion time.
+struct shim_completion {
+   struct list_head link;
+   uint64_t deadline_ns;
+   uint32_t buffer_id_count;
+   uint32_t semaphore_id_count;
+   uint64_t ids[]; // buffer ids followed by signal semaphore ids
+};
+
+struct shim_connection {
+   struct magma_connection base;
+
+   uint64_t delay_ns;
+
+   // Completed buffer ids not yet read from the notification channel.
+   pthread_mutex_t notification_mutex;
+   struct util_dynarray notifications;
+   size_t notification_offset;
+   int notification_fd;
+
+   pthread_mutex_t completion_mutex;
+   pthread_cond_t completion_cond;
+   struct list_head completions;
+   pthread_t completion_thread;
+   bool completion_thread_started;
+   bool stop;
+};
+
+static atomic_uint_fast64_t next_id = 1;
+
+// Semaphores are signaled by id on completion, so keep a process-wide registry as the
+// system driver does.
+static pthread_mutex_t semaphore_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table_u64* semaphores;
+
+static uint64_t gettime_ns(void)
+{
+   struct timespec current;
+   clock_gettime(CLOCK_MONOTONIC, &current);
+   return (uint64_t)current.tv_sec * NSEC_PER_SEC + current.tv_nsec;
+}
+
+static uint64_t get_env_u64(const char* name, uint64_t default_value)
+{
+   const char* str = getenv(name);
+   if (!str)
+      return default_value;
+   return strtoull(str, NULL, 0);
+}
+
+static struct shim_connection* shim_connection(magma_connection_t connection)
+{
+   return (struct shim_connection*)connection;
+}
+
+static struct shim_buffer* shim_buffer(magma_buffer_t buffer)
+{
+   return (struct shim_buffer*)(uintptr_t)buffer;
+}
+
+static struct shim_semaphore* shim_semaphore(magma_semaphore_t semaphore)
+{
+   return (struct shim_semaphore*)(uintptr_t)semaphore;
+}
+
+static void eventfd_signal(int fd)
+{
+   uint64_t value = 1;
+   ssize_t result = write(fd, &value, sizeof(value));
+   assert(result == sizeof(value));
+   (void)result;
+}
+
+static void eventfd_drain(int fd)
+{
+   uint64_t value;
+   // EAGAIN if already drained.
+   (void)read(fd, &value, sizeof(value));
+}
+
+static void notify(struct shim_connection* connection, const uint64_t* buffer_ids, uint32_t count)
+{
+   pthread_mutex_lock(&connection->notification_mutex);
+   bool was_empty = connection->notifications.size == connection->notification_offset;
+   void* dst = util_dynarray_grow_bytes(&connection->notifications, count, sizeof(uint64_t));
+   memcpy(dst, buffer_ids, count * sizeof(uint64_t));
+   if (was_empty)
+      eventfd_signal(connection->notification_fd);
+   pthread_mutex_unlock(&connection->notification_mutex);
+}
+
+static void signal_semaphore_ids(const uint64_t* semaphore_ids, uint32_t count)
+{
+   pthread_mutex_lock(&semaphore_mutex);
+   for (uint32_t i = 0; i < count; i++) {
+      struct shim_semaphore* semaphore = _mesa_hash_table_u64_search(semaphores, semaphore_ids[i]);
+      if (semaphore)
+         eventfd_signal(semaphore->fd);
+   }
+   pthread_mutex_unlock(&semaphore_mutex);
+}
+
+static void complete(struct shim_connection* connection, struct shim_completion* completion)
+{
+   // Signal first so a client that sees the buffers retire also sees the semaphores.
+   signal_semaphore_ids(completion->ids + completion->buffer_id_count,
+                        completion->semaphore_id_count);
+   notify(connection, completion->ids, completion->buffer_id_count);
+}
+
+static void* completion_thread(void* arg)
+{
+   struct shim_connection* connection = arg;
+
+   pthread_mutex_lock(&connection->completion_mutex);
+   while (!connection->stop) {
+      if (list_is_empty(&connection->completions)) {
+         pthread_cond_wait(&connection->completion_cond, &connection->completion_mutex);
+         continue;
+      }
+
+      // The delay is constant so completions are queued in deadline order.
+      struct shim_completion* completion =
+          list_first_entry(&connection->completions, struct shim_completion, link);
+      if (gettime_ns() < completion->deadline_ns) {
+         struct timespec deadline = {
+             .tv_sec = completion->deadline_ns / NSEC_PER_SEC,
+             .tv_nsec = completion->deadline_ns % NSEC_PER_SEC,
+         };
+         pthread_cond_timedwait(&connection->completion_cond, &connection->completion_mutex,
+                                &deadline);
+         continue;
+      }
+
+      list_del(&completion->link);
+      pthread_mutex_unlock(&connection->completion_mutex);
+      complete(connection, completion);
+      free(completion);
+      pthread_mutex_lock(&connection->completion_mutex);
+   }
+   pthread_mutex_unlock(&connection->completion_mutex);
+
+   return NULL;
+}
+
+magma_status_t magma_device_import(magma_handle_t device_channel, magma_device_t* device_out)
+{
+   // Any openable node will do; there is no device behind it.
+   close(device_channel);
+   *device_out = 1;
+   return MAGMA_STATUS_OK;
+}
+
+void magma_device_release(magma_device_t device) {}
+
+magma_status_t magma_query2(magma_device_t device, uint64_t id, uint64_t* value_out)
+{
+   switch (id) {
+   case MAGMA_QUERY_DEVICE_ID:
+      *value_out = get_env_u64("MAGMA_SHIM_DEVICE_ID", SHIM_DEFAULT_DEVICE_ID);
+      return MAGMA_STATUS_OK;
+   case kMsdIntelGenQuerySubsliceAndEuTotal:
+      *value_out = ((uint64_t)SHIM_SUBSLICE_TOTAL << 32) | SHIM_EU_TOTAL;
+      return MAGMA_STATUS_OK;
+   case kMsdIntelGenQueryGttSize:
+      *value_out = SHIM_GTT_SIZE;
+      return MAGMA_STATUS_OK;
+   case kMsdIntelGenQueryExtraPageCount:
+      *value_out = 1;
+      return MAGMA_STATUS_OK;
+   default:
+      return MAGMA_STATUS_INVALID_ARGS;
+   }
+}
+
+magma_status_t magma_create_connection2(magma_device_t device, magma_connection_t* connection_out)
+{
+   struct shim_connection* connection = calloc(1, sizeof(*connection));
+   if (!connection)
+      return MAGMA_STATUS_MEMORY_ERROR;
+
+   connection->notification_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (connection->notification_fd < 0) {
+      free(connection);
+      return MAGMA_STATUS_INTERNAL_ERROR;
+   }
+
+   connection->delay_ns = get_env_u64("MAGMA_SHIM_DELAY_US", 0) * NSEC_PER_USEC;
+
+   pthread_mutex_init(&connection->notification_mutex, NULL);
+   util_dynarray_init(&connection->notifications, NULL);
+
+   pthread_mutex_init(&connection->completion_mutex, NULL);
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&connection->completion_cond, &attr);
+   pthread_condattr_destroy(&attr);
+   list_inithead(&connection->completions);
+
+   if (connection->delay_ns) {
+      connection->completion_thread_started =
+          pthread_create(&connection->completion_thread, NULL, completion_thread, connection) ==
+          0;
+      if (!connection->completion_thread_started) {
+         fprintf(stderr, "magma-shim: failed to start completion thread\n");
+         connection->delay_ns = 0;
+      }
+   }
+
+   *connection_out = &connection->base;
+   return MAGMA_STATUS_OK;
+}
+
+void magma_release_connection(magma_connection_t magma_connection)
+{
+   struct shim_connection* connection = shim_connection(magma_connection);
+
+   if (connection->completion_thread_started) {
+      pthread_mutex_lock(&connection->completion_mutex);
+      connection->stop = true;
+      pthread_cond_signal(&connection->completion_cond);
+      pthread_mutex_unlock(&connection->completion_mutex);
+      pthread_join(connection->completion_thread, NULL);
+   }
+
+   list_for_each_entry_safe(struct shim_completion, completion, &connection->completions, link)
+   {
+      free(completion);
+   }
+
+   pthread_cond_destroy(&connection->completion_cond);
+   pthread_mutex_destroy(&connection->completion_mutex);
+   util_dynarray_fini(&connection->notifications);
+   pthread_mutex_destroy(&connection->notification_mutex);
+   close(connection->notification_fd);
+   free(connection);
+}
+
+void magma_create_context(magma_connection_t connection, uint32_t* context_id_out)
+{
+   *context_id_out = (uint32_t)atomic_fetch_add(&next_id, 1);
+}
+
+void magma_release_context(magma_connection_t connection, uint32_t context_id) {}
+
+magma_status_t magma_create_buffer(magma_connection_t connection, uint64_t size,
+                                   uint64_t* size_out, magma_buffer_t* buffer_out)
+{
+   uint64_t page_size = sysconf(_SC_PAGESIZE);
+   size = (size + page_size - 1) & ~(page_size - 1);
+
+   int fd = memfd_create("magma-shim buffer", MFD_CLOEXEC);
+   if (fd < 0)
+      return MAGMA_STATUS_MEMORY_ERROR;
+
+   if (ftruncate(fd, size) != 0) {
+      close(fd);
+      return MAGMA_STATUS_MEMORY_ERROR;
+   }
+
+   struct shim_buffer* buffer = malloc(sizeof(*buffer));
+   buffer->id = atomic_fetch_add(&next_id, 1);
+   buffer->size = size;
+   buffer->fd = fd;
+
+   *size_out = size;
+   *buffer_out = (magma_buffer_t)(uintptr_t)buffer;
+   return MAGMA_STATUS_OK;
+}
+
+void magma_release_buffer(magma_connection_t connection, magma_buffer_t magma_buffer)
+{
+   struct shim_buffer* buffer = shim_buffer(magma_buffer);
+   close(buffer->fd);
+   free(buffer);
+}
+
+uint64_t magma_get_buffer_id(magma_buffer_t buffer) { return shim_buffer(buffer)->id; }
+
+uint64_t magma_get_buffer_size(magma_buffer_t buffer) { return shim_buffer(buffer)->size; }
+
+magma_status_t magma_get_buffer_handle(magma_connection_t connection, magma_buffer_t buffer,
+                                       magma_handle_t* handle_out)
+{
+   int fd = fcntl(shim_buffer(buffer)->fd, F_DUPFD_CLOEXEC, 0);
+   if (fd < 0)
+      return MAGMA_STATUS_INTERNAL_ERROR;
+   *handle_out = fd;
+   return MAGMA_STATUS_OK;
+}
+
+magma_status_t magma_export(magma_connection_t connection, magma_buffer_t buffer,
+                            magma_handle_t* buffer_handle_out)
+{
+   return magma_get_buffer_handle(connection, buffer, buffer_handle_out);
+}
+
+magma_status_t magma_import(magma_connection_t connection, magma_handle_t buffer_handle,
+                            magma_buffer_t* buffer_out)
+{
+   struct stat stat;
+   if (fstat(buffer_handle, &stat) != 0)
+      return MAGMA_STATUS_INVALID_ARGS;
+
+   // The import gets its own id; the memory is shared through the fd.
+   struct shim_buffer* buffer = malloc(sizeof(*buffer));
+   buffer->id = atomic_fetch_add(&next_id, 1);
+   buffer->size = stat.st_size;
+   buffer->fd = buffer_handle;
+
+   *buffer_out = (magma_buffer_t)(uintptr_t)buffer;
+   return MAGMA_STATUS_OK;
+}
+
+void magma_map_buffer_gpu(magma_connection_t connection, magma_buffer_t buffer,
+                          uint64_t page_offset, uint64_t page_count, uint64_t gpu_va,
+                          uint64_t map_flags)
+{
+}
+
+static magma_status_t add_semaphore(int fd, magma_semaphore_t* semaphore_out)
+{
+   struct shim_semaphore* semaphore = malloc(sizeof(*semaphore));
+   semaphore->id = atomic_fetch_add(&next_id, 1);
+   semaphore->fd = fd;
+
+   pthread_mutex_lock(&semaphore_mutex);
+   if (!semaphores)
+      semaphores = _mesa_hash_table_u64_create(NULL);
+   _mesa_hash_table_u64_insert(semaphores, semaphore->id, semaphore);
+   pthread_mutex_unlock(&semaphore_mutex);
+
+   *semaphore_out = (magma_semaphore_t)(uintptr_t)semaphore;
+   return MAGMA_STATUS_OK;
+}
+
+magma_status_t magma_create_semaphore(magma_connection_t connection,
+                                      magma_semaphore_t* semaphore_out)
+{
+   int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (fd < 0)
+      return MAGMA_STATUS_INTERNAL_ERROR;
+   return add_semaphore(fd, semaphore_out);
+}
+
+void magma_release_semaphore(magma_connection_t connection, magma_semaphore_t magma_semaphore)
+{
+   struct shim_semaphore* semaphore = shim_semaphore(magma_semaphore);
+
+   pthread_mutex_lock(&semaphore_mutex);
+   _mesa_hash_table_u64_remove(semaphores, semaphore->id);
+   pthread_mutex_unlock(&semaphore_mutex);
+
+   close(semaphore->fd);
+   free(semaphore);
+}
+
+uint64_t magma_get_semaphore_id(magma_semaphore_t semaphore)
+{
+   return shim_semaphore(semaphore)->id;
+}
+
+void magma_signal_semaphore(magma_semaphore_t semaphore)
+{
+   eventfd_signal(shim_semaphore(semaphore)->fd);
+}
+
+void magma_reset_semaphore(magma_semaphore_t semaphore)
+{
+   eventfd_drain(shim_semaphore(semaphore)->fd);
+}
+
+magma_status_t magma_export_semaphore(magma_connection_t connection, magma_semaphore_t semaphore,
+                                      magma_handle_t* semaphore_handle_out)
+{
+   int fd = fcntl(shim_semaphore(semaphore)->fd, F_DUPFD_CLOEXEC, 0);
+   if (fd < 0)
+      return MAGMA_STATUS_INTERNAL_ERROR;
+   *semaphore_handle_out = fd;
+   return MAGMA_STATUS_OK;
+}
+
+magma_status_t magma_import_semaphore(magma_connection_t connection,
+                                      magma_handle_t semaphore_handle,
+                                      magma_semaphore_t* semaphore_out)
+{
+   // As with buffers the import gets its own id; the eventfd carries the signaled state.
+   return add_semaphore(semaphore_handle, semaphore_out);
+}
+
+void magma_execute_command_buffer_with_resources(magma_connection_t magma_connection,
+                                                 uint32_t context_id,
+                                                 struct magma_system_command_buffer* command_buffer,
+                                                 struct magma_system_exec_resource* resources,
+                                                 uint64_t* semaphore_ids)
+{
+   struct shim_connection* connection = shim_connection(magma_connection);
+
+   uint32_t buffer_id_count = command_buffer->resource_count;
+   uint32_t semaphore_id_count = command_buffer->signal_semaphore_count;
+
+   struct shim_completion* completion =
+       malloc(sizeof(*completion) + (buffer_id_count + semaphore_id_count) * sizeof(uint64_t));
+   completion->buffer_id_count = buffer_id_count;
+   completion->semaphore_id_count = semaphore_id_count;
+
+   for (uint32_t i = 0; i < buffer_id_count; i++)
+      completion->ids[i] = resources[i].buffer_id;
+
+   // Signal semaphores follow the wait semaphores.
+   memcpy(completion->ids + buffer_id_count,
+          semaphore_ids + command_buffer->wait_semaphore_count,
+          semaphore_id_count * sizeof(uint64_t));
+
+   if (!connection->delay_ns) {
+      complete(connection, completion);
+      free(completion);
+      return;
+   }
+
+   completion->deadline_ns = gettime_ns() + connection->delay_ns;
+
+   pthread_mutex_lock(&connection->completion_mutex);
+   bool was_empty = list_is_empty(&connection->completions);
+   list_addtail(&completion->link, &connection->completions);
+   if (was_empty)
+      pthread_cond_signal(&connection->completion_cond);
+   pthread_mutex_unlock(&connection->completion_mutex);
+}
+
+magma_handle_t magma_get_notification_channel_handle(magma_connection_t connection)
+{
+   return shim_connection(connection)->notification_fd;
+}
+
+magma_status_t magma_read_notification_channel2(magma_connection_t magma_connection, void* buffer,
+                                                uint64_t buffer_size, uint64_t* buffer_size_out,
+                                                magma_bool_t* more_data_out)
+{
+   struct shim_connection* connection = shim_connection(magma_connection);
+
+   pthread_mutex_lock(&connection->notification_mutex);
+
+   size_t available = connection->notifications.size - connection->notification_offset;
+   size_t size = MIN2(available, buffer_size - buffer_size % sizeof(uint64_t));
+
+   memcpy(buffer, (uint8_t*)connection->notifications.data + connection->notification_offset,
+          size);
+   connection->notification_offset += size;
+
+   bool more_data = size < available;
+   if (!more_data) {
+      util_dynarray_clear(&connection->notifications);
+      connection->notification_offset = 0;
+      eventfd_drain(connection->notification_fd);
+   }
+
+   pthread_mutex_unlock(&connection->notification_mutex);
+
+   *buffer_size_out = size;
+   *more_data_out = more_data;
+   return MAGMA_STATUS_OK;
+}
+
+static magma_status_t poll_items(magma_poll_item_t* items, struct pollfd* fds, uint32_t count,
+                                 uint64_t timeout_ns)
+{
+   for (uint32_t i = 0; i < count; i++) {
+      switch (items[i].type) {
+      case MAGMA_POLL_TYPE_SEMAPHORE:
+         fds[i].fd = shim_semaphore(items[i].semaphore)->fd;
+         fds[i].events = (items[i].condition & MAGMA_POLL_CONDITION_SIGNALED) ? POLLIN : 0;
+         break;
+      case MAGMA_POLL_TYPE_HANDLE:
+         fds[i].fd = items[i].handle;
+         fds[i].events = (items[i].condition & MAGMA_POLL_CONDITION_READABLE) ? POLLIN : 0;
+         break;
+      default:
+         return MAGMA_STATUS_INVALID_ARGS;
+      }
+   }
+
+   uint64_t start_ns = gettime_ns();
+   uint64_t deadline_ns =
+       timeout_ns > UINT64_MAX - start_ns ? UINT64_MAX : start_ns + timeout_ns;
+
+   while (true) {
+      int result;
+      if (deadline_ns == UINT64_MAX) {
+         result = ppoll(fds, count, NULL, NULL);
+      } else {
+         uint64_t now = gettime_ns();
+         uint64_t remaining_ns = now < deadline_ns ? deadline_ns - now : 0;
+         struct timespec timeout = {
+             .tv_sec = remaining_ns / NSEC_PER_SEC,
+             .tv_nsec = remaining_ns % NSEC_PER_SEC,
+         };
+         result = ppoll(fds, count, &timeout, NULL);
+      }
+
+      if (result < 0) {
+         if (errno == EINTR)
+            continue;
+         return MAGMA_STATUS_INTERNAL_ERROR;
+      }
+      if (result == 0)
+         return MAGMA_STATUS_TIMED_OUT;
+      break;
+   }
+
+   for (uint32_t i = 0; i < count; i++) {
+      items[i].result = 0;
+      if (fds[i].revents & POLLIN) {
+         items[i].result = items[i].type == MAGMA_POLL_TYPE_SEMAPHORE
+                               ? MAGMA_POLL_CONDITION_SIGNALED
+                               : MAGMA_POLL_CONDITION_READABLE;
+      }
+   }
+
+   return MAGMA_STATUS_OK;
+}
+
+magma_status_t magma_poll(magma_poll_item_t* items, uint32_t count, uint64_t timeout_ns)
+{
+   /* With no items, ppoll just sleeps until the timeout. */
+   struct pollfd inline_fds[SHIM_POLL_ITEMS_INLINE];
+   struct pollfd* fds = inline_fds;
+
+   if (count > SHIM_POLL_ITEMS_INLINE) {
+      fds = malloc(count * sizeof(struct pollfd));
+      if (!fds)
+         return MAGMA_STATUS_MEMORY_ERROR;
+   }
+
+   magma_status_t status = poll_items(items, fds, count, timeout_ns);
+
+   if (fds != inline_fds)
+      free(fds);
+
+   return status;
+}
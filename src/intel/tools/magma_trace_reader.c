@@ -0,0 +1,182 @@
+/*
+ * Copyright © 2020 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/* Summarizes a trace written by the anv magma backend (ANV_MAGMA_TRACE=<file>):
+ * submit to retire latency percentiles and queue depth.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vulkan/anv_magma_trace.h"
+
+static void
+print_help(const char *progname, FILE *file)
+{
+   fprintf(file,
+           "Usage: %s [OPTION]... FILE\n"
+           "Summarize a magma submit trace.\n\n"
+           "  -h, --help          display this help and exit\n"
+           "  -r, --records       also print every record\n",
+           progname);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted values. */
+static uint64_t
+percentile(const uint64_t *sorted, uint32_t count, uint32_t pct)
+{
+   uint32_t rank = (pct * (uint64_t)count + 99) / 100;
+   return sorted[rank ? rank - 1 : 0];
+}
+
+int
+main(int argc, char *argv[])
+{
+   bool help = false, print_records = false;
+   const struct option opts[] = {
+      { "help",       no_argument,       NULL,     'h' },
+      { "records",    no_argument,       NULL,     'r' },
+      { NULL,         0,                 NULL,     0 }
+   };
+
+   int c, i = 0;
+   while ((c = getopt_long(argc, argv, "hr", opts, &i)) != -1) {
+      switch (c) {
+      case 'h':
+         help = true;
+         break;
+      case 'r':
+         print_records = true;
+         break;
+      default:
+         break;
+      }
+   }
+
+   const char *filename = optind < argc ? argv[optind] : NULL;
+   if (help || !filename) {
+      print_help(argv[0], help ? stdout : stderr);
+      return help ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   FILE *file = fopen(filename, "rb");
+   if (!file) {
+      fprintf(stderr, "Failed to open \"%s\": %m\n", filename);
+      return EXIT_FAILURE;
+   }
+
+   struct anv_magma_trace_header header;
+   if (fread(&header, sizeof(header), 1, file) != 1 ||
+       header.magic != ANV_MAGMA_TRACE_MAGIC) {
+      fprintf(stderr, "\"%s\" is not a magma trace\n", filename);
+      return EXIT_FAILURE;
+   }
+   if (header.version != ANV_MAGMA_TRACE_VERSION ||
+       header.record_size != sizeof(struct anv_magma_trace_record)) {
+      fprintf(stderr, "Unsupported trace version %u\n", header.version);
+      return EXIT_FAILURE;
+   }
+
+   struct anv_magma_trace_record *records =
+      calloc(header.record_count, sizeof(*records));
+   uint64_t *latencies = calloc(header.record_count, sizeof(*latencies));
+   if (header.record_count && (!records || !latencies)) {
+      fprintf(stderr, "Out of memory\n");
+      return EXIT_FAILURE;
+   }
+
+   if (fread(records, sizeof(*records), header.record_count, file) !=
+       header.record_count) {
+      fprintf(stderr, "Truncated trace\n");
+      return EXIT_FAILURE;
+   }
+   fclose(file);
+
+   uint32_t retired = 0, max_depth = 0;
+   uint64_t total_depth = 0, total_resources = 0, total_mappings = 0;
+
+   if (print_records)
+      printf("batch_buffer_id,submit_ns,retire_ns,resources,mappings,inflight\n");
+
+   for (uint32_t r = 0; r < header.record_count; r++) {
+      const struct anv_magma_trace_record *record = &records[r];
+
+      if (print_records) {
+         printf("%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u,%u,%u\n",
+                record->batch_buffer_id, record->submit_ns, record->retire_ns,
+                record->resource_count, record->mapping_count,
+                record->inflight_depth);
+      }
+
+      if (record->retire_ns)
+         latencies[retired++] = record->retire_ns - record->submit_ns;
+
+      total_depth += record->inflight_depth;
+      total_resources += record->resource_count;
+      total_mappings += record->mapping_count;
+      if (record->inflight_depth > max_depth)
+         max_depth = record->inflight_depth;
+   }
+
+   printf("submits:             %u (%u retired)\n", header.record_count, retired);
+
+   if (header.record_count) {
+      uint64_t duration = records[header.record_count - 1].submit_ns -
+                          records[0].submit_ns;
+      if (duration)
+         printf("submit rate:         %.1f/s\n",
+                header.record_count * 1e9 / duration);
+      printf("resources/submit:    %.1f\n",
+             (double)total_resources / header.record_count);
+      printf("mappings/submit:     %.2f\n",
+             (double)total_mappings / header.record_count);
+      printf("inflight depth:      avg %.1f max %u\n",
+             (double)total_depth / header.record_count, max_depth);
+   }
+
+   if (retired) {
+      qsort(latencies, retired, sizeof(*latencies), compare_u64);
+      printf("submit to retire us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+             percentile(latencies, retired, 50) / 1000.0,
+             percentile(latencies, retired, 90) / 1000.0,
+             percentile(latencies, retired, 99) / 1000.0,
+             latencies[retired - 1] / 1000.0);
+   }
+
+   free(records);
+   free(latencies);
+
+   return EXIT_SUCCESS;
+}
@@ -1711,6 +1711,14 @@ anv_queue_execbuf_locked(struct anv_queue *queue,
    if (result == VK_SUCCESS && submit->need_out_fence)
       submit->out_fence = execbuf.execbuf.rsvd2 >> 32;
 
+#if defined(ANV_MAGMA)
+   /* The batch buffer is the last object by drm convention. */
+   if (result == VK_SUCCESS && execbuf.bo_count > 0) {
+      submit->batch_buffer_id =
+         anv_gem_get_buffer_id(device, execbuf.bos[execbuf.bo_count - 1]->gem_handle);
+   }
+#endif
+
  error:
    pthread_cond_broadcast(&device->queue_submit);
 
@@ -22,10 +22,12 @@
  */
 
 #include "anv_magma.h"
+#include "anv_magma_constraints_cache.h"
 #include "anv_magma_map.h"
 #include "anv_private.h"
 #include "dev/gen_device_info.h" // for gen_getparam
 #include "msd_intel_gen_query.h"
+#include "util/debug.h"
 #include <sys/mman.h> // for MAP_FAILED
 
 #if defined(__linux__)
@@ -47,6 +49,15 @@
          intel_logi(__VA_ARGS__);                                                                  \
    } while (0)
 
+// Unreferenced cpu mappings are kept up to this size.
+#define MMAP_CACHE_IDLE_BYTES_MAX (64ull * 1024 * 1024)
+
+// Distinct image constraint keys remembered per device.
+#define CONSTRAINTS_CACHE_MAX_ENTRIES 256
+
+// Submits remembered when ANV_MAGMA_TRACE is set.
+#define TRACE_RECORD_COUNT 16384
+
 static magma_connection_t magma_connection(struct anv_device* device)
 {
    assert(device);
@@ -56,39 +67,57 @@ static magma_connection_t magma_connection(struct anv_device* device)
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
+// New gem handles are reserved this many at a time.
+#define BUFFER_MAP_HANDLE_BATCH 32
+
 void BufferMap_Init(struct BufferMap* map)
 {
-   size_t node_size = 8;  /* grows as necessary */
-   uint32_t sentinel = 0; /* invalid gem_handle */
+   size_t node_size = 256; /* grows as necessary */
+   uint32_t sentinel = 0;  /* invalid gem_handle */
 
    util_sparse_array_init(&map->array, sizeof(struct BufferMapEntry), node_size);
-   util_sparse_array_free_list_init(&map->free_list, &map->array, sentinel,
-                                    offsetof(struct BufferMapEntry, free_index));
+
+   for (uint32_t i = 0; i < BUFFER_MAP_SHARD_COUNT; i++) {
+      util_sparse_array_free_list_init(&map->shards[i].free_list, &map->array, sentinel,
+                                       offsetof(struct BufferMapEntry, free_index));
+   }
 
    map->next_index = 1;
 }
 
 void BufferMap_Release(struct BufferMap* map)
 {
-   struct BufferMapEntry* entry;
-   while ((entry = util_sparse_array_free_list_pop_elem(&map->free_list))) {
-   }
    util_sparse_array_finish(&map->array);
 }
 
+// Threads are spread over the shards by hashing their identity.
+static struct BufferMapShard* BufferMap_Shard(struct BufferMap* map)
+{
+   uint64_t hash = (uint64_t)(uintptr_t)pthread_self() * 0x9e3779b97f4a7c15ull;
+   return &map->shards[(hash >> 32) % BUFFER_MAP_SHARD_COUNT];
+}
+
 void BufferMap_Get(struct BufferMap* map, struct BufferMapEntry** entry_out)
 {
-   *entry_out = util_sparse_array_free_list_pop_elem(&map->free_list);
+   struct BufferMapShard* shard = BufferMap_Shard(map);
+
+   *entry_out = util_sparse_array_free_list_pop_elem(&shard->free_list);
    if (*entry_out)
       return;
 
-   uint32_t gem_handle = atomic_fetch_add(&map->next_index, 1);
+   uint32_t first = atomic_fetch_add(&map->next_index, BUFFER_MAP_HANDLE_BATCH);
 
-   struct BufferMapEntry* entry = util_sparse_array_get(&map->array, gem_handle);
+   uint32_t handles[BUFFER_MAP_HANDLE_BATCH];
+   for (uint32_t i = 0; i < BUFFER_MAP_HANDLE_BATCH; i++) {
+      handles[i] = first + i;
+      struct BufferMapEntry* entry = util_sparse_array_get(&map->array, handles[i]);
+      entry->gem_handle = handles[i];
+   }
 
-   entry->gem_handle = gem_handle;
+   // Keep the first for the caller, the rest are cached for this shard.
+   util_sparse_array_free_list_push(&shard->free_list, &handles[1], BUFFER_MAP_HANDLE_BATCH - 1);
 
-   *entry_out = entry;
+   *entry_out = util_sparse_array_get(&map->array, first);
 }
 
 void BufferMap_Query(struct BufferMap* map, uint32_t gem_handle, struct BufferMapEntry** entry_out)
@@ -100,7 +129,69 @@ void BufferMap_Query(struct BufferMap* map, uint32_t gem_handle, struct BufferMa
 
 void BufferMap_Put(struct BufferMap* map, uint32_t gem_handle)
 {
-   util_sparse_array_free_list_push(&map->free_list, &gem_handle, 1);
+   util_sparse_array_free_list_push(&BufferMap_Shard(map)->free_list, &gem_handle, 1);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void unmap_buffer(void* addr, uint64_t size);
+
+void MmapCache_Init(struct MmapCache* cache, uint64_t idle_bytes_max)
+{
+   pthread_mutex_init(&cache->mutex, NULL);
+   cache->buffers = _mesa_hash_table_u64_create(NULL);
+   cache->addrs = _mesa_pointer_hash_table_create(NULL);
+   list_inithead(&cache->idle);
+   cache->idle_bytes = 0;
+   cache->idle_bytes_max = idle_bytes_max;
+   cache->hits = 0;
+   cache->misses = 0;
+}
+
+void MmapCache_Release(struct MmapCache* cache)
+{
+   hash_table_foreach(cache->addrs, hash_entry)
+   {
+      struct MmapCacheEntry* entry = hash_entry->data;
+      if (entry->refcount == 0)
+         unmap_buffer(entry->addr, entry->size);
+      free(entry);
+   }
+   _mesa_hash_table_destroy(cache->addrs, NULL);
+   _mesa_hash_table_u64_destroy(cache->buffers, NULL);
+   pthread_mutex_destroy(&cache->mutex);
+}
+
+void MmapCache_GetStats(struct MmapCache* cache, uint64_t* hits_out, uint64_t* misses_out)
+{
+   pthread_mutex_lock(&cache->mutex);
+   *hits_out = cache->hits;
+   *misses_out = cache->misses;
+   pthread_mutex_unlock(&cache->mutex);
+}
+
+// Drops all cached mappings of the given buffer, since its gem handle may be reused.
+// Mappings still referenced are left to their owner.
+static void MmapCache_Purge(struct MmapCache* cache, uint32_t gem_handle)
+{
+   pthread_mutex_lock(&cache->mutex);
+
+   struct MmapCacheEntry* entry = _mesa_hash_table_u64_search(cache->buffers, gem_handle);
+   _mesa_hash_table_u64_remove(cache->buffers, gem_handle);
+
+   while (entry) {
+      struct MmapCacheEntry* next = entry->next;
+      _mesa_hash_table_remove_key(cache->addrs, entry->addr);
+      if (entry->refcount == 0) {
+         list_del(&entry->idle_link);
+         cache->idle_bytes -= entry->size;
+         unmap_buffer(entry->addr, entry->size);
+      }
+      free(entry);
+      entry = next;
+   }
+
+   pthread_mutex_unlock(&cache->mutex);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -116,9 +207,25 @@ int anv_gem_connect(struct anv_device* device)
 
    device->connection = AnvMagmaCreateConnection(connection);
 
-   device->connection->buffer_map = malloc(sizeof(struct BufferMap));
+   device->connection->buffer_map =
+       aligned_alloc(BUFFER_MAP_CACHE_LINE_SIZE, sizeof(struct BufferMap));
    BufferMap_Init(device->connection->buffer_map);
 
+   device->connection->mmap_cache = malloc(sizeof(struct MmapCache));
+   MmapCache_Init(device->connection->mmap_cache, MMAP_CACHE_IDLE_BYTES_MAX);
+
+   device->connection->constraints_cache = malloc(sizeof(struct ConstraintsCache));
+   ConstraintsCache_Init(device->connection->constraints_cache, CONSTRAINTS_CACHE_MAX_ENTRIES);
+
+   const char* trace_path = getenv("ANV_MAGMA_TRACE");
+   if (trace_path)
+      AnvMagmaConnectionStartTrace(device->connection, trace_path, TRACE_RECORD_COUNT);
+
+   if (env_var_as_boolean("ANV_MAGMA_COMPLETION_THREAD", false)) {
+      if (!AnvMagmaConnectionStartCompletionReader(device->connection))
+         intel_logd("Failed to start completion reader thread");
+   }
+
    LOG_VERBOSE("created magma connection");
 
    return 0;
@@ -126,6 +233,19 @@ int anv_gem_connect(struct anv_device* device)
 
 void anv_gem_disconnect(struct anv_device* device)
 {
+   uint64_t hits, misses;
+   MmapCache_GetStats(device->connection->mmap_cache, &hits, &misses);
+   intel_logd("mmap cache: %lu hits %lu misses", hits, misses);
+
+   MmapCache_Release(device->connection->mmap_cache);
+   free(device->connection->mmap_cache);
+
+   ConstraintsCache_GetStats(device->connection->constraints_cache, &hits, &misses);
+   intel_logd("constraints cache: %lu hits %lu misses", hits, misses);
+
+   ConstraintsCache_Release(device->connection->constraints_cache);
+   free(device->connection->constraints_cache);
+
    BufferMap_Release(device->connection->buffer_map);
    free(device->connection->buffer_map);
 
@@ -167,16 +287,16 @@ void anv_gem_close(struct anv_device* device, uint32_t gem_handle)
       return;
    }
 
+   MmapCache_Purge(device->connection->mmap_cache, gem_handle);
+
    AnvMagmaReleaseBuffer(device->connection, entry->buffer);
 
    BufferMap_Put(device->connection->buffer_map, gem_handle);
 }
 
-void* anv_gem_mmap(struct anv_device* device, uint32_t gem_handle, uint64_t offset, uint64_t size,
-                   uint32_t flags)
+static void* map_buffer(struct anv_device* device, uint32_t gem_handle, uint64_t offset,
+                        uint64_t size)
 {
-   assert(flags == 0);
-
    struct BufferMapEntry* entry;
    BufferMap_Query(device->connection->buffer_map, gem_handle, &entry);
    if (!entry) {
@@ -220,17 +340,14 @@ void* anv_gem_mmap(struct anv_device* device, uint32_t gem_handle, uint64_t offs
 #error Unsupported
 #endif
 
-   LOG_VERBOSE("anv_gem_mmap gem_handle %u buffer %lu offset %lu size 0x%zx returning %p",
+   LOG_VERBOSE("map_buffer gem_handle %u buffer %lu offset %lu size 0x%zx returning %p",
                gem_handle, entry->buffer->id, offset, size, addr);
 
    return addr;
 }
 
-void anv_gem_munmap(void* addr, uint64_t size)
+static void unmap_buffer(void* addr, uint64_t size)
 {
-   if (!addr)
-      return;
-
 #ifdef __Fuchsia__
    zx_status_t status = zx_vmar_unmap(zx_vmar_root_self(), addr, size);
    if (status != ZX_OK) {
@@ -247,7 +364,125 @@ void anv_gem_munmap(void* addr, uint64_t size)
    }
 #endif
 
-   LOG_VERBOSE("anv_gem_munmap addr %p sizee %lu", addr, size);
+   LOG_VERBOSE("unmap_buffer addr %p size %lu", addr, size);
+}
+
+void* anv_gem_mmap(struct anv_device* device, uint32_t gem_handle, uint64_t offset, uint64_t size,
+                   uint32_t flags)
+{
+   assert(flags == 0);
+
+   struct MmapCache* cache = device->connection->mmap_cache;
+
+   pthread_mutex_lock(&cache->mutex);
+
+   struct MmapCacheEntry* entry = _mesa_hash_table_u64_search(cache->buffers, gem_handle);
+   while (entry && (entry->offset != offset || entry->size != size))
+      entry = entry->next;
+
+   if (entry) {
+      if (entry->refcount++ == 0) {
+         list_del(&entry->idle_link);
+         cache->idle_bytes -= entry->size;
+      }
+      cache->hits++;
+      pthread_mutex_unlock(&cache->mutex);
+
+      LOG_VERBOSE("anv_gem_mmap gem_handle %u offset %lu size 0x%zx cached %p", gem_handle, offset,
+                  size, entry->addr);
+      return entry->addr;
+   }
+
+   cache->misses++;
+   pthread_mutex_unlock(&cache->mutex);
+
+   void* addr = map_buffer(device, gem_handle, offset, size);
+   if (addr == MAP_FAILED)
+      return MAP_FAILED;
+
+   entry = malloc(sizeof(struct MmapCacheEntry));
+   entry->gem_handle = gem_handle;
+   entry->refcount = 1;
+   entry->offset = offset;
+   entry->size = size;
+   entry->addr = addr;
+
+   pthread_mutex_lock(&cache->mutex);
+   entry->next = _mesa_hash_table_u64_search(cache->buffers, gem_handle);
+   _mesa_hash_table_u64_insert(cache->buffers, gem_handle, entry);
+   _mesa_hash_table_insert(cache->addrs, addr, entry);
+   pthread_mutex_unlock(&cache->mutex);
+
+   return addr;
+}
+
+// Removes the entry from the cache; the caller unmaps. Must hold the cache mutex.
+static void mmap_cache_remove(struct MmapCache* cache, struct MmapCacheEntry* entry)
+{
+   struct MmapCacheEntry* head = _mesa_hash_table_u64_search(cache->buffers, entry->gem_handle);
+   if (head == entry) {
+      if (entry->next) {
+         _mesa_hash_table_u64_insert(cache->buffers, entry->gem_handle, entry->next);
+      } else {
+         _mesa_hash_table_u64_remove(cache->buffers, entry->gem_handle);
+      }
+   } else {
+      while (head->next != entry)
+         head = head->next;
+      head->next = entry->next;
+   }
+
+   _mesa_hash_table_remove_key(cache->addrs, entry->addr);
+
+   if (entry->refcount == 0) {
+      list_del(&entry->idle_link);
+      cache->idle_bytes -= entry->size;
+   }
+}
+
+void anv_gem_munmap(struct anv_device* device, void* addr, uint64_t size)
+{
+   if (!addr)
+      return;
+
+   struct MmapCache* cache = device->connection->mmap_cache;
+
+   pthread_mutex_lock(&cache->mutex);
+
+   struct hash_entry* hash_entry = _mesa_hash_table_search(cache->addrs, addr);
+   if (!hash_entry) {
+      // Not a mapping returned by anv_gem_mmap, eg. an interior pointer.
+      pthread_mutex_unlock(&cache->mutex);
+      unmap_buffer(addr, size);
+      return;
+   }
+
+   struct MmapCacheEntry* entry = hash_entry->data;
+   assert(entry->size == size);
+   assert(entry->refcount > 0);
+
+   if (--entry->refcount == 0) {
+      // Defer the unmap; the same range is likely to be mapped again.
+      list_addtail(&entry->idle_link, &cache->idle);
+      cache->idle_bytes += entry->size;
+   }
+
+   struct list_head evicted;
+   list_inithead(&evicted);
+
+   while (cache->idle_bytes > cache->idle_bytes_max) {
+      struct MmapCacheEntry* lru = list_first_entry(&cache->idle, struct MmapCacheEntry, idle_link);
+      mmap_cache_remove(cache, lru);
+      list_addtail(&lru->idle_link, &evicted);
+   }
+
+   pthread_mutex_unlock(&cache->mutex);
+
+   list_for_each_entry_safe(struct MmapCacheEntry, lru, &evicted, idle_link)
+   {
+      unmap_buffer(lru->addr, lru->size);
+      free(lru);
+   }
 }
 
 uint32_t anv_gem_userptr(struct anv_device* device, void* mem, size_t size)
@@ -285,8 +520,12 @@ int anv_gem_wait(struct anv_device* device, uint32_t gem_handle, int64_t* timeou
    LOG_VERBOSE("anv_gem_wait gem_handle %u buffer_id %lu timeout_ns %lu", gem_handle,
                entry->buffer->id, *timeout_ns);
 
-   magma_status_t status =
-       AnvMagmaConnectionWait(device->connection, entry->buffer->id, *timeout_ns);
+   return anv_gem_wait_buffer_id(device, entry->buffer->id, timeout_ns);
+}
+
+int anv_gem_wait_buffer_id(struct anv_device* device, uint64_t buffer_id, int64_t* timeout_ns)
+{
+   magma_status_t status = AnvMagmaConnectionWait(device->connection, buffer_id, *timeout_ns);
    switch (status) {
    case MAGMA_STATUS_OK:
       break;
@@ -299,6 +538,13 @@ int anv_gem_wait(struct anv_device* device, uint32_t gem_handle, int64_t* timeou
    return 0;
 }
 
+uint64_t anv_gem_get_buffer_id(struct anv_device* device, uint32_t gem_handle)
+{
+   struct BufferMapEntry* entry;
+   BufferMap_Query(device->connection->buffer_map, gem_handle, &entry);
+   return entry->buffer->id;
+}
+
 /**
  * Returns 0, 1, or negative to indicate error
  */
@@ -694,8 +940,13 @@ int anv_gem_syncobj_wait(struct anv_device* device, anv_syncobj_handle_t* sync_o
       semaphores[i] = magma_semaphore->semaphore;
    }
 
+   // The completion reader, if any, services the notification channel.
    return magma_wait(device->connection->notification_channel, semaphores, count, abs_timeout_ns,
-                     wait_all, notification_callback, device);
+                     wait_all,
+                     AnvMagmaConnectionHasCompletionReader(device->connection)
+                         ? NULL
+                         : notification_callback,
+                     device);
 }
 
 int anv_gem_reg_read(struct anv_device* device, uint32_t offset, uint64_t* result)
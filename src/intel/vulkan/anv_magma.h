@@ -30,6 +30,7 @@
 #include "drm-uapi/i915_drm.h"
 #include "magma.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #define ANV_MAGMA_DRET(ret)                                                                        \
@@ -43,6 +44,8 @@
 struct anv_connection {
    magma_connection_t connection;
    struct BufferMap* buffer_map;
+   struct MmapCache* mmap_cache;
+   struct ConstraintsCache* constraints_cache;
    magma_handle_t notification_channel;
 };
 
@@ -56,6 +59,17 @@ struct anv_magma_semaphore {
    uint64_t id;
 };
 
+struct anv_magma_gpu_mapping {
+   magma_buffer_t buffer;
+   uint64_t page_offset;
+   uint64_t page_count;
+   uint64_t gpu_addr;
+};
+
+typedef void (*anv_magma_map_buffers_gpu_t)(magma_connection_t connection,
+                                            const struct anv_magma_gpu_mapping* mappings,
+                                            uint32_t count);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -71,6 +85,21 @@ magma_status_t AnvMagmaGetSysmemConnection(struct anv_connection* connection,
 magma_status_t AnvMagmaConnectionWait(struct anv_connection* connection, uint64_t buffer_id,
                                       uint64_t timeout_ns);
 
+// Replaces the function used to establish the gpu mappings for each exec.
+void AnvMagmaConnectionInjectForTest(struct anv_connection* connection,
+                                     anv_magma_map_buffers_gpu_t map_buffers_gpu);
+
+// Records submit to retire latency for up to |record_count| recent submits, written to |path| when
+// the connection is released. Must be called before the first exec.
+void AnvMagmaConnectionStartTrace(struct anv_connection* connection, const char* path,
+                                  uint32_t record_count);
+
+// Starts a thread that owns the notification channel and retires completed buffers, so
+// submits and waits don't have to service it. Returns false if the thread wasn't started.
+bool AnvMagmaConnectionStartCompletionReader(struct anv_connection* connection);
+
+bool AnvMagmaConnectionHasCompletionReader(struct anv_connection* connection);
+
 void AnvMagmaConnectionServiceNotifications(struct anv_connection* connection);
 
 int AnvMagmaConnectionExec(struct anv_connection* connection, uint32_t context_id,
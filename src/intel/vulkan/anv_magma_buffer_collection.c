@@ -22,6 +22,7 @@
  */
 
 #include "anv_magma.h"
+#include "anv_magma_constraints_cache.h"
 #include "anv_private.h"
 #include "magma_sysmem.h"
 #include "vk_util.h"
@@ -91,23 +92,24 @@ void anv_DestroyBufferCollectionFUCHSIA(VkDevice vk_device, VkBufferCollectionFU
    vk_free2(&device->alloc, pAllocator, buffer_collection);
 }
 
-static VkResult get_image_format_constraints(
-    VkDevice vk_device, VkFormat format, const VkImageCreateInfo* pImageInfo,
-    magma_image_format_constraints_t* image_constraints_out, isl_tiling_flags_t isl_tiling_flags,
-    VkImageFormatConstraintsInfoFUCHSIA* format_constraints)
+// Called by the constraints cache on a miss.
+static VkResult compute_image_format_constraints(
+    void* context, const struct ConstraintsCacheKey* key,
+    magma_image_format_constraints_t* image_constraints_out)
 {
-   ANV_FROM_HANDLE(anv_device, device, vk_device);
+   struct anv_device* device = context;
+   const VkFormat format = key->format;
 
    const struct anv_format_plane plane_format =
-       anv_get_format_plane(&device->info, format, VK_IMAGE_ASPECT_COLOR_BIT, pImageInfo->tiling);
+       anv_get_format_plane(&device->info, format, VK_IMAGE_ASPECT_COLOR_BIT, key->tiling);
 
    const isl_surf_usage_flags_t isl_surf_usage =
-       choose_isl_surf_usage(pImageInfo->flags, // vk_create_flags
-                             pImageInfo->usage, // vk_usage
-                             0,                 // isl_extra_usage
+       choose_isl_surf_usage(key->flags, // vk_create_flags
+                             key->usage, // vk_usage
+                             0,          // isl_extra_usage
                              VK_IMAGE_ASPECT_COLOR_BIT);
    enum isl_surf_dim dim;
-   switch (pImageInfo->imageType) {
+   switch (key->image_type) {
    case VK_IMAGE_TYPE_1D:
       dim = ISL_SURF_DIM_1D;
       break;
@@ -121,16 +123,16 @@ static VkResult get_image_format_constraints(
    struct isl_surf_init_info isl_surf_init_info = {
        .dim = dim,
        .format = plane_format.isl_format,
-       .width = pImageInfo->extent.width / plane_format.denominator_scales[0],
-       .height = pImageInfo->extent.height / plane_format.denominator_scales[1],
-       .depth = pImageInfo->extent.depth,
-       .levels = pImageInfo->mipLevels,
-       .array_len = pImageInfo->arrayLayers,
-       .samples = pImageInfo->samples,
+       .width = key->width / plane_format.denominator_scales[0],
+       .height = key->height / plane_format.denominator_scales[1],
+       .depth = key->depth,
+       .levels = key->mip_levels,
+       .array_len = key->array_layers,
+       .samples = key->samples,
        .min_alignment_B = 0,
        .row_pitch_B = 0,
        .usage = isl_surf_usage,
-       .tiling_flags = isl_tiling_flags};
+       .tiling_flags = key->isl_tiling_flags};
 
    struct isl_surf isl_surf;
    if (!isl_surf_init_s(&device->isl_dev, &isl_surf, &isl_surf_init_info)) {
@@ -138,9 +140,9 @@ static VkResult get_image_format_constraints(
       return VK_ERROR_FORMAT_NOT_SUPPORTED;
    }
 
-   assert(pImageInfo->extent.width);
-   magma_image_format_constraints_t image_constraints = {.width = pImageInfo->extent.width,
-                                                         .height = pImageInfo->extent.height,
+   assert(key->width);
+   magma_image_format_constraints_t image_constraints = {.width = key->width,
+                                                         .height = key->height,
                                                          .layers = 1,
                                                          .bytes_per_row_divisor = 1,
                                                          .min_bytes_per_row = isl_surf.row_pitch_B};
@@ -190,10 +192,10 @@ static VkResult get_image_format_constraints(
       break;
    case VK_FORMAT_R8_UNORM:
       image_constraints.image_format = MAGMA_FORMAT_R8;
-      if (format_constraints && format_constraints->sysmemFormat) {
-         if (format_constraints->sysmemFormat == MAGMA_FORMAT_L8) {
+      if (key->sysmem_format) {
+         if (key->sysmem_format == MAGMA_FORMAT_L8) {
             image_constraints.image_format = MAGMA_FORMAT_L8;
-         } else if (format_constraints->sysmemFormat != MAGMA_FORMAT_R8) {
+         } else if (key->sysmem_format != MAGMA_FORMAT_R8) {
             return VK_ERROR_FORMAT_NOT_SUPPORTED;
          }
       }
@@ -210,6 +212,33 @@ static VkResult get_image_format_constraints(
    return VK_SUCCESS;
 }
 
+static VkResult get_image_format_constraints(
+    VkDevice vk_device, VkFormat format, const VkImageCreateInfo* pImageInfo,
+    magma_image_format_constraints_t* image_constraints_out, isl_tiling_flags_t isl_tiling_flags,
+    VkImageFormatConstraintsInfoFUCHSIA* format_constraints)
+{
+   ANV_FROM_HANDLE(anv_device, device, vk_device);
+
+   const struct ConstraintsCacheKey key = {
+       .format = format,
+       .image_type = pImageInfo->imageType,
+       .flags = pImageInfo->flags,
+       .usage = pImageInfo->usage,
+       .tiling = pImageInfo->tiling,
+       .width = pImageInfo->extent.width,
+       .height = pImageInfo->extent.height,
+       .depth = pImageInfo->extent.depth,
+       .mip_levels = pImageInfo->mipLevels,
+       .array_layers = pImageInfo->arrayLayers,
+       .samples = pImageInfo->samples,
+       .isl_tiling_flags = isl_tiling_flags,
+       .sysmem_format = format_constraints ? format_constraints->sysmemFormat : 0,
+   };
+
+   return ConstraintsCache_Get(device->connection->constraints_cache, &key,
+                               compute_image_format_constraints, device, image_constraints_out);
+}
+
 VkResult anv_SetBufferCollectionConstraintsFUCHSIA(VkDevice vk_device,
                                                    VkBufferCollectionFUCHSIA vk_collection,
                                                    const VkImageCreateInfo* pImageInfo)
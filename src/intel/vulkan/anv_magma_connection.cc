@@ -22,14 +22,20 @@
  */
 
 #include "anv_magma.h"
+#include "anv_magma_trace.h"
 #include "common/gen_gem.h"
 #include "common/intel_log.h"
 #include "magma_sysmem.h"
 #include "util/inflight_list.h"
 #include <assert.h>
+#include <algorithm>
 #include <chrono>
-#include <map>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #if VK_USE_PLATFORM_FUCHSIA
@@ -42,6 +48,15 @@
          intel_logd(__VA_ARGS__);                                                                  \
    } while (0)
 
+static void map_buffers_gpu(magma_connection_t connection,
+                            const struct anv_magma_gpu_mapping* mappings, uint32_t count)
+{
+   for (uint32_t i = 0; i < count; i++) {
+      magma_map_buffer_gpu(connection, mappings[i].buffer, mappings[i].page_offset,
+                           mappings[i].page_count, mappings[i].gpu_addr, 0);
+   }
+}
+
 static inline uint64_t page_size() { return sysconf(_SC_PAGESIZE); }
 
 static inline bool is_page_aligned(uint64_t val) { return (val & (page_size() - 1)) == 0; }
@@ -70,38 +85,181 @@ public:
       anv_magma_buffer::buffer = 0;
    }
 
-   void AddMapping(uint64_t page_offset, uint64_t page_count, uint64_t addr)
-   {
-      mappings_[addr] = {page_offset, page_count};
-   }
-
    struct Segment {
+      uint64_t addr = 0;
       uint64_t page_offset = 0;
       uint64_t page_count = 0;
    };
 
-   bool HasMapping(uint64_t addr, Segment* segment_out) const
+   // Returns the mapping at the given gpu address, or nullptr.
+   Segment* FindMapping(uint64_t addr)
+   {
+      auto iter = LowerBound(addr);
+      if (iter != mappings_.end() && iter->addr == addr)
+         return &*iter;
+      return nullptr;
+   }
+
+   void AddMapping(uint64_t page_offset, uint64_t page_count, uint64_t addr)
+   {
+      auto iter = LowerBound(addr);
+      if (iter != mappings_.end() && iter->addr == addr) {
+         iter->page_offset = page_offset;
+         iter->page_count = page_count;
+         return;
+      }
+      mappings_.insert(iter, {addr, page_offset, page_count});
+   }
+
+private:
+   std::vector<Segment>::iterator LowerBound(uint64_t addr)
+   {
+      return std::lower_bound(
+          mappings_.begin(), mappings_.end(), addr,
+          [](const Segment& segment, uint64_t addr) { return segment.addr < addr; });
+   }
+
+   // Sorted by gpu address. Buffers typically have only one or two mappings, so a flat
+   // array is cheaper to search (and to allocate) than a tree.
+   std::vector<Segment> mappings_;
+};
+
+// Storage for building the arguments of one exec. Each array grows to the largest submit seen
+// and is then reused, so the steady state submit path doesn't allocate.
+class SubmitArena {
+public:
+   magma_system_exec_resource* resources(uint32_t count) { return Reserve(resources_, count); }
+
+   anv_magma_gpu_mapping* mappings(uint32_t count) { return Reserve(mappings_, count); }
+
+   uint64_t* semaphore_ids(uint32_t count) { return Reserve(semaphore_ids_, count); }
+
+private:
+   template <class T> T* Reserve(std::vector<T>& vec, uint32_t count)
+   {
+      if (vec.size() < count)
+         vec.resize(count);
+      return vec.data();
+   }
+
+   std::vector<magma_system_exec_resource> resources_;
+   std::vector<anv_magma_gpu_mapping> mappings_;
+   std::vector<uint64_t> semaphore_ids_;
+};
+
+// Records the most recent submits, and when each one's batch buffer retired, for offline latency
+// analysis. Written out in the format of anv_magma_trace.h when the connection is released.
+class TraceRing {
+public:
+   TraceRing(const char* path, uint32_t capacity) : path_(path), records_(capacity)
    {
-      auto iter = mappings_.find(addr);
-      if (iter != mappings_.end()) {
-         if (segment_out) {
-            *segment_out = iter->second;
+      pending_.reserve(capacity);
+   }
+
+   ~TraceRing() { Write(); }
+
+   static uint64_t now_ns()
+   {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+   }
+
+   void Submit(uint64_t batch_buffer_id, uint32_t resource_count, uint32_t mapping_count,
+               uint32_t inflight_depth)
+   {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (next_ - retire_next_ == records_.size()) {
+         // Overwriting a record that never retired.
+         Unpend(records_[retire_next_ % records_.size()].batch_buffer_id);
+         retire_next_++;
+      }
+      pending_[batch_buffer_id]++;
+      records_[next_ % records_.size()] = {
+          .batch_buffer_id = batch_buffer_id,
+          .submit_ns = now_ns(),
+          .retire_ns = 0,
+          .resource_count = resource_count,
+          .mapping_count = mapping_count,
+          .inflight_depth = inflight_depth,
+          .reserved = 0,
+      };
+      next_++;
+   }
+
+   // Called for every retired buffer id, not only batch buffers.
+   void Retire(uint64_t buffer_id)
+   {
+      uint64_t timestamp = now_ns();
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Most retired ids are other resources of the exec, which have no record.
+      if (!Unpend(buffer_id))
+         return;
+      // Submits retire in order, so the match is almost always the oldest pending record.
+      for (uint64_t i = retire_next_; i < next_; i++) {
+         anv_magma_trace_record& record = records_[i % records_.size()];
+         if (record.batch_buffer_id == buffer_id && !record.retire_ns) {
+            record.retire_ns = timestamp;
+            break;
          }
-         return true;
       }
-      return false;
+      while (retire_next_ < next_ && records_[retire_next_ % records_.size()].retire_ns)
+         retire_next_++;
    }
 
-   void RemoveMapping(uint64_t addr) { mappings_.erase(addr); }
+   static void RetiredCallback(void* context, uint64_t buffer_id)
+   {
+      static_cast<TraceRing*>(context)->Retire(buffer_id);
+   }
 
 private:
-   std::map<uint64_t, Segment> mappings_;
+   // Drops one pending record of |batch_buffer_id|; returns false if there was none.
+   bool Unpend(uint64_t batch_buffer_id)
+   {
+      auto iter = pending_.find(batch_buffer_id);
+      if (iter == pending_.end())
+         return false;
+      if (--iter->second == 0)
+         pending_.erase(iter);
+      return true;
+   }
+
+   void Write()
+   {
+      FILE* file = fopen(path_.c_str(), "wb");
+      if (!file) {
+         intel_logd("Failed to open trace file %s", path_.c_str());
+         return;
+      }
+
+      uint64_t count = std::min<uint64_t>(next_, records_.size());
+      anv_magma_trace_header header = {
+          .magic = ANV_MAGMA_TRACE_MAGIC,
+          .version = ANV_MAGMA_TRACE_VERSION,
+          .record_size = sizeof(anv_magma_trace_record),
+          .record_count = static_cast<uint32_t>(count),
+      };
+      bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+      for (uint64_t i = next_ - count; ok && i < next_; i++)
+         ok = fwrite(&records_[i % records_.size()], sizeof(anv_magma_trace_record), 1, file) == 1;
+
+      if (fclose(file) != 0 || !ok)
+         intel_logd("Failed to write trace file %s", path_.c_str());
+   }
+
+   std::string path_;
+   std::mutex mutex_;
+   std::vector<anv_magma_trace_record> records_;
+   uint64_t next_ = 0;        // count of records ever submitted
+   uint64_t retire_next_ = 0; // oldest record that may still retire
+   // Count of records that haven't retired, by batch buffer id.
+   std::unordered_map<uint64_t, uint32_t> pending_;
 };
 
 class Connection : public anv_connection {
 public:
    Connection(magma_connection_t magma_connection, magma_handle_t notification_channel)
-       : inflight_list_(InflightList_Create())
+       : inflight_list_(InflightList_Create()), map_buffers_gpu_(map_buffers_gpu)
    {
       anv_connection::connection = magma_connection;
       anv_connection::notification_channel = notification_channel;
@@ -114,14 +272,40 @@ public:
          magma_sysmem_connection_release(sysmem_connection_);
       }
 #endif // VK_USE_PLATFORM_FUCHSIA
+      InflightList_StopReader(inflight_list_);
       magma_release_connection(magma_connection());
       InflightList_Destroy(inflight_list_);
+      trace_.reset();
    }
 
    magma_connection_t magma_connection() { return anv_connection::connection; }
 
    InflightList* inflight_list() { return inflight_list_; }
 
+   // Execs on a connection are serialized by the caller.
+   SubmitArena* submit_arena() { return &submit_arena_; }
+
+   void MapBuffersGpu(const anv_magma_gpu_mapping* mappings, uint32_t count)
+   {
+      if (count)
+         map_buffers_gpu_(magma_connection(), mappings, count);
+   }
+
+   void set_map_buffers_gpu(anv_magma_map_buffers_gpu_t map_buffers_gpu)
+   {
+      map_buffers_gpu_ = map_buffers_gpu;
+   }
+
+   // Tracing is enabled before any submits.
+   void StartTrace(const char* path, uint32_t capacity)
+   {
+      assert(!trace_);
+      trace_ = std::make_unique<TraceRing>(path, capacity);
+      InflightList_SetRetiredCallback(inflight_list_, TraceRing::RetiredCallback, trace_.get());
+   }
+
+   TraceRing* trace() { return trace_.get(); }
+
 #if VK_USE_PLATFORM_FUCHSIA
    magma_status_t GetSysmemConnection(magma_sysmem_connection_t* sysmem_connection_out)
    {
@@ -148,6 +332,9 @@ private:
    magma_sysmem_connection_t sysmem_connection_{};
 #endif // #if VK_USE_PLATFORM_FUCHSIA
    InflightList* inflight_list_;
+   anv_magma_map_buffers_gpu_t map_buffers_gpu_;
+   SubmitArena submit_arena_;
+   std::unique_ptr<TraceRing> trace_;
 };
 
 anv_connection* AnvMagmaCreateConnection(magma_connection_t connection)
@@ -168,6 +355,30 @@ magma_status_t AnvMagmaGetSysmemConnection(struct anv_connection* connection,
 }
 #endif // VK_USE_PLATFORM_FUCHSIA
 
+void AnvMagmaConnectionInjectForTest(anv_connection* connection,
+                                     anv_magma_map_buffers_gpu_t map_buffers_gpu)
+{
+   Connection::cast(connection)->set_map_buffers_gpu(map_buffers_gpu);
+}
+
+void AnvMagmaConnectionStartTrace(anv_connection* connection, const char* path,
+                                  uint32_t record_count)
+{
+   Connection::cast(connection)->StartTrace(path, record_count);
+}
+
+bool AnvMagmaConnectionStartCompletionReader(anv_connection* connection)
+{
+   return InflightList_StartReader(Connection::cast(connection)->inflight_list(),
+                                   Connection::cast(connection)->magma_connection(),
+                                   connection->notification_channel);
+}
+
+bool AnvMagmaConnectionHasCompletionReader(anv_connection* connection)
+{
+   return InflightList_HasReader(Connection::cast(connection)->inflight_list());
+}
+
 void AnvMagmaConnectionServiceNotifications(anv_connection* connection)
 {
    InflightList_TryUpdate(Connection::cast(connection)->inflight_list(),
@@ -190,8 +401,14 @@ int AnvMagmaConnectionExec(anv_connection* connection, uint32_t context_id,
 
    auto exec_objects = reinterpret_cast<drm_i915_gem_exec_object2*>(execbuf->buffers_ptr);
 
-   std::vector<magma_system_exec_resource> resources;
-   resources.reserve(execbuf->buffer_count);
+   SubmitArena* arena = Connection::cast(connection)->submit_arena();
+
+   magma_system_exec_resource* resources = arena->resources(execbuf->buffer_count);
+
+   // Gather all new or grown mappings so they can be established together, before the
+   // command buffer is sent.
+   anv_magma_gpu_mapping* mappings = arena->mappings(execbuf->buffer_count);
+   uint32_t mapping_count = 0;
 
    for (uint32_t i = 0; i < execbuf->buffer_count; i++) {
       auto buffer = reinterpret_cast<Buffer*>(exec_objects[i].handle);
@@ -199,81 +416,96 @@ int AnvMagmaConnectionExec(anv_connection* connection, uint32_t context_id,
       uint64_t offset = exec_objects[i].rsvd1;
       uint64_t length = exec_objects[i].rsvd2;
 
-      resources.push_back({
+      resources[i] = {
           .buffer_id = buffer->id,
           .offset = offset,
           .length = length,
-      });
+      };
 
-      if (!is_page_aligned(offset))
+      if (!is_page_aligned(offset)) {
+         // Keep the mapping tables consistent with what was gathered so far.
+         Connection::cast(connection)->MapBuffersGpu(mappings, mapping_count);
          return ANV_MAGMA_DRET_MSG(-1, "offset (0x%lx) not page aligned", offset);
+      }
 
       uint64_t gpu_addr = gen_48b_address(exec_objects[i].offset);
       uint64_t page_offset = offset / page_size();
       uint64_t page_count = round_up(length, page_size()) / page_size();
 
-      Buffer::Segment segment;
-      bool has_mapping = buffer->HasMapping(gpu_addr, &segment);
-      if (has_mapping) {
-         assert(page_offset == segment.page_offset);
-         if (page_count > segment.page_count) {
-            // Growing an existing mapping.
-            buffer->RemoveMapping(gpu_addr);
-            has_mapping = false;
-         } else {
-            assert(page_count == segment.page_count);
+      Buffer::Segment* segment = buffer->FindMapping(gpu_addr);
+      if (segment) {
+         assert(page_offset == segment->page_offset);
+         if (page_count <= segment->page_count) {
+            assert(page_count == segment->page_count);
+            continue;
          }
+         // Growing an existing mapping.
+         segment->page_count = page_count;
+      } else {
+         buffer->AddMapping(page_offset, page_count, gpu_addr);
       }
 
-      if (!has_mapping) {
-         LOG_VERBOSE("mapping to gpu addr 0x%lx: id %lu page_offset %lu page_count %lu", gpu_addr,
-                     buffer->id, page_offset, page_count);
-         magma_map_buffer_gpu(Connection::cast(connection)->magma_connection(), buffer->get(),
-                              page_offset, page_count, gpu_addr, 0);
+      LOG_VERBOSE("mapping to gpu addr 0x%lx: id %lu page_offset %lu page_count %lu", gpu_addr,
+                  buffer->id, page_offset, page_count);
 
-         buffer->AddMapping(page_offset, page_count, gpu_addr);
-      }
+      mappings[mapping_count++] = {
+          .buffer = buffer->get(),
+          .page_offset = page_offset,
+          .page_count = page_count,
+          .gpu_addr = gpu_addr,
+      };
    }
 
+   Connection::cast(connection)->MapBuffersGpu(mappings, mapping_count);
+
    uint32_t syncobj_count = execbuf->num_cliprects;
+   auto syncobjs = reinterpret_cast<drm_i915_gem_exec_fence*>(execbuf->cliprects_ptr);
 
-   std::vector<uint64_t> semaphore_ids;
-   semaphore_ids.reserve(syncobj_count);
+   // A syncobj may be both waited on and signalled, so reserve room for each.
+   uint64_t* semaphore_ids = arena->semaphore_ids(2 * syncobj_count);
+   uint64_t* semaphore_ids_end = semaphore_ids + 2 * syncobj_count;
    uint32_t wait_semaphore_count = 0;
+   uint32_t signal_semaphore_count = 0;
 
-   // Wait semaphores first, then signal
+   // Wait semaphores first, then signal. Waits are packed from the front and signals from the
+   // back, so one pass suffices.
    for (uint32_t i = 0; i < syncobj_count; i++) {
-      auto& syncobj = reinterpret_cast<drm_i915_gem_exec_fence*>(execbuf->cliprects_ptr)[i];
-      if (syncobj.flags & I915_EXEC_FENCE_WAIT) {
-         semaphore_ids.push_back(reinterpret_cast<anv_magma_semaphore*>(syncobj.handle)->id);
-         wait_semaphore_count++;
-      }
-   }
-   for (uint32_t i = 0; i < syncobj_count; i++) {
-      auto& syncobj = reinterpret_cast<drm_i915_gem_exec_fence*>(execbuf->cliprects_ptr)[i];
-      if (syncobj.flags & I915_EXEC_FENCE_SIGNAL) {
-         semaphore_ids.push_back(reinterpret_cast<anv_magma_semaphore*>(syncobj.handle)->id);
-      }
+      uint64_t id = reinterpret_cast<anv_magma_semaphore*>(syncobjs[i].handle)->id;
+      if (syncobjs[i].flags & I915_EXEC_FENCE_WAIT)
+         semaphore_ids[wait_semaphore_count++] = id;
+      if (syncobjs[i].flags & I915_EXEC_FENCE_SIGNAL)
+         *(semaphore_ids_end - ++signal_semaphore_count) = id;
    }
 
+   // Restore the order of the signals, directly following the waits.
+   uint64_t* signal_ids = semaphore_ids_end - signal_semaphore_count;
+   std::reverse(signal_ids, semaphore_ids_end);
+   if (signal_ids != semaphore_ids + wait_semaphore_count)
+      std::copy(signal_ids, semaphore_ids_end, semaphore_ids + wait_semaphore_count);
+
    magma_system_command_buffer command_buffer = {
        .resource_count = execbuf->buffer_count,
        .batch_buffer_resource_index = execbuf->buffer_count - 1, // by drm convention
        .batch_start_offset = execbuf->batch_start_offset,
        .wait_semaphore_count = wait_semaphore_count,
-       .signal_semaphore_count =
-           static_cast<uint32_t>(semaphore_ids.size()) - wait_semaphore_count};
+       .signal_semaphore_count = signal_semaphore_count};
 
    // Add to inflight list first to avoid race with any other thread reading completions from the
    // notification channel, in case this thread is preempted just after sending the command buffer
    // and the completion happens quickly.
+   TraceRing* trace = Connection::cast(connection)->trace();
+   if (trace) {
+      trace->Submit(resources[execbuf->buffer_count - 1].buffer_id, execbuf->buffer_count,
+                    mapping_count, InflightList_size(Connection::cast(connection)->inflight_list()));
+   }
+
    InflightList_AddAndUpdate(Connection::cast(connection)->inflight_list(),
-                             Connection::cast(connection)->magma_connection(), resources.data(),
+                             Connection::cast(connection)->magma_connection(), resources,
                              execbuf->buffer_count);
 
    magma_execute_command_buffer_with_resources(Connection::cast(connection)->magma_connection(),
-                                               context_id, &command_buffer, resources.data(),
-                                               semaphore_ids.data());
+                                               context_id, &command_buffer, resources,
+                                               semaphore_ids);
 
    return 0;
 }
@@ -0,0 +1,119 @@
+/*
+ * Copyright © 2020 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "anv_magma_constraints_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ConstraintsCacheEntry {
+   struct ConstraintsCacheKey key;
+   VkResult result;
+   magma_image_format_constraints_t constraints;
+};
+
+static uint32_t key_hash(const void* key)
+{
+   return _mesa_hash_data(key, sizeof(struct ConstraintsCacheKey));
+}
+
+static bool key_equal(const void* a, const void* b)
+{
+   return memcmp(a, b, sizeof(struct ConstraintsCacheKey)) == 0;
+}
+
+static void free_entry(struct hash_entry* hash_entry)
+{
+   free(hash_entry->data);
+}
+
+void ConstraintsCache_Init(struct ConstraintsCache* cache, uint32_t max_entries)
+{
+   pthread_mutex_init(&cache->mutex, NULL);
+   cache->entries = _mesa_hash_table_create(NULL, key_hash, key_equal);
+   cache->max_entries = max_entries;
+   cache->hits = 0;
+   cache->misses = 0;
+}
+
+void ConstraintsCache_Release(struct ConstraintsCache* cache)
+{
+   _mesa_hash_table_destroy(cache->entries, free_entry);
+   pthread_mutex_destroy(&cache->mutex);
+}
+
+VkResult ConstraintsCache_Get(struct ConstraintsCache* cache, const struct ConstraintsCacheKey* key,
+                              ConstraintsCacheComputeFn compute, void* context,
+                              magma_image_format_constraints_t* constraints_out)
+{
+   pthread_mutex_lock(&cache->mutex);
+
+   struct hash_entry* hash_entry = _mesa_hash_table_search(cache->entries, key);
+   if (hash_entry) {
+      struct ConstraintsCacheEntry* entry = hash_entry->data;
+      VkResult result = entry->result;
+      if (result == VK_SUCCESS)
+         *constraints_out = entry->constraints;
+      cache->hits++;
+      pthread_mutex_unlock(&cache->mutex);
+      return result;
+   }
+
+   cache->misses++;
+   pthread_mutex_unlock(&cache->mutex);
+
+   struct ConstraintsCacheEntry* entry = malloc(sizeof(struct ConstraintsCacheEntry));
+   if (!entry)
+      return compute(context, key, constraints_out);
+
+   entry->key = *key;
+   memset(&entry->constraints, 0, sizeof(entry->constraints));
+   entry->result = compute(context, key, &entry->constraints);
+
+   if (entry->result == VK_SUCCESS)
+      *constraints_out = entry->constraints;
+
+   VkResult result = entry->result;
+
+   pthread_mutex_lock(&cache->mutex);
+   if (_mesa_hash_table_search(cache->entries, &entry->key)) {
+      // Another thread computed the same key.
+      free(entry);
+   } else {
+      // Distinct keys only accumulate with many different extents; start over when full.
+      if (cache->entries->entries >= cache->max_entries)
+         _mesa_hash_table_clear(cache->entries, free_entry);
+      _mesa_hash_table_insert(cache->entries, &entry->key, entry);
+   }
+   pthread_mutex_unlock(&cache->mutex);
+
+   return result;
+}
+
+void ConstraintsCache_GetStats(struct ConstraintsCache* cache, uint64_t* hits_out,
+                               uint64_t* misses_out)
+{
+   pthread_mutex_lock(&cache->mutex);
+   *hits_out = cache->hits;
+   *misses_out = cache->misses;
+   pthread_mutex_unlock(&cache->mutex);
+}
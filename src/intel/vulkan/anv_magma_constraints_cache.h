@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2020 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef ANV_MAGMA_CONSTRAINTS_CACHE_H
+#define ANV_MAGMA_CONSTRAINTS_CACHE_H
+
+#include "magma_sysmem.h"
+#include "util/hash_table.h"
+#include <pthread.h>
+#include <vulkan/vulkan.h>
+
+/* Everything that determines the sysmem image constraints for one format slot.
+ * All fields are 32 bits so the key has no padding and can be hashed as bytes.
+ */
+struct ConstraintsCacheKey {
+   uint32_t format;           /* VkFormat */
+   uint32_t image_type;       /* VkImageType */
+   uint32_t flags;            /* VkImageCreateFlags */
+   uint32_t usage;            /* VkImageUsageFlags */
+   uint32_t tiling;           /* VkImageTiling */
+   uint32_t width;
+   uint32_t height;
+   uint32_t depth;
+   uint32_t mip_levels;
+   uint32_t array_layers;
+   uint32_t samples;          /* VkSampleCountFlagBits */
+   uint32_t isl_tiling_flags; /* isl_tiling_flags_t */
+   uint32_t sysmem_format;    /* requested by the client, or 0 */
+};
+
+/* Computes the constraints for a key on a cache miss. */
+typedef VkResult (*ConstraintsCacheComputeFn)(void* context, const struct ConstraintsCacheKey* key,
+                                               magma_image_format_constraints_t* constraints_out);
+
+/* This memoizes image format constraints per device, so recreating a swapchain or importing
+ * another frame with the same parameters doesn't renegotiate formats and tiling.
+ * Failed lookups are cached too. The constraints depend only on the key and the device's
+ * format and isl layout rules, which don't change while the connection exists, so entries
+ * never go stale; the cache is released with the connection.
+ */
+struct ConstraintsCache {
+   pthread_mutex_t mutex;
+   struct hash_table* entries; /* struct ConstraintsCacheEntry, keyed by its key */
+   uint32_t max_entries;
+   uint64_t hits;
+   uint64_t misses;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ConstraintsCache_Init(struct ConstraintsCache* cache, uint32_t max_entries);
+void ConstraintsCache_Release(struct ConstraintsCache* cache);
+
+VkResult ConstraintsCache_Get(struct ConstraintsCache* cache, const struct ConstraintsCacheKey* key,
+                              ConstraintsCacheComputeFn compute, void* context,
+                              magma_image_format_constraints_t* constraints_out);
+
+void ConstraintsCache_GetStats(struct ConstraintsCache* cache, uint64_t* hits_out,
+                               uint64_t* misses_out);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ANV_MAGMA_CONSTRAINTS_CACHE_H
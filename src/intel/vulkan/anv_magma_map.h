@@ -24,19 +24,40 @@
 #ifndef ANV_MAGMA_MAP_H
 #define ANV_MAGMA_MAP_H
 
+#include "util/hash_table.h"
+#include "util/list.h"
 #include "util/sparse_array.h"
+#include <assert.h>
+#include <pthread.h>
 #include <stdatomic.h>
 
+#define BUFFER_MAP_CACHE_LINE_SIZE 64
+#define BUFFER_MAP_SHARD_COUNT 8
+
+/* Entries are packed so a cache line holds a whole number of them. */
 struct BufferMapEntry {
    struct anv_magma_buffer* buffer;
    uint32_t gem_handle;
    uint32_t free_index;
 };
 
-/* This is used to assign 32 bit gem handles to magma buffers. */
+static_assert(BUFFER_MAP_CACHE_LINE_SIZE % sizeof(struct BufferMapEntry) == 0,
+              "BufferMapEntry must not straddle cache lines");
+
+/* Free gem handles, cached for the threads that hash to this shard.
+ * Each shard has a cache line to itself so threads don't contend on the list heads.
+ */
+struct BufferMapShard {
+   struct util_sparse_array_free_list free_list;
+} __attribute__((aligned(BUFFER_MAP_CACHE_LINE_SIZE)));
+
+/* This is used to assign 32 bit gem handles to magma buffers.
+ * New handles are reserved from next_index in batches, so the shared counter is only touched
+ * when a shard runs dry.
+ */
 struct BufferMap {
+   struct BufferMapShard shards[BUFFER_MAP_SHARD_COUNT];
    struct util_sparse_array array;
-   struct util_sparse_array_free_list free_list;
    atomic_uint next_index;
 };
 
@@ -46,4 +67,33 @@ void BufferMap_Get(struct BufferMap* map, struct BufferMapEntry** entry_out);
 void BufferMap_Put(struct BufferMap* map, uint32_t gem_handle);
 void BufferMap_Query(struct BufferMap* map, uint32_t gem_handle, struct BufferMapEntry** entry_out);
 
+struct MmapCacheEntry {
+   struct MmapCacheEntry* next; /* next entry for the same gem handle */
+   struct list_head idle_link;  /* in the idle list while unreferenced */
+   uint32_t gem_handle;
+   uint32_t refcount;
+   uint64_t offset;
+   uint64_t size;
+   void* addr;
+};
+
+/* This caches cpu mappings of magma buffers, so mapping the same range again
+ * doesn't go back to the kernel. Unreferenced mappings stay mapped until they
+ * exceed a memory cap, and are then released least recently used first.
+ */
+struct MmapCache {
+   pthread_mutex_t mutex;
+   struct hash_table_u64* buffers; /* gem_handle -> list of struct MmapCacheEntry */
+   struct hash_table* addrs;       /* addr -> struct MmapCacheEntry */
+   struct list_head idle;          /* unreferenced entries, least recently used first */
+   uint64_t idle_bytes;
+   uint64_t idle_bytes_max;
+   uint64_t hits;
+   uint64_t misses;
+};
+
+void MmapCache_Init(struct MmapCache* cache, uint64_t idle_bytes_max);
+void MmapCache_Release(struct MmapCache* cache);
+void MmapCache_GetStats(struct MmapCache* cache, uint64_t* hits_out, uint64_t* misses_out);
+
 #endif /* ANV_MAGMA_MAP_H */
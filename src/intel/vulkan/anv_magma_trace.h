@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2020 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef ANV_MAGMA_TRACE_H
+#define ANV_MAGMA_TRACE_H
+
+// Binary format of the per-submit trace written when ANV_MAGMA_TRACE names an output file.
+// The file is a header followed by record_count records, oldest first; all fields are
+// little endian. Read it with src/intel/tools/magma_trace_reader.
+
+#include <stdint.h>
+
+#define ANV_MAGMA_TRACE_MAGIC 0x52544d41 // "AMTR"
+#define ANV_MAGMA_TRACE_VERSION 1
+
+struct anv_magma_trace_header {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t record_size;
+   uint32_t record_count;
+};
+
+struct anv_magma_trace_record {
+   uint64_t batch_buffer_id;
+   uint64_t submit_ns;       // monotonic clock
+   uint64_t retire_ns;       // 0 if not retired when the trace was written
+   uint32_t resource_count;
+   uint32_t mapping_count;   // gpu mappings established for this submit
+   uint32_t inflight_depth;  // buffers inflight just before this submit
+   uint32_t reserved;
+};
+
+#endif // ANV_MAGMA_TRACE_H
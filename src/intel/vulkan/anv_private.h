@@ -1208,6 +1208,11 @@ struct anv_queue_submit {
    struct anv_bo *                           simple_bo;
    uint32_t                                  simple_bo_size;
 
+#if defined(ANV_MAGMA)
+   /* Set by anv_queue_execbuf_locked. */
+   uint64_t                                  batch_buffer_id;
+#endif
+
    struct list_head                          link;
 };
 
@@ -1533,7 +1538,7 @@ void anv_gem_disconnect(struct anv_device* device);
 
 void* anv_gem_mmap(struct anv_device* device,
                    uint32_t gem_handle, uint64_t offset, uint64_t size, uint32_t flags);
-void anv_gem_munmap(void *p, uint64_t size);
+void anv_gem_munmap(struct anv_device *device, void *p, uint64_t size);
 uint32_t anv_gem_create(struct anv_device *device, uint64_t size);
 void anv_gem_close(struct anv_device *device, uint32_t gem_handle);
 uint32_t anv_gem_userptr(struct anv_device *device, void *mem, size_t size);
@@ -1578,6 +1583,11 @@ int anv_gem_syncobj_wait(struct anv_device *device,
                          anv_syncobj_handle_t *handles, uint32_t num_handles,
                          int64_t abs_timeout_ns, bool wait_all);
 int anv_gem_import_fuchsia_buffer(struct anv_device *device, uint32_t handle, uint32_t* buffer_out, uint64_t* size_out);
+#if defined(ANV_MAGMA)
+/* Magma buffer ids are never reused, unlike gem handles. */
+uint64_t anv_gem_get_buffer_id(struct anv_device *device, uint32_t gem_handle);
+int anv_gem_wait_buffer_id(struct anv_device *device, uint64_t buffer_id, int64_t *timeout_ns);
+#endif
 
 uint64_t anv_vma_alloc(struct anv_device *device,
                        uint64_t size, uint64_t align,
@@ -3047,6 +3057,13 @@ struct anv_timeline_point {
 
    /* BO used for synchronization. */
    struct anv_bo *bo;
+
+#if defined(ANV_MAGMA)
+   /* On magma the point has no BO; it is signaled when the batch buffer of
+    * the submission that signals it retires.
+    */
+   uint64_t buffer_id;
+#endif
 };
 
 struct anv_timeline {
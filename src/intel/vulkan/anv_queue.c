@@ -137,17 +137,71 @@ anv_timeline_finish(struct anv_device *device,
    list_for_each_entry_safe(struct anv_timeline_point, point,
                             &timeline->free_points, link) {
       list_del(&point->link);
-      anv_device_release_bo(device, point->bo);
+      if (point->bo)
+         anv_device_release_bo(device, point->bo);
       vk_free(&device->alloc, point);
    }
    list_for_each_entry_safe(struct anv_timeline_point, point,
                             &timeline->points, link) {
       list_del(&point->link);
-      anv_device_release_bo(device, point->bo);
+      if (point->bo)
+         anv_device_release_bo(device, point->bo);
       vk_free(&device->alloc, point);
    }
 }
 
+#if defined(ANV_MAGMA)
+/* Magma has no implicit sync, and submissions retire in order, so timeline
+ * points don't need a BO of their own: a point is resolved against the
+ * retirement of the batch buffer that signals it.  This keeps timelines down
+ * to a counter and a short list of pending points, with no BO allocation.
+ */
+static VkResult
+anv_timeline_point_busy(struct anv_device *device,
+                        struct anv_timeline_point *point)
+{
+   int64_t timeout = 0;
+   int ret = anv_gem_wait_buffer_id(device, point->buffer_id, &timeout);
+   if (ret == -1 && errno == ETIME) {
+      return VK_NOT_READY;
+   } else if (ret == -1) {
+      return anv_device_set_lost(device, "buffer wait failed: %m");
+   }
+
+   return anv_device_query_status(device);
+}
+
+static VkResult
+anv_timeline_point_wait(struct anv_device *device,
+                        struct anv_timeline_point *point,
+                        int64_t timeout)
+{
+   int ret = anv_gem_wait_buffer_id(device, point->buffer_id, &timeout);
+   if (ret == -1 && errno == ETIME) {
+      return VK_TIMEOUT;
+   } else if (ret == -1) {
+      return anv_device_set_lost(device, "buffer wait failed: %m");
+   }
+
+   return anv_device_query_status(device);
+}
+#else
+static VkResult
+anv_timeline_point_busy(struct anv_device *device,
+                        struct anv_timeline_point *point)
+{
+   return anv_device_bo_busy(device, point->bo);
+}
+
+static VkResult
+anv_timeline_point_wait(struct anv_device *device,
+                        struct anv_timeline_point *point,
+                        int64_t timeout)
+{
+   return anv_device_wait(device, point->bo, timeout);
+}
+#endif
+
 static VkResult
 anv_timeline_add_point_locked(struct anv_device *device,
                               struct anv_timeline *timeline,
@@ -162,6 +216,7 @@ anv_timeline_add_point_locked(struct anv_device *device,
                    8, VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
       if (!(*point))
          result = vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
+#if !defined(ANV_MAGMA)
       if (result == VK_SUCCESS) {
          result = anv_device_alloc_bo(device, 4096,
                                       ANV_BO_ALLOC_EXTERNAL |
@@ -171,6 +226,7 @@ anv_timeline_add_point_locked(struct anv_device *device,
          if (result != VK_SUCCESS)
             vk_free(&device->alloc, *point);
       }
+#endif
    } else {
       *point = list_first_entry(&timeline->free_points,
                                 struct anv_timeline_point, link);
@@ -179,6 +235,10 @@ anv_timeline_add_point_locked(struct anv_device *device,
 
    if (result == VK_SUCCESS) {
       (*point)->serial = value;
+#if defined(ANV_MAGMA)
+      /* Set once submitted; an unsubmitted point is never busy. */
+      (*point)->buffer_id = 0;
+#endif
       list_addtail(&(*point)->link, &timeline->points);
    }
 
@@ -211,7 +271,7 @@ anv_timeline_gc_locked(struct anv_device *device,
          return VK_SUCCESS;
 
       /* Garbage collect any signaled point. */
-      VkResult result = anv_device_bo_busy(device, point->bo);
+      VkResult result = anv_timeline_point_busy(device, point);
       if (result == VK_NOT_READY) {
          /* We walk the list in-order so if this time point is still busy so
           * is every following time point
@@ -241,6 +301,10 @@ anv_queue_submit_timeline_locked(struct anv_queue *queue,
 {
    VkResult result;
 
+#if !defined(ANV_MAGMA)
+   /* On magma the wait is implied: the signaling submission was sent earlier
+    * on the same in-order context.
+    */
    for (uint32_t i = 0; i < submit->wait_timeline_count; i++) {
       struct anv_timeline *timeline = submit->wait_timelines[i];
       uint64_t wait_value = submit->wait_timeline_values[i];
@@ -257,6 +321,7 @@ anv_queue_submit_timeline_locked(struct anv_queue *queue,
          break;
       }
    }
+#endif
    for (uint32_t i = 0; i < submit->signal_timeline_count; i++) {
       struct anv_timeline *timeline = submit->signal_timelines[i];
       uint64_t signal_value = submit->signal_timeline_values[i];
@@ -267,9 +332,11 @@ anv_queue_submit_timeline_locked(struct anv_queue *queue,
       if (result != VK_SUCCESS)
          return result;
 
+#if !defined(ANV_MAGMA)
       result = anv_queue_submit_add_fence_bo(submit, point->bo, true);
       if (result != VK_SUCCESS)
          return result;
+#endif
    }
 
    result = anv_queue_execbuf_locked(queue, submit);
@@ -282,6 +349,13 @@ anv_queue_submit_timeline_locked(struct anv_queue *queue,
 
          assert(signal_value > timeline->highest_pending);
          timeline->highest_pending = signal_value;
+
+#if defined(ANV_MAGMA)
+         struct anv_timeline_point *point =
+            list_last_entry(&timeline->points, struct anv_timeline_point, link);
+         assert(point->serial == signal_value);
+         point->buffer_id = submit->batch_buffer_id;
+#endif
       }
 
       /* Update signaled semaphores backed by syncfd. */
@@ -2226,7 +2300,7 @@ anv_timeline_wait_locked(struct anv_device *device,
       if (timeline->highest_past >= serial)
          return VK_SUCCESS;
 
-      /* If we got here, our earliest time point has a busy BO */
+      /* If we got here, our earliest time point is busy */
       struct anv_timeline_point *point =
          list_first_entry(&timeline->points,
                           struct anv_timeline_point, link);
@@ -2235,8 +2309,8 @@ anv_timeline_wait_locked(struct anv_device *device,
       point->waiting++;
       pthread_mutex_unlock(&device->mutex);
 
-      result = anv_device_wait(device, point->bo,
-                               anv_get_relative_timeout(abs_timeout_ns));
+      result = anv_timeline_point_wait(device, point,
+                                       anv_get_relative_timeout(abs_timeout_ns));
 
       /* Pick the mutex back up */
       pthread_mutex_lock(&device->mutex);
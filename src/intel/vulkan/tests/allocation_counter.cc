@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+// The count_allocations config links with --wrap for the C allocator entry points, so every
+// reference to malloc etc. from the statically linked driver code lands here. Operator new is
+// replaced below to go through malloc, so allocations by the C++ standard library are counted
+// too.
+
+static std::atomic<uint64_t> allocation_count;
+
+extern "C" {
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+   allocation_count++;
+   return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+   allocation_count++;
+   return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+   allocation_count++;
+   return __real_realloc(ptr, size);
+}
+
+uint64_t allocation_counter_get(void) { return allocation_count; }
+
+} // extern "C"
+
+void* operator new(size_t size)
+{
+   void* ptr = malloc(size ? size : 1);
+   if (!ptr)
+      abort();
+   return ptr;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete[](void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t size) noexcept { free(ptr); }
+
+void operator delete[](void* ptr, size_t size) noexcept { free(ptr); }
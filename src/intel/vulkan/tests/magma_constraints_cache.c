@@ -0,0 +1,122 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "anv_magma_constraints_cache.h"
+#include "test_common.h"
+
+#include <stdbool.h>
+
+/* Stands in for sysmem format negotiation; only NV12 and 2D images are supported. */
+struct allocator {
+   uint32_t compute_count;
+};
+
+static VkResult compute(void* context, const struct ConstraintsCacheKey* key,
+                        magma_image_format_constraints_t* constraints_out)
+{
+   struct allocator* allocator = context;
+   allocator->compute_count++;
+
+   if (key->image_type != VK_IMAGE_TYPE_2D)
+      return VK_ERROR_FORMAT_NOT_SUPPORTED;
+
+   *constraints_out = (magma_image_format_constraints_t){
+       .image_format = MAGMA_FORMAT_NV12,
+       .width = key->width,
+       .height = key->height,
+       .layers = 1,
+       .bytes_per_row_divisor = 1,
+       .min_bytes_per_row = key->width,
+   };
+   return VK_SUCCESS;
+}
+
+static struct ConstraintsCacheKey make_key(uint32_t width, uint32_t height)
+{
+   return (struct ConstraintsCacheKey){
+       .format = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM,
+       .image_type = VK_IMAGE_TYPE_2D,
+       .usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+       .tiling = VK_IMAGE_TILING_LINEAR,
+       .width = width,
+       .height = height,
+       .depth = 1,
+       .mip_levels = 1,
+       .array_layers = 1,
+       .samples = VK_SAMPLE_COUNT_1_BIT,
+   };
+}
+
+static void check_stats(struct ConstraintsCache* cache, uint64_t hits, uint64_t misses)
+{
+   uint64_t cache_hits, cache_misses;
+   ConstraintsCache_GetStats(cache, &cache_hits, &cache_misses);
+   ASSERT(cache_hits == hits);
+   ASSERT(cache_misses == misses);
+}
+
+int main(int argc, char** argv)
+{
+   struct allocator allocator = {};
+   struct ConstraintsCache cache;
+   ConstraintsCache_Init(&cache, 4);
+
+   magma_image_format_constraints_t constraints;
+
+   /* The first lookup negotiates, repeats reuse the result. */
+   struct ConstraintsCacheKey key = make_key(1920, 1080);
+   for (uint32_t i = 0; i < 10; i++) {
+      ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) == VK_SUCCESS);
+      ASSERT(constraints.width == 1920);
+      ASSERT(constraints.min_bytes_per_row == 1920);
+   }
+   ASSERT(allocator.compute_count == 1);
+   check_stats(&cache, 9, 1);
+
+   /* Any difference in the inputs is a separate entry. */
+   key = make_key(1280, 720);
+   ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) == VK_SUCCESS);
+   ASSERT(constraints.width == 1280);
+   key.tiling = VK_IMAGE_TILING_OPTIMAL;
+   ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) == VK_SUCCESS);
+   ASSERT(allocator.compute_count == 3);
+
+   /* Failures are remembered too. */
+   key.image_type = VK_IMAGE_TYPE_3D;
+   ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) ==
+          VK_ERROR_FORMAT_NOT_SUPPORTED);
+   ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) ==
+          VK_ERROR_FORMAT_NOT_SUPPORTED);
+   ASSERT(allocator.compute_count == 4);
+   check_stats(&cache, 10, 4);
+
+   /* Going over the limit starts over. */
+   key = make_key(640, 480);
+   ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) == VK_SUCCESS);
+   key = make_key(1920, 1080);
+   ASSERT(ConstraintsCache_Get(&cache, &key, compute, &allocator, &constraints) == VK_SUCCESS);
+   ASSERT(allocator.compute_count == 6);
+
+   ConstraintsCache_Release(&cache);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "anv_magma.h"
+#include "anv_private.h"
+#include "test_common.h"
+
+#define NUM_BUFFERS 256
+#define PAGE_SIZE 4096
+
+static uint32_t map_call_count;
+static uint32_t map_count;
+
+static void count_map_buffers_gpu(magma_connection_t connection,
+                                  const struct anv_magma_gpu_mapping* mappings, uint32_t count)
+{
+   map_call_count++;
+   map_count += count;
+
+   for (uint32_t i = 0; i < count; i++)
+      ASSERT(mappings[i].page_count > 0);
+}
+
+static void exec(struct anv_device* device, uint32_t* gem_handles, uint32_t count,
+                 uint64_t addr_base, uint64_t length)
+{
+   struct drm_i915_gem_exec_object2 objects[NUM_BUFFERS];
+
+   for (uint32_t i = 0; i < count; i++) {
+      objects[i] = (struct drm_i915_gem_exec_object2){
+          .handle = gem_handles[i],
+          .offset = addr_base + i * 16 * PAGE_SIZE,
+          .rsvd1 = 0,      /* offset */
+          .rsvd2 = length, /* length */
+      };
+   }
+
+   struct drm_i915_gem_execbuffer2 execbuf = {
+       .buffers_ptr = (uintptr_t)objects,
+       .buffer_count = count,
+   };
+
+   map_call_count = 0;
+   map_count = 0;
+
+   ASSERT(anv_gem_execbuffer(device, &execbuf) == 0);
+}
+
+int main(int argc, char** argv)
+{
+   struct anv_physical_device physical_device = {};
+   struct anv_device device = {
+       .physical = &physical_device,
+   };
+
+   anv_gem_connect(&device);
+   AnvMagmaConnectionInjectForTest(device.connection, count_map_buffers_gpu);
+   device.context_id = anv_gem_create_context(&device);
+
+   uint32_t gem_handles[NUM_BUFFERS];
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
+      gem_handles[i] = anv_gem_create(&device, 4 * PAGE_SIZE);
+      ASSERT(gem_handles[i]);
+   }
+
+   /* All mappings are new, and are established together. */
+   exec(&device, gem_handles, NUM_BUFFERS, 0x100000, PAGE_SIZE);
+   ASSERT(map_call_count == 1);
+   ASSERT(map_count == NUM_BUFFERS);
+
+   /* Nothing changed, nothing to map. */
+   exec(&device, gem_handles, NUM_BUFFERS, 0x100000, PAGE_SIZE);
+   ASSERT(map_call_count == 0);
+   ASSERT(map_count == 0);
+
+   /* Growing the existing mappings. */
+   exec(&device, gem_handles, NUM_BUFFERS, 0x100000, 4 * PAGE_SIZE);
+   ASSERT(map_call_count == 1);
+   ASSERT(map_count == NUM_BUFFERS);
+
+   /* Additional mappings at a second address, half of the buffers. */
+   exec(&device, gem_handles, NUM_BUFFERS / 2, 0x10000000, 4 * PAGE_SIZE);
+   ASSERT(map_call_count == 1);
+   ASSERT(map_count == NUM_BUFFERS / 2);
+
+   /* Both sets of mappings are remembered. */
+   exec(&device, gem_handles, NUM_BUFFERS, 0x100000, 4 * PAGE_SIZE);
+   ASSERT(map_call_count == 0);
+   exec(&device, gem_handles, NUM_BUFFERS / 2, 0x10000000, 4 * PAGE_SIZE);
+   ASSERT(map_call_count == 0);
+
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++)
+      anv_gem_close(&device, gem_handles[i]);
+
+   anv_gem_destroy_context(&device, device.context_id);
+   anv_gem_disconnect(&device);
+}
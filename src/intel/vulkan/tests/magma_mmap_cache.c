@@ -0,0 +1,94 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include "anv_magma.h"
+#include "anv_magma_map.h"
+#include "anv_private.h"
+#include "test_common.h"
+
+#include <sys/mman.h> // for MAP_FAILED
+
+#define PAGE_SIZE 4096
+
+static void check_stats(struct anv_device* device, uint64_t hits, uint64_t misses)
+{
+   uint64_t cache_hits, cache_misses;
+   MmapCache_GetStats(device->connection->mmap_cache, &cache_hits, &cache_misses);
+   ASSERT(cache_hits == hits);
+   ASSERT(cache_misses == misses);
+}
+
+int main(int argc, char** argv)
+{
+   struct anv_physical_device physical_device = {};
+   struct anv_device device = {
+       .physical = &physical_device,
+   };
+
+   anv_gem_connect(&device);
+
+   uint32_t gem_handle = anv_gem_create(&device, 4 * PAGE_SIZE);
+   ASSERT(gem_handle);
+
+   void* addr = anv_gem_mmap(&device, gem_handle, 0, 4 * PAGE_SIZE, 0);
+   ASSERT(addr != MAP_FAILED);
+   check_stats(&device, 0, 1);
+
+   /* A second mapping of the same range shares the first. */
+   void* addr2 = anv_gem_mmap(&device, gem_handle, 0, 4 * PAGE_SIZE, 0);
+   ASSERT(addr2 == addr);
+   check_stats(&device, 1, 1);
+
+   anv_gem_munmap(&device, addr2, 4 * PAGE_SIZE);
+   anv_gem_munmap(&device, addr, 4 * PAGE_SIZE);
+
+   /* The unmap was deferred, so mapping again is a hit. */
+   addr = anv_gem_mmap(&device, gem_handle, 0, 4 * PAGE_SIZE, 0);
+   ASSERT(addr != MAP_FAILED);
+   check_stats(&device, 2, 1);
+
+   /* A different range is a separate mapping. */
+   void* addr3 = anv_gem_mmap(&device, gem_handle, PAGE_SIZE, PAGE_SIZE, 0);
+   ASSERT(addr3 != MAP_FAILED);
+   ASSERT(addr3 != addr);
+   check_stats(&device, 2, 2);
+
+   anv_gem_munmap(&device, addr3, PAGE_SIZE);
+   anv_gem_munmap(&device, addr, 4 * PAGE_SIZE);
+
+   /* Closing the buffer drops its idle mappings, so a new buffer starts cold. */
+   anv_gem_close(&device, gem_handle);
+
+   gem_handle = anv_gem_create(&device, 4 * PAGE_SIZE);
+   ASSERT(gem_handle);
+
+   addr = anv_gem_mmap(&device, gem_handle, 0, 4 * PAGE_SIZE, 0);
+   ASSERT(addr != MAP_FAILED);
+   check_stats(&device, 2, 3);
+
+   anv_gem_munmap(&device, addr, 4 * PAGE_SIZE);
+   anv_gem_close(&device, gem_handle);
+
+   anv_gem_disconnect(&device);
+}
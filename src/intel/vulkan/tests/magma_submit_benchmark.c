@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "allocation_counter.h"
+#include "anv_magma.h"
+#include "anv_private.h"
+#include "test_common.h"
+
+#define NUM_BUFFERS 128
+#define NUM_SYNCOBJS 4
+#define NUM_WARMUP_SUBMITS 16
+#define NUM_SUBMITS 10000
+#define PAGE_SIZE 4096
+
+static uint64_t gettime_ns(void)
+{
+   struct timespec current;
+   clock_gettime(CLOCK_MONOTONIC, &current);
+   return (uint64_t)current.tv_sec * 1000000000ull + current.tv_nsec;
+}
+
+static void submit(struct anv_device* device, uint32_t* gem_handles,
+                   anv_syncobj_handle_t* syncobjs)
+{
+   struct drm_i915_gem_exec_object2 objects[NUM_BUFFERS];
+   struct drm_i915_gem_exec_fence fences[NUM_SYNCOBJS];
+
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
+      objects[i] = (struct drm_i915_gem_exec_object2){
+          .handle = gem_handles[i],
+          .offset = 0x100000 + i * PAGE_SIZE,
+          .rsvd1 = 0,         /* offset */
+          .rsvd2 = PAGE_SIZE, /* length */
+      };
+   }
+
+   for (uint32_t i = 0; i < NUM_SYNCOBJS; i++) {
+      fences[i] = (struct drm_i915_gem_exec_fence){
+          .handle = (uintptr_t)syncobjs[i],
+          .flags = (i % 2) ? I915_EXEC_FENCE_SIGNAL : I915_EXEC_FENCE_WAIT,
+      };
+   }
+
+   struct drm_i915_gem_execbuffer2 execbuf = {
+       .buffers_ptr = (uintptr_t)objects,
+       .buffer_count = NUM_BUFFERS,
+       .num_cliprects = NUM_SYNCOBJS,
+       .cliprects_ptr = (uintptr_t)fences,
+   };
+
+   ASSERT(anv_gem_execbuffer(device, &execbuf) == 0);
+}
+
+int main(int argc, char** argv)
+{
+   struct anv_physical_device physical_device = {};
+   struct anv_device device = {
+       .physical = &physical_device,
+   };
+
+   anv_gem_connect(&device);
+   device.context_id = anv_gem_create_context(&device);
+
+   uint32_t gem_handles[NUM_BUFFERS];
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
+      gem_handles[i] = anv_gem_create(&device, PAGE_SIZE);
+      ASSERT(gem_handles[i]);
+   }
+
+   anv_syncobj_handle_t syncobjs[NUM_SYNCOBJS];
+   for (uint32_t i = 0; i < NUM_SYNCOBJS; i++) {
+      syncobjs[i] = anv_gem_syncobj_create(&device, 0);
+      ASSERT(syncobjs[i]);
+   }
+
+   /* The first submits establish the gpu mappings and size the submit storage. */
+   for (uint32_t i = 0; i < NUM_WARMUP_SUBMITS; i++)
+      submit(&device, gem_handles, syncobjs);
+
+   uint64_t allocation_count = allocation_counter_get();
+   uint64_t start = gettime_ns();
+
+   for (uint32_t i = 0; i < NUM_SUBMITS; i++)
+      submit(&device, gem_handles, syncobjs);
+
+   uint64_t elapsed = gettime_ns() - start;
+   allocation_count = allocation_counter_get() - allocation_count;
+
+   printf("%u submits of %u buffers: %lu ns, %.2f allocations per submit\n", NUM_SUBMITS,
+          NUM_BUFFERS, elapsed / NUM_SUBMITS, (double)allocation_count / NUM_SUBMITS);
+
+   /* Steady state submits must not allocate. */
+   ASSERT(allocation_count == 0);
+
+   for (uint32_t i = 0; i < NUM_SYNCOBJS; i++)
+      anv_gem_syncobj_destroy(&device, syncobjs[i]);
+
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++)
+      anv_gem_close(&device, gem_handles[i]);
+
+   anv_gem_destroy_context(&device, device.context_id);
+   anv_gem_disconnect(&device);
+}
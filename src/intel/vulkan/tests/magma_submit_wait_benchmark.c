@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2021 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Drives the anv submit and wait loop against the magma shim, which completes command buffers
+// without a gpu, so only the host side cost is measured.
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include "anv_private.h"
+#include "test_common.h"
+
+#define NUM_BUFFERS 64
+#define MAX_INFLIGHT 4
+#define NUM_WARMUP_SUBMITS 16
+#define NUM_SUBMITS 10000
+#define PAGE_SIZE 4096
+#define WAIT_TIMEOUT_NS 1000000000ll
+
+static uint64_t gettime_ns(void)
+{
+   struct timespec current;
+   clock_gettime(CLOCK_MONOTONIC, &current);
+   return (uint64_t)current.tv_sec * 1000000000ull + current.tv_nsec;
+}
+
+static void submit(struct anv_device* device, uint32_t* gem_handles, uint32_t batch_handle)
+{
+   struct drm_i915_gem_exec_object2 objects[NUM_BUFFERS + 1];
+
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
+      objects[i] = (struct drm_i915_gem_exec_object2){
+          .handle = gem_handles[i],
+          .offset = 0x100000 + i * PAGE_SIZE,
+          .rsvd1 = 0,         /* offset */
+          .rsvd2 = PAGE_SIZE, /* length */
+      };
+   }
+
+   // The batch buffer goes last, by drm convention.
+   objects[NUM_BUFFERS] = (struct drm_i915_gem_exec_object2){
+       .handle = batch_handle,
+       .offset = 0x100000 + NUM_BUFFERS * PAGE_SIZE,
+       .rsvd1 = 0,
+       .rsvd2 = PAGE_SIZE,
+   };
+
+   struct drm_i915_gem_execbuffer2 execbuf = {
+       .buffers_ptr = (uintptr_t)objects,
+       .buffer_count = NUM_BUFFERS + 1,
+   };
+
+   ASSERT(anv_gem_execbuffer(device, &execbuf) == 0);
+}
+
+static void wait_batch(struct anv_device* device, uint32_t batch_handle)
+{
+   int64_t timeout_ns = WAIT_TIMEOUT_NS;
+   ASSERT(anv_gem_wait(device, batch_handle, &timeout_ns) == 0);
+}
+
+// Submits with up to |inflight| batches outstanding, waiting for the oldest before reusing its
+// batch buffer. Returns the average time per submit.
+static uint64_t run(struct anv_device* device, uint32_t* gem_handles, uint32_t* batch_handles,
+                    uint32_t inflight, uint32_t submit_count)
+{
+   uint64_t start = gettime_ns();
+
+   for (uint32_t i = 0; i < submit_count; i++) {
+      uint32_t batch_handle = batch_handles[i % inflight];
+      if (i >= inflight)
+         wait_batch(device, batch_handle);
+      submit(device, gem_handles, batch_handle);
+   }
+
+   for (uint32_t i = 0; i < inflight; i++)
+      wait_batch(device, batch_handles[i]);
+
+   return (gettime_ns() - start) / submit_count;
+}
+
+int main(int argc, char** argv)
+{
+   struct anv_physical_device physical_device = {};
+   struct anv_device device = {
+       .physical = &physical_device,
+   };
+
+   anv_gem_connect(&device);
+   device.context_id = anv_gem_create_context(&device);
+
+   uint32_t gem_handles[NUM_BUFFERS];
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
+      gem_handles[i] = anv_gem_create(&device, PAGE_SIZE);
+      ASSERT(gem_handles[i]);
+   }
+
+   uint32_t batch_handles[MAX_INFLIGHT];
+   for (uint32_t i = 0; i < MAX_INFLIGHT; i++) {
+      batch_handles[i] = anv_gem_create(&device, PAGE_SIZE);
+      ASSERT(batch_handles[i]);
+
+      // Batches are written through a cpu mapping, as the driver does.
+      uint32_t* batch = anv_gem_mmap(&device, batch_handles[i], 0, PAGE_SIZE, 0);
+      ASSERT(batch != MAP_FAILED);
+      batch[0] = 0x05000000; /* MI_BATCH_BUFFER_END */
+      anv_gem_munmap(&device, batch, PAGE_SIZE);
+   }
+
+   // The first submits establish the gpu mappings and size the submit storage.
+   run(&device, gem_handles, batch_handles, MAX_INFLIGHT, NUM_WARMUP_SUBMITS);
+
+   for (uint32_t inflight = 1; inflight <= MAX_INFLIGHT; inflight *= 2) {
+      uint64_t ns = run(&device, gem_handles, batch_handles, inflight, NUM_SUBMITS);
+      printf("%u submits of %u buffers, %u inflight: %lu ns per submit and wait\n", NUM_SUBMITS,
+             NUM_BUFFERS + 1, inflight, ns);
+   }
+
+   for (uint32_t i = 0; i < MAX_INFLIGHT; i++)
+      anv_gem_close(&device, batch_handles[i]);
+
+   for (uint32_t i = 0; i < NUM_BUFFERS; i++)
+      anv_gem_close(&device, gem_handles[i]);
+
+   anv_gem_destroy_context(&device, device.context_id);
+   anv_gem_disconnect(&device);
+}
@@ -22,6 +22,11 @@
  */
 
 #include "inflight_list.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <time.h>
 
 static uint64_t gettime_ns(void)
@@ -52,6 +57,33 @@ static magma_status_t wait_notification_channel(magma_handle_t channel, int64_t
    return magma_poll(&item, 1, timeout_ns);
 }
 
+#define INITIAL_CAPACITY 256
+#define RESIZING (1u << 31)
+
+struct InflightEntry {
+   _Atomic uint64_t buffer_id; // 0 if the slot is unused
+   atomic_uint count;          // number of inflight references; may be 0
+};
+
+struct InflightTable {
+   struct InflightEntry* entries;
+   uint32_t capacity; // power of two
+   atomic_uint used;  // slots with a buffer id
+   atomic_uint size;  // sum of entry counts
+   atomic_uint users; // threads accessing entries; high bit set while resizing
+};
+
+// Bounds how long stopping the reader takes, since the channel wait can't be interrupted.
+#define READER_WAIT_NS 100000000ull
+
+struct InflightReader {
+   pthread_t thread;
+   magma_connection_t connection;
+   magma_handle_t notification_channel;
+   atomic_bool stop;
+   atomic_bool active;
+};
+
 struct InflightList* InflightList_Create()
 {
    struct InflightList* list = (struct InflightList*)malloc(sizeof(struct InflightList));
@@ -60,75 +92,302 @@ struct InflightList* InflightList_Create()
       return NULL;
    }
 
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   int result = pthread_cond_init(&list->retired_, &attr);
+   pthread_condattr_destroy(&attr);
+   if (result != 0) {
+      pthread_mutex_destroy(&list->mutex_);
+      free(list);
+      return NULL;
+   }
+   list->polling_ = false;
+   list->retired_callback_ = NULL;
+   list->retired_callback_context_ = NULL;
+
    list->wait_ = wait_notification_channel;
    list->read_ = magma_read_notification_channel2;
-   u_vector_init(&list->buffers_, sizeof(uint64_t), sizeof(uint64_t) * 8 /* initial byte size */);
-   list->size_ = 0;
+
+   struct InflightTable* table = (struct InflightTable*)malloc(sizeof(struct InflightTable));
+   table->entries = (struct InflightEntry*)calloc(INITIAL_CAPACITY, sizeof(struct InflightEntry));
+   table->capacity = INITIAL_CAPACITY;
+   atomic_init(&table->used, 0);
+   atomic_init(&table->size, 0);
+   atomic_init(&table->users, 0);
+   list->table_ = table;
+   list->reader_ = NULL;
+
    return list;
 }
 
 void InflightList_Destroy(struct InflightList* list)
 {
-   u_vector_finish(&list->buffers_);
+   InflightList_StopReader(list);
+   free(list->table_->entries);
+   free(list->table_);
+   pthread_cond_destroy(&list->retired_);
    pthread_mutex_destroy(&list->mutex_);
    free(list);
 }
 
+static inline uint32_t hash_index(uint64_t buffer_id, uint32_t capacity)
+{
+   // Fibonacci hashing; buffer ids are often sequential.
+   return (uint32_t)((buffer_id * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+static inline bool is_full(struct InflightTable* table)
+{
+   // Keep some slots unused so probes terminate quickly.
+   return atomic_load(&table->used) >= table->capacity / 4 * 3;
+}
+
+// Registers the caller as a user of the entries, waiting out any resize in progress.
+static void enter(struct InflightList* list)
+{
+   struct InflightTable* table = list->table_;
+   uint32_t users = atomic_load(&table->users);
+   while (true) {
+      if (users & RESIZING) {
+         // The resizer holds the mutex for the duration.
+         pthread_mutex_lock(&list->mutex_);
+         pthread_mutex_unlock(&list->mutex_);
+         users = atomic_load(&table->users);
+         continue;
+      }
+      if (atomic_compare_exchange_weak(&table->users, &users, users + 1))
+         return;
+   }
+}
+
+static void leave(struct InflightList* list) { atomic_fetch_sub(&list->table_->users, 1); }
+
+// Returns the entry for the given buffer id, or NULL.
+static struct InflightEntry* find(struct InflightTable* table, uint64_t buffer_id)
+{
+   uint32_t mask = table->capacity - 1;
+   for (uint32_t i = hash_index(buffer_id, table->capacity);; i = (i + 1) & mask) {
+      uint64_t id = atomic_load(&table->entries[i].buffer_id);
+      if (id == buffer_id)
+         return &table->entries[i];
+      if (id == 0)
+         return NULL;
+   }
+}
+
+// Rebuilds the entries, dropping those that are no longer inflight.
+static void resize(struct InflightList* list)
+{
+   struct InflightTable* table = list->table_;
+
+   pthread_mutex_lock(&list->mutex_);
+
+   // Another thread may have resized while we waited for the mutex.
+   if (!is_full(table)) {
+      pthread_mutex_unlock(&list->mutex_);
+      return;
+   }
+
+   atomic_fetch_or(&table->users, RESIZING);
+
+   while (atomic_load(&table->users) != RESIZING) {
+   }
+
+   uint32_t live = 0;
+   for (uint32_t i = 0; i < table->capacity; i++) {
+      if (atomic_load(&table->entries[i].count))
+         live++;
+   }
+
+   // Leave plenty of room so resizes are amortized.
+   uint32_t capacity = INITIAL_CAPACITY;
+   while (capacity < live * 4)
+      capacity *= 2;
+
+   struct InflightEntry* entries =
+       (struct InflightEntry*)calloc(capacity, sizeof(struct InflightEntry));
+   for (uint32_t i = 0; i < table->capacity; i++) {
+      uint32_t count = atomic_load(&table->entries[i].count);
+      if (count == 0)
+         continue;
+      uint64_t buffer_id = atomic_load(&table->entries[i].buffer_id);
+      uint32_t j = hash_index(buffer_id, capacity);
+      while (atomic_load(&entries[j].buffer_id))
+         j = (j + 1) & (capacity - 1);
+      atomic_store(&entries[j].buffer_id, buffer_id);
+      atomic_store(&entries[j].count, count);
+   }
+
+   free(table->entries);
+   table->entries = entries;
+   table->capacity = capacity;
+   atomic_store(&table->used, live);
+
+   atomic_store(&table->users, 0);
+
+   pthread_mutex_unlock(&list->mutex_);
+}
+
 void InflightList_add(struct InflightList* list, uint64_t buffer_id)
 {
    assert(buffer_id != 0);
-   *(uint64_t*)u_vector_add(&list->buffers_) = buffer_id;
-   list->size_ += 1;
+
+   struct InflightTable* table = list->table_;
+
+   while (true) {
+      enter(list);
+
+      uint32_t mask = table->capacity - 1;
+      for (uint32_t i = hash_index(buffer_id, table->capacity);; i = (i + 1) & mask) {
+         struct InflightEntry* entry = &table->entries[i];
+         uint64_t id = atomic_load(&entry->buffer_id);
+
+         if (id == 0) {
+            if (is_full(table))
+               break;
+            if (atomic_compare_exchange_strong(&entry->buffer_id, &id, buffer_id)) {
+               atomic_fetch_add(&table->used, 1);
+               id = buffer_id;
+            }
+         }
+
+         if (id == buffer_id) {
+            atomic_fetch_add(&entry->count, 1);
+            atomic_fetch_add(&table->size, 1);
+            leave(list);
+            return;
+         }
+      }
+
+      leave(list);
+      resize(list);
+   }
 }
 
 bool InflightList_remove(struct InflightList* list, uint64_t buffer_id)
 {
+   struct InflightTable* table = list->table_;
    bool foundit = false;
-   void* element;
-
-   // Find the buffer_id, mark it for removal
-   u_vector_foreach(element, &list->buffers_)
-   {
-      if (*(uint64_t*)element == buffer_id) {
-         *(uint64_t*)element = 0;
-         foundit = true;
-         break;
+
+   enter(list);
+
+   struct InflightEntry* entry = find(table, buffer_id);
+   if (entry) {
+      // The slot keeps its buffer id, since the buffer is likely to be submitted again.
+      uint32_t count = atomic_load(&entry->count);
+      while (count && !atomic_compare_exchange_weak(&entry->count, &count, count - 1)) {
       }
+      foundit = count != 0;
    }
 
-   if (!foundit)
-      return false; // Not found
+   if (foundit) {
+      assert(atomic_load(&table->size) > 0);
+      atomic_fetch_sub(&table->size, 1);
+   }
+
+   leave(list);
 
-   assert(list->size_ > 0);
-   list->size_ -= 1;
+   return foundit;
+}
 
-   // Remove all marked nodes at the tail
-   const int length = u_vector_length(&list->buffers_);
+uint32_t InflightList_size(struct InflightList* list) { return atomic_load(&list->table_->size); }
 
-   for (int i = 0; i < length; i++) {
-      element = u_vector_tail(&list->buffers_);
-      assert(element);
-      if (*(uint64_t*)element == 0) {
-         u_vector_remove(&list->buffers_);
-      } else {
+bool InflightList_is_inflight(struct InflightList* list, uint64_t buffer_id)
+{
+   enter(list);
+
+   struct InflightEntry* entry = find(list->table_, buffer_id);
+   bool inflight = entry && atomic_load(&entry->count) != 0;
+
+   leave(list);
+
+   return inflight;
+}
+
+// Returns true if some other thread is responsible for reading the notification channel: either
+// the reader thread, or a waiter polling it. Draining here could leave that thread waiting for a
+// completion that was already read. Must hold the list mutex.
+static bool channel_is_owned(struct InflightList* list)
+{
+   return list->polling_ || InflightList_HasReader(list);
+}
+
+static void* reader_thread(void* context)
+{
+   struct InflightList* list = (struct InflightList*)context;
+   struct InflightReader* reader = list->reader_;
+
+   while (!atomic_load(&reader->stop)) {
+      magma_status_t status = list->wait_(reader->notification_channel, READER_WAIT_NS);
+      if (status == MAGMA_STATUS_TIMED_OUT)
+         continue;
+      if (status != MAGMA_STATUS_OK)
          break;
-      }
+
+      // Waiters check for retirement while holding the mutex, so this can't be missed.
+      pthread_mutex_lock(&list->mutex_);
+      InflightList_update(list, reader->connection);
+      pthread_mutex_unlock(&list->mutex_);
    }
 
+   // Hand the channel back to the waiters.
+   pthread_mutex_lock(&list->mutex_);
+   atomic_store(&reader->active, false);
+   pthread_cond_broadcast(&list->retired_);
+   pthread_mutex_unlock(&list->mutex_);
+
+   return NULL;
+}
+
+bool InflightList_StartReader(struct InflightList* list, magma_connection_t connection,
+                              magma_handle_t notification_channel)
+{
+   pthread_mutex_lock(&list->mutex_);
+
+   if (list->reader_) {
+      pthread_mutex_unlock(&list->mutex_);
+      return false;
+   }
+
+   struct InflightReader* reader = (struct InflightReader*)malloc(sizeof(struct InflightReader));
+   reader->connection = connection;
+   reader->notification_channel = notification_channel;
+   atomic_init(&reader->stop, false);
+   atomic_init(&reader->active, true);
+   list->reader_ = reader;
+
+   if (pthread_create(&reader->thread, NULL, reader_thread, list) != 0) {
+      list->reader_ = NULL;
+      free(reader);
+      pthread_mutex_unlock(&list->mutex_);
+      return false;
+   }
+
+   pthread_mutex_unlock(&list->mutex_);
    return true;
 }
 
-uint32_t InflightList_size(struct InflightList* list) { return list->size_; }
+void InflightList_StopReader(struct InflightList* list)
+{
+   struct InflightReader* reader = list->reader_;
+   if (!reader)
+      return;
 
-bool InflightList_is_inflight(struct InflightList* list, uint64_t buffer_id)
+   atomic_store(&reader->stop, true);
+   pthread_join(reader->thread, NULL);
+
+   pthread_mutex_lock(&list->mutex_);
+   list->reader_ = NULL;
+   pthread_mutex_unlock(&list->mutex_);
+
+   free(reader);
+}
+
+bool InflightList_HasReader(struct InflightList* list)
 {
-   void* element;
-   u_vector_foreach(element, &list->buffers_)
-   {
-      if (*(uint64_t*)element == buffer_id)
-         return true;
-   }
-   return false;
+   struct InflightReader* reader = list->reader_;
+   return reader && atomic_load(&reader->active);
 }
 
 bool InflightList_TryUpdate(struct InflightList* list, magma_connection_t connection)
@@ -137,7 +396,8 @@ bool InflightList_TryUpdate(struct InflightList* list, magma_connection_t connec
       return false;
    }
 
-   InflightList_update(list, connection);
+   if (!channel_is_owned(list))
+      InflightList_update(list, connection);
 
    pthread_mutex_unlock(&list->mutex_);
 
@@ -148,6 +408,9 @@ magma_status_t InflightList_WaitForBuffer(struct InflightList* list, magma_conne
                                           magma_handle_t notification_channel, uint64_t buffer_id,
                                           uint64_t timeout_ns)
 {
+   if (!InflightList_is_inflight(list, buffer_id))
+      return MAGMA_STATUS_OK;
+
    // Calculate deadline before potentially blocking on the mutex
    uint64_t start = gettime_ns();
    uint64_t deadline = start + timeout_ns;
@@ -157,28 +420,49 @@ magma_status_t InflightList_WaitForBuffer(struct InflightList* list, magma_conne
 
    magma_status_t status = MAGMA_STATUS_OK;
 
-   if (InflightList_is_inflight(list, buffer_id)) {
-
-      while (true) {
-         // First pass optimization: optimistically try reading the notification channel;
-         // may avoid an unnecessary wait.
+   while (true) {
+      // Optimistically try reading the notification channel; may avoid an unnecessary wait.
+      if (!channel_is_owned(list))
          InflightList_update(list, connection);
 
-         if (!InflightList_is_inflight(list, buffer_id))
-            break;
+      if (!InflightList_is_inflight(list, buffer_id)) {
+         status = MAGMA_STATUS_OK;
+         break;
+      }
 
-         if (timeout_ns == 0) {
-            // Optimization: don't bother making the wait system call since the notification
-            // channel was just drained.
-            status = MAGMA_STATUS_TIMED_OUT;
-            break;
-         }
+      if (status != MAGMA_STATUS_OK)
+         break;
 
-         status = list->wait_(notification_channel, get_relative_timeout(deadline));
-         if (status != MAGMA_STATUS_OK) {
-            break;
-         }
+      if (timeout_ns == 0) {
+         // Optimization: don't bother making the wait system call since the notification
+         // channel was just drained.
+         status = MAGMA_STATUS_TIMED_OUT;
+         break;
+      }
+
+      if (channel_is_owned(list)) {
+         // Another thread is reading the channel; sleep until it retires something.
+         struct timespec abs_timeout = {
+             .tv_sec = deadline / 1000000000,
+             .tv_nsec = deadline % 1000000000,
+         };
+         if (pthread_cond_timedwait(&list->retired_, &list->mutex_, &abs_timeout) == ETIMEDOUT)
+            status = MAGMA_STATUS_TIMED_OUT;
+         continue;
       }
+
+      // The mutex isn't held while polling, so submits aren't blocked.
+      list->polling_ = true;
+      pthread_mutex_unlock(&list->mutex_);
+
+      status = list->wait_(notification_channel, get_relative_timeout(deadline));
+
+      result = pthread_mutex_lock(&list->mutex_);
+      assert(result == 0);
+      list->polling_ = false;
+
+      // Let a sleeping waiter take over polling.
+      pthread_cond_broadcast(&list->retired_);
    }
 
    pthread_mutex_unlock(&list->mutex_);
@@ -189,14 +473,15 @@ magma_status_t InflightList_WaitForBuffer(struct InflightList* list, magma_conne
 void InflightList_AddAndUpdate(struct InflightList* list, magma_connection_t connection,
                                struct magma_system_exec_resource* resources, uint32_t count)
 {
-   int result = pthread_mutex_lock(&list->mutex_);
-   assert(result == 0);
-
    for (uint32_t i = 0; i < count; i++) {
       InflightList_add(list, resources[i].buffer_id);
    }
 
-   InflightList_update(list, connection);
+   int result = pthread_mutex_lock(&list->mutex_);
+   assert(result == 0);
+
+   if (!channel_is_owned(list))
+      InflightList_update(list, connection);
 
    pthread_mutex_unlock(&list->mutex_);
 }
@@ -218,7 +503,10 @@ void InflightList_update(struct InflightList* list, magma_connection_t connectio
       for (uint32_t i = 0; i < bytes_available / sizeof(uint64_t); i++) {
          assert(InflightList_is_inflight(list, list->notification_buffer[i]));
          InflightList_remove(list, list->notification_buffer[i]);
+         if (list->retired_callback_)
+            list->retired_callback_(list->retired_callback_context_, list->notification_buffer[i]);
       }
+      pthread_cond_broadcast(&list->retired_);
       if (!more_data)
          return;
    }
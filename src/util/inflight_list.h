@@ -24,8 +24,6 @@
 #ifndef INFLIGHT_LIST_H
 #define INFLIGHT_LIST_H
 
-#include "u_vector.h"
-
 #include <assert.h>
 #include <magma.h>
 #include <pthread.h>
@@ -34,7 +32,22 @@
 
 // A convenience utility for maintaining a list of inflight command buffers,
 // by reading completed buffer ids from the magma notification channel.
-// Not threadsafe.
+//
+// Buffer ids are kept in an open-addressed hash table along with a count of
+// inflight references, so add, remove and membership are constant time.
+//
+// Threading: add, remove, is_inflight and size may be called concurrently
+// from any thread. Reads of the notification channel must be serialized;
+// update doesn't lock, the functions marked Threadsafe below do so using the
+// list mutex, which they never hold across a wait: one waiter polls the
+// notification channel while any others sleep until buffers are retired.
+// The mutex is also taken to grow the table, so add must not be called while
+// holding it.
+//
+// Optionally a reader thread can own the notification channel (see
+// InflightList_StartReader); then submitters and waiters never read or poll
+// the channel themselves, and is_inflight tells them without a syscall
+// whether the reader has retired a buffer yet.
 
 typedef magma_status_t (*wait_notification_channel_t)(magma_handle_t channel, int64_t timeout_ns);
 
@@ -43,12 +56,22 @@ typedef magma_status_t (*read_notification_channel_t)(magma_connection_t connect
                                                       uint64_t* buffer_size_out,
                                                       magma_bool_t* more_data_out);
 
+// Called with the id of each buffer as it is retired.
+typedef void (*inflight_retired_callback_t)(void* context, uint64_t buffer_id);
+
+struct InflightTable;
+struct InflightReader;
+
 struct InflightList {
    wait_notification_channel_t wait_;
    read_notification_channel_t read_;
-   struct u_vector buffers_;
-   uint32_t size_;
+   struct InflightTable* table_;
+   struct InflightReader* reader_;
    pthread_mutex_t mutex_;
+   pthread_cond_t retired_; // signalled when buffers are removed by update
+   bool polling_;           // a waiter is polling the notification channel
+   inflight_retired_callback_t retired_callback_;
+   void* retired_callback_context_;
    uint64_t notification_buffer[4096 / sizeof(uint64_t)];
 };
 
@@ -68,10 +91,20 @@ static inline void InflightList_inject_for_test(struct InflightList* list,
    list->read_ = read;
 }
 
-// Add to the end of the list.
+// The callback may be called from any thread that services the notification channel. Must be
+// set before any buffers are added.
+static inline void InflightList_SetRetiredCallback(struct InflightList* list,
+                                                   inflight_retired_callback_t callback,
+                                                   void* context)
+{
+   list->retired_callback_ = callback;
+   list->retired_callback_context_ = context;
+}
+
+// Add a reference to the given buffer.
 void InflightList_add(struct InflightList* list, uint64_t buffer_id);
 
-// Remove from anywhere in the list.
+// Remove a reference to the given buffer; returns false if it wasn't inflight.
 bool InflightList_remove(struct InflightList* list, uint64_t buffer_id);
 
 uint32_t InflightList_size(struct InflightList* list);
@@ -83,6 +116,18 @@ void InflightList_update(struct InflightList* list, magma_connection_t connectio
 // Returns true if the list lock was obtained. Threadsafe.
 bool InflightList_TryUpdate(struct InflightList* list, magma_connection_t magma_connection);
 
+// Starts a thread that reads the notification channel and retires buffers as they complete.
+// Returns false if the thread couldn't be started. Threadsafe.
+bool InflightList_StartReader(struct InflightList* list, magma_connection_t connection,
+                              magma_handle_t notification_channel);
+
+// Stops the reader thread, if any; may take up to the reader's poll interval. Must be called
+// before the connection is released, once no other threads are using the list.
+void InflightList_StopReader(struct InflightList* list);
+
+// Returns true if a reader thread owns the notification channel.
+bool InflightList_HasReader(struct InflightList* list);
+
 // Wait for the given |buffer_id| to be removed from the inflight list. Threadsafe.
 magma_status_t InflightList_WaitForBuffer(struct InflightList* list, magma_connection_t connection,
                                           magma_handle_t notification_channel, uint64_t buffer_id,
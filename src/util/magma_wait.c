@@ -53,7 +53,7 @@ int magma_wait(magma_handle_t notification_handle, magma_semaphore_t* semaphores
    if (semaphore_count == 0)
       return 0;
 
-   uint32_t count = semaphore_count + 1;
+   uint32_t count = notification_callback ? semaphore_count + 1 : semaphore_count;
    uint32_t channel_index = semaphore_count;
 
    magma_poll_item_t* items = (magma_poll_item_t*)calloc(count, sizeof(magma_poll_item_t));
@@ -63,9 +63,11 @@ int magma_wait(magma_handle_t notification_handle, magma_semaphore_t* semaphores
       items[i].type = MAGMA_POLL_TYPE_SEMAPHORE;
       items[i].condition = MAGMA_POLL_CONDITION_SIGNALED;
    }
-   items[channel_index].handle = notification_handle;
-   items[channel_index].type = MAGMA_POLL_TYPE_HANDLE;
-   items[channel_index].condition = MAGMA_POLL_CONDITION_READABLE;
+   if (notification_callback) {
+      items[channel_index].handle = notification_handle;
+      items[channel_index].type = MAGMA_POLL_TYPE_HANDLE;
+      items[channel_index].condition = MAGMA_POLL_CONDITION_READABLE;
+   }
 
    uint32_t signalled_count = 0;
 
@@ -33,6 +33,8 @@ extern "C" {
 
 /* Wait for one (or all) |semaphores| to be signalled, while invoking the given
  * |notification_callback| when there is data readable on |notification_handle|.
+ * If |notification_callback| is NULL the notification channel isn't polled,
+ * for when another thread is responsible for reading it.
  * Returns 0 on success, else -1 on error, with errno set to ETIME on timeout.
  */
 int magma_wait(magma_handle_t notification_handle, magma_semaphore_t* semaphores,
@@ -115,7 +115,6 @@ TEST_F(TestInflightList, RemoveFromTail)
    EXPECT_TRUE(InflightList_remove(list_, kBufferIdBase + 2));
    EXPECT_FALSE(InflightList_is_inflight(list_, kBufferIdBase + 2));
    EXPECT_EQ(0u, InflightList_size(list_));
-   EXPECT_EQ(0u, u_vector_length(&list_->buffers_));
 }
 
 TEST_F(TestInflightList, RemoveFromHead)
@@ -129,11 +128,9 @@ TEST_F(TestInflightList, RemoveFromHead)
    EXPECT_TRUE(InflightList_remove(list_, kBufferIdBase + 2));
    EXPECT_FALSE(InflightList_is_inflight(list_, kBufferIdBase + 2));
    EXPECT_EQ(1u, InflightList_size(list_));
-   EXPECT_EQ(2u, u_vector_length(&list_->buffers_)); // Entry was only marked for deletion
    EXPECT_TRUE(InflightList_remove(list_, kBufferIdBase + 1));
    EXPECT_FALSE(InflightList_is_inflight(list_, kBufferIdBase + 1));
    EXPECT_EQ(0u, InflightList_size(list_));
-   EXPECT_EQ(0u, u_vector_length(&list_->buffers_));
 }
 
 TEST_F(TestInflightList, RemoveMiddle)
@@ -149,7 +146,6 @@ TEST_F(TestInflightList, RemoveMiddle)
    EXPECT_TRUE(InflightList_remove(list_, kBufferIdBase + 2));
    EXPECT_FALSE(InflightList_is_inflight(list_, kBufferIdBase + 2));
    EXPECT_EQ(2u, InflightList_size(list_));
-   EXPECT_EQ(3u, u_vector_length(&list_->buffers_)); // Entry was only marked for deletion
 }
 
 TEST_F(TestInflightList, RemoveDouble)
@@ -0,0 +1,283 @@
+/*
+ * Copyright © 2019 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "util/inflight_list.h"
+#include "gtest/gtest.h"
+
+// Stands in for the notification channel: completed buffer ids are queued by
+// a fake gpu thread and drained through the injected read hook.
+struct FakeConnection : public magma_connection {
+   std::mutex mutex;
+   std::condition_variable readable;
+   std::deque<uint64_t> completions;
+   std::set<std::thread::id> readers;
+
+   void Complete(uint64_t buffer_id)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      completions.push_back(buffer_id);
+      readable.notify_all();
+   }
+};
+
+static FakeConnection* g_connection;
+
+static magma_status_t wait_notification_channel(magma_handle_t channel, int64_t timeout_ns)
+{
+   std::unique_lock<std::mutex> lock(g_connection->mutex);
+   if (!g_connection->readable.wait_for(lock, std::chrono::nanoseconds(timeout_ns),
+                                        [] { return !g_connection->completions.empty(); }))
+      return MAGMA_STATUS_TIMED_OUT;
+   return MAGMA_STATUS_OK;
+}
+
+static magma_status_t read_notification_channel(magma_connection_t connection, void* buffer,
+                                                uint64_t buffer_size, uint64_t* buffer_size_out,
+                                                magma_bool_t* more_data_out)
+{
+   auto fake = static_cast<FakeConnection*>(connection);
+   std::lock_guard<std::mutex> lock(fake->mutex);
+   fake->readers.insert(std::this_thread::get_id());
+
+   uint64_t count = std::min<uint64_t>(fake->completions.size(), buffer_size / sizeof(uint64_t));
+   for (uint64_t i = 0; i < count; i++) {
+      reinterpret_cast<uint64_t*>(buffer)[i] = fake->completions.front();
+      fake->completions.pop_front();
+   }
+   *buffer_size_out = count * sizeof(uint64_t);
+   *more_data_out = !fake->completions.empty();
+   return MAGMA_STATUS_OK;
+}
+
+const uint64_t kBufferIdBase = 0xaabbccdd00000000;
+constexpr uint32_t kThreadCount = 8;
+
+class TestInflightListStress : public ::testing::Test {
+public:
+   void SetUp() override
+   {
+      list_ = InflightList_Create();
+      g_connection = &connection_;
+      InflightList_inject_for_test(list_, wait_notification_channel, read_notification_channel);
+   }
+
+   void TearDown() override
+   {
+      InflightList_Destroy(list_);
+      g_connection = nullptr;
+   }
+
+protected:
+   // Submits from several threads, each waiting for its buffers to be retired.
+   void SubmitAndWait();
+
+   InflightList* list_;
+   FakeConnection connection_;
+};
+
+TEST_F(TestInflightListStress, Grow)
+{
+   constexpr uint32_t kCount = 10000;
+
+   for (uint32_t i = 0; i < kCount; i++)
+      InflightList_add(list_, kBufferIdBase + i);
+   EXPECT_EQ(kCount, InflightList_size(list_));
+
+   for (uint32_t i = 0; i < kCount; i++)
+      EXPECT_TRUE(InflightList_is_inflight(list_, kBufferIdBase + i));
+   EXPECT_FALSE(InflightList_is_inflight(list_, kBufferIdBase + kCount));
+
+   for (uint32_t i = 0; i < kCount; i += 2)
+      EXPECT_TRUE(InflightList_remove(list_, kBufferIdBase + i));
+   EXPECT_EQ(kCount / 2, InflightList_size(list_));
+
+   for (uint32_t i = 0; i < kCount; i++)
+      EXPECT_EQ(i % 2 == 1, InflightList_is_inflight(list_, kBufferIdBase + i));
+}
+
+TEST_F(TestInflightListStress, RetiredCallback)
+{
+   std::vector<uint64_t> retired;
+   InflightList_SetRetiredCallback(
+       list_,
+       [](void* context, uint64_t buffer_id) {
+          static_cast<std::vector<uint64_t>*>(context)->push_back(buffer_id);
+       },
+       &retired);
+
+   for (uint32_t i = 0; i < 3; i++)
+      InflightList_add(list_, kBufferIdBase + i);
+
+   connection_.Complete(kBufferIdBase + 1);
+   connection_.Complete(kBufferIdBase);
+   InflightList_update(list_, &connection_);
+
+   EXPECT_EQ(std::vector<uint64_t>({kBufferIdBase + 1, kBufferIdBase}), retired);
+   EXPECT_TRUE(InflightList_is_inflight(list_, kBufferIdBase + 2));
+}
+
+TEST_F(TestInflightListStress, ConcurrentAddRemove)
+{
+   constexpr uint32_t kIdsPerThread = 1000;
+   constexpr uint32_t kIterations = 20;
+
+   std::vector<std::thread> threads;
+   for (uint32_t t = 0; t < kThreadCount; t++) {
+      threads.emplace_back([this, t] {
+         uint64_t base = kBufferIdBase + t * kIdsPerThread;
+         for (uint32_t iter = 0; iter < kIterations; iter++) {
+            for (uint32_t i = 0; i < kIdsPerThread; i++)
+               InflightList_add(list_, base + i);
+            for (uint32_t i = 0; i < kIdsPerThread; i++)
+               EXPECT_TRUE(InflightList_is_inflight(list_, base + i));
+            for (uint32_t i = 0; i < kIdsPerThread; i++)
+               EXPECT_TRUE(InflightList_remove(list_, base + i));
+            for (uint32_t i = 0; i < kIdsPerThread; i++)
+               EXPECT_FALSE(InflightList_is_inflight(list_, base + i));
+         }
+      });
+   }
+   for (auto& thread : threads)
+      thread.join();
+
+   EXPECT_EQ(0u, InflightList_size(list_));
+}
+
+TEST_F(TestInflightListStress, ConcurrentSharedIds)
+{
+   constexpr uint32_t kIdCount = 500;
+
+   auto for_each_thread = [](auto&& func) {
+      std::vector<std::thread> threads;
+      for (uint32_t t = 0; t < kThreadCount; t++)
+         threads.emplace_back(func);
+      for (auto& thread : threads)
+         thread.join();
+   };
+
+   for_each_thread([this] {
+      for (uint32_t i = 0; i < kIdCount; i++)
+         InflightList_add(list_, kBufferIdBase + i);
+   });
+   EXPECT_EQ(kThreadCount * kIdCount, InflightList_size(list_));
+
+   // Every thread's reference has to be removed before the buffer is retired.
+   for_each_thread([this] {
+      for (uint32_t i = 0; i < kIdCount; i++)
+         EXPECT_TRUE(InflightList_remove(list_, kBufferIdBase + i));
+   });
+   EXPECT_EQ(0u, InflightList_size(list_));
+
+   for (uint32_t i = 0; i < kIdCount; i++) {
+      EXPECT_FALSE(InflightList_is_inflight(list_, kBufferIdBase + i));
+      EXPECT_FALSE(InflightList_remove(list_, kBufferIdBase + i));
+   }
+}
+
+void TestInflightListStress::SubmitAndWait()
+{
+   constexpr uint32_t kSubmitsPerThread = 500;
+   constexpr uint32_t kResourceCount = 8;
+   constexpr uint64_t kTimeoutNs = 5000000000ull;
+
+   std::mutex gpu_mutex;
+   std::condition_variable gpu_work;
+   std::deque<uint64_t> gpu_queue;
+   bool gpu_done = false;
+
+   // Completes submitted buffers in order, like the hardware would.
+   std::thread gpu([&] {
+      std::unique_lock<std::mutex> lock(gpu_mutex);
+      while (true) {
+         gpu_work.wait(lock, [&] { return gpu_done || !gpu_queue.empty(); });
+         if (gpu_queue.empty())
+            break;
+         uint64_t buffer_id = gpu_queue.front();
+         gpu_queue.pop_front();
+         connection_.Complete(buffer_id);
+      }
+   });
+
+   std::vector<std::thread> threads;
+   for (uint32_t t = 0; t < kThreadCount; t++) {
+      threads.emplace_back([&, t] {
+         for (uint32_t submit = 0; submit < kSubmitsPerThread; submit++) {
+            magma_system_exec_resource resources[kResourceCount] = {};
+            for (uint32_t i = 0; i < kResourceCount; i++)
+               resources[i].buffer_id = kBufferIdBase + (t * kResourceCount + i) * 0x1000 + submit;
+
+            InflightList_AddAndUpdate(list_, &connection_, resources, kResourceCount);
+            {
+               std::lock_guard<std::mutex> lock(gpu_mutex);
+               for (uint32_t i = 0; i < kResourceCount; i++)
+                  gpu_queue.push_back(resources[i].buffer_id);
+               gpu_work.notify_one();
+            }
+
+            for (uint32_t i = 0; i < kResourceCount; i++) {
+               EXPECT_EQ(MAGMA_STATUS_OK,
+                         InflightList_WaitForBuffer(list_, &connection_, 0 /*channel*/,
+                                                    resources[i].buffer_id, kTimeoutNs));
+               EXPECT_FALSE(InflightList_is_inflight(list_, resources[i].buffer_id));
+            }
+         }
+      });
+   }
+   for (auto& thread : threads)
+      thread.join();
+
+   {
+      std::lock_guard<std::mutex> lock(gpu_mutex);
+      gpu_done = true;
+      gpu_work.notify_one();
+   }
+   gpu.join();
+
+   EXPECT_EQ(0u, InflightList_size(list_));
+}
+
+TEST_F(TestInflightListStress, SubmitAndWait) { SubmitAndWait(); }
+
+TEST_F(TestInflightListStress, SubmitAndWaitWithReader)
+{
+   ASSERT_TRUE(InflightList_StartReader(list_, &connection_, 0 /*channel*/));
+   EXPECT_TRUE(InflightList_HasReader(list_));
+   EXPECT_FALSE(InflightList_StartReader(list_, &connection_, 0 /*channel*/));
+
+   SubmitAndWait();
+
+   // Only the reader thread touched the notification channel.
+   EXPECT_EQ(1u, connection_.readers.size());
+   EXPECT_EQ(0u, connection_.readers.count(std::this_thread::get_id()));
+
+   InflightList_StopReader(list_);
+   EXPECT_FALSE(InflightList_HasReader(list_));
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright © 2020 Google, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures the cost of allocating and freeing indices through a free list
+ * when many threads share it, compared with giving each thread its own list
+ * backed by the same array.
+ */
+
+#undef NDEBUG
+
+#include "util/os_time.h"
+#include "util/sparse_array.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "c11/threads.h"
+
+#define NUM_THREADS 8
+#define NUM_ITERATIONS (1 << 18)
+#define NUM_HELD 16
+#define BATCH_SIZE 32
+
+struct elem {
+   uint32_t index;
+   uint32_t free_index;
+};
+
+struct list {
+   struct util_sparse_array_free_list fl;
+} __attribute__((aligned(64)));
+
+struct state {
+   struct util_sparse_array arr;
+   struct list lists[NUM_THREADS];
+   atomic_uint next_index;
+   bool sharded;
+};
+
+struct thread_state {
+   struct state *state;
+   unsigned thread_idx;
+};
+
+static struct elem *
+alloc_elem(struct state *state, struct util_sparse_array_free_list *fl)
+{
+   struct elem *elem = util_sparse_array_free_list_pop_elem(fl);
+   if (elem)
+      return elem;
+
+   uint32_t first = atomic_fetch_add(&state->next_index, BATCH_SIZE);
+   uint32_t items[BATCH_SIZE];
+   for (unsigned i = 0; i < BATCH_SIZE; i++) {
+      items[i] = first + i;
+      elem = util_sparse_array_get(&state->arr, items[i]);
+      elem->index = items[i];
+   }
+   util_sparse_array_free_list_push(fl, &items[1], BATCH_SIZE - 1);
+
+   return util_sparse_array_get(&state->arr, first);
+}
+
+static int
+test_thread(void *_thread_state)
+{
+   struct thread_state *ts = _thread_state;
+   struct state *state = ts->state;
+   struct util_sparse_array_free_list *fl =
+      &state->lists[state->sharded ? ts->thread_idx : 0].fl;
+
+   uint32_t held[NUM_HELD];
+   for (unsigned i = 0; i < NUM_ITERATIONS; i++) {
+      unsigned slot = i % NUM_HELD;
+      if (i >= NUM_HELD)
+         util_sparse_array_free_list_push(fl, &held[slot], 1);
+
+      struct elem *elem = alloc_elem(state, fl);
+      assert(util_sparse_array_get(&state->arr, elem->index) == elem);
+      held[slot] = elem->index;
+   }
+
+   return 0;
+}
+
+static uint64_t
+run_test(bool sharded)
+{
+   struct state state;
+   util_sparse_array_init(&state.arr, sizeof(struct elem), 256);
+   for (unsigned i = 0; i < NUM_THREADS; i++) {
+      util_sparse_array_free_list_init(&state.lists[i].fl, &state.arr, 0,
+                                       offsetof(struct elem, free_index));
+   }
+   state.next_index = 1;
+   state.sharded = sharded;
+
+   struct thread_state thread_states[NUM_THREADS];
+   thrd_t threads[NUM_THREADS];
+
+   int64_t start = os_time_get_nano();
+
+   for (unsigned i = 0; i < NUM_THREADS; i++) {
+      thread_states[i] = (struct thread_state) {
+         .state = &state,
+         .thread_idx = i,
+      };
+      int ret = thrd_create(&threads[i], test_thread, &thread_states[i]);
+      assert(ret == thrd_success);
+   }
+
+   for (unsigned i = 0; i < NUM_THREADS; i++) {
+      int ret = thrd_join(threads[i], NULL);
+      assert(ret == thrd_success);
+   }
+
+   int64_t elapsed = os_time_get_nano() - start;
+
+   util_sparse_array_finish(&state.arr);
+
+   return elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+   uint64_t shared_ns = run_test(false);
+   uint64_t sharded_ns = run_test(true);
+
+   uint64_t ops = (uint64_t)NUM_THREADS * NUM_ITERATIONS;
+   printf("shared free list:  %.1f ns per alloc/free\n", (double)shared_ns / ops);
+   printf("sharded free list: %.1f ns per alloc/free\n", (double)sharded_ns / ops);
+
+   return 0;
+}